@@ -0,0 +1,93 @@
+/*
+ * Interfaces to our local broker.
+ *
+ * In broker mode a per-user daemon (keychain-pkcs11d) does all of the
+ * talking to the Security framework and owns the object catalog and the
+ * LocalAuthentication context; the library fetches a copy of the catalog
+ * over a Unix domain socket and forwards key operations to the daemon.
+ * This means every process that loads us shares one identity scan, one
+ * certificate scan, and one login.
+ *
+ * The protocol is dead simple: every message is a struct broker_msg
+ * followed by "length" bytes of payload, and every request gets exactly
+ * one reply.  In a reply, "type" holds the CK_RV of the operation.
+ */
+
+#ifndef __BROKER_H__
+#define __BROKER_H__ 1
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Request types
+ */
+
+#define BROKER_CATALOG	1	/* Fetch catalog; arg[0] = our generation */
+#define BROKER_LOGIN	2	/* Log in; payload is PIN, arg[0] = has PIN */
+#define BROKER_SIGN	3	/* Sign; payload is data */
+#define BROKER_VERIFY	4	/* Verify; payload is data || signature */
+#define BROKER_ENCRYPT	5	/* Encrypt; payload is data */
+#define BROKER_DECRYPT	6	/* Decrypt; payload is data */
+
+/*
+ * For key operations the arguments are:
+ *
+ * arg[0]	Slot identifier
+ * arg[1]	Object handle
+ * arg[2]	Mechanism
+ * arg[3]	Length of data (BROKER_VERIFY only; the rest is signature)
+ *
+ * The generation is the catalog generation the object handle came from;
+ * if the daemon has rescanned since then we get back CKR_KEY_CHANGED.
+ */
+
+struct broker_msg {
+	uint32_t	type;		/* Request type, or CK_RV in reply */
+	uint32_t	length;		/* Length of payload */
+	uint64_t	generation;	/* Catalog generation */
+	uint64_t	arg[4];		/* Request arguments */
+};
+
+/*
+ * The largest payload we will accept in a request; replies can be larger
+ * since they can carry a catalog.
+ */
+
+#define BROKER_MAX_REQUEST	(1024 * 1024)
+#define BROKER_MAX_REPLY	(64 * 1024 * 1024)
+
+/*
+ * Set to true when we are running inside of the daemon
+ */
+
+extern bool broker_server;
+
+const char *broker_path(void);
+
+/*
+ * Client functions.  broker_call() sends a request and waits for the
+ * reply; the reply header is written back into the passed-in message and
+ * any reply payload is returned in malloc()d storage.  If the daemon goes
+ * away we return CKR_DEVICE_REMOVED and try to reconnect on the next call.
+ * Each request in flight gets its own connection, so broker_call() can be
+ * used from many threads at once and nobody waits behind a slow request.
+ * A child process should call broker_forked() so it gets its own
+ * connections.
+ */
+
+int broker_connect(void);
+void broker_disconnect(void);
+void broker_forked(void);
+unsigned long broker_call(struct broker_msg *, const void *, uint32_t,
+			  void **);
+
+/*
+ * Server functions
+ */
+
+int broker_listen(void);
+int broker_recv(int, struct broker_msg *, void **);
+int broker_send(int, struct broker_msg *, const void *);
+
+#endif /* __BROKER_H__ */
@@ -0,0 +1,115 @@
+/*
+ * Our object catalog.
+ *
+ * This is a flattened, position-independent copy of our object lists
+ * (and a bit of identity information) that can be handed to another
+ * process.  Everything in it is referred to by offsets from the start
+ * of the catalog, so it can be sent over a socket or mapped into
+ * memory at any address and used as-is.
+ */
+
+#ifndef __CATALOG_H__
+#define __CATALOG_H__ 1
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CATALOG_MAGIC	0x5441434b	/* "KCAT" */
+#define CATALOG_VERSION	4
+
+/*
+ * The catalog holds one object list per slot; catalog slot index 0 is
+ * our token slot, index 1 is the certificate slot.
+ */
+
+#define CATALOG_SLOTS	2
+
+/*
+ * Catalog header flags
+ */
+
+#define CATALOG_HAS_CERTS	0x0001	/* Certificate slot is populated */
+
+struct catalog_header {
+	uint32_t	magic;		/* CATALOG_MAGIC */
+	uint32_t	version;	/* CATALOG_VERSION */
+	uint64_t	generation;	/* Identity list generation */
+	uint32_t	size;		/* Total size of catalog, in bytes */
+	uint32_t	flags;		/* CATALOG_ flags */
+	uint32_t	token_label;	/* Offset of token label string */
+	uint32_t	ident_count;	/* Number of identities */
+	uint32_t	ident_offset;	/* Offset of identity table */
+	uint32_t	obj_count[CATALOG_SLOTS];	/* Objects per slot */
+	uint32_t	obj_offset[CATALOG_SLOTS];	/* Object tables */
+	uint32_t	pad;
+	uint64_t	stamp;		/* Keychain stamp (certificate slot) */
+};
+
+/*
+ * Identity flags; these mirror the capability flags in our id_info
+ * structure
+ */
+
+#define CATALOG_ID_SIGN		0x0001
+#define CATALOG_ID_DECRYPT	0x0002
+#define CATALOG_ID_VERIFY	0x0004
+#define CATALOG_ID_ENCRYPT	0x0008
+#define CATALOG_ID_WRAP		0x0010
+
+struct catalog_ident {
+	uint32_t	label;		/* Offset of identity label */
+	uint32_t	flags;		/* CATALOG_ID_ flags */
+	uint64_t	keytype;	/* CK_KEY_TYPE */
+	uint64_t	blocksize;	/* Key block size, in bytes */
+};
+
+struct catalog_object {
+	uint64_t	class;		/* CK_OBJECT_CLASS */
+	uint32_t	id_index;	/* Index into identity/cert list */
+	uint32_t	attr_count;	/* Number of attributes */
+	uint32_t	attr_offset;	/* Offset of attribute table */
+	uint32_t	handle;		/* Object handle */
+};
+
+struct catalog_attr {
+	uint64_t	type;		/* CK_ATTRIBUTE_TYPE */
+	uint32_t	length;		/* Length of value */
+	uint32_t	offset;		/* Offset of value */
+};
+
+/*
+ * Functions to build a catalog.  catalog_add_object() copies the
+ * attribute values, so the caller is free to release them afterwards.
+ * catalog_finish() returns the flattened catalog (which should be
+ * released with free()) and frees the builder.
+ */
+
+struct catalog;
+
+struct catalog *catalog_new(void);
+void catalog_set_token_label(struct catalog *, const char *);
+void catalog_set_stamp(struct catalog *, uint64_t);
+void catalog_add_ident(struct catalog *, const char *, uint32_t, uint64_t,
+		       uint64_t);
+void catalog_add_object(struct catalog *, unsigned int, uint64_t,
+			unsigned int, uint32_t, const void *, unsigned int);
+void *catalog_finish(struct catalog *, uint64_t, uint32_t, size_t *);
+void catalog_free(struct catalog *);
+
+/*
+ * Functions to read a catalog.  Call catalog_valid() before using
+ * anything you received from someone else; the accessor functions
+ * assume the catalog has been checked.
+ */
+
+int catalog_valid(const void *, size_t);
+const char *catalog_string(const void *, uint32_t);
+const struct catalog_ident *catalog_ident(const void *, unsigned int);
+const struct catalog_object *catalog_object(const void *, unsigned int,
+					    unsigned int);
+const struct catalog_attr *catalog_attr(const void *,
+					const struct catalog_object *,
+					unsigned int);
+const void *catalog_value(const void *, const struct catalog_attr *);
+
+#endif /* __CATALOG_H__ */
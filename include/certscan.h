@@ -0,0 +1,69 @@
+/*
+ * Interfaces to the part of our certificate slot scan that decides which
+ * certificates go in it, and who issued each one.
+ *
+ * We're handed every certificate in the Keychain, and want the ones whose
+ * common name matches our certificateList, everything those issued,
+ * everything that issued, and so on.  We used to do that by searching the
+ * whole set of certificates again for every certificate we added (and
+ * checking each one against every certificate we already had), and find
+ * issuers by comparing every certificate to every other one.  That's fine
+ * for a few hundred certificates, but an enterprise trust store can have
+ * tens of thousands, so now we index the certificates by name and public
+ * key hash first.
+ *
+ * Like certstore.h, nothing here knows about the Security framework; the
+ * caller describes each certificate with the names and public key hash
+ * it got from the Keychain.  test/certslot_bench uses a stand-in for the
+ * Keychain so the scan can be measured anywhere.
+ */
+
+#ifndef __CERTSCAN_H__
+#define __CERTSCAN_H__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * What we need to know about a certificate.  Names are DER, and are
+ * compared byte for byte.
+ */
+
+struct certscan_cert {
+	const void	*subject;	/* Subject (NULL if we don't know) */
+	size_t		subject_len;
+	const void	*issuer;	/* Issuer (NULL if we don't know) */
+	size_t		issuer_len;
+	const void	*keyhash;	/* Public key hash (NULL if none) */
+	size_t		keyhash_len;
+	bool		root;		/* Matches our certificateList */
+	bool		skip;		/* Never goes in our slot */
+};
+
+/*
+ * Pick the certificates for our slot: each root, followed by what it
+ * issued (depth first).  A certificate with the same public key hash as
+ * one we already picked (the same CA, cross-signed) is left out, and so
+ * is anything under it that we can't reach some other way; so is anything
+ * marked "skip", or without a key hash.  We don't look for what was
+ * issued by a certificate without a subject.
+ *
+ * Fills in "order" (which must have room for every certificate) with
+ * the indexes of the ones we picked, in order, and returns how many.
+ * "cancelled" (which may be NULL) is called with "arg" before we pick
+ * each certificate; if it returns true we give up and return -1.
+ */
+
+int certscan_select(const struct certscan_cert *, unsigned int,
+		    unsigned int *, bool (*)(void *), void *);
+
+/*
+ * Find the issuer of each certificate: the one certificate whose subject
+ * is its issuer name and that has a key hash.  Fills in "issuer" with its
+ * index, or -1 if there isn't exactly one (or the certificate has no
+ * issuer name).  A self-issued certificate is its own issuer.
+ */
+
+void certscan_issuers(const struct certscan_cert *, unsigned int, int *);
+
+#endif /* __CERTSCAN_H__ */
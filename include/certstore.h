@@ -0,0 +1,125 @@
+/*
+ * Interfaces to our compressed certificate store.
+ *
+ * A big enterprise trust store puts thousands of certificates in our
+ * certificate slot, and every one of them used to cost us its DER (for
+ * CKA_VALUE) plus copies of its subject, issuer and serial number for the
+ * certificate object and again for its trust object.  Applications almost
+ * never read CKA_VALUE for most of them, so if enabled (see the
+ * compressCertificates preference) we keep it deflated instead, with a
+ * dictionary shared by every certificate in the slot.  The dictionary
+ * starts with the DER that nearly every X.509 certificate has (algorithm
+ * identifiers, name attribute and extension OIDs) and ends with the
+ * issuer and subject names that show up most often in the certificates
+ * being stored, since those are what repeats from one certificate to the
+ * next.  Each certificate's names are kept (uncompressed) in the same
+ * entry, so its attributes can point at them rather than having their
+ * own copies.
+ *
+ * Values are inflated on demand into a small cache of the most recently
+ * used ones, so an application that looks at the same few certificates
+ * over and over (as Firefox does when building a chain) only pays for it
+ * once.
+ *
+ * Nothing here knows about Cryptoki or the Security framework, so it can
+ * be tested and benchmarked anywhere zlib is.
+ */
+
+#ifndef __CERTSTORE_H__
+#define __CERTSTORE_H__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CERTSTORE_NAMES_MAX	3		/* Names kept per entry */
+
+struct certstore_dict;
+struct certstore_packer;
+struct certstore_entry;
+
+/*
+ * A piece of data we're given; a name for certstore_pack(), or a sample
+ * to train a dictionary on.
+ */
+
+struct certstore_sample {
+	const void	*data;
+	size_t		len;
+};
+
+/*
+ * Build a dictionary from sample names (usually the issuer and subject
+ * of every certificate), and drop a reference to one.  Entries keep a
+ * reference to the dictionary they were packed with.
+ */
+
+struct certstore_dict *certstore_dict_new(const struct certstore_sample *,
+					  unsigned int);
+void certstore_dict_release(struct certstore_dict *);
+size_t certstore_dict_size(struct certstore_dict *);
+
+/*
+ * Pack certificates into entries.  A packer holds the compression state,
+ * so make one for each batch of certificates rather than each one.
+ * certstore_pack() takes the certificate and up to CERTSTORE_NAMES_MAX
+ * names (a NULL data pointer means there isn't one), and returns NULL if
+ * it can't.
+ */
+
+struct certstore_packer *certstore_packer_new(struct certstore_dict *);
+struct certstore_entry *certstore_pack(struct certstore_packer *,
+				       const void *, size_t,
+				       const struct certstore_sample *,
+				       unsigned int);
+void certstore_packer_free(struct certstore_packer *);
+
+/*
+ * Entries are reference counted; each object using one holds a reference.
+ */
+
+struct certstore_entry *certstore_retain(struct certstore_entry *);
+void certstore_release(struct certstore_entry *);
+
+/*
+ * Where a name is kept in an entry (or NULL if it doesn't have it), and
+ * whether a pointer is somewhere in an entry (and so mustn't be freed).
+ */
+
+const void *certstore_name(struct certstore_entry *, unsigned int);
+bool certstore_owns(struct certstore_entry *, const void *);
+
+/*
+ * The certificate itself: its length, a copy of it (the buffer must be
+ * at least that long), and whether it's the same as some data.  These
+ * return false if the entry is damaged.
+ */
+
+size_t certstore_value_len(struct certstore_entry *);
+bool certstore_copy(struct certstore_entry *, void *);
+bool certstore_equal(struct certstore_entry *, const void *, size_t);
+
+/*
+ * Statistics for everything we've packed, and the cache
+ */
+
+struct certstore_stats {
+	uint64_t	entries;	/* Entries that exist */
+	uint64_t	value_bytes;	/* Their certificates, unpacked */
+	uint64_t	packed_bytes;	/* ... packed */
+	uint64_t	stored_bytes;	/* What entries take up in all */
+	uint64_t	cache_bytes;	/* Unpacked values in the cache */
+	uint64_t	hits;		/* Values found in the cache */
+	uint64_t	misses;		/* Values we had to unpack */
+};
+
+void certstore_stats(struct certstore_stats *);
+
+/*
+ * Empty the cache, and fix our locks in a child process
+ */
+
+void certstore_flush(void);
+void certstore_forked(void);
+
+#endif /* __CERTSTORE_H__ */
@@ -9,6 +9,15 @@
 extern bool get_certificate_info(CFDataRef, CFDataRef *, CFDataRef *,
 				 CFDataRef *);
 
+/*
+ * Extract the SubjectPublicKeyInfo, the SHA-1 hash of the subject public
+ * key, and the validity dates from an encoded certificate.  Returns "true"
+ * if successful, CFDataRef return pointers must be released.
+ */
+
+extern bool get_certificate_keyinfo(CFDataRef, CFDataRef *, CFDataRef *,
+				    CK_DATE *, CK_DATE *);
+
 /*
  * Find common name in an encoded X.509 Name
  *
@@ -0,0 +1,76 @@
+/*
+ * Interfaces to our circuit breaker for private key operations.
+ *
+ * When a card starts failing (pulled out mid-operation, a flaky reader)
+ * every thread ends up waiting for its own error or timeout.  The breaker
+ * watches the outcome of each private key operation; once enough of the
+ * recent ones have failed it "opens", and new operations fail right away
+ * with CKR_DEVICE_ERROR.  After a cool-down period it lets exactly one
+ * trial operation through ("half-open"); if that works we close again,
+ * and if it doesn't we start another cool-down.
+ *
+ * Only errors that look like the device's fault count as failures; a
+ * cancelled operation or a bad PIN doesn't say anything about the card.
+ */
+
+#ifndef __CIRCUIT_H__
+#define __CIRCUIT_H__ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+struct keychain_circuit_stats;
+
+struct circuit {
+	pthread_mutex_t	mutex;
+	bool		enabled;	/* Are we doing this at all? */
+	int		state;		/* Closed, open or half-open */
+	bool		probing;	/* Half-open trial in progress? */
+	uint64_t	open_until;	/* End of cool-down (ns) */
+	uint32_t	window;		/* Recent outcomes, 1 is failure */
+	unsigned int	window_count;	/* Valid bits in window */
+	uint64_t	calls;		/* Operations we let through */
+	uint64_t	failures;	/* ... and how many failed */
+	uint64_t	rejected;	/* Operations we failed fast */
+	uint64_t	trips;		/* Times we've opened */
+	uint64_t	avg_ns;		/* Moving average latency */
+	uint64_t	max_ns;		/* Worst latency */
+};
+
+/*
+ * Set up a breaker (it does nothing if not enabled), and reset the
+ * locks in a child process after fork().
+ */
+
+void circuit_init(struct circuit *, bool);
+void circuit_forked(struct circuit *);
+
+/*
+ * Forget everything we know; we do this when the card changes.
+ */
+
+void circuit_reset(struct circuit *);
+
+/*
+ * Can we start a private key operation?  If this returns true and sets
+ * the second argument, this is the half-open trial.  Pass that along to
+ * circuit_record() with the result and how long it took (ns).
+ */
+
+bool circuit_allow(struct circuit *, bool *);
+void circuit_record(struct circuit *, bool, CK_RV, uint64_t);
+
+/*
+ * Are we failing operations right now?
+ */
+
+bool circuit_tripped(struct circuit *);
+
+/*
+ * Get our state and statistics
+ */
+
+void circuit_stats(struct circuit *, struct keychain_circuit_stats *);
+
+#endif /* __CIRCUIT_H__ */
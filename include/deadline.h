@@ -0,0 +1,47 @@
+/*
+ * Interfaces to run a backend call with a deadline.
+ *
+ * A wedged reader or an ignored PIN dialog can leave the Security
+ * framework blocked forever, and since we call it with our locks held,
+ * that blocks every thread in the application.  If a deadline is set, we
+ * make the call on a worker thread and wait at most that long for it; if
+ * we give up, the worker is abandoned and cleans up after itself
+ * whenever the call finally returns.  That means the function must only
+ * use things it owns (retained references, copied data), never anything
+ * belonging to the caller.
+ */
+
+#ifndef __DEADLINE_H__
+#define __DEADLINE_H__ 1
+
+#include <limits.h>
+#include <stdatomic.h>
+
+enum deadline_result {
+	DEADLINE_DONE,			/* The call finished in time */
+	DEADLINE_EXPIRED,		/* We gave up waiting */
+	DEADLINE_CANCELLED,		/* We were cancelled while waiting */
+	DEADLINE_FAILED,		/* We couldn't start the call */
+};
+
+/*
+ * Wait as long as it takes (but still check for cancellation)
+ */
+
+#define DEADLINE_FOREVER	UINT_MAX
+
+/*
+ * Run func(arg) on a worker thread and wait up to the given number of
+ * milliseconds (or DEADLINE_FOREVER) for it.  If the value at "cancel"
+ * (which may be NULL) stops being equal to "gen" while we wait, we give
+ * up early.  If we return DEADLINE_EXPIRED or DEADLINE_CANCELLED, arg
+ * belongs to the worker, which will call abandon(arg) after func(arg)
+ * returns; if we return DEADLINE_FAILED (out of memory), func was never
+ * called and arg still belongs to the caller.
+ */
+
+enum deadline_result deadline_run(void (*)(void *), void (*)(void *), void *,
+				  unsigned int, _Atomic(unsigned long) *,
+				  unsigned long);
+
+#endif /* __DEADLINE_H__ */
@@ -50,6 +50,7 @@ const char * getCKOName(CK_OBJECT_CLASS class);
 const char * getCKMName(CK_MECHANISM_TYPE mech);
 const char * getCKCName(CK_CERTIFICATE_TYPE ctype);
 const char * getCKSName(CK_STATE state);
+const char * getTraceName(unsigned int id);
 #if 0
 const char * getSecErrorName(int status);
 #endif
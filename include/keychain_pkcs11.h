@@ -6,6 +6,8 @@
 #define __KEYCHAIN_PKCS11_H__ 1
 
 #include <os/log.h>
+#include <stdint.h>
+#include <stddef.h>
 
 extern os_log_t logsys;
 
@@ -32,4 +34,12 @@ do { \
 
 extern void logtype(const char *, CFTypeRef);
 
+/*
+ * Used by the broker daemon to hand out our object catalog (see
+ * catalog.h) and to see if our identity list has changed.
+ */
+
+extern void *keychain_catalog_export(size_t *, uint64_t *);
+extern uint64_t keychain_generation(void);
+
 #endif /* __KEYCHAIN_PKCS11_H__ */
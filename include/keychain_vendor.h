@@ -0,0 +1,189 @@
+/*
+ * Our vendor extensions to the Cryptoki API.
+ *
+ * These aren't in our function list (there's nowhere to put them), so
+ * applications that want them need to look them up with dlsym() after
+ * loading us.  They all follow the normal Cryptoki conventions (they
+ * return a CK_RV, and need C_Initialize() to have been called).  Include
+ * this after the Cryptoki headers.
+ */
+
+#ifndef __KEYCHAIN_VENDOR_H__
+#define __KEYCHAIN_VENDOR_H__ 1
+
+/*
+ * Statistics for our verification cache (see the verifyCache preference).
+ * A size of 0 means the cache is disabled for this application.
+ */
+
+struct keychain_verify_cache_stats {
+	CK_ULONG	size;		/* Maximum number of entries */
+	CK_ULONG	entries;	/* Current number of entries */
+	CK_ULONG	hits;		/* Lookups that found an entry */
+	CK_ULONG	misses;		/* Lookups that didn't */
+	CK_ULONG	evictions;	/* Entries pushed out by new ones */
+	CK_ULONG	flushes;	/* Times the cache was emptied */
+};
+
+CK_RV C_KeychainGetVerifyCacheStats(struct keychain_verify_cache_stats *);
+typedef CK_RV (*C_KeychainGetVerifyCacheStats_t)(
+				struct keychain_verify_cache_stats *);
+
+/*
+ * Verify a batch of signatures made with one public key.  Each item is
+ * verified independently, and its result (CKR_OK, CKR_SIGNATURE_INVALID,
+ * etc) is stored in the matching element of the results array.  The
+ * function itself only returns an error if it couldn't start at all
+ * (bad session, key or mechanism); a bad signature in the batch isn't
+ * an error for the batch.  This doesn't touch any C_VerifyInit() state
+ * the session may have.
+ */
+
+struct keychain_verify_item {
+	CK_BYTE_PTR	data;		/* Data that was signed */
+	CK_ULONG	data_len;
+	CK_BYTE_PTR	sig;		/* Signature over the data */
+	CK_ULONG	sig_len;
+};
+
+CK_RV C_KeychainVerifyBatch(CK_SESSION_HANDLE, CK_MECHANISM_PTR,
+			    CK_OBJECT_HANDLE, struct keychain_verify_item *,
+			    CK_ULONG, CK_RV *);
+typedef CK_RV (*C_KeychainVerifyBatch_t)(CK_SESSION_HANDLE, CK_MECHANISM_PTR,
+					 CK_OBJECT_HANDLE,
+					 struct keychain_verify_item *,
+					 CK_ULONG, CK_RV *);
+
+/*
+ * Statistics for signature coalescing (see the coalesceSign preference).
+ * Every signature with a coalesced mechanism is either a leader (we did
+ * the work) or a follower (we copied a concurrent leader's answer, and
+ * saved a trip to the card).
+ */
+
+struct keychain_sign_coalesce_stats {
+	CK_ULONG	mechanisms;	/* Mechanisms being coalesced */
+	CK_ULONG	leaders;	/* Signatures we actually made */
+	CK_ULONG	followers;	/* Signatures we copied */
+	CK_ULONG	in_flight;	/* Leaders working right now */
+};
+
+CK_RV C_KeychainGetSignCoalesceStats(struct keychain_sign_coalesce_stats *);
+typedef CK_RV (*C_KeychainGetSignCoalesceStats_t)(
+				struct keychain_sign_coalesce_stats *);
+
+/*
+ * Set the deadline for private key operations (signing and decryption)
+ * on this session, in milliseconds; 0 means wait forever.  Sessions start
+ * with the operationTimeout preference.  If the card (or the user) takes
+ * longer than this the operation returns CKR_DEVICE_ERROR.
+ */
+
+CK_RV C_KeychainSetOperationTimeout(CK_SESSION_HANDLE, CK_ULONG);
+typedef CK_RV (*C_KeychainSetOperationTimeout_t)(CK_SESSION_HANDLE, CK_ULONG);
+
+/*
+ * The state of a slot's circuit breaker (see the circuitBreaker
+ * preference).  While the breaker isn't closed, private key operations
+ * fail immediately with CKR_DEVICE_ERROR, and C_GetTokenInfo() sets
+ * CKF_ERROR_STATE in the token flags.  Only the token slot has a breaker;
+ * the certificate slot always reports a disabled one.
+ */
+
+#define KEYCHAIN_CIRCUIT_CLOSED		0	/* Everything is normal */
+#define KEYCHAIN_CIRCUIT_OPEN		1	/* Failing operations */
+#define KEYCHAIN_CIRCUIT_HALF_OPEN	2	/* Trying one operation */
+
+/*
+ * This is from PKCS#11 3.0, which is newer than our headers
+ */
+
+#ifndef CKF_ERROR_STATE
+#define CKF_ERROR_STATE			0x01000000UL
+#endif /* CKF_ERROR_STATE */
+
+struct keychain_circuit_stats {
+	CK_BBOOL	enabled;	/* Is the breaker in use? */
+	CK_ULONG	state;		/* KEYCHAIN_CIRCUIT_* */
+	CK_ULONG	cooldown_ms;	/* Time left before a trial */
+	CK_ULONG	calls;		/* Operations let through */
+	CK_ULONG	failures;	/* ... that failed */
+	CK_ULONG	rejected;	/* Operations failed fast */
+	CK_ULONG	trips;		/* Times the breaker opened */
+	CK_ULONG	recent_calls;	/* Operations in our window */
+	CK_ULONG	recent_failures; /* ... that failed */
+	CK_ULONG	avg_latency_us;	/* Moving average latency */
+	CK_ULONG	max_latency_us;	/* Worst latency */
+};
+
+CK_RV C_KeychainGetCircuitStats(CK_SLOT_ID, struct keychain_circuit_stats *);
+typedef CK_RV (*C_KeychainGetCircuitStats_t)(CK_SLOT_ID,
+					     struct keychain_circuit_stats *);
+
+/*
+ * Our backend call profile.  Every call we make into the Security
+ * framework is counted and timed, separately for each phase we make it
+ * in.  Like most Cryptoki list functions, call this with a NULL list to
+ * find out how many entries there are; only probes that have been called
+ * at least once in a phase are returned.  The profile starts over at
+ * C_Initialize() or when you call C_KeychainResetBackendProfile().
+ */
+
+#define KEYCHAIN_PHASE_OTHER		0	/* Anything else */
+#define KEYCHAIN_PHASE_ID_SCAN		1	/* Scanning for identities */
+#define KEYCHAIN_PHASE_CERT_SCAN	2	/* Scanning certificates */
+#define KEYCHAIN_PHASE_OBJECT_BUILD	3	/* Building object lists */
+#define KEYCHAIN_PHASE_CRYPTO		4	/* Key operations */
+#define KEYCHAIN_PHASE_COUNT		5
+
+struct keychain_backend_probe {
+	char		name[48];	/* Probe name (NUL-terminated) */
+	CK_ULONG	phase;		/* KEYCHAIN_PHASE_* */
+	CK_ULONG	count;		/* Number of calls */
+	CK_ULONG	errors;		/* ... that failed */
+	CK_LONG		last_error;	/* Last OSStatus or CFError code */
+	CK_ULONG	total_us;	/* Total time in calls */
+	CK_ULONG	max_us;		/* Longest call */
+};
+
+CK_RV C_KeychainGetBackendProfile(struct keychain_backend_probe *,
+				  CK_ULONG_PTR);
+typedef CK_RV (*C_KeychainGetBackendProfile_t)(struct keychain_backend_probe *,
+					       CK_ULONG_PTR);
+CK_RV C_KeychainResetBackendProfile(void);
+typedef CK_RV (*C_KeychainResetBackendProfile_t)(void);
+
+/*
+ * Get the same attributes from many objects in one call, instead of two
+ * C_GetAttributeValue() calls per object.  The values array has
+ * object_count rows of type_count entries (one row per object, in order);
+ * we fill in each entry's type and length, and point it at its value in
+ * the caller's buffer.  Values are packed into the buffer one after the
+ * other, each starting on a CK_ULONG boundary.  An attribute the object
+ * doesn't have gets a length of CK_UNAVAILABLE_INFORMATION and a NULL
+ * pointer.
+ *
+ * With a NULL buffer, we just fill in the lengths and return the buffer
+ * size needed in *buffer_len, so fetching everything from a slot takes
+ * two calls however many objects it has.  If the buffer is too small we
+ * copy nothing and return CKR_BUFFER_TOO_SMALL and the size needed.
+ *
+ * Each object's result (CKR_OK, CKR_OBJECT_HANDLE_INVALID, or
+ * CKR_ATTRIBUTE_TYPE_INVALID if it is missing any of the attributes) goes
+ * in the matching element of the results array; as with
+ * C_KeychainVerifyBatch(), the function itself only fails if it can't do
+ * anything at all.
+ */
+
+CK_RV C_KeychainGetAttributeValues(CK_SESSION_HANDLE, CK_OBJECT_HANDLE_PTR,
+				   CK_ULONG, CK_ATTRIBUTE_TYPE *, CK_ULONG,
+				   CK_ATTRIBUTE_PTR, CK_BYTE_PTR, CK_ULONG_PTR,
+				   CK_RV *);
+typedef CK_RV (*C_KeychainGetAttributeValues_t)(CK_SESSION_HANDLE,
+						CK_OBJECT_HANDLE_PTR,
+						CK_ULONG, CK_ATTRIBUTE_TYPE *,
+						CK_ULONG, CK_ATTRIBUTE_PTR,
+						CK_BYTE_PTR, CK_ULONG_PTR,
+						CK_RV *);
+
+#endif /* __KEYCHAIN_VENDOR_H__ */
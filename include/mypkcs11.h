@@ -32,4 +32,12 @@
 #include "pkcs11.h"
 #include "pkcs11n.h"
 
+/*
+ * Attributes from later versions of PKCS#11 than our headers
+ */
+
+#ifndef CKA_PUBLIC_KEY_INFO
+#define CKA_PUBLIC_KEY_INFO	0x00000129
+#endif
+
 #endif
@@ -0,0 +1,101 @@
+/*
+ * Interfaces to our backend call profiler.
+ *
+ * The tracer (see trace.h) tells you what happened in one particular run,
+ * in order; this answers the other question, which is "where does our
+ * time go overall?"  Every place we call into the Security framework is
+ * a named probe, and each probe keeps a count, the total and worst time,
+ * and how many calls failed (and the last error code) separately for each
+ * phase we can be in: scanning identities, scanning certificates,
+ * building objects, or doing a key operation.  The same call can be cheap
+ * in one phase and expensive in another (SecItemCopyMatching() is the
+ * usual suspect), so we don't lump them together.
+ *
+ * The counters are all atomics and the probes are only ever around calls
+ * that take orders of magnitude longer than reading the clock, so this
+ * is always on.
+ *
+ * Most of our backend calls are made from helpers that get called in more
+ * than one phase, so the phase is per-thread state; the scan and object
+ * building functions set it with prof_enter() and put it back with
+ * prof_leave() when they return.
+ */
+
+#ifndef __PROFILE_H__
+#define __PROFILE_H__ 1
+
+#include <stdint.h>
+
+struct keychain_backend_probe;
+
+/*
+ * Our probes.  These are the names we report, so they're either the
+ * Security framework function we call or (for getaccesscontrol() and
+ * getkeylabel(), which each do a Keychain query) our own function.
+ */
+
+#define PROF_PROBE_LIST \
+	PROF_PROBE(SecItemCopyMatching) \
+	PROF_PROBE(getaccesscontrol) \
+	PROF_PROBE(getkeylabel) \
+	PROF_PROBE(SecIdentityCopyCertificate) \
+	PROF_PROBE(SecIdentityCopyPrivateKey) \
+	PROF_PROBE(SecCertificateCopyPublicKey) \
+	PROF_PROBE(SecKeyCopyAttributes) \
+	PROF_PROBE(SecKeyIsAlgorithmSupported) \
+	PROF_PROBE(SecKeyCopyExternalRepresentation) \
+	PROF_PROBE(SecCertificateCopyValues) \
+	PROF_PROBE(SecCertificateCopyData) \
+	PROF_PROBE(SecCertificateCopySubjectSummary) \
+	PROF_PROBE(SecCertificateCopyCommonName) \
+	PROF_PROBE(SecKeyCreateSignature) \
+	PROF_PROBE(SecKeyVerifySignature) \
+	PROF_PROBE(SecKeyCreateEncryptedData) \
+	PROF_PROBE(SecKeyCreateDecryptedData)
+
+enum prof_probe {
+#define PROF_PROBE(name) PROF_ ## name,
+	PROF_PROBE_LIST
+#undef PROF_PROBE
+	PROF_PROBE_MAX
+};
+
+/*
+ * Error code to record for a call that failed without telling us why
+ * (it returned NULL and has no CFErrorRef argument).
+ */
+
+#define PROF_FAILED	(-1L)
+
+/*
+ * Grab a start time with prof_now(), make the call, then record it with
+ * PROF_RECORD() (in the current phase) or prof_record() (in a specific
+ * phase).  An error of 0 means the call worked.
+ */
+
+uint64_t prof_now(void);
+void prof_record(enum prof_probe, int, uint64_t, long);
+
+#define PROF_RECORD(probe, start, err) \
+	prof_record(PROF_ ## probe, prof_phase(), start, err)
+
+/*
+ * Get and set the phase of the current thread (one of the
+ * KEYCHAIN_PHASE_* values in keychain_vendor.h); prof_enter() returns the
+ * old phase for prof_leave().
+ */
+
+int prof_phase(void);
+int prof_enter(int);
+void prof_leave(int);
+
+/*
+ * Forget everything, and copy out every probe and phase that has been
+ * called at least once.  prof_get() fills in at most the given number of
+ * entries and returns how many there are in all.
+ */
+
+void prof_reset(void);
+unsigned int prof_get(struct keychain_backend_probe *, unsigned int);
+
+#endif /* __PROFILE_H__ */
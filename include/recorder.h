@@ -0,0 +1,111 @@
+/*
+ * Interfaces to our Cryptoki call recorder, and the format of the files
+ * it writes.
+ *
+ * The tracer (see trace.h) tells you how long each call took, but not
+ * what the application asked for; to benchmark what Firefox or ssh
+ * really do, we need their template shapes, their two-call sizing
+ * patterns and their session churn.  If the environment variable
+ * KEYCHAIN_PKCS11_RECORD is set to a file name (a "%d" in it is replaced
+ * with the process ID), C_GetFunctionList() hands out a function list
+ * that records every call, with its arguments and results, to that file
+ * as it happens.  test/pkcs11_replay reads it back and makes the same
+ * calls against any PKCS#11 module.
+ *
+ * We never record data itself; just its length and a hash.  Attribute
+ * values of eight bytes or less (classes, key types, booleans) are kept
+ * as they are, since the replay needs them to find the same objects, and
+ * so are mechanism parameters.  Data of that length passed to
+ * C_Decrypt(), C_Sign() or C_Verify() is kept as well.  PINs, and the
+ * plaintext passed to C_Encrypt(), are never recorded at all, not even
+ * hashed; their REC_DATA entries have only a length, and a hash of 0.
+ *
+ * Only calls made through the function list are recorded; an application
+ * that looks up our C_ functions by name bypasses the recorder.
+ */
+
+#ifndef __RECORDER_H__
+#define __RECORDER_H__ 1
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * A recording is a header followed by a sequence of calls, each of which
+ * is a struct rec_call followed by arg_count struct rec_args.  Calls are
+ * written when they return, so calls from different threads can be out
+ * of order; sort them by timestamp.  Function identifiers are the same
+ * as the tracer's.
+ */
+
+#define REC_MAGIC	"KCRECORD"
+#define REC_VERSION	1
+
+struct rec_header {
+	char		magic[8];	/* REC_MAGIC */
+	uint32_t	version;	/* REC_VERSION */
+	uint32_t	arg_size;	/* sizeof(struct rec_arg) */
+	uint64_t	pid;		/* Process ID of recorded process */
+};
+
+struct rec_call {
+	uint64_t	timestamp;	/* Start time (ns since first call) */
+	uint64_t	duration;	/* Duration (nanoseconds) */
+	uint64_t	thread;		/* Thread identifier */
+	uint32_t	id;		/* Function (enum trace_id) */
+	uint32_t	rv;		/* Return value */
+	uint32_t	arg_count;	/* Number of rec_args that follow */
+	uint32_t	reserved;
+};
+
+/*
+ * The kinds of arguments.  What arguments each function has (and in
+ * what order) is fixed; see the wrappers in recorder.c.
+ */
+
+enum rec_kind {
+	REC_ULONG,		/* value: A number or handle */
+	REC_NULL,		/* A NULL pointer (value: length passed) */
+	REC_BUFFER,		/* An output buffer (value: length passed,
+				   type: attribute, if it is for one) */
+	REC_DATA,		/* value: length, hash: hash of data
+				   (0 for PINs and C_Encrypt() input) */
+	REC_MECH,		/* type: mechanism, value: parameter length */
+	REC_PARAM,		/* hash: next 8 bytes of the parameter */
+	REC_ATTR,		/* type: attribute, value/hash: the value */
+	REC_ATTR_NULL,		/* type: attribute (value: length passed) */
+	REC_OUT_ULONG,		/* value: A number or handle returned */
+	REC_OUT_ATTR,		/* type: attribute, value/hash: returned */
+};
+
+struct rec_arg {
+	uint32_t	kind;		/* enum rec_kind */
+	uint32_t	type;		/* Attribute or mechanism type */
+	uint64_t	value;		/* Number, handle or length */
+	uint64_t	hash;		/* Hash of data, or small data */
+};
+
+/*
+ * Data of this length or less is stored in "hash" as it is
+ */
+
+#define REC_INLINE_MAX	sizeof(uint64_t)
+
+/*
+ * Check the environment and start recording calls to the given function
+ * list if asked; called once at load time.  In a child process after
+ * fork() we start a new recording (or stop, if the file name doesn't
+ * have a "%d" in it).
+ */
+
+void recorder_init(CK_FUNCTION_LIST_PTR);
+void recorder_forked(void);
+
+/*
+ * Return the function list that records our calls, or NULL if we aren't
+ * recording
+ */
+
+CK_FUNCTION_LIST_PTR recorder_list(void);
+
+#endif /* __RECORDER_H__ */
@@ -0,0 +1,51 @@
+/*
+ * Interfaces to our shared-memory catalogs.
+ *
+ * Every process that loads us builds the same object lists, so the first
+ * one to do so can publish them (as a catalog; see catalog.h) in a named
+ * shared memory segment, and later processes can copy them out of there
+ * instead of building them again.  We keep one segment for the token slot
+ * and one for the certificate slot, since they are built at different
+ * times (and not every application builds the certificate slot).
+ *
+ * A shared certificate slot replaces the whole certificate scan.  A shared
+ * token slot only replaces building the token objects; we still have to
+ * scan for identities, both to get our key references and to check that
+ * the catalog was built from the identities we have now.
+ */
+
+#ifndef __SHMCATALOG_H__
+#define __SHMCATALOG_H__ 1
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHM_CATALOG_TOKEN	0	/* Token slot segment */
+#define SHM_CATALOG_CERTS	1	/* Certificate slot segment */
+
+/*
+ * Return a validated copy of a shared catalog (which must be free()d),
+ * or NULL if there isn't one, it was written by a different version of
+ * us, or it is older than "maxage" seconds (0 means any age is fine).
+ * The generation of the segment is returned in the last argument.
+ */
+
+void *shm_catalog_fetch(int, unsigned int, size_t *, uint64_t *);
+
+/*
+ * Publish a catalog.  This is best-effort; if someone else is publishing
+ * at the same time, we just skip it.
+ */
+
+void shm_catalog_publish(int, const void *, size_t);
+
+/*
+ * Return a stamp for the Keychain files on this system, mixed with the
+ * certificate search strings passed in.  It changes whenever any of
+ * the Keychain files do (or a different search is used), so a shared
+ * certificate catalog built under a different stamp is out of date.
+ */
+
+uint64_t shm_keychain_stamp(char **);
+
+#endif /* __SHMCATALOG_H__ */
@@ -0,0 +1,78 @@
+/*
+ * Interfaces to our signature coalescing.
+ *
+ * Some mechanisms (all of the PKCS#1 v1.5 ones) always produce the same
+ * signature for the same key and input.  If several threads ask us for
+ * the same signature at the same time there's no point in going to the
+ * card once for each of them; the first one (the "leader") does the
+ * work, and everyone who shows up while it is in flight waits for it and
+ * gets a copy of its answer.  Nothing is remembered once the leader is
+ * done; this is not a cache.
+ *
+ * Only mechanisms marked as deterministic in keychain_mechmap and named
+ * in the coalesceSign preference are coalesced.
+ */
+
+#ifndef __SIGNFLIGHT_H__
+#define __SIGNFLIGHT_H__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+struct sflight;
+struct keychain_sign_coalesce_stats;
+
+/*
+ * Set the list of mechanisms we'll coalesce (an empty list turns it all
+ * off, as does running out of memory), and free it.
+ */
+
+void sflight_init(const CK_MECHANISM_TYPE *, unsigned int);
+void sflight_free(void);
+
+/*
+ * Will we coalesce signatures made with this mechanism?
+ */
+
+bool sflight_eligible(CK_MECHANISM_TYPE);
+
+/*
+ * Join the flight for this signature (slot, key object, mechanism and
+ * input), or start a new one.  If we set the last argument to true you
+ * are the leader: make the signature and report it with sflight_land().
+ * Otherwise use sflight_wait() to get the leader's answer.  Everyone
+ * calls sflight_release() when they are done with the flight.  Don't
+ * hold any of our other locks while waiting!  If we're out of memory we
+ * return NULL; make the signature yourself without coalescing.
+ *
+ * sflight_wait() also gives up, returning CKR_FUNCTION_CANCELED, if the
+ * cancel generation passed in changes while it waits (the follower's
+ * session was cancelled).  It returns the same thing if the leader has
+ * no answer for you; if you weren't cancelled, make the signature
+ * yourself.  If the leader takes longer than the follower's own deadline
+ * (in milliseconds, 0 for none) it returns CKR_DEVICE_ERROR, just as if
+ * the follower had gone to the card itself and run out of time.
+ */
+
+struct sflight *sflight_join(CK_SLOT_ID, CK_OBJECT_HANDLE, CK_MECHANISM_TYPE,
+			     const void *, size_t, bool *);
+void sflight_land(struct sflight *, CK_RV, const void *, size_t);
+CK_RV sflight_wait(struct sflight *, _Atomic(unsigned long) *, unsigned long,
+		  unsigned int, const unsigned char **, size_t *);
+void sflight_release(struct sflight *);
+
+/*
+ * Called in a child process after fork(); the leaders of any flights in
+ * progress didn't come with us.
+ */
+
+void sflight_forked(void);
+
+/*
+ * Get our statistics
+ */
+
+void sflight_stats(struct keychain_sign_coalesce_stats *);
+
+#endif /* __SIGNFLIGHT_H__ */
@@ -38,17 +38,31 @@ struct mechanism_map {
 	 * will mean we only have one PIN prompt.  Currently this is "true"
 	 * for all mechanisms we support, but I didn't feel confident
 	 * hardcoding this for future mechanisms.
+	 *
+	 * "deterministic" is true if signing the same input with the same
+	 * key always gives the same signature (true for PKCS#1 v1.5, not
+	 * for PSS or ECDSA); only those mechanisms can have concurrent
+	 * identical signatures coalesced (see signflight.h).
 	 */
 	const SecKeyAlgorithm	*sec_encmech;	/* Security mech for enc */
 	const SecKeyAlgorithm	*sec_signmech;	/* Security mech for sign */
 	const CFStringRef	*sec_digest;	/* Digest type used */
 	unsigned int		sec_digestlen;	/* Digest length */
 	bool			blocksize_out;	/* Is block size output? */
+	bool			deterministic;	/* Same input, same sig? */
 };
 
 extern struct mechanism_map keychain_mechmap[];
 extern unsigned int keychain_mechmap_size;
 
+/*
+ * Return the index of a mechanism in keychain_mechmap, or -1 if we don't
+ * support it.  This is a hash lookup, so it's cheap enough to call on
+ * every operation.
+ */
+
+extern int keychain_mechmap_index(CK_MECHANISM_TYPE);
+
 /*
  * Table used for mapping between Cryptoki key types and Security
  * framework key types.  The same rules apply as above; we use pointers
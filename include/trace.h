@@ -0,0 +1,154 @@
+/*
+ * Interfaces to our low-overhead binary tracer.
+ *
+ * The idea here is that os_log_debug() is great when you want to know
+ * WHAT happened, but terrible when you want to know how LONG things took;
+ * formatting all of those strings (and decoding DER in dump_attribute())
+ * changes the timing enough that a stall you are chasing often disappears
+ * once you turn on debugging.  So instead we write small fixed-size binary
+ * records into a per-thread ring buffer and dump those out when the
+ * library is finalized.  The test/trace_decode program turns those back
+ * into something a human can read; we can also write them out as a
+ * Chrome trace-event JSON file.
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__ 1
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Internal events we trace in addition to the Cryptoki functions, along
+ * with the category we put them in for the JSON output.  If you add one
+ * here, add it to the END of the list so existing trace files still
+ * decode correctly.
+ */
+
+#define TRACE_EVENT_LIST \
+	TRACE_EVENT(scan_identities, "scan") \
+	TRACE_EVENT(build_id_objects, "scan") \
+	TRACE_EVENT(scan_certificates, "scan") \
+	TRACE_EVENT(build_cert_objects, "scan") \
+	TRACE_EVENT(SecItemCopyMatching, "backend") \
+	TRACE_EVENT(SecKeyCreateSignature, "backend") \
+	TRACE_EVENT(SecKeyVerifySignature, "backend") \
+	TRACE_EVENT(SecKeyCreateEncryptedData, "backend") \
+	TRACE_EVENT(SecKeyCreateDecryptedData, "backend") \
+	TRACE_EVENT(broker_call, "broker") \
+	TRACE_EVENT(refresh_certificates, "scan") \
+	TRACE_EVENT(C_KeychainGetVerifyCacheStats, "vendor") \
+	TRACE_EVENT(C_KeychainVerifyBatch, "vendor") \
+	TRACE_EVENT(C_KeychainGetSignCoalesceStats, "vendor") \
+	TRACE_EVENT(C_KeychainSetOperationTimeout, "vendor") \
+	TRACE_EVENT(C_KeychainGetCircuitStats, "vendor") \
+	TRACE_EVENT(prewarm_keys, "scan") \
+	TRACE_EVENT(C_KeychainGetBackendProfile, "vendor") \
+	TRACE_EVENT(C_KeychainResetBackendProfile, "vendor") \
+	TRACE_EVENT(C_KeychainGetAttributeValues, "vendor")
+
+/*
+ * Our trace identifiers.  The Cryptoki function identifiers are generated
+ * from pkcs11f.h (the same trick we use to build our function list) so
+ * they always stay in sync.
+ */
+
+enum trace_id {
+#define CK_PKCS11_FUNCTION_INFO(name) TRACE_ ## name,
+#include "pkcs11f.h"
+#undef CK_PKCS11_FUNCTION_INFO
+#define TRACE_EVENT(name, cat) TRACE_ ## name,
+	TRACE_EVENT_LIST
+#undef TRACE_EVENT
+	TRACE_ID_MAX
+};
+
+#define TRACE_ID_NONE	0xffffffff
+
+/*
+ * True if this identifier is a Cryptoki function (and thus the return
+ * value in the record is a CK_RV) rather than an internal event.
+ */
+
+#define TRACE_IS_FUNCTION(id)	((id) < TRACE_scan_identities)
+
+/*
+ * A single trace record.  These are written as-is to the trace file,
+ * so don't change the layout without bumping TRACE_VERSION.
+ */
+
+struct trace_record {
+	uint64_t	timestamp;	/* Start time (nanoseconds) */
+	uint64_t	duration;	/* Duration (nanoseconds) */
+	uint64_t	thread;		/* Thread identifier */
+	uint64_t	handle;		/* Session/slot handle, if any */
+	uint32_t	id;		/* Trace identifier (enum trace_id) */
+	uint32_t	rv;		/* Return value */
+};
+
+/*
+ * The header at the start of a trace file, followed by record_count
+ * trace records.
+ */
+
+#define TRACE_MAGIC	"KCTRACE"
+#define TRACE_VERSION	1
+
+struct trace_header {
+	char		magic[8];	/* TRACE_MAGIC */
+	uint32_t	version;	/* TRACE_VERSION */
+	uint32_t	record_size;	/* sizeof(struct trace_record) */
+	uint64_t	pid;		/* Process ID of traced process */
+	uint64_t	record_count;	/* Number of records that follow */
+	uint64_t	dropped;	/* Records lost to ring wraparound */
+};
+
+/*
+ * Set to true if tracing is enabled; we check this before calling into
+ * the tracer so the cost when tracing is off is a single load.
+ */
+
+extern bool trace_enabled;
+
+void trace_init(void);
+void trace_flush(void);
+void trace_forked(void);
+uint64_t trace_now(void);
+char *trace_filename(const char *);
+void trace_begin(uint32_t);
+void trace_handle(uint64_t);
+void trace_end(uint32_t);
+void trace_record(uint32_t, uint64_t, uint64_t, uint32_t);
+
+#define TRACE_BEGIN(id) \
+do { \
+	if (trace_enabled) \
+		trace_begin(id); \
+} while (0)
+
+#define TRACE_HANDLE(h) \
+do { \
+	if (trace_enabled) \
+		trace_handle(h); \
+} while (0)
+
+#define TRACE_END(rv) \
+do { \
+	if (trace_enabled) \
+		trace_end(rv); \
+} while (0)
+
+/*
+ * For internal events; grab a start time with TRACE_NOW() and then
+ * record the event with TRACE_SPAN() when it is done.
+ */
+
+#define TRACE_NOW() (trace_enabled ? trace_now() : 0)
+
+#define TRACE_SPAN(id, start, h, rv) \
+do { \
+	if (trace_enabled && (start) != 0) \
+		trace_record(id, start, h, rv); \
+} while (0)
+
+#endif /* __TRACE_H__ */
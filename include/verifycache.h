@@ -0,0 +1,60 @@
+/*
+ * Interfaces to our verification cache.
+ *
+ * Some applications verify the same signatures over and over (cached
+ * tokens, certificate chains they re-validate).  If enabled, we remember
+ * the last few signatures that verified successfully, and don't bother
+ * the Security framework (or the broker) if we see one again.  Entries
+ * are keyed by a SHA-256 hash of the public key object handle (which is
+ * derived from the key itself), the mechanism, the data and the
+ * signature.  The cache gets flushed whenever our identity list changes;
+ * failed verifications are never cached.
+ */
+
+#ifndef __VERIFYCACHE_H__
+#define __VERIFYCACHE_H__ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define VCACHE_KEYLEN	32		/* Size of SHA-256 hash */
+
+struct keychain_verify_cache_stats;
+
+/*
+ * Set up the cache with room for the given number of entries (0 turns it
+ * off, as does running out of memory), and free it.
+ */
+
+void vcache_init(unsigned int);
+void vcache_free(void);
+
+/*
+ * Is the cache turned on?
+ */
+
+bool vcache_enabled(void);
+
+/*
+ * Compute the cache key for a verification
+ */
+
+void vcache_key(CK_OBJECT_HANDLE, CK_MECHANISM_TYPE, const void *, size_t,
+		const void *, size_t, unsigned char *);
+
+/*
+ * Look up a key (returns true if it is there), add one, or throw them
+ * all away.
+ */
+
+bool vcache_lookup(const unsigned char *);
+void vcache_insert(const unsigned char *);
+void vcache_flush(void);
+
+/*
+ * Get our statistics
+ */
+
+void vcache_stats(struct keychain_verify_cache_stats *);
+
+#endif /* __VERIFYCACHE_H__ */
@@ -0,0 +1,424 @@
+/*
+ * The transport for our local broker (see broker.h for the overview).
+ *
+ * The client side keeps a small pool of connections to the daemon and
+ * uses one connection per request in flight; the daemon handles each
+ * connection in its own thread, so requests from different threads (a
+ * slow signature waiting on the user, a catalog fetch, a verification)
+ * don't wait for each other.  broker_mutex only protects the pool and is
+ * never held while we're talking to the daemon.  A connection goes back
+ * into the pool when its request is done, so there is always at least
+ * one open (which is what keeps our login alive in the daemon).  If a
+ * connection breaks we close it and open another on the next request.
+ *
+ * The socket lives in the per-user temporary directory (which is only
+ * accessible by that user) unless KEYCHAIN_PKCS11_BROKER_SOCKET is set.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "mypkcs11.h"
+#include "broker.h"
+
+bool broker_server = false;
+
+/*
+ * Our connections.  Busy ones are on the list too so a forked child can
+ * close them all.  We never close an idle connection on our own: the
+ * daemon's sessions for us (and so our login) live on whichever
+ * connections we used, and the pool is only ever as big as the number of
+ * requests we had in flight at once.
+ */
+
+struct broker_conn {
+	int			fd;
+	bool			busy;
+	bool			stale;		/* Close when request is done */
+	struct broker_conn	*next;
+};
+
+static struct broker_conn *broker_conns = NULL;
+static pthread_mutex_t broker_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Return the path to our broker socket
+ */
+
+const char *
+broker_path(void)
+{
+	static char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+	const char *env;
+	char tmpdir[1024];
+
+	if ((env = getenv("KEYCHAIN_PKCS11_BROKER_SOCKET"))) {
+		snprintf(path, sizeof(path), "%s", env);
+		return path;
+	}
+
+#ifdef _CS_DARWIN_USER_TEMP_DIR
+	if (confstr(_CS_DARWIN_USER_TEMP_DIR, tmpdir, sizeof(tmpdir)) > 0 &&
+	    strlen(tmpdir) < sizeof(tmpdir)) {
+		snprintf(path, sizeof(path), "%s%skeychain-pkcs11.sock",
+			 tmpdir, tmpdir[strlen(tmpdir) - 1] == '/' ? "" : "/");
+		return path;
+	}
+#endif /* _CS_DARWIN_USER_TEMP_DIR */
+
+	snprintf(tmpdir, sizeof(tmpdir), "/tmp/keychain-pkcs11-%lu.sock",
+		 (unsigned long) getuid());
+	snprintf(path, sizeof(path), "%s", tmpdir);
+	return path;
+}
+
+/*
+ * Read or write exactly "len" bytes
+ */
+
+static int
+readn(int fd, void *buf, size_t len)
+{
+	unsigned char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int
+writen(int fd, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Don't let a dead peer kill us with SIGPIPE
+ */
+
+static void
+nosigpipe(int fd)
+{
+#ifdef SO_NOSIGPIPE
+	int on = 1;
+
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif /* SO_NOSIGPIPE */
+}
+
+/*
+ * Open a new connection to the daemon; returns the socket or -1.  The
+ * socket may live in /tmp, where anyone could have put one, so we only
+ * talk to a daemon running as us.
+ */
+
+static int
+broker_open(void)
+{
+	struct sockaddr_un sun;
+	uid_t uid;
+	gid_t gid;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", broker_path());
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	if (getpeereid(fd, &uid, &gid) < 0 || uid != getuid()) {
+		close(fd);
+		return -1;
+	}
+
+	nosigpipe(fd);
+
+	return fd;
+}
+
+/*
+ * Get a connection for a request: an idle one from the pool if we have
+ * one, otherwise a new one.  Returns NULL if we can't reach the daemon.
+ */
+
+static struct broker_conn *
+broker_get(void)
+{
+	struct broker_conn *conn;
+	int fd;
+
+	pthread_mutex_lock(&broker_mutex);
+
+	for (conn = broker_conns; conn; conn = conn->next) {
+		if (! conn->busy) {
+			conn->busy = true;
+			pthread_mutex_unlock(&broker_mutex);
+			return conn;
+		}
+	}
+
+	pthread_mutex_unlock(&broker_mutex);
+
+	if ((fd = broker_open()) < 0)
+		return NULL;
+
+	if (! (conn = calloc(1, sizeof(*conn)))) {
+		close(fd);
+		return NULL;
+	}
+
+	conn->fd = fd;
+	conn->busy = true;
+
+	pthread_mutex_lock(&broker_mutex);
+	conn->next = broker_conns;
+	broker_conns = conn;
+	pthread_mutex_unlock(&broker_mutex);
+
+	return conn;
+}
+
+/*
+ * Done with a connection.  If it broke (or we were told to disconnect
+ * while it was busy) close it, otherwise put it back in the pool.
+ */
+
+static void
+broker_put(struct broker_conn *conn, bool broken)
+{
+	struct broker_conn **p;
+
+	pthread_mutex_lock(&broker_mutex);
+
+	if (! broken && ! conn->stale) {
+		conn->busy = false;
+		pthread_mutex_unlock(&broker_mutex);
+		return;
+	}
+
+	for (p = &broker_conns; *p != conn; p = &(*p)->next)
+		;
+	*p = conn->next;
+
+	pthread_mutex_unlock(&broker_mutex);
+
+	close(conn->fd);
+	free(conn);
+}
+
+/*
+ * Make sure we can talk to the daemon.  Returns 0 on success, -1 if the
+ * daemon isn't there.  The connection we make stays in the pool.
+ */
+
+int
+broker_connect(void)
+{
+	struct broker_conn *conn;
+
+	if (! (conn = broker_get()))
+		return -1;
+
+	broker_put(conn, false);
+
+	return 0;
+}
+
+/*
+ * Close all of our idle connections; busy ones get closed when their
+ * request is done.
+ */
+
+void
+broker_disconnect(void)
+{
+	struct broker_conn **p, *conn;
+
+	pthread_mutex_lock(&broker_mutex);
+
+	for (p = &broker_conns; (conn = *p); ) {
+		if (conn->busy) {
+			conn->stale = true;
+			p = &conn->next;
+		} else {
+			*p = conn->next;
+			close(conn->fd);
+			free(conn);
+		}
+	}
+
+	pthread_mutex_unlock(&broker_mutex);
+}
+
+/*
+ * Called in a child process after fork().  Our connections belong to our
+ * parent (and other threads may have been in the middle of requests on
+ * some of them), so just drop them all without telling the daemon and
+ * connect again later.  We are the only thread in the child, so it's safe
+ * to reset the mutex and walk the list without it.
+ */
+
+void
+broker_forked(void)
+{
+	struct broker_conn *conn, *next;
+
+	pthread_mutex_init(&broker_mutex, NULL);
+
+	for (conn = broker_conns; conn; conn = next) {
+		next = conn->next;
+		close(conn->fd);
+		free(conn);
+	}
+
+	broker_conns = NULL;
+}
+
+/*
+ * Send a request to the daemon and wait for the reply
+ */
+
+unsigned long
+broker_call(struct broker_msg *msg, const void *data, uint32_t len,
+	    void **reply)
+{
+	struct broker_conn *conn;
+	void *p = NULL;
+
+	*reply = NULL;
+
+	if (! (conn = broker_get()))
+		return CKR_DEVICE_REMOVED;
+
+	msg->length = len;
+
+	if (writen(conn->fd, msg, sizeof(*msg)) ||
+	    (len && writen(conn->fd, data, len)) ||
+	    readn(conn->fd, msg, sizeof(*msg)) ||
+	    msg->length > BROKER_MAX_REPLY)
+		goto fail;
+
+	if (msg->length) {
+		if (! (p = malloc(msg->length)))
+			goto fail;
+		if (readn(conn->fd, p, msg->length))
+			goto fail;
+	}
+
+	broker_put(conn, false);
+
+	*reply = p;
+	return msg->type;
+
+fail:
+	free(p);
+	broker_put(conn, true);
+	return CKR_DEVICE_REMOVED;
+}
+
+/*
+ * Create our listening socket; only the owning user can connect to it.
+ * Returns the socket, or -1 on failure (with errno set).
+ */
+
+int
+broker_listen(void)
+{
+	struct sockaddr_un sun;
+	mode_t mask;
+	int fd, ret;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", broker_path());
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+
+	unlink(sun.sun_path);
+
+	mask = umask(077);
+	ret = bind(fd, (struct sockaddr *) &sun, sizeof(sun));
+	umask(mask);
+
+	if (ret < 0 || listen(fd, 16) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Receive a request.  Returns 0 on success, -1 if the connection went
+ * away or sent us garbage.
+ */
+
+int
+broker_recv(int fd, struct broker_msg *msg, void **data)
+{
+	*data = NULL;
+
+	nosigpipe(fd);
+
+	if (readn(fd, msg, sizeof(*msg)) || msg->length > BROKER_MAX_REQUEST)
+		return -1;
+
+	if (msg->length) {
+		if (! (*data = malloc(msg->length)))
+			return -1;
+		if (readn(fd, *data, msg->length)) {
+			free(*data);
+			*data = NULL;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int
+broker_send(int fd, struct broker_msg *msg, const void *data)
+{
+	if (writen(fd, msg, sizeof(*msg)) ||
+	    (msg->length && writen(fd, data, msg->length)))
+		return -1;
+
+	return 0;
+}
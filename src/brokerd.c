@@ -0,0 +1,336 @@
+/*
+ * keychain-pkcs11d: our local broker daemon.
+ *
+ * This is the library itself (linked in directly) plus a small server
+ * that hands out our object catalog and performs key operations on behalf
+ * of clients (see broker.h for the protocol).  It's meant to be run as a
+ * per-user LaunchAgent; only processes running as the same user are
+ * allowed to talk to it.
+ *
+ * Each client connection gets its own thread and its own PKCS#11
+ * sessions, but they all share our identity list and LocalAuthentication
+ * context; that's the whole point.  Since we close a connection's sessions
+ * when it goes away, the shared login lasts as long as at least one
+ * client is connected.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "mypkcs11.h"
+#include "keychain_pkcs11.h"
+#include "broker.h"
+#include "debug.h"
+
+/*
+ * The largest output we expect from a key operation; our biggest keys
+ * are 4096-bit RSA keys, so this is plenty.
+ */
+
+#define BROKERD_MAX_OUTPUT	4096
+
+/*
+ * Don't rescan for identities more than once a second, no matter how
+ * many clients ask us to.
+ */
+
+#define BROKERD_SCAN_INTERVAL	1
+
+/*
+ * How long we wait at startup for the certificate slot to be built
+ */
+
+#define BROKERD_CERT_WAIT	60
+
+struct client {
+	int			fd;
+	CK_SESSION_HANDLE	session[2];	/* Per-slot sessions */
+	uint64_t		generation;	/* Generation of sessions */
+};
+
+static pthread_mutex_t scan_mutex = PTHREAD_MUTEX_INITIALIZER;
+static time_t last_scan = 0;
+
+/*
+ * Rescan our identities, unless we did that recently
+ */
+
+static void
+rescan(void)
+{
+	CK_ULONG count = 0;
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&scan_mutex);
+	if (now - last_scan >= BROKERD_SCAN_INTERVAL) {
+		C_GetSlotList(CK_FALSE, NULL, &count);
+		last_scan = now;
+	}
+	pthread_mutex_unlock(&scan_mutex);
+}
+
+static void
+close_sessions(struct client *cl)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (cl->session[i])
+			C_CloseSession(cl->session[i]);
+		cl->session[i] = 0;
+	}
+}
+
+/*
+ * Get this client's session for a slot, opening it if necessary.  If our
+ * identity list has changed then the old sessions are useless, so toss
+ * them and start over.
+ */
+
+static CK_RV
+get_session(struct client *cl, CK_SLOT_ID slot, CK_SESSION_HANDLE *session)
+{
+	uint64_t gen = keychain_generation();
+	CK_RV rv;
+
+	if (slot != 1 && slot != 2)
+		return CKR_SLOT_ID_INVALID;
+
+	if (cl->generation != gen) {
+		close_sessions(cl);
+		cl->generation = gen;
+	}
+
+	if (! cl->session[slot - 1]) {
+		rv = C_OpenSession(slot, CKF_SERIAL_SESSION, NULL, NULL,
+				   &cl->session[slot - 1]);
+		if (rv != CKR_OK)
+			return rv;
+	}
+
+	*session = cl->session[slot - 1];
+
+	return CKR_OK;
+}
+
+/*
+ * Perform a key operation for a client
+ */
+
+static CK_RV
+keyop(struct client *cl, struct broker_msg *msg, unsigned char *data,
+      unsigned char *out, CK_ULONG *outlen)
+{
+	CK_MECHANISM mech = { msg->arg[2], NULL, 0 };
+	CK_SESSION_HANDLE session;
+	CK_RV rv;
+
+	if (msg->generation != keychain_generation())
+		return CKR_KEY_CHANGED;
+
+	if ((rv = get_session(cl, msg->arg[0], &session)) != CKR_OK)
+		return rv;
+
+	switch (msg->type) {
+	case BROKER_SIGN:
+		if ((rv = C_SignInit(session, &mech, msg->arg[1])) == CKR_OK)
+			rv = C_Sign(session, data, msg->length, out, outlen);
+		break;
+	case BROKER_VERIFY:
+		if (msg->arg[3] > msg->length)
+			return CKR_ARGUMENTS_BAD;
+		if ((rv = C_VerifyInit(session, &mech, msg->arg[1])) == CKR_OK)
+			rv = C_Verify(session, data, msg->arg[3],
+				      data + msg->arg[3],
+				      msg->length - msg->arg[3]);
+		*outlen = 0;
+		break;
+	case BROKER_ENCRYPT:
+		if ((rv = C_EncryptInit(session, &mech, msg->arg[1])) == CKR_OK)
+			rv = C_Encrypt(session, data, msg->length, out,
+				       outlen);
+		break;
+	case BROKER_DECRYPT:
+		if ((rv = C_DecryptInit(session, &mech, msg->arg[1])) == CKR_OK)
+			rv = C_Decrypt(session, data, msg->length, out,
+				       outlen);
+		break;
+	default:
+		rv = CKR_FUNCTION_NOT_SUPPORTED;
+	}
+
+	return rv;
+}
+
+/*
+ * Handle all of the requests from one client
+ */
+
+static void *
+client_thread(void *arg)
+{
+	struct client *cl = arg;
+	struct broker_msg msg;
+	unsigned char out[BROKERD_MAX_OUTPUT];
+	CK_SESSION_HANDLE session;
+	CK_ULONG outlen;
+	void *data, *catalog;
+	size_t len;
+	uint64_t gen;
+	int ret;
+
+	while (broker_recv(cl->fd, &msg, &data) == 0) {
+		catalog = NULL;
+		outlen = 0;
+
+		switch (msg.type) {
+		case BROKER_CATALOG:
+			rescan();
+			gen = keychain_generation();
+			msg.type = CKR_OK;
+			if (msg.arg[0] != gen) {
+				catalog = keychain_catalog_export(&len, &gen);
+				if (catalog)
+					outlen = len;
+				else
+					msg.type = CKR_HOST_MEMORY;
+			}
+			msg.generation = gen;
+			break;
+		case BROKER_LOGIN:
+			msg.type = get_session(cl, 1, &session);
+			if (msg.type == CKR_OK)
+				msg.type = C_Login(session, CKU_USER,
+						   msg.arg[0] ? data : NULL,
+						   msg.length);
+			break;
+		case BROKER_SIGN:
+		case BROKER_VERIFY:
+		case BROKER_ENCRYPT:
+		case BROKER_DECRYPT:
+			outlen = sizeof(out);
+			msg.type = keyop(cl, &msg, data, out, &outlen);
+			if (msg.type != CKR_OK)
+				outlen = 0;
+			break;
+		default:
+			msg.type = CKR_FUNCTION_NOT_SUPPORTED;
+		}
+
+		os_log_debug(logsys, "Broker request on fd %d returning %s",
+			     cl->fd, getCKRName(msg.type));
+
+		msg.length = outlen;
+		ret = broker_send(cl->fd, &msg, catalog ? catalog : out);
+
+		free(catalog);
+		free(data);
+
+		if (ret)
+			break;
+	}
+
+	close_sessions(cl);
+	close(cl->fd);
+	free(cl);
+
+	return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+	CK_C_INITIALIZE_ARGS init = { NULL, NULL, NULL, NULL,
+				      CKF_OS_LOCKING_OK, NULL };
+	CK_SLOT_INFO slot_info;
+	struct client *cl;
+	pthread_t thread;
+	uid_t uid;
+	gid_t gid;
+	CK_RV rv;
+	int fd, s, i;
+
+	if (argc != 1) {
+		fprintf(stderr, "Usage: %s\n", argv[0]);
+		exit(1);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	broker_server = true;
+
+	if ((rv = C_Initialize(&init)) != CKR_OK) {
+		fprintf(stderr, "C_Initialize failed: %s\n", getCKRName(rv));
+		exit(1);
+	}
+
+	/*
+	 * Do our initial identity scan, and give the certificate scan a
+	 * chance to finish so the first clients get the certificate slot.
+	 */
+
+	rescan();
+
+	for (i = 0; i < BROKERD_CERT_WAIT * 10; i++) {
+		if (C_GetSlotInfo(2, &slot_info) == CKR_OK &&
+		    (slot_info.flags & CKF_TOKEN_PRESENT))
+			break;
+		usleep(100000);
+	}
+
+	if ((fd = broker_listen()) < 0) {
+		fprintf(stderr, "Unable to listen on %s: %s\n", broker_path(),
+			strerror(errno));
+		exit(1);
+	}
+
+	for (;;) {
+		if ((s = accept(fd, NULL, NULL)) < 0) {
+			if (errno != EINTR)
+				fprintf(stderr, "accept failed: %s\n",
+					strerror(errno));
+			continue;
+		}
+
+		/*
+		 * The socket is only accessible by our user, but check
+		 * anyway.
+		 */
+
+		uid = (uid_t) -1;
+		if (getpeereid(s, &uid, &gid) < 0 || uid != getuid()) {
+			os_log_debug(logsys, "Rejecting broker connection "
+				     "from uid %d", (int) uid);
+			close(s);
+			continue;
+		}
+
+		if (! (cl = calloc(1, sizeof(*cl)))) {
+			close(s);
+			continue;
+		}
+
+		cl->fd = s;
+
+		if (pthread_create(&thread, NULL, client_thread, cl) != 0) {
+			close(s);
+			free(cl);
+			continue;
+		}
+
+		pthread_detach(thread);
+	}
+
+	/* NOTREACHED */
+	return 0;
+}
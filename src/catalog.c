@@ -0,0 +1,407 @@
+/*
+ * Routines to build and read our flattened object catalog.
+ *
+ * While we are building a catalog we keep the identities, objects, and
+ * attributes in separate growable arrays and copy all of the strings
+ * and attribute values into one data buffer.  catalog_finish() then lays
+ * everything out in a single allocation:
+ *
+ *	header | identities | slot 0 objects | slot 1 objects |
+ *	attributes | data
+ *
+ * Offsets used while building are relative to the start of the data
+ * buffer (or the attribute array); they get converted to offsets from
+ * the start of the catalog when it is finished.
+ *
+ * If any allocation fails while building we just remember that and
+ * ignore everything else we're given; catalog_finish() then returns NULL.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mypkcs11.h"
+#include "catalog.h"
+
+struct catalog {
+	struct catalog_ident	*idents;
+	unsigned int		ident_count;
+	unsigned int		ident_size;
+	struct catalog_object	*objs[CATALOG_SLOTS];
+	unsigned int		obj_count[CATALOG_SLOTS];
+	unsigned int		obj_size[CATALOG_SLOTS];
+	struct catalog_attr	*attrs;
+	unsigned int		attr_count;
+	unsigned int		attr_size;
+	unsigned char		*data;
+	size_t			data_len;
+	size_t			data_size;
+	uint32_t		token_label;
+	uint64_t		stamp;
+	bool			failed;
+};
+
+/*
+ * Make room for one more array element; sets the failed flag (and leaves
+ * the array alone) if we can't.
+ */
+
+#define GROW(cat, ptr, count, size, incr) \
+do { \
+	if ((count) >= (size)) { \
+		void *_p = realloc((ptr), sizeof(*(ptr)) * ((size) + (incr))); \
+		if (_p) { \
+			(ptr) = _p; \
+			(size) += (incr); \
+		} else { \
+			(cat)->failed = true; \
+		} \
+	} \
+} while (0)
+
+/*
+ * Copy some bytes into our data buffer and return their offset
+ */
+
+static uint32_t
+catalog_data(struct catalog *cat, const void *data, size_t len)
+{
+	uint32_t offset;
+	size_t size;
+	void *p;
+
+	if (cat->failed)
+		return 0;
+
+	if (cat->data_len + len > cat->data_size) {
+		size = (cat->data_len + len) * 2 + 256;
+		if (! (p = realloc(cat->data, size))) {
+			cat->failed = true;
+			return 0;
+		}
+		cat->data = p;
+		cat->data_size = size;
+	}
+
+	offset = cat->data_len;
+	if (len)
+		memcpy(cat->data + offset, data, len);
+	cat->data_len += len;
+
+	return offset;
+}
+
+/*
+ * Add a NUL-terminated string to our data buffer
+ */
+
+static uint32_t
+catalog_strdata(struct catalog *cat, const char *str)
+{
+	return catalog_data(cat, str ? str : "", strlen(str ? str : "") + 1);
+}
+
+struct catalog *
+catalog_new(void)
+{
+	struct catalog *cat = calloc(1, sizeof(*cat));
+
+	if (! cat)
+		return NULL;
+
+	cat->token_label = catalog_strdata(cat, "");
+
+	return cat;
+}
+
+void
+catalog_set_token_label(struct catalog *cat, const char *label)
+{
+	cat->token_label = catalog_strdata(cat, label);
+}
+
+void
+catalog_set_stamp(struct catalog *cat, uint64_t stamp)
+{
+	cat->stamp = stamp;
+}
+
+void
+catalog_add_ident(struct catalog *cat, const char *label, uint32_t flags,
+		  uint64_t keytype, uint64_t blocksize)
+{
+	struct catalog_ident *id;
+
+	GROW(cat, cat->idents, cat->ident_count, cat->ident_size, 5);
+
+	if (cat->failed)
+		return;
+
+	id = &cat->idents[cat->ident_count++];
+	id->label = catalog_strdata(cat, label);
+	id->flags = flags;
+	id->keytype = keytype;
+	id->blocksize = blocksize;
+}
+
+/*
+ * Add an object and all of its attributes to the catalog.  The
+ * attributes are passed in as an array of CK_ATTRIBUTEs.  The object
+ * handle is carried along so everyone using the catalog agrees on it.
+ */
+
+void
+catalog_add_object(struct catalog *cat, unsigned int slot, uint64_t class,
+		   unsigned int id_index, uint32_t handle, const void *attrs,
+		   unsigned int attr_count)
+{
+	const CK_ATTRIBUTE *a = attrs;
+	struct catalog_object *obj;
+	unsigned int i;
+
+	if (slot >= CATALOG_SLOTS)
+		return;
+
+	GROW(cat, cat->objs[slot], cat->obj_count[slot], cat->obj_size[slot],
+	     20);
+
+	if (cat->failed)
+		return;
+
+	obj = &cat->objs[slot][cat->obj_count[slot]++];
+	obj->class = class;
+	obj->id_index = id_index;
+	obj->attr_count = attr_count;
+	obj->attr_offset = cat->attr_count;
+	obj->handle = handle;
+
+	for (i = 0; i < attr_count; i++) {
+		GROW(cat, cat->attrs, cat->attr_count, cat->attr_size, 100);
+		if (cat->failed)
+			return;
+		cat->attrs[cat->attr_count].type = a[i].type;
+		cat->attrs[cat->attr_count].length = a[i].ulValueLen;
+		cat->attrs[cat->attr_count].offset =
+				catalog_data(cat, a[i].pValue, a[i].ulValueLen);
+		cat->attr_count++;
+	}
+}
+
+/*
+ * Lay everything out in one buffer and free our builder.  Returns NULL
+ * if we ran out of memory at any point.
+ */
+
+void *
+catalog_finish(struct catalog *cat, uint64_t generation, uint32_t flags,
+	       size_t *len)
+{
+	struct catalog_header *hdr;
+	struct catalog_ident *idents;
+	struct catalog_object *objs;
+	struct catalog_attr *attrs;
+	unsigned char *buf;
+	size_t off, attr_off, data_off;
+	uint32_t obj_offset[CATALOG_SLOTS];
+	unsigned int i, j;
+
+	if (cat->failed) {
+		catalog_free(cat);
+		return NULL;
+	}
+
+	off = sizeof(*hdr);
+	off += sizeof(*idents) * cat->ident_count;
+	for (i = 0; i < CATALOG_SLOTS; i++) {
+		obj_offset[i] = off;
+		off += sizeof(*objs) * cat->obj_count[i];
+	}
+	attr_off = off;
+	off += sizeof(*attrs) * cat->attr_count;
+	data_off = off;
+	off += cat->data_len;
+
+	if (! (buf = calloc(1, off))) {
+		catalog_free(cat);
+		return NULL;
+	}
+
+	hdr = (struct catalog_header *) buf;
+
+	hdr->magic = CATALOG_MAGIC;
+	hdr->version = CATALOG_VERSION;
+	hdr->generation = generation;
+	hdr->size = off;
+	hdr->flags = flags;
+	hdr->stamp = cat->stamp;
+	hdr->token_label = data_off + cat->token_label;
+	hdr->ident_count = cat->ident_count;
+	hdr->ident_offset = sizeof(*hdr);
+
+	idents = (struct catalog_ident *) (buf + hdr->ident_offset);
+	for (i = 0; i < cat->ident_count; i++) {
+		idents[i] = cat->idents[i];
+		idents[i].label += data_off;
+	}
+
+	for (i = 0; i < CATALOG_SLOTS; i++) {
+		hdr->obj_count[i] = cat->obj_count[i];
+		hdr->obj_offset[i] = obj_offset[i];
+		objs = (struct catalog_object *) (buf + obj_offset[i]);
+		for (j = 0; j < cat->obj_count[i]; j++) {
+			objs[j] = cat->objs[i][j];
+			objs[j].attr_offset = attr_off +
+				cat->objs[i][j].attr_offset * sizeof(*attrs);
+		}
+	}
+
+	attrs = (struct catalog_attr *) (buf + attr_off);
+	for (i = 0; i < cat->attr_count; i++) {
+		attrs[i] = cat->attrs[i];
+		attrs[i].offset += data_off;
+	}
+
+	if (cat->data_len)
+		memcpy(buf + data_off, cat->data, cat->data_len);
+
+	catalog_free(cat);
+
+	*len = off;
+	return buf;
+}
+
+void
+catalog_free(struct catalog *cat)
+{
+	unsigned int i;
+
+	if (! cat)
+		return;
+
+	free(cat->idents);
+	for (i = 0; i < CATALOG_SLOTS; i++)
+		free(cat->objs[i]);
+	free(cat->attrs);
+	free(cat->data);
+	free(cat);
+}
+
+/*
+ * Make sure a catalog is sane: every table and value we might refer to
+ * needs to be inside of the buffer, and all strings need to be
+ * terminated.
+ */
+
+#define INBOUNDS(off, n, len) ((off) <= (len) && (n) <= (len) - (off))
+
+int
+catalog_valid(const void *buf, size_t len)
+{
+	const struct catalog_header *hdr = buf;
+	const struct catalog_ident *id;
+	const struct catalog_object *obj;
+	const struct catalog_attr *attr;
+	unsigned int i, j, k;
+
+	if (len < sizeof(*hdr) || hdr->magic != CATALOG_MAGIC ||
+	    hdr->version != CATALOG_VERSION || hdr->size != len)
+		return 0;
+
+#define VALIDSTRING(off) \
+	(INBOUNDS(off, 1, len) && \
+	 memchr((const char *) buf + (off), '\0', len - (off)) != NULL)
+
+	if (! VALIDSTRING(hdr->token_label))
+		return 0;
+
+	if (! INBOUNDS(hdr->ident_offset,
+		       (size_t) hdr->ident_count * sizeof(*id), len))
+		return 0;
+
+	for (i = 0; i < hdr->ident_count; i++) {
+		id = catalog_ident(buf, i);
+		if (! VALIDSTRING(id->label))
+			return 0;
+	}
+
+	for (i = 0; i < CATALOG_SLOTS; i++) {
+		if (! INBOUNDS(hdr->obj_offset[i],
+			       (size_t) hdr->obj_count[i] * sizeof(*obj), len))
+			return 0;
+		for (j = 0; j < hdr->obj_count[i]; j++) {
+			obj = catalog_object(buf, i, j);
+			/*
+			 * Token objects and keys refer to an entry in the
+			 * identity table, so make sure it's there.  In the
+			 * certificate slot id_index is the certificate's
+			 * index in the exporter's certificate list, and
+			 * every certificate has at least one object, so it
+			 * can't be more than the object count.  Nothing
+			 * but certificates and trust objects belong there.
+			 */
+			if ((i == 0 || obj->class == CKO_PUBLIC_KEY ||
+			     obj->class == CKO_PRIVATE_KEY) &&
+			    obj->id_index >= hdr->ident_count)
+				return 0;
+			if (i == 1 && (obj->id_index >= hdr->obj_count[1] ||
+				       (obj->class != CKO_CERTIFICATE &&
+					obj->class != CKO_NSS_TRUST)))
+				return 0;
+			if (! INBOUNDS(obj->attr_offset,
+				       (size_t) obj->attr_count * sizeof(*attr),
+				       len))
+				return 0;
+			for (k = 0; k < obj->attr_count; k++) {
+				attr = catalog_attr(buf, obj, k);
+				if (! INBOUNDS(attr->offset, attr->length, len))
+					return 0;
+			}
+		}
+	}
+
+#undef VALIDSTRING
+
+	return 1;
+}
+
+const char *
+catalog_string(const void *buf, uint32_t offset)
+{
+	return (const char *) buf + offset;
+}
+
+const struct catalog_ident *
+catalog_ident(const void *buf, unsigned int index)
+{
+	const struct catalog_header *hdr = buf;
+
+	return (const struct catalog_ident *)
+			((const unsigned char *) buf + hdr->ident_offset) +
+			index;
+}
+
+const struct catalog_object *
+catalog_object(const void *buf, unsigned int slot, unsigned int index)
+{
+	const struct catalog_header *hdr = buf;
+
+	return (const struct catalog_object *)
+			((const unsigned char *) buf + hdr->obj_offset[slot]) +
+			index;
+}
+
+const struct catalog_attr *
+catalog_attr(const void *buf, const struct catalog_object *obj,
+	     unsigned int index)
+{
+	return (const struct catalog_attr *)
+			((const unsigned char *) buf + obj->attr_offset) +
+			index;
+}
+
+const void *
+catalog_value(const void *buf, const struct catalog_attr *attr)
+{
+	return (const unsigned char *) buf + attr->offset;
+}
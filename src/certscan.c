@@ -0,0 +1,264 @@
+/*
+ * Picking the certificates for our certificate slot (see certscan.h for
+ * the overview).
+ *
+ * Our indexes are hash tables of certificate indexes, chained through an
+ * array (one link per certificate), keyed by a name or key hash that
+ * lives in the caller's certificates.  A chain holds everything that
+ * hashed to that bucket, so we still compare the names as we walk it.
+ * Chains are in certificate order, so we pick certificates in the same
+ * order every time for the same Keychain.
+ *
+ * The walk uses a stack rather than recursion, since a long enough
+ * chain of certificates would otherwise run us out of stack.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "certscan.h"
+
+struct cs_index {
+	unsigned int	mask;		/* Buckets - 1 */
+	unsigned int	*head;		/* First in each bucket, plus one */
+	unsigned int	*next;		/* Next in the same bucket, plus one */
+};
+
+static bool cs_index_init(struct cs_index *, unsigned int);
+static void cs_index_add(struct cs_index *, unsigned int, const void *,
+			 size_t);
+static unsigned int cs_index_first(struct cs_index *, const void *, size_t);
+static void cs_index_free(struct cs_index *);
+static uint32_t cs_hash(const void *, size_t);
+static bool cs_equal(const void *, size_t, const void *, size_t);
+
+int
+certscan_select(const struct certscan_cert *certs, unsigned int count,
+		unsigned int *order, bool (*cancelled)(void *), void *arg)
+{
+	struct cs_index issuers = { 0 }, picked = { 0 };
+	unsigned int *stack = NULL, depth = 0, size = 0, *p;
+	unsigned int i, j, k, c, t, n = 0;
+	const struct certscan_cert *ce;
+	bool *seen;
+	int rv = -1;
+
+	seen = calloc(count ? count : 1, sizeof(*seen));
+
+	if (! seen || ! cs_index_init(&issuers, count) ||
+	    ! cs_index_init(&picked, count))
+		goto out;
+
+	/*
+	 * Add in reverse, so each chain comes out in certificate order
+	 */
+
+	for (i = count; i-- > 0; )
+		if (certs[i].issuer)
+			cs_index_add(&issuers, i, certs[i].issuer,
+				     certs[i].issuer_len);
+
+	for (i = 0; i < count; i++) {
+		if (! certs[i].root || seen[i])
+			continue;
+
+		depth = 0;
+		c = i;
+
+		for (;;) {
+			if (! seen[c]) {
+				seen[c] = true;
+				ce = &certs[c];
+
+				if (cancelled && cancelled(arg))
+					goto out;
+
+				if (ce->skip || ! ce->keyhash)
+					goto next;
+
+				for (j = cs_index_first(&picked, ce->keyhash,
+							ce->keyhash_len); j;
+				     j = picked.next[j - 1])
+					if (cs_equal(ce->keyhash,
+						     ce->keyhash_len,
+						     certs[j - 1].keyhash,
+						     certs[j - 1].keyhash_len))
+						goto next;
+
+				cs_index_add(&picked, c, ce->keyhash,
+					     ce->keyhash_len);
+				order[n++] = c;
+
+				if (! ce->subject)
+					goto next;
+
+				/*
+				 * Push what this certificate issued, last
+				 * first, so we visit them in order
+				 */
+
+				j = depth;
+
+				for (c = cs_index_first(&issuers, ce->subject,
+							ce->subject_len); c;
+				     c = issuers.next[c - 1]) {
+					if (seen[c - 1] ||
+					    ! cs_equal(ce->subject,
+						       ce->subject_len,
+						       certs[c - 1].issuer,
+						       certs[c - 1].issuer_len))
+						continue;
+					if (depth == size) {
+						size = size ? size * 2 : 64;
+						if (! (p = realloc(stack,
+							size * sizeof(*p))))
+							goto out;
+						stack = p;
+					}
+					stack[depth++] = c - 1;
+				}
+
+				for (k = depth; j + 1 < k; j++, k--) {
+					t = stack[j];
+					stack[j] = stack[k - 1];
+					stack[k - 1] = t;
+				}
+			}
+next:
+			if (depth == 0)
+				break;
+			c = stack[--depth];
+		}
+	}
+
+	rv = n;
+
+out:
+	free(stack);
+	free(seen);
+	cs_index_free(&issuers);
+	cs_index_free(&picked);
+
+	return rv;
+}
+
+void
+certscan_issuers(const struct certscan_cert *certs, unsigned int count,
+		 int *issuer)
+{
+	struct cs_index subjects;
+	unsigned int i, j, found;
+
+	if (! cs_index_init(&subjects, count)) {
+		for (i = 0; i < count; i++)
+			issuer[i] = -1;
+		return;
+	}
+
+	for (i = 0; i < count; i++)
+		if (certs[i].subject && certs[i].keyhash)
+			cs_index_add(&subjects, i, certs[i].subject,
+				     certs[i].subject_len);
+
+	for (i = 0; i < count; i++) {
+		issuer[i] = -1;
+
+		if (! certs[i].issuer)
+			continue;
+
+		for (j = cs_index_first(&subjects, certs[i].issuer,
+					certs[i].issuer_len), found = 0;
+		     j && found < 2; j = subjects.next[j - 1]) {
+			if (! cs_equal(certs[i].issuer, certs[i].issuer_len,
+				       certs[j - 1].subject,
+				       certs[j - 1].subject_len))
+				continue;
+			issuer[i] = found++ ? -1 : (int) (j - 1);
+		}
+	}
+
+	cs_index_free(&subjects);
+}
+
+/*
+ * Make an empty index with room for this many certificates
+ */
+
+static bool
+cs_index_init(struct cs_index *ix, unsigned int count)
+{
+	unsigned int buckets = 16;
+
+	while (buckets < count * 2 && buckets < (1U << 30))
+		buckets <<= 1;
+
+	ix->mask = buckets - 1;
+	ix->head = calloc(buckets, sizeof(*ix->head));
+	ix->next = calloc(count ? count : 1, sizeof(*ix->next));
+
+	if (! ix->head || ! ix->next) {
+		cs_index_free(ix);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Add a certificate to the front of its chain
+ */
+
+static void
+cs_index_add(struct cs_index *ix, unsigned int i, const void *key,
+	     size_t len)
+{
+	uint32_t b = cs_hash(key, len) & ix->mask;
+
+	ix->next[i] = ix->head[b];
+	ix->head[b] = i + 1;
+}
+
+/*
+ * Return the first certificate (plus one) in the chain for a key, or 0
+ */
+
+static unsigned int
+cs_index_first(struct cs_index *ix, const void *key, size_t len)
+{
+	return ix->head[cs_hash(key, len) & ix->mask];
+}
+
+static void
+cs_index_free(struct cs_index *ix)
+{
+	free(ix->head);
+	free(ix->next);
+	ix->head = ix->next = NULL;
+}
+
+/*
+ * FNV-1a; DER names all start the same way, so it needs to look at
+ * every byte.
+ */
+
+static uint32_t
+cs_hash(const void *key, size_t len)
+{
+	const unsigned char *p = key;
+	uint32_t h = 2166136261U;
+
+	while (len-- > 0) {
+		h ^= *p++;
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+static bool
+cs_equal(const void *a, size_t alen, const void *b, size_t blen)
+{
+	return alen == blen && memcmp(a, b, alen) == 0;
+}
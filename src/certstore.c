@@ -0,0 +1,645 @@
+/*
+ * Our compressed certificate store (see certstore.h for the overview).
+ *
+ * Certificates are raw deflate streams (no zlib header; we know what
+ * they are) using the dictionary as a preset window, so a certificate
+ * only pays for what's different about it.  deflate can only look back
+ * 32K, so that's as big as a dictionary gets; the names that show up most
+ * often go at the end, where matches are cheapest.  If deflating doesn't
+ * save anything we just keep the certificate as it is.
+ *
+ * The cache is a handful of slots with a byte budget, evicted least
+ * recently used first.  Slots are matched by each entry's unique ID
+ * rather than its address, so an entry that is freed (and its memory
+ * reused) can never be confused with a new one.  One mutex protects the
+ * cache and the inflate state we share.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "certstore.h"
+
+#define CS_DICT_MAX		32768		/* deflate's window */
+#define CS_CACHE_SLOTS		16
+#define CS_CACHE_BYTES		(128 * 1024)
+#define CS_TAIL			8		/* See certstore_equal() */
+
+struct certstore_dict {
+	_Atomic(unsigned int)	refs;
+	size_t			size;
+	unsigned char		data[];
+};
+
+struct certstore_packer {
+	struct certstore_dict	*dict;
+	z_stream		z;
+	bool			ready;		/* deflateInit2() worked */
+	unsigned char		*buf;		/* Scratch for output */
+	size_t			bufsize;
+};
+
+struct certstore_entry {
+	_Atomic(unsigned int)	refs;
+	uint64_t		id;		/* For the cache */
+	struct certstore_dict	*dict;		/* What we were packed with */
+	size_t			size;		/* Whole allocation */
+	size_t			value_len;	/* Certificate, unpacked */
+	size_t			packed_len;	/* ... packed (0 if not) */
+	size_t			value_off;	/* Where it is in data */
+	size_t			name_off[CERTSTORE_NAMES_MAX];
+	size_t			name_len[CERTSTORE_NAMES_MAX];
+	unsigned char		tail[CS_TAIL];	/* End of the certificate */
+	unsigned char		data[];		/* Names, then certificate */
+};
+
+struct cs_slot {
+	uint64_t		id;		/* Entry ID, 0 if empty */
+	uint64_t		used;		/* When we last used it */
+	size_t			len;
+	unsigned char		*data;
+};
+
+/*
+ * DER that nearly every certificate has.  Order doesn't matter much;
+ * it's all further back in the window than the names.
+ */
+
+static const unsigned char cs_template[] = {
+	/* Version 3, and the outer sequences */
+	0xa0, 0x03, 0x02, 0x01, 0x02, 0x30, 0x82,
+	/* rsaEncryption, and the RSA signature algorithms */
+	0x30, 0x0d, 0x06, 0x09, 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01,
+	0x01, 0x01, 0x05, 0x00,
+	0x30, 0x0d, 0x06, 0x09, 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01,
+	0x01, 0x05, 0x05, 0x00,
+	0x30, 0x0d, 0x06, 0x09, 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01,
+	0x01, 0x0c, 0x05, 0x00,
+	0x30, 0x0d, 0x06, 0x09, 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01,
+	0x01, 0x0b, 0x05, 0x00,
+	/* id-ecPublicKey with P-384 and P-256, and the ECDSA signatures */
+	0x30, 0x10, 0x06, 0x07, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x02, 0x01,
+	0x06, 0x05, 0x2b, 0x81, 0x04, 0x00, 0x22,
+	0x30, 0x13, 0x06, 0x07, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x02, 0x01,
+	0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07,
+	0x30, 0x0a, 0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x04, 0x03,
+	0x03,
+	0x30, 0x0a, 0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x04, 0x03,
+	0x02,
+	/* Authority information access: OCSP and CA issuers */
+	0x06, 0x08, 0x2b, 0x06, 0x01, 0x05, 0x05, 0x07, 0x01, 0x01,
+	0x06, 0x08, 0x2b, 0x06, 0x01, 0x05, 0x05, 0x07, 0x30, 0x02,
+	0x86, 'h', 't', 't', 'p', ':', '/', '/',
+	0x06, 0x08, 0x2b, 0x06, 0x01, 0x05, 0x05, 0x07, 0x30, 0x01,
+	0x86, 'h', 't', 't', 'p', ':', '/', '/', 'o', 'c', 's', 'p', '.',
+	/* Extended key usage: server and client authentication */
+	0x06, 0x03, 0x55, 0x1d, 0x25, 0x04, 0x16, 0x30, 0x14,
+	0x06, 0x08, 0x2b, 0x06, 0x01, 0x05, 0x05, 0x07, 0x03, 0x01,
+	0x06, 0x08, 0x2b, 0x06, 0x01, 0x05, 0x05, 0x07, 0x03, 0x02,
+	/* CRL distribution points and certificate policies */
+	0x06, 0x03, 0x55, 0x1d, 0x1f, 0x86, 'h', 't', 't', 'p', ':', '/', '/',
+	'c', 'r', 'l', '.', '.', 'c', 'r', 'l',
+	0x06, 0x03, 0x55, 0x1d, 0x20, 0x06, 0x08, 0x2b, 0x06, 0x01, 0x05,
+	0x05, 0x07, 0x02, 0x01, 0x16, 'h', 't', 't', 'p', 's', ':', '/', '/',
+	/* Subject alternative name, key identifiers */
+	0x06, 0x03, 0x55, 0x1d, 0x11,
+	0x06, 0x03, 0x55, 0x1d, 0x23, 0x04, 0x18, 0x30, 0x16, 0x80, 0x14,
+	0x06, 0x03, 0x55, 0x1d, 0x0e, 0x04, 0x16, 0x04, 0x14,
+	/* Key usage, and basic constraints for CAs */
+	0x06, 0x03, 0x55, 0x1d, 0x0f, 0x01, 0x01, 0xff, 0x04, 0x04, 0x03,
+	0x02, 0x01, 0x86,
+	0x06, 0x03, 0x55, 0x1d, 0x0f, 0x01, 0x01, 0xff, 0x04, 0x04, 0x03,
+	0x02, 0x05, 0xa0,
+	0x30, 0x0f, 0x06, 0x03, 0x55, 0x1d, 0x13, 0x01, 0x01, 0xff, 0x04,
+	0x05, 0x30, 0x03, 0x01, 0x01, 0xff,
+	/* Name attributes: C, ST, L, O, OU, CN, and email */
+	0x31, 0x0b, 0x30, 0x09, 0x06, 0x03, 0x55, 0x04, 0x06, 0x13, 0x02,
+	'U', 'S',
+	0x06, 0x03, 0x55, 0x04, 0x08, 0x0c,
+	0x06, 0x03, 0x55, 0x04, 0x07, 0x0c,
+	0x06, 0x03, 0x55, 0x04, 0x0a, 0x13,
+	0x06, 0x03, 0x55, 0x04, 0x0a, 0x0c,
+	0x06, 0x03, 0x55, 0x04, 0x0b, 0x13,
+	0x06, 0x03, 0x55, 0x04, 0x0b, 0x0c,
+	0x06, 0x09, 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x09, 0x01,
+	0x16,
+	0x06, 0x03, 0x55, 0x04, 0x03, 0x13,
+	0x06, 0x03, 0x55, 0x04, 0x03, 0x0c,
+};
+
+static _Atomic(uint64_t) cs_next_id = 1;
+static _Atomic(uint64_t) cs_entries = 0;
+static _Atomic(uint64_t) cs_value_bytes = 0;
+static _Atomic(uint64_t) cs_stored_bytes = 0;
+static _Atomic(uint64_t) cs_packed_bytes = 0;
+
+static pthread_mutex_t cs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct cs_slot cs_cache[CS_CACHE_SLOTS];
+static size_t cs_cache_bytes = 0;
+static uint64_t cs_clock = 0;
+static uint64_t cs_hits = 0;
+static uint64_t cs_misses = 0;
+static z_stream cs_inflate;
+static bool cs_inflate_ready = false;
+
+static int cs_sample_cmp(const void *, const void *);
+static int cs_count_cmp(const void *, const void *);
+static const unsigned char *cs_value(struct certstore_entry *);
+static bool cs_unpack(struct certstore_entry *, unsigned char *);
+static void cs_evict(size_t);
+
+/*
+ * Distinct names and how many times we saw them
+ */
+
+struct cs_count {
+	const struct certstore_sample	*sample;
+	unsigned int			count;
+};
+
+struct certstore_dict *
+certstore_dict_new(const struct certstore_sample *samples, unsigned int count)
+{
+	const struct certstore_sample **sorted = NULL;
+	struct certstore_dict *dict;
+	struct cs_count *counts = NULL;
+	unsigned int i, j, n = 0, used;
+	size_t size = sizeof(cs_template);
+
+	if (count) {
+		sorted = malloc(count * sizeof(*sorted));
+		counts = malloc(count * sizeof(*counts));
+		if (! sorted || ! counts)
+			count = 0;
+	}
+
+	/*
+	 * Sort the samples so duplicates are together, count them, then
+	 * sort the distinct names by how often they appear.
+	 */
+
+	for (i = 0, j = 0; i < count; i++)
+		if (samples[i].data && samples[i].len &&
+		    samples[i].len < CS_DICT_MAX / 4)
+			sorted[j++] = &samples[i];
+	count = j;
+
+	qsort(sorted, count, sizeof(*sorted), cs_sample_cmp);
+
+	for (i = 0; i < count; i++) {
+		if (n && cs_sample_cmp(&sorted[i], &counts[n - 1].sample) == 0) {
+			counts[n - 1].count++;
+			continue;
+		}
+		counts[n].sample = sorted[i];
+		counts[n].count = 1;
+		n++;
+	}
+
+	qsort(counts, n, sizeof(*counts), cs_count_cmp);
+
+	/*
+	 * Take the most common names that fit (a name we only saw once
+	 * won't help anyone else), then lay them out least common first.
+	 */
+
+	for (used = 0; used < n && counts[used].count > 1; used++) {
+		if (size + counts[used].sample->len > CS_DICT_MAX)
+			break;
+		size += counts[used].sample->len;
+	}
+
+	if (! (dict = malloc(sizeof(*dict) + size))) {
+		free(sorted);
+		free(counts);
+		return NULL;
+	}
+
+	atomic_init(&dict->refs, 1);
+	dict->size = size;
+	memcpy(dict->data, cs_template, sizeof(cs_template));
+	size = sizeof(cs_template);
+
+	for (i = used; i > 0; i--) {
+		memcpy(dict->data + size, counts[i - 1].sample->data,
+		       counts[i - 1].sample->len);
+		size += counts[i - 1].sample->len;
+	}
+
+	free(sorted);
+	free(counts);
+
+	return dict;
+}
+
+void
+certstore_dict_release(struct certstore_dict *dict)
+{
+	if (dict && atomic_fetch_sub(&dict->refs, 1) == 1)
+		free(dict);
+}
+
+size_t
+certstore_dict_size(struct certstore_dict *dict)
+{
+	return dict ? dict->size : 0;
+}
+
+struct certstore_packer *
+certstore_packer_new(struct certstore_dict *dict)
+{
+	struct certstore_packer *pk;
+
+	if (! dict || ! (pk = calloc(1, sizeof(*pk))))
+		return NULL;
+
+	pk->dict = dict;
+	atomic_fetch_add(&dict->refs, 1);
+
+	if (deflateInit2(&pk->z, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 9,
+			 Z_DEFAULT_STRATEGY) == Z_OK)
+		pk->ready = true;
+
+	return pk;
+}
+
+void
+certstore_packer_free(struct certstore_packer *pk)
+{
+	if (! pk)
+		return;
+
+	if (pk->ready)
+		deflateEnd(&pk->z);
+	certstore_dict_release(pk->dict);
+	free(pk->buf);
+	free(pk);
+}
+
+struct certstore_entry *
+certstore_pack(struct certstore_packer *pk, const void *value, size_t len,
+	       const struct certstore_sample *names, unsigned int name_count)
+{
+	struct certstore_entry *e;
+	const unsigned char *stored = value;
+	size_t packed = 0, size, off = 0, need;
+	unsigned int i;
+
+	if (! pk || ! value || name_count > CERTSTORE_NAMES_MAX)
+		return NULL;
+
+	/*
+	 * Deflate into our scratch buffer; if that doesn't work (or isn't
+	 * any smaller) we keep the certificate as it is.
+	 */
+
+	if (pk->ready && deflateReset(&pk->z) == Z_OK &&
+	    deflateSetDictionary(&pk->z, pk->dict->data,
+				 pk->dict->size) == Z_OK) {
+		need = deflateBound(&pk->z, len);
+		if (need > pk->bufsize) {
+			free(pk->buf);
+			pk->bufsize = need;
+			if (! (pk->buf = malloc(need)))
+				pk->bufsize = 0;
+		}
+
+		pk->z.next_in = (Bytef *) value;
+		pk->z.avail_in = len;
+		pk->z.next_out = pk->buf;
+		pk->z.avail_out = pk->bufsize;
+
+		if (pk->buf && deflate(&pk->z, Z_FINISH) == Z_STREAM_END &&
+		    pk->z.total_out < len) {
+			packed = pk->z.total_out;
+			stored = pk->buf;
+		}
+	}
+
+	size = packed ? packed : len;
+	for (i = 0; i < name_count; i++)
+		if (names[i].data)
+			size += names[i].len;
+
+	if (! (e = malloc(sizeof(*e) + size)))
+		return NULL;
+
+	atomic_init(&e->refs, 1);
+	e->id = atomic_fetch_add(&cs_next_id, 1);
+	e->dict = NULL;
+	e->size = sizeof(*e) + size;
+	e->value_len = len;
+	e->packed_len = packed;
+
+	for (i = 0; i < CERTSTORE_NAMES_MAX; i++) {
+		e->name_off[i] = 0;
+		e->name_len[i] = 0;
+		if (i >= name_count || ! names[i].data)
+			continue;
+		memcpy(e->data + off, names[i].data, names[i].len);
+		e->name_off[i] = off;
+		e->name_len[i] = names[i].len;
+		off += names[i].len;
+	}
+
+	e->value_off = off;
+	memcpy(e->data + off, stored, packed ? packed : len);
+
+	memset(e->tail, 0, sizeof(e->tail));
+	need = len < CS_TAIL ? len : CS_TAIL;
+	memcpy(e->tail, (const unsigned char *) value + len - need, need);
+
+	if (packed) {
+		e->dict = pk->dict;
+		atomic_fetch_add(&e->dict->refs, 1);
+	}
+
+	atomic_fetch_add(&cs_entries, 1);
+	atomic_fetch_add(&cs_value_bytes, len);
+	atomic_fetch_add(&cs_stored_bytes, e->size);
+	atomic_fetch_add(&cs_packed_bytes, packed ? packed : len);
+
+	return e;
+}
+
+struct certstore_entry *
+certstore_retain(struct certstore_entry *e)
+{
+	if (e)
+		atomic_fetch_add(&e->refs, 1);
+
+	return e;
+}
+
+void
+certstore_release(struct certstore_entry *e)
+{
+	if (! e || atomic_fetch_sub(&e->refs, 1) != 1)
+		return;
+
+	atomic_fetch_sub(&cs_entries, 1);
+	atomic_fetch_sub(&cs_value_bytes, e->value_len);
+	atomic_fetch_sub(&cs_stored_bytes, e->size);
+	atomic_fetch_sub(&cs_packed_bytes, e->packed_len ? e->packed_len :
+							   e->value_len);
+
+	certstore_dict_release(e->dict);
+	free(e);
+}
+
+const void *
+certstore_name(struct certstore_entry *e, unsigned int i)
+{
+	if (! e || i >= CERTSTORE_NAMES_MAX || ! e->name_len[i])
+		return NULL;
+
+	return e->data + e->name_off[i];
+}
+
+bool
+certstore_owns(struct certstore_entry *e, const void *p)
+{
+	const unsigned char *c = p;
+
+	return e && c >= (const unsigned char *) e &&
+	       c < (const unsigned char *) e + e->size;
+}
+
+size_t
+certstore_value_len(struct certstore_entry *e)
+{
+	return e ? e->value_len : 0;
+}
+
+bool
+certstore_copy(struct certstore_entry *e, void *buf)
+{
+	const unsigned char *v;
+
+	if (! e->packed_len) {
+		memcpy(buf, e->data + e->value_off, e->value_len);
+		return true;
+	}
+
+	pthread_mutex_lock(&cs_mutex);
+	if ((v = cs_value(e)))
+		memcpy(buf, v, e->value_len);
+	pthread_mutex_unlock(&cs_mutex);
+
+	return v != NULL;
+}
+
+/*
+ * Certificates of the same length are common, but they end with a
+ * signature, so comparing the last few bytes first saves unpacking
+ * anything that can't match.
+ */
+
+bool
+certstore_equal(struct certstore_entry *e, const void *data, size_t len)
+{
+	const unsigned char *v;
+	size_t n = len < CS_TAIL ? len : CS_TAIL;
+	bool ret;
+
+	if (len != e->value_len ||
+	    memcmp(e->tail, (const unsigned char *) data + len - n, n) != 0)
+		return false;
+
+	if (! e->packed_len)
+		return memcmp(e->data + e->value_off, data, len) == 0;
+
+	pthread_mutex_lock(&cs_mutex);
+	ret = (v = cs_value(e)) && memcmp(v, data, len) == 0;
+	pthread_mutex_unlock(&cs_mutex);
+
+	return ret;
+}
+
+void
+certstore_stats(struct certstore_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	stats->entries = atomic_load(&cs_entries);
+	stats->value_bytes = atomic_load(&cs_value_bytes);
+	stats->stored_bytes = atomic_load(&cs_stored_bytes);
+	stats->packed_bytes = atomic_load(&cs_packed_bytes);
+
+	pthread_mutex_lock(&cs_mutex);
+	stats->cache_bytes = cs_cache_bytes;
+	stats->hits = cs_hits;
+	stats->misses = cs_misses;
+	pthread_mutex_unlock(&cs_mutex);
+}
+
+void
+certstore_flush(void)
+{
+	pthread_mutex_lock(&cs_mutex);
+	cs_evict(SIZE_MAX);
+	pthread_mutex_unlock(&cs_mutex);
+}
+
+void
+certstore_forked(void)
+{
+	pthread_mutex_init(&cs_mutex, NULL);
+}
+
+/*
+ * Sort samples by length and then contents
+ */
+
+static int
+cs_sample_cmp(const void *a, const void *b)
+{
+	const struct certstore_sample *sa = *(const struct certstore_sample **) a;
+	const struct certstore_sample *sb = *(const struct certstore_sample **) b;
+
+	if (sa->len != sb->len)
+		return sa->len < sb->len ? -1 : 1;
+
+	return memcmp(sa->data, sb->data, sa->len);
+}
+
+/*
+ * Most common first; shorter first if they're just as common
+ */
+
+static int
+cs_count_cmp(const void *a, const void *b)
+{
+	const struct cs_count *ca = a, *cb = b;
+
+	if (ca->count != cb->count)
+		return ca->count > cb->count ? -1 : 1;
+	if (ca->sample->len != cb->sample->len)
+		return ca->sample->len < cb->sample->len ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Everything below here is called with cs_mutex locked
+ */
+
+/*
+ * Find a packed entry's value in the cache, or unpack it into a new slot.
+ * The pointer is good until the mutex is unlocked.
+ */
+
+static const unsigned char *
+cs_value(struct certstore_entry *e)
+{
+	struct cs_slot *slot = NULL;
+	unsigned char *buf;
+	unsigned int i;
+
+	for (i = 0; i < CS_CACHE_SLOTS; i++) {
+		if (cs_cache[i].id == e->id) {
+			cs_cache[i].used = ++cs_clock;
+			cs_hits++;
+			return cs_cache[i].data;
+		}
+	}
+
+	cs_misses++;
+
+	if (! (buf = malloc(e->value_len)))
+		return NULL;
+
+	if (! cs_unpack(e, buf)) {
+		free(buf);
+		return NULL;
+	}
+
+	/*
+	 * Make room, then take an empty slot (or the least recently used
+	 * one, if we're out of slots rather than bytes).  A value bigger
+	 * than the whole budget still gets a slot, until the next miss.
+	 */
+
+	cs_evict(e->value_len > CS_CACHE_BYTES ? CS_CACHE_BYTES :
+						 e->value_len);
+
+	for (i = 0; i < CS_CACHE_SLOTS; i++) {
+		if (! cs_cache[i].id) {
+			slot = &cs_cache[i];
+			break;
+		}
+		if (! slot || cs_cache[i].used < slot->used)
+			slot = &cs_cache[i];
+	}
+
+	if (slot->id) {
+		cs_cache_bytes -= slot->len;
+		free(slot->data);
+	}
+
+	slot->id = e->id;
+	slot->used = ++cs_clock;
+	slot->len = e->value_len;
+	slot->data = buf;
+	cs_cache_bytes += slot->len;
+
+	return buf;
+}
+
+static bool
+cs_unpack(struct certstore_entry *e, unsigned char *buf)
+{
+	int ret;
+
+	if (! cs_inflate_ready) {
+		memset(&cs_inflate, 0, sizeof(cs_inflate));
+		if (inflateInit2(&cs_inflate, -15) != Z_OK)
+			return false;
+		cs_inflate_ready = true;
+	} else if (inflateReset(&cs_inflate) != Z_OK) {
+		return false;
+	}
+
+	if (inflateSetDictionary(&cs_inflate, e->dict->data,
+				 e->dict->size) != Z_OK)
+		return false;
+
+	cs_inflate.next_in = e->data + e->value_off;
+	cs_inflate.avail_in = e->packed_len;
+	cs_inflate.next_out = buf;
+	cs_inflate.avail_out = e->value_len;
+
+	ret = inflate(&cs_inflate, Z_FINISH);
+
+	return ret == Z_STREAM_END && cs_inflate.total_out == e->value_len;
+}
+
+/*
+ * Throw away the least recently used values until we have room for this
+ * many more bytes
+ */
+
+static void
+cs_evict(size_t need)
+{
+	struct cs_slot *lru;
+	unsigned int i;
+
+	while (cs_cache_bytes > 0 && (need > CS_CACHE_BYTES ||
+				      cs_cache_bytes + need > CS_CACHE_BYTES)) {
+		lru = NULL;
+		for (i = 0; i < CS_CACHE_SLOTS; i++)
+			if (cs_cache[i].id && (! lru ||
+					       cs_cache[i].used < lru->used))
+				lru = &cs_cache[i];
+		if (! lru)
+			break;
+		cs_cache_bytes -= lru->len;
+		free(lru->data);
+		memset(lru, 0, sizeof(*lru));
+	}
+}
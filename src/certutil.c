@@ -10,8 +10,10 @@
 #include <Security/SecAsn1Templates.h>
 #include <Security/SecDigestTransform.h>
 
+#include "mypkcs11.h"
 #include "certutil.h"
 #include "keychain_pkcs11.h"
+#include "profile.h"
 #include "config.h"
 
 /*
@@ -42,7 +44,7 @@
  * Our ASN.1 template array; each entry in the template corresponds to
  * another field in the ASN.1 structure.
  *
- * Since all we care about is the issuer and subject, we skip the actual
+ * Since all we care about is the raw DER of a few fields, we skip the actual
  * decoding of most fields with SEC_ASN1_SKIP.  The version is a bit weird,
  * so we have to specify the explict tag and use kSecAsn1SkipTemplate.
  *
@@ -73,7 +75,9 @@
 struct certinfo {
 	SecAsn1Item	serialnumber;	/* Certificate serial number */
 	SecAsn1Item	issuer;		/* Certificate issuer */
+	SecAsn1Item	validity;	/* Certificate validity */
 	SecAsn1Item	subject;	/* Certificate subject */
+	SecAsn1Item	spki;		/* SubjectPublicKeyInfo */
 };
 
 /*
@@ -92,9 +96,12 @@ static const SecAsn1Template cert_template[] = {
 	{ SEC_ASN1_SKIP, 0, NULL, 0 },		/* AlgorithmIdentifier */
 	{ SEC_ASN1_SAVE, offsetof(struct certinfo, issuer), NULL, 0 },
 	{ SEC_ASN1_SKIP, 0, NULL, 0 },		/* Issuer */
+	{ SEC_ASN1_SAVE, offsetof(struct certinfo, validity), NULL, 0 },
 	{ SEC_ASN1_SKIP, 0, NULL, 0 },		/* Validity */
 	{ SEC_ASN1_SAVE, offsetof(struct certinfo, subject), NULL, 0 },
 	{ SEC_ASN1_SKIP, 0, NULL, 0 },		/* Subject */
+	{ SEC_ASN1_SAVE, offsetof(struct certinfo, spki), NULL, 0 },
+	{ SEC_ASN1_SKIP, 0, NULL, 0 },		/* SubjectPublicKeyInfo */
 	{ SEC_ASN1_SKIP_REST, 0, NULL, 0 },	/* Stop decoding here */
 	{ 0, 0, NULL, 0 }		/* Dunno if needed, but just in case */
 };
@@ -179,6 +186,30 @@ static const SecAsn1Template rsapubkey_template[] = {
 	{ 0, 0, NULL, 0 },
 };
 
+/*
+ * A template to pull the public key bits out of a SubjectPublicKeyInfo:
+ *
+ * SEQUENCE of
+ *
+ * AlgorithmIdentifier (which we skip)
+ * BIT STRING (subjectPublicKey)
+ *
+ * Note that the decoder returns the length of a BIT STRING in bits.
+ */
+
+struct spki {
+	SecAsn1Item	public_key;
+};
+
+static const SecAsn1Template spki_template[] = {
+	{ SEC_ASN1_SEQUENCE, 0, NULL, sizeof(struct spki) },
+	{ SEC_ASN1_SKIP, 0, NULL, 0 },		/* AlgorithmIdentifier */
+	{ SEC_ASN1_BIT_STRING, offsetof(struct spki, public_key), NULL, 0 },
+	{ 0, 0, NULL, 0 },
+};
+
+static bool get_validity_date(const unsigned char **, size_t *, CK_DATE *);
+
 /*
  * Extract out the DER-encoded certificate subject
  */
@@ -237,6 +268,145 @@ get_certificate_info(CFDataRef certdata, CFDataRef *serialnumber,
 	return true;
 }
 
+/*
+ * Extract out the things from a certificate that clients would otherwise
+ * have to parse the certificate for: the DER-encoded SubjectPublicKeyInfo,
+ * the SHA-1 hash of the subject public key (the bits inside of the BIT
+ * STRING, which is how PKCS#11 and OCSP define it) and the start and end
+ * of the validity period.
+ */
+
+bool
+get_certificate_keyinfo(CFDataRef certdata, CFDataRef *spki,
+			CFDataRef *keyhash, CK_DATE *start, CK_DATE *end)
+{
+	SecAsn1CoderRef coder;
+	struct certinfo cinfo;
+	struct spki key;
+	const unsigned char *p;
+	CFDataRef keybits;
+	size_t len;
+	OSStatus ret;
+
+	*spki = *keyhash = NULL;
+
+	ret = SecAsn1CoderCreate(&coder);
+
+	if (ret) {
+		LOG_SEC_ERR("SecAsn1CreateCoder failed: %{public}@", ret);
+		return false;
+	}
+
+	memset(&cinfo, 0, sizeof(cinfo));
+	memset(&key, 0, sizeof(key));
+
+	ret = SecAsn1Decode(coder, CFDataGetBytePtr(certdata),
+			    CFDataGetLength(certdata), cert_template, &cinfo);
+
+	if (ret) {
+		SecAsn1CoderRelease(coder);
+		LOG_SEC_ERR("SecAsn1Decode failed: %{public}@", ret);
+		return false;
+	}
+
+	ret = SecAsn1Decode(coder, cinfo.spki.Data, cinfo.spki.Length,
+			    spki_template, &key);
+
+	if (ret) {
+		SecAsn1CoderRelease(coder);
+		LOG_SEC_ERR("SecAsn1Decode of SubjectPublicKeyInfo failed: "
+			    "%{public}@", ret);
+		return false;
+	}
+
+	/*
+	 * The Validity is a SEQUENCE of two Times (each either a UTCTime
+	 * or GeneralizedTime); skip over the SEQUENCE header and pick
+	 * them apart by hand.  The SEQUENCE is always small enough to use
+	 * the short length form.
+	 */
+
+	p = cinfo.validity.Data;
+	len = cinfo.validity.Length;
+
+	if (len < 2 || p[0] != 0x30 || p[1] != len - 2) {
+		SecAsn1CoderRelease(coder);
+		os_log_debug(logsys, "Unable to parse certificate validity");
+		return false;
+	}
+
+	p += 2;
+	len -= 2;
+
+	if (! get_validity_date(&p, &len, start) ||
+	    ! get_validity_date(&p, &len, end)) {
+		SecAsn1CoderRelease(coder);
+		os_log_debug(logsys, "Unable to parse certificate validity "
+			     "dates");
+		return false;
+	}
+
+	*spki = CFDataCreate(kCFAllocatorDefault, cinfo.spki.Data,
+			     cinfo.spki.Length);
+
+	keybits = CFDataCreate(kCFAllocatorDefault, key.public_key.Data,
+			       (key.public_key.Length + 7) / 8);
+	*keyhash = get_hash(kSecDigestSHA1, 0, keybits);
+	CFRelease(keybits);
+
+	SecAsn1CoderRelease(coder);
+
+	if (! *keyhash) {
+		CFRelease(*spki);
+		*spki = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Convert one DER-encoded Time into a CK_DATE (which is just the ASCII
+ * year, month, and day), and advance past it.  A UTCTime has a two-digit
+ * year (50-99 is 19xx, otherwise 20xx); a GeneralizedTime has all four.
+ */
+
+static bool
+get_validity_date(const unsigned char **p, size_t *len, CK_DATE *date)
+{
+	const unsigned char *t = *p;
+	size_t tlen, i;
+
+	if (*len < 2 || (t[0] != 0x17 && t[0] != 0x18))
+		return false;
+
+	tlen = t[1];
+
+	if (tlen > *len - 2 || tlen < (t[0] == 0x17 ? 6 : 8))
+		return false;
+
+	for (i = 0; i < (t[0] == 0x17 ? 6 : 8); i++)
+		if (t[2 + i] < '0' || t[2 + i] > '9')
+			return false;
+
+	if (t[0] == 0x17) {
+		date->year[0] = t[2] >= '5' ? '1' : '2';
+		date->year[1] = t[2] >= '5' ? '9' : '0';
+		memcpy(&date->year[2], t + 2, 2);
+		memcpy(date->month, t + 4, 2);
+		memcpy(date->day, t + 6, 2);
+	} else {
+		memcpy(date->year, t + 2, 4);
+		memcpy(date->month, t + 6, 2);
+		memcpy(date->day, t + 8, 2);
+	}
+
+	*p += tlen + 2;
+	*len -= tlen + 2;
+
+	return true;
+}
+
 /*
  * Find the commonName out of a full DER-encoded Name
  */
@@ -414,6 +584,7 @@ is_cert_ca(SecCertificateRef cert)
 	CFErrorRef err = NULL;
 	CFTypeRef result;
 	bool is_ca = false;
+	uint64_t pstart;
 	CFIndex i;
 
 	/*
@@ -433,7 +604,10 @@ is_cert_ca(SecCertificateRef cert)
 		goto out;
 	}
 
+	pstart = prof_now();
 	mdict = SecCertificateCopyValues(cert, query, &err);
+	PROF_RECORD(SecCertificateCopyValues, pstart,
+		    mdict ? 0 : err ? CFErrorGetCode(err) : PROF_FAILED);
 
 	/*
 	 * The dictionary should always be returned, even if it is empty;
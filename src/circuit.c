@@ -0,0 +1,226 @@
+/*
+ * Our circuit breaker (see circuit.h for the overview).
+ *
+ * We remember the outcome of the last CIRCUIT_WINDOW operations as a bit
+ * mask, and open once at least CIRCUIT_MIN_FAILURES of them failed and
+ * they make up at least half of the window.  A single failure (or a
+ * card that fails one time in ten) shouldn't cut anyone off.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "mypkcs11.h"
+#include "keychain_vendor.h"
+#include "circuit.h"
+
+#ifndef NSEC_PER_SEC
+#define NSEC_PER_SEC		1000000000ull
+#endif /* NSEC_PER_SEC */
+
+#define CIRCUIT_WINDOW		20
+#define CIRCUIT_MIN_FAILURES	5
+#define CIRCUIT_COOLDOWN	(30 * NSEC_PER_SEC)
+
+static uint64_t circuit_now(void);
+static bool circuit_failure(CK_RV);
+static void circuit_trip(struct circuit *, uint64_t);
+
+void
+circuit_init(struct circuit *c, bool enabled)
+{
+	pthread_mutex_init(&c->mutex, NULL);
+	c->enabled = enabled;
+	c->calls = c->failures = c->rejected = c->trips = 0;
+	c->avg_ns = c->max_ns = 0;
+	circuit_reset(c);
+}
+
+void
+circuit_forked(struct circuit *c)
+{
+	pthread_mutex_init(&c->mutex, NULL);
+	c->probing = false;
+}
+
+void
+circuit_reset(struct circuit *c)
+{
+	pthread_mutex_lock(&c->mutex);
+
+	c->state = KEYCHAIN_CIRCUIT_CLOSED;
+	c->probing = false;
+	c->open_until = 0;
+	c->window = 0;
+	c->window_count = 0;
+
+	pthread_mutex_unlock(&c->mutex);
+}
+
+bool
+circuit_allow(struct circuit *c, bool *trial)
+{
+	bool ret = true;
+
+	*trial = false;
+
+	if (! c->enabled)
+		return true;
+
+	pthread_mutex_lock(&c->mutex);
+
+	if (c->state == KEYCHAIN_CIRCUIT_OPEN &&
+	    circuit_now() >= c->open_until)
+		c->state = KEYCHAIN_CIRCUIT_HALF_OPEN;
+
+	if (c->state == KEYCHAIN_CIRCUIT_OPEN ||
+	    (c->state == KEYCHAIN_CIRCUIT_HALF_OPEN && c->probing)) {
+		c->rejected++;
+		ret = false;
+	} else if (c->state == KEYCHAIN_CIRCUIT_HALF_OPEN) {
+		c->probing = true;
+		*trial = true;
+	}
+
+	pthread_mutex_unlock(&c->mutex);
+
+	return ret;
+}
+
+void
+circuit_record(struct circuit *c, bool trial, CK_RV rv, uint64_t ns)
+{
+	bool failed = circuit_failure(rv);
+
+	if (! c->enabled)
+		return;
+
+	pthread_mutex_lock(&c->mutex);
+
+	c->calls++;
+	c->avg_ns = c->avg_ns ? c->avg_ns - c->avg_ns / 8 + ns / 8 : ns;
+	if (ns > c->max_ns)
+		c->max_ns = ns;
+
+	if (failed)
+		c->failures++;
+
+	if (trial) {
+		/*
+		 * The trial decides things either way, unless it didn't
+		 * tell us anything (it was cancelled, say); then the next
+		 * operation gets to be the trial.
+		 */
+
+		c->probing = false;
+		if (failed) {
+			circuit_trip(c, circuit_now());
+		} else if (rv == CKR_OK) {
+			c->state = KEYCHAIN_CIRCUIT_CLOSED;
+			c->window = 0;
+			c->window_count = 0;
+		}
+	} else if (c->state == KEYCHAIN_CIRCUIT_CLOSED) {
+		c->window = (c->window << 1) | (failed ? 1 : 0);
+		c->window &= (1u << CIRCUIT_WINDOW) - 1;
+		if (c->window_count < CIRCUIT_WINDOW)
+			c->window_count++;
+
+		if (failed) {
+			unsigned int nfail = __builtin_popcount(c->window);
+
+			if (nfail >= CIRCUIT_MIN_FAILURES &&
+			    nfail * 2 >= c->window_count)
+				circuit_trip(c, circuit_now());
+		}
+	}
+
+	pthread_mutex_unlock(&c->mutex);
+}
+
+bool
+circuit_tripped(struct circuit *c)
+{
+	bool ret;
+
+	if (! c->enabled)
+		return false;
+
+	pthread_mutex_lock(&c->mutex);
+	ret = c->state != KEYCHAIN_CIRCUIT_CLOSED;
+	pthread_mutex_unlock(&c->mutex);
+
+	return ret;
+}
+
+void
+circuit_stats(struct circuit *c, struct keychain_circuit_stats *stats)
+{
+	uint64_t now = circuit_now();
+
+	pthread_mutex_lock(&c->mutex);
+
+	memset(stats, 0, sizeof(*stats));
+	stats->enabled = c->enabled;
+	stats->state = c->state;
+	if (c->state == KEYCHAIN_CIRCUIT_OPEN && c->open_until > now)
+		stats->cooldown_ms = (c->open_until - now) / 1000000;
+	stats->calls = c->calls;
+	stats->failures = c->failures;
+	stats->rejected = c->rejected;
+	stats->trips = c->trips;
+	stats->recent_calls = c->window_count;
+	stats->recent_failures = __builtin_popcount(c->window);
+	stats->avg_latency_us = c->avg_ns / 1000;
+	stats->max_latency_us = c->max_ns / 1000;
+
+	pthread_mutex_unlock(&c->mutex);
+}
+
+/*
+ * Everything below here should be called with the mutex locked (or
+ * doesn't care)
+ */
+
+static uint64_t
+circuit_now(void)
+{
+	return clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+}
+
+/*
+ * Does this error mean the card (or reader) is in trouble?  We get
+ * CKR_GENERAL_ERROR for Security framework failures we can't blame on
+ * the user or the input (those come to us as CKR_FUNCTION_CANCELED,
+ * CKR_PIN_INCORRECT and the like; see cferr_rv()), and CKR_DEVICE_ERROR
+ * when an operation runs past its deadline.
+ */
+
+static bool
+circuit_failure(CK_RV rv)
+{
+	switch (rv) {
+	case CKR_GENERAL_ERROR:
+	case CKR_FUNCTION_FAILED:
+	case CKR_DEVICE_ERROR:
+	case CKR_DEVICE_MEMORY:
+	case CKR_DEVICE_REMOVED:
+	case CKR_TOKEN_NOT_PRESENT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void
+circuit_trip(struct circuit *c, uint64_t now)
+{
+	c->state = KEYCHAIN_CIRCUIT_OPEN;
+	c->open_until = now + CIRCUIT_COOLDOWN;
+	c->window = 0;
+	c->window_count = 0;
+	c->trips++;
+}
@@ -0,0 +1,122 @@
+/*
+ * Run a backend call with a deadline (see deadline.h for the overview).
+ *
+ * The caller and the worker race to change the job state: whoever moves
+ * it out of "running" first decides who cleans up.  If the worker gets
+ * there first the call finished and the caller gets the results; if the
+ * caller does, the worker throws everything away when it's done.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <dispatch/dispatch.h>
+
+#include "deadline.h"
+
+/*
+ * How often we check for cancellation while waiting
+ */
+
+#define DEADLINE_POLL_MS	100
+
+enum job_state {
+	JOB_RUNNING,
+	JOB_DONE,
+	JOB_ABANDONED,
+};
+
+struct deadline_job {
+	void			(*func)(void *);
+	void			(*abandon)(void *);
+	void			*arg;
+	dispatch_semaphore_t	done;
+	_Atomic(int)		state;
+};
+
+static void deadline_worker(void *);
+static void deadline_job_free(struct deadline_job *);
+
+enum deadline_result
+deadline_run(void (*func)(void *), void (*abandon)(void *), void *arg,
+	     unsigned int ms, _Atomic(unsigned long) *cancel, unsigned long gen)
+{
+	struct deadline_job *job;
+	enum deadline_result result = DEADLINE_EXPIRED;
+	unsigned int waited = 0, slice;
+	int expect = JOB_RUNNING;
+
+	if (! (job = malloc(sizeof(*job))))
+		return DEADLINE_FAILED;
+
+	if (! (job->done = dispatch_semaphore_create(0))) {
+		free(job);
+		return DEADLINE_FAILED;
+	}
+
+	job->func = func;
+	job->abandon = abandon;
+	job->arg = arg;
+	atomic_init(&job->state, JOB_RUNNING);
+
+	dispatch_async_f(dispatch_get_global_queue(
+				DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+			 job, deadline_worker);
+
+	while (ms == DEADLINE_FOREVER || waited < ms) {
+		slice = ms == DEADLINE_FOREVER ? DEADLINE_POLL_MS : ms - waited;
+		if (cancel && slice > DEADLINE_POLL_MS)
+			slice = DEADLINE_POLL_MS;
+
+		if (dispatch_semaphore_wait(job->done, dispatch_time(
+				DISPATCH_TIME_NOW, slice * NSEC_PER_MSEC)) == 0) {
+			deadline_job_free(job);
+			return DEADLINE_DONE;
+		}
+
+		if (ms != DEADLINE_FOREVER)
+			waited += slice;
+
+		if (cancel && atomic_load(cancel) != gen) {
+			result = DEADLINE_CANCELLED;
+			break;
+		}
+	}
+
+	/*
+	 * If the worker finished while we were deciding to give up, we
+	 * might as well use what it got.
+	 */
+
+	if (! atomic_compare_exchange_strong(&job->state, &expect,
+					     JOB_ABANDONED)) {
+		dispatch_semaphore_wait(job->done, DISPATCH_TIME_FOREVER);
+		deadline_job_free(job);
+		return DEADLINE_DONE;
+	}
+
+	return result;
+}
+
+static void
+deadline_worker(void *context)
+{
+	struct deadline_job *job = context;
+	int expect = JOB_RUNNING;
+
+	job->func(job->arg);
+
+	if (atomic_compare_exchange_strong(&job->state, &expect, JOB_DONE)) {
+		dispatch_semaphore_signal(job->done);
+	} else {
+		job->abandon(job->arg);
+		deadline_job_free(job);
+	}
+}
+
+static void
+deadline_job_free(struct deadline_job *job)
+{
+	dispatch_release(job->done);
+	free(job);
+}
@@ -22,6 +22,7 @@
 
 
 #include "debug.h"
+#include "trace.h"
 
 
 char *hexify(unsigned char *data, int len) {
@@ -372,6 +373,7 @@ const char * getCKAName(CK_ATTRIBUTE_TYPE attrib) {
         case CKA_EXPONENT_1: return "CKA_EXPONENT_1";
         case CKA_EXPONENT_2: return "CKA_EXPONENT_2";
         case CKA_COEFFICIENT: return "CKA_COEFFICIENT";
+        case CKA_PUBLIC_KEY_INFO: return "CKA_PUBLIC_KEY_INFO";
         case CKA_PRIME: return "CKA_PRIME";
         case CKA_SUBPRIME: return "CKA_SUBPRIME";
         case CKA_BASE: return "CKA_BASE";
@@ -622,6 +624,21 @@ const char * getCKSName(CK_STATE state) {
     }
 }
 
+const char * getTraceName(unsigned int id) {
+    static const char *names[] = {
+#define CK_PKCS11_FUNCTION_INFO(name) #name,
+#include "pkcs11f.h"
+#undef CK_PKCS11_FUNCTION_INFO
+#define TRACE_EVENT(name, cat) #name,
+        TRACE_EVENT_LIST
+#undef TRACE_EVENT
+    };
+
+    if (id >= sizeof(names) / sizeof(names[0]))
+        return "Unknown Trace Identifier";
+    return names[id];
+}
+
 #if 0
 const char * getSecErrorName(int status) {
 
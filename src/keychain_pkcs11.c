@@ -12,6 +12,8 @@
 #include <stdarg.h>
 #include <pthread.h>
 #include <stdatomic.h>
+#include <time.h>
+#include <limits.h>
 
 #include "mypkcs11.h"
 #include "keychain_pkcs11.h"
@@ -19,6 +21,19 @@
 #include "certutil.h"
 #include "debug.h"
 #include "tables.h"
+#include "trace.h"
+#include "catalog.h"
+#include "broker.h"
+#include "shmcatalog.h"
+#include "verifycache.h"
+#include "signflight.h"
+#include "deadline.h"
+#include "circuit.h"
+#include "profile.h"
+#include "recorder.h"
+#include "certstore.h"
+#include "certscan.h"
+#include "keychain_vendor.h"
 #include "config.h"
 
 /* We currently support 2.40 of Cryptoki */
@@ -37,6 +52,7 @@
 
 #define CHECKSLOT(slot, present) \
 do { \
+	TRACE_HANDLE(slot); \
 	if (slot != TOKEN_SLOT && slot != CERTIFICATE_SLOT) { \
 		os_log_debug(logsys, "Slot %lu is invalid, returning " \
 			     "CKR_SLOT_ID_INVALID", slot); \
@@ -117,6 +133,14 @@ do { \
 	} \
 } while (0)
 
+/*
+ * We count how many threads hold id_mutex or sess_mutex, so a child
+ * process can tell if it got a copy of our lists while someone was in
+ * the middle of changing them (see fork_child()).
+ */
+
+#define LIST_MUTEX(mutex) (&(mutex) == &id_mutex || &(mutex) == &sess_mutex)
+
 #define LOCK_MUTEX(mutex) \
 do { \
 	int rc; \
@@ -129,6 +153,8 @@ do { \
 		if (rc) { \
 			os_log_debug(logsys, "lock_mutex returned %d", rc); \
 		} \
+		if (LIST_MUTEX(mutex)) \
+			atomic_fetch_add(&list_locks_held, 1); \
 	} \
 } while (0)
 
@@ -136,6 +162,8 @@ do { \
 do { \
 	int rc; \
 	if (use_mutex) { \
+		if (LIST_MUTEX(mutex)) \
+			atomic_fetch_sub(&list_locks_held, 1); \
 		if (unlockmutex) { \
 			rc = (*unlockmutex)(&mutex.ck); \
 		} else { \
@@ -149,6 +177,24 @@ do { \
 
 static kc_mutex id_mutex;
 static kc_mutex sess_mutex;
+_Atomic static int list_locks_held = ATOMIC_VAR_INIT(0);
+
+/*
+ * In broker mode our key operations let go of id_mutex while they wait
+ * for the daemon; they don't need the identity list, and we don't want
+ * every other thread waiting behind one slow request.  They keep the
+ * session mutex, which is enough to keep C_CloseSession() from freeing
+ * the session under them, but it means they can't take id_mutex again.
+ * UNLOCK_ID_MUTEX() releases id_mutex only if we still have it.
+ */
+
+#define UNLOCK_ID_MUTEX(locked) \
+do { \
+	if (locked) { \
+		UNLOCK_MUTEX(id_mutex); \
+		(locked) = false; \
+	} \
+} while (0)
 
 /*
  * Our list of identities that is stored on our smartcard
@@ -168,6 +214,10 @@ struct id_info {
 	bool			pubcanverify;	/* Can pubkey verify? */
 	bool			pubcanencrypt;	/* Can pubkey encrypt? */
 	bool			pubcanwrap;	/* Can pubkey wrap? */
+	size_t			blocksize;	/* Key block size */
+	CK_ULONG		keybits;	/* Key size in bits */
+	CK_FLAGS *		mechflags;	/* Usage flags for each entry
+						   in keychain_mechmap */
 };
 
 static struct id_info *id_list = NULL;
@@ -177,16 +227,96 @@ static bool id_list_init = false;		/* Is ID list initialized? */
 static bool ask_pin = false;			/* Should we ask for a PIN? */
 static bool logged_in = false;			/* Are we logged into card? */
 static void *lacontext = NULL;			/* LocalAuth context */
+static uint64_t id_list_generation = 0;		/* ID list generation */
+static bool id_refs_stale = false;		/* Refs belong to parent? */
+
+/*
+ * We start the first identity scan in the background from C_Initialize(),
+ * so it overlaps with the application's own startup.  C_GetSlotList()
+ * waits for it (but not forever); if it finishes in time then the first
+ * C_GetSlotList() doesn't need to scan again.
+ *
+ * C_Finalize() cancels the scan by bumping id_scan_cancel; the Keychain
+ * queries made by the background scan give up when they see that (see
+ * secitem_copy_matching()), and then C_Finalize() waits a bounded time
+ * for the scan to let go of id_mutex.
+ */
+
+#define ID_SCAN_WAIT		10	/* Seconds */
+#define FINALIZE_WAIT		10	/* Seconds */
 
+static dispatch_group_t id_scan_group = NULL;
+_Atomic static bool id_scan_pending = ATOMIC_VAR_INIT(false);
+static _Atomic(unsigned long) id_scan_cancel = ATOMIC_VAR_INIT(0);
+static __thread bool id_scan_thread = false;	/* Background scan? */
+static __thread unsigned long id_scan_gen = 0;	/* ... started when */
+
+static void background_id_scan(void *);
 static int scan_identities(void);
 static int add_identity(CFDictionaryRef);
 static SecAccessControlRef getaccesscontrol(CFDictionaryRef);
 static unsigned int cflistcount(CFTypeRef);	/* Count of list entries */
 static CFDictionaryRef cfgetindex(CFTypeRef, unsigned int);/* Entry in list */
 static void id_list_free(void);
+static void id_list_forget(void);
 static CK_KEY_TYPE convert_keytype(CFNumberRef);
 static void token_logout(void);
 
+/*
+ * What mechanisms each key can actually do.  When we scan a key we ask
+ * the Security framework which of our mechanisms it supports (using
+ * SecKeyIsAlgorithmSupported()) and save the answer in the identity's
+ * mechflags array, so the Init functions can reject a mechanism the key
+ * can't do without a trip to the card.  The union of all of the keys is
+ * what we report for the token slot in C_GetMechanismList() and
+ * C_GetMechanismInfo(); that is indexed the same way as keychain_mechmap,
+ * and a mechanism no key supports has no flags set.  The certificate slot
+ * has no keys, so it has no mechanisms.
+ */
+
+static CK_MECHANISM_INFO *token_mechinfo = NULL;
+static CK_MECHANISM_TYPE *token_mechlist = NULL;
+static unsigned int token_mechcount = 0;
+
+static void id_mechs_get(struct id_info *);
+static bool key_supports(SecKeyRef, SecKeyOperationType, SecKeyAlgorithm);
+static void id_mechs_fallback(struct id_info *);
+static void build_mech_list(void);
+static void mech_list_free(void);
+static CK_RV id_mech_check(unsigned int, int, CK_FLAGS);
+
+/*
+ * Snapshots of our slot and token information.  Applications call
+ * C_GetSlotInfo() and C_GetTokenInfo() a lot (browsers do it for every
+ * slot on every UI refresh), so we fill these in when the identity list
+ * changes (see slot_info_publish()) and those functions just copy them
+ * without taking any locks.  The things that change more often (whether
+ * the certificate slot is ready yet and the session counts) get filled
+ * in when we copy.
+ *
+ * A reader might still be copying an old snapshot when we publish a new
+ * one, so readers count themselves in slot_readers while they copy (see
+ * slot_snap_hold()).  Replaced snapshots go on a retired list, which we
+ * free the next time we publish and find nobody reading.
+ */
+
+struct slot_snapshot {
+	CK_SLOT_INFO		slot_info[2];	/* Indexed by slot ID - 1 */
+	CK_TOKEN_INFO		token_info[2];
+	struct slot_snapshot	*prev;		/* Next on retired list */
+};
+
+static _Atomic(struct slot_snapshot *) slot_snap = ATOMIC_VAR_INIT(NULL);
+static _Atomic(unsigned long) slot_readers = ATOMIC_VAR_INIT(0);
+static struct slot_snapshot *slot_retired = NULL;
+static _Atomic(unsigned long) slot_sessions[2];	/* Open sessions by slot */
+
+static void slot_info_publish(void);
+static void slot_info_free(void);
+static struct slot_snapshot *slot_snap_hold(void);
+static void slot_snap_release(void);
+static void id_list_changed(void);
+
 /*
  * Our object list and the functions to handle them
  *
@@ -197,9 +327,13 @@ static void token_logout(void);
  * Private keys (CKO_PRIVATE_KEY).
  *
  * The general rule is the CKA_ID attribute for any of those should all
- * match for a given identity.  I implemented this so the CKA_ID
- * is a CK_ULONG that is an index into our identity array.  This is
- * arbitrary; we could just match on any byte string.
+ * match for a given identity.  Originally the CKA_ID was a CK_ULONG that
+ * was an index into our identity array, but that changed every time we
+ * rebuilt the identity list; now it's the identity's public key hash, so
+ * it stays the same across rescans (and card reinsertions).  Object
+ * handles in the token slot are derived from the same hash and remembered
+ * in a handle map, for the same reason (see obj_handle()).  Handles in
+ * the certificate slot are just the object index plus one.
  *
  * Previously I had implemented each object list as part of a session, but
  * really the object space is per-token, so I changed the implementation to
@@ -212,19 +346,69 @@ static void token_logout(void);
 struct obj_info {
 	unsigned int		id_index;
 	unsigned char		id_value[sizeof(CK_ULONG)];
+	CK_OBJECT_HANDLE	handle;
 	CK_OBJECT_CLASS		class;
 	CK_ATTRIBUTE_PTR	attrs;
 	unsigned int		attr_count;
 	unsigned int		attr_size;
+	struct certstore_entry	*store;		/* Packed values, if any */
 };
 
-#define LOG_DEBUG_OBJECT(obj, se) \
-	os_log_debug(logsys, "Object %lu (%s)", obj, \
-		     getCKOName(se->obj_list[obj].class));
+#define LOG_DEBUG_OBJECT(obj) \
+	os_log_debug(logsys, "Object %lu (%s)", (obj)->handle, \
+		     getCKOName((obj)->class));
 
 static void build_id_objects(int);
 static void obj_free(struct obj_info **, unsigned int *, unsigned int *);
 
+/*
+ * Our map of token object handles; see obj_handle().  Entries are never
+ * removed (until C_Finalize()), so an identity that goes away and comes
+ * back gets its old handles back.
+ */
+
+struct handle_map {
+	CFDataRef		key;		/* Identity public key hash */
+	CK_OBJECT_CLASS		class;		/* Object class */
+	CK_OBJECT_HANDLE	handle;		/* Handle we gave out */
+};
+
+static struct handle_map *handle_map = NULL;
+static unsigned int handle_map_count = 0;
+static unsigned int handle_map_size = 0;
+
+/*
+ * Token slot handles all have this bit set, so they never collide with
+ * certificate slot handles.
+ */
+
+#define TOKEN_HANDLE_BASE	0x40000000
+
+static CK_OBJECT_HANDLE obj_handle(CFDataRef, CK_OBJECT_CLASS);
+static void handle_map_free(void);
+
+/*
+ * The things we pull out of a certificate when building objects for it.
+ * We work these out once when building our object lists so clients
+ * don't have to parse the certificate (CKA_VALUE) to get them.
+ */
+
+struct certparts {
+	CFDataRef	value;		/* DER-encoded certificate */
+	CFDataRef	subject;	/* Subject Name */
+	CFDataRef	issuer;		/* Issuer Name */
+	CFDataRef	serial;		/* Serial number */
+	CFDataRef	hash;		/* SHA-1 hash of certificate */
+	CFDataRef	spki;		/* SubjectPublicKeyInfo */
+	CFDataRef	keyhash;	/* SHA-1 hash of subject public key */
+	CFDataRef	issuerhash;	/* SHA-1 hash of issuer public key */
+	CK_DATE		start;		/* Start of validity period */
+	CK_DATE		end;		/* End of validity period */
+};
+
+static void certparts_get(SecCertificateRef, struct certparts *);
+static void certparts_free(struct certparts *);
+
 static struct obj_info *id_obj_list = NULL;	/* Identity object list */
 static unsigned int id_obj_count = 0;		/* Identity object list count */
 static unsigned int id_obj_size = 0;		/* Size of identity obj_list */
@@ -240,13 +424,15 @@ static unsigned int id_obj_size = 0;		/* Size of identity obj_list */
  *
  * SecKeyAlgorithms are currently constant CFStringRef so we shouldn't
  * have to worry about maintaing references to it using CFRetain/CFRelease().
+ *
+ * Sessions don't keep their own copy of the object list; they always
+ * look at the current list for their slot (see session_objects()), so
+ * object handles keep working after we rescan.
  */
 
 struct session {
 	kc_mutex 	mutex;			/* Session mutex */
 	CK_SLOT_ID	slot_id;		/* Slot identifier */
-	struct obj_info *obj_list;		/* Pointer to object list */
-	unsigned int	obj_list_count;		/* Copy of object count */
 	unsigned int	obj_search_index;	/* Current search index */
 	CK_ATTRIBUTE_PTR search_attrs;		/* Search attributes */
 	unsigned int	search_attrs_count;	/* Search attribute count */
@@ -261,6 +447,17 @@ struct session {
 	SecKeyAlgorithm dec_alg;		/* Decryption algorithm */
 	SecKeyRef	dec_key;		/* Decryption key */
 	size_t		dec_size;		/* Max size of dec, 0 unknown */
+	CK_OBJECT_HANDLE sig_obj;		/* Broker: signing key */
+	CK_MECHANISM_TYPE sig_mech;		/* Broker: signing mechanism */
+	CK_OBJECT_HANDLE ver_obj;		/* Broker: verify key */
+	CK_MECHANISM_TYPE ver_mech;		/* Broker: verify mechanism */
+	CK_OBJECT_HANDLE enc_obj;		/* Broker: encryption key */
+	CK_MECHANISM_TYPE enc_mech;		/* Broker: encrypt mechanism */
+	CK_OBJECT_HANDLE dec_obj;		/* Broker: decryption key */
+	CK_MECHANISM_TYPE dec_mech;		/* Broker: decrypt mechanism */
+	_Atomic(unsigned long) cancel_gen;	/* Bumped by C_CancelFunction */
+	unsigned long	op_gen;			/* cancel_gen we've acted on */
+	_Atomic(unsigned int) op_timeout;	/* Private key deadline (ms) */
 };
 
 static struct session **sess_list = NULL;	/* Yes, array of pointers */
@@ -268,6 +465,10 @@ static unsigned int sess_list_count = 0;
 static unsigned int sess_list_size = 0;
 static void sess_free(struct session *);
 static void sess_list_free(void);
+static void sess_list_forget(void);
+static struct obj_info *session_objects(struct session *, unsigned int *);
+static struct obj_info *obj_lookup(struct session *, CK_OBJECT_HANDLE);
+static bool sess_sync_cancel(struct session *);
 
 /*
  * Return CKR_SESSION_HANDLE_INVALID if we don't have a valid session
@@ -276,6 +477,7 @@ static void sess_list_free(void);
 
 #define CHECKSESSION(session, var) \
 do { \
+	TRACE_HANDLE(session); \
 	LOCK_MUTEX(sess_mutex); \
 	session--; \
 	if (session >= sess_list_count || sess_list[session] == NULL) { \
@@ -332,31 +534,175 @@ static const char *default_cert_applist[] = {
 };
 
 /*
- * Sigh, I realize I have a cert_list AND a certlist.  Not great naming
- * on my part; I just don't want to change it now
+ * A certificate scan runs as a job on a dispatch queue.  Each job gets a
+ * generation number; cert_scan_want holds the generation of the scan we
+ * actually want, and a job that notices it is no longer wanted throws
+ * away what it has done so far and exits (see cert_scan_cancelled()).
+ * cert_scan_current is the newest job that hasn't given up yet, and is
+ * what a re-initialization can adopt.  Only one job does any work at a
+ * time (they hold cert_scan_serial), since they all build into cert_list
+ * and cert_obj_list.
  */
 
-struct certlist {
-	CFDictionaryRef		certdict;
-	struct certlist		*next;
+struct cert_scan {
+	uint64_t		gen;		/* Scan generation */
+	char			**match;	/* certificateList we scan for */
+	bool			cancelled;	/* We've given up */
+	uint64_t		stamp;		/* Keychain stamp at start */
 };
 
-struct certcontext {
-	struct certlist		*head;
-	struct certlist		*tail;
-	const void		*match;
-};
+static pthread_mutex_t cert_scan_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t cert_scan_serial = PTHREAD_MUTEX_INITIALIZER;
+_Atomic static uint64_t cert_scan_want = ATOMIC_VAR_INIT(0);
+static uint64_t cert_scan_gen = 0;		/* Last generation we used */
+static struct cert_scan *cert_scan_current = NULL;
+static dispatch_group_t cert_scan_group = NULL;	/* All of our scan jobs */
 
+static void start_cert_scan(void);
 static void background_cert_scan(void *);
-static void scan_certificates(void);
-static void add_certificate(CFDictionaryRef, CFMutableSetRef);
+static bool cert_scan_cancelled(struct cert_scan *);
+static void cert_scan_forked(void);
+static int scan_certificates(struct cert_scan *);
+static void cert_describe(CFDictionaryRef, CFArrayRef,
+			  struct certscan_cert *);
+static bool cn_match(SecCertificateRef, CFArrayRef);
+static bool cert_scan_stop(void *);
+static void add_certificate(CFDictionaryRef);
 static void cert_list_free(void);
-static struct certlist *search_certs(CFMutableSetRef, CFArrayRef, CFDataRef);
-static void cn_match(const void *, void *);
-static void issuer_match(const void *, void *);
-static void add_cert_to_list(CFDictionaryRef, struct certcontext *);
-static void free_certlist(struct certlist *);
-static void build_cert_objects(void);
+static int build_cert_objects(struct cert_scan *);
+static void cert_issuers_find(struct certparts *, unsigned int);
+static void cert_objects_add(struct obj_info **, unsigned int *,
+			     unsigned int *, int, struct certparts *,
+			     CK_OBJECT_HANDLE);
+static bool array_equal(char **, char **);
+
+/*
+ * Once the certificate slot is built we check the Keychain again every
+ * so often, and if any certificates were added or removed we build a
+ * new object list and swap it in (under id_mutex, since that is what
+ * sessions hold while they look at the object list).  Certificates that
+ * didn't change keep their objects and handles.
+ */
+
+#define CERT_REFRESH_INTERVAL	300	/* Seconds */
+
+static dispatch_queue_t cert_refresh_queue = NULL;
+static dispatch_source_t cert_refresh_timer = NULL;
+
+static void cert_refresh_start(void);
+static void cert_refresh_stop(void);
+static void cert_refresh(void *);
+static CFDataRef obj_attr_data(struct obj_info *, CK_ATTRIBUTE_TYPE);
+
+/*
+ * If compress_certs is set, certificate objects keep CKA_VALUE packed in
+ * our certificate store (see certstore.h) instead of in their attribute
+ * list; the attribute is there with its length, but a NULL pValue.  Their
+ * names (and those of the matching trust object) point into the store
+ * entry.  cert_dict is what the certificate slot was last packed with.
+ */
+
+static bool compress_certs = false;
+static struct certstore_dict *cert_dict = NULL;
+
+static void cert_objects_pack(struct obj_info *, unsigned int, bool);
+static bool attr_packed(struct obj_info *, CK_ATTRIBUTE_PTR);
+static bool attr_copy(struct obj_info *, CK_ATTRIBUTE_PTR, void *);
+static void obj_attrs_free(struct obj_info *);
+
+/*
+ * Things we need for talking to our broker daemon (see broker.h).  When
+ * use_broker is set the identity list and object lists are copies of the
+ * daemon's catalog; the identities have no Security framework references,
+ * and key operations get forwarded to the daemon.
+ */
+
+static bool use_broker = false;			/* Using the broker? */
+static char *broker_label = NULL;		/* Token label from broker */
+
+static int broker_refresh(void);
+static void catalog_import(const void *);
+static CFDataRef broker_keyop(uint32_t, uint64_t, CK_SLOT_ID,
+			      CK_OBJECT_HANDLE, CK_MECHANISM_TYPE, CFDataRef,
+			      CFDataRef, CFErrorRef *);
+static void broker_vcache_insert(const unsigned char *, uint64_t);
+static CK_RV broker_login(CK_UTF8CHAR_PTR, CK_ULONG);
+
+/*
+ * How many successful verifications we remember, for applications that
+ * use our verification cache (see verifycache.h).
+ */
+
+#define VERIFY_CACHE_SIZE	1024
+
+/*
+ * Deadlines, in milliseconds (0 means wait forever), for private key
+ * operations and Keychain queries (see deadline.h).  They come from the
+ * operationTimeout and scanTimeout preferences; each session starts with
+ * op_timeout, and can change it with C_KeychainSetOperationTimeout().
+ */
+
+static unsigned int op_timeout = 0;
+static unsigned int scan_timeout = 0;
+
+typedef CFDataRef (*seckey_func)(SecKeyRef, SecKeyAlgorithm, CFDataRef,
+				 CFErrorRef *);
+
+static CFDataRef seckey_call(struct session *, seckey_func, SecKeyRef,
+			     SecKeyAlgorithm, CFDataRef, CFErrorRef *,
+			     CK_RV *);
+static OSStatus secitem_copy_matching(CFDictionaryRef, CFTypeRef *);
+static long cferr_code(CFErrorRef);
+static CK_RV cferr_rv(CFErrorRef, CK_RV);
+
+/*
+ * The circuit breaker for private key operations on our token (see
+ * circuit.h); the certificate slot has no private keys.
+ */
+
+static struct circuit token_circuit;
+
+/*
+ * Key prewarming.  The Security framework does a lot of its work for a
+ * token key lazily (connecting to the token driver, loading the key's
+ * attributes and access control), so the first signature after a card
+ * shows up is a lot slower than the rest.  If the prewarmKeys preference
+ * is set for us, we do that work on a background thread as soon as the
+ * identity list changes.  Each change bumps prewarm_gen so a prewarm
+ * that is still running for an old list gives up.
+ */
+
+struct prewarm_job {
+	uint64_t		gen;		/* Our prewarm_gen */
+	unsigned int		count;		/* Number of keys */
+	SecKeyRef		*keys;		/* Retained private keys */
+	CK_FLAGS		**mechflags;	/* Copy of each mechflags */
+};
+
+static bool prewarm_keys = false;
+_Atomic static uint64_t prewarm_gen = ATOMIC_VAR_INIT(0);
+
+static void prewarm_start(void);
+static void background_prewarm(void *);
+static void prewarm_job_free(struct prewarm_job *);
+
+/*
+ * Things we need for our shared-memory catalogs (see shmcatalog.h).  The
+ * certificate slot catalog is only used if the Keychain stamp it was
+ * built under still matches, and even then only for this long, since
+ * not every certificate lives in a Keychain file.
+ */
+
+#define SHARED_CERT_MAXAGE	3600
+
+static bool shared_catalog = false;		/* Use shared catalogs? */
+_Atomic static uint64_t cert_list_stamp = ATOMIC_VAR_INIT(0);
+
+static void *catalog_export(bool, bool, size_t *);
+static void cert_object_export(struct catalog *, struct obj_info *);
+static bool shared_id_import(void);
+static bool shared_cert_import(char **);
+static void shared_publish(int);
 
 /*
  * Various other utility functions we need
@@ -368,6 +714,7 @@ static char *getkeylabel(SecKeyRef);
 static char *getstrcopy(CFStringRef);
 static bool prefkey_found(const char *, const char *, const char **);
 static char **prefkey_arrayget(const char *, const char **);
+static unsigned int prefkey_number(const char *, unsigned int);
 static void array_free(char **);
 #ifdef KEYCHAIN_DEBUG
 void dumpdict(const char *, CFDictionaryRef);
@@ -407,6 +754,7 @@ static CK_FUNCTION_LIST function_list = {
 do { \
 	dispatch_once_f(&loginit, NULL, log_init); \
 	os_log_debug(logsys, #func " called"); \
+	TRACE_BEGIN(TRACE_ ## func); \
 } while (0)
 
 #define FUNCINITCHK(func) \
@@ -414,6 +762,7 @@ do { \
 do { \
 	if (! module_initialized) { \
 		os_log_debug(logsys, #func " returning NOT_INITIALIZED"); \
+		TRACE_END(CKR_CRYPTOKI_NOT_INITIALIZED); \
 		return CKR_CRYPTOKI_NOT_INITIALIZED; \
 	} \
 } while (0)
@@ -422,17 +771,50 @@ do { \
 CK_RV name args { \
 	FUNCINITCHK(name); \
 	os_log_debug(logsys, "Function " #name " returning NOT SUPPORTED!"); \
+	TRACE_END(CKR_FUNCTION_NOT_SUPPORTED); \
 	return CKR_FUNCTION_NOT_SUPPORTED; \
 }
 
 #define RET(name, val) \
 do { \
 	os_log_debug(logsys, #name " returning %s", getCKRName(val)); \
+	TRACE_END(val); \
 	return val; \
 } while (0)
 
 static int module_initialized = 0;
 
+/*
+ * Fork handling.  A child process inherits all of our state, but PKCS#11
+ * says it has to call C_Initialize() before it can use us.  Most of what
+ * we have (our preferences, identity list and object lists) is still
+ * perfectly good and shared copy-on-write with the parent, so rather
+ * than throwing it away we keep it, and only reset the things that can't
+ * survive a fork: our locks, our sessions, and our Security framework and
+ * LocalAuthentication references (which talk to daemons over connections
+ * that belong to the parent).
+ *
+ * We don't take any locks around fork() (that could deadlock, or call
+ * into the application's mutex callbacks at a bad time).  Instead the
+ * child notes whether anyone held id_mutex or sess_mutex when it was
+ * forked; if so our lists may be half-updated and C_Initialize() starts
+ * over from scratch.  The fork handler itself only resets flags and
+ * locks; nothing touches dispatch or the Security framework until the
+ * child calls C_Initialize(), and the certificate scan waits until the
+ * child first asks about slots.
+ */
+
+static pthread_once_t fork_once = PTHREAD_ONCE_INIT;
+static bool forked = false;		/* Child of initialized parent? */
+static bool fork_dirty = false;		/* Lists were being changed? */
+/* Certificate scan put off until first use after a fork */
+_Atomic static bool fork_cert_scan = ATOMIC_VAR_INIT(false);
+
+static void fork_register(void);
+static void fork_child(void);
+static void fork_reinit(void);
+static void fork_resume(void);
+
 /*
  * Our implementation of C_GetFunctionList(), which just returns a pointer
  * to our function list
@@ -446,7 +828,13 @@ CK_RV C_GetFunctionList(CK_FUNCTION_LIST_PTR_PTR pPtr)
 		RET(C_GetFunctionList, CKR_ARGUMENTS_BAD);
 	}
 
-	*pPtr = &function_list;
+	/*
+	 * If we're recording calls, hand out the list that does that
+	 * (see recorder.h)
+	 */
+
+	if (! (*pPtr = recorder_list()))
+		*pPtr = &function_list;
 
 	RET(C_GetFunctionList, CKR_OK);
 }
@@ -498,6 +886,20 @@ CK_RV C_Initialize(CK_VOID_PTR p)
 
 	CREATE_MUTEX(id_mutex);
 	CREATE_MUTEX(sess_mutex);
+	atomic_store(&list_locks_held, 0);
+
+	pthread_once(&fork_once, fork_register);
+
+	/*
+	 * If we're a child process of an initialized parent, just keep
+	 * everything we inherited (see above).
+	 */
+
+	if (forked) {
+		fork_reinit();
+		module_initialized = 1;
+		RET(C_Initialize, CKR_OK);
+	}
 
 	/*
 	 * By default we let the Security framework pop up a dialog box
@@ -526,46 +928,178 @@ CK_RV C_Initialize(CK_VOID_PTR p)
 		ask_pin = true;
 	}
 
+	/*
+	 * See if this application wants private key operations to fail
+	 * fast when the card looks unhealthy.  This has to be ready before
+	 * we get our first identity list.
+	 */
+
+	circuit_init(&token_circuit, prefkey_found("circuitBreaker", progname,
+						   NULL));
+
+	/*
+	 * And if it wants our keys warmed up before the first operation
+	 */
+
+	prewarm_keys = prefkey_found("prewarmKeys", progname, NULL);
+
+	/*
+	 * And whether we should keep the certificate slot compressed
+	 */
+
+	compress_certs = prefkey_found("compressCertificates", progname, NULL);
+
+	/*
+	 * See if this application should use the broker daemon.  If the
+	 * daemon isn't running (or we can't get a catalog from it) then
+	 * we just do everything ourselves like normal.  The daemon itself
+	 * runs this code too, so make sure it doesn't try to talk to itself.
+	 */
+
+	if (broker_server) {
+		/*
+		 * Start our generation count from the current time so
+		 * clients notice if the daemon has been restarted.
+		 */
+		id_list_generation = (uint64_t) time(NULL) << 16;
+	} else if (prefkey_found("useBroker", progname, NULL)) {
+		if (broker_connect() == 0) {
+			LOCK_MUTEX(id_mutex);
+			use_broker = broker_refresh() == 0;
+			UNLOCK_MUTEX(id_mutex);
+		}
+
+		if (use_broker) {
+			os_log_debug(logsys, "Program \"%{public}s\" is using "
+				     "the broker at %{public}s", progname,
+				     broker_path());
+		} else {
+			os_log_debug(logsys, "Program \"%{public}s\" is set to "
+				     "use the broker, but it is not available; "
+				     "running standalone", progname);
+			broker_disconnect();
+		}
+	}
+
+	/*
+	 * See if this application should use (and publish) the shared
+	 * memory catalogs.  There's no point to this in broker mode.
+	 */
+
+	shared_catalog = ! use_broker && ! broker_server &&
+			 prefkey_found("sharedCatalog", progname, NULL);
+
+	/*
+	 * And if it wants us to remember signatures we've verified
+	 */
+
+	vcache_init(prefkey_found("verifyCache", progname, NULL) ?
+		    VERIFY_CACHE_SIZE : 0);
+
+	/*
+	 * How long we're willing to wait for the card (or the user)
+	 */
+
+	op_timeout = prefkey_number("operationTimeout", 0);
+	scan_timeout = prefkey_number("scanTimeout", 0);
+
+	/*
+	 * Each initialization gets its own backend call profile
+	 */
+
+	prof_reset();
+
+	/*
+	 * See which signature mechanisms we should coalesce.  Unlike most
+	 * of our preferences this is a list of mechanism names, not
+	 * application names.  Without locking we can't have two signatures
+	 * going at once, so there would be nothing to coalesce.
+	 */
+
+	if (use_mutex) {
+		CK_MECHANISM_TYPE *mechs;
+		unsigned int i, count = 0;
+
+		/*
+		 * Coalescing is only an optimization, so if we can't
+		 * allocate our list just don't coalesce anything.
+		 */
+
+		if (! (mechs = malloc(sizeof(*mechs) *
+				      keychain_mechmap_size))) {
+			sflight_init(NULL, 0);
+		} else {
+			for (i = 0; i < keychain_mechmap_size; i++)
+				if (keychain_mechmap[i].deterministic &&
+				    prefkey_found("coalesceSign",
+					getCKMName(keychain_mechmap[i].cki_mech),
+					NULL))
+					mechs[count++] =
+						keychain_mechmap[i].cki_mech;
+
+			sflight_init(mechs, count);
+			free(mechs);
+		}
+	}
+
 	/*
 	 * Also check to see if this application will create the default
-	 * Keychain certificate slot.
+	 * Keychain certificate slot.  The broker daemon always builds
+	 * the certificate slot so it can hand it out to clients that
+	 * want it.
 	 */
 
-	if (! prefkey_found("keychainCertSlot", progname,
-			    default_cert_applist)) {
+	if (! broker_server && ! prefkey_found("keychainCertSlot", progname,
+					       default_cert_applist)) {
 		os_log_debug(logsys, "Program \"%{public}s\" has the Keychain "
 			     "Certificate slot DISABLED", progname);
 		cert_slot_enabled = false;
 	} else {
-		enum certstate status = uninitialized;
 		os_log_debug(logsys, "Program \"%{public}s\" has the Keychain "
 			     "Certificate slot ENABLED", progname);
 		cert_slot_enabled = true;
+		start_cert_scan();
 
 		/*
-		 * Mark that we have a certificate scan running; if one
-		 * is running then don't start another.
-		 *
-		 * In a perfect world this shouldn't happen, but if an
-		 * application called C_Finalize() then C_Initialize then
-		 * this could mess things up.
-		 *
-		 * Since by default we are only doing a certificate scan
-		 * for a few applications (like firefox) I decided to
-		 * make things as simple as possible; this means that an
-		 * application that calls C_Finalize() before a certificate
-		 * scan is complete will leak memory.  I thought about all
-		 * of the complicated gyrations that needed to be done
-		 * to fix this, and since this is really only useful for
-		 * Firefox (which is typically long-running) I decided to
-		 * not deal with it.  Maybe I will address it later.
+		 * See if we should keep the certificate slot up to date;
+		 * a broker client gets its certificate slot from the
+		 * broker, and if we aren't allowed to lock we can't swap
+		 * in a new object list safely.
 		 */
 
-		if (atomic_compare_exchange_strong(&cert_list_status,
-						   &status, initializing))
-			dispatch_async_f(dispatch_get_global_queue(
-					  DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
-					 NULL, background_cert_scan);
+		if (! use_broker && use_mutex &&
+		    (broker_server || prefkey_found("certificateRefresh",
+						    progname,
+						    default_cert_applist)))
+			cert_refresh_start();
+	}
+
+	/*
+	 * Fill in our slot information; if we're using the broker this
+	 * has already been done, but that was before we knew about the
+	 * certificate slot.
+	 */
+
+	LOCK_MUTEX(id_mutex);
+	slot_info_publish();
+	UNLOCK_MUTEX(id_mutex);
+
+	/*
+	 * Start looking for identities; the broker already gave us
+	 * ours.  If the application told us not to do any locking then
+	 * we can't have our own thread poking at the identity list, so
+	 * wait for C_GetSlotList() like we used to.
+	 */
+
+	if (! use_broker && use_mutex) {
+		if (! id_scan_group)
+			id_scan_group = dispatch_group_create();
+		atomic_store(&id_scan_pending, true);
+		dispatch_group_async_f(id_scan_group,
+				       dispatch_get_global_queue(
+					DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+				       (void *) atomic_load(&id_scan_cancel),
+				       background_id_scan);
 	}
 
 	module_initialized = 1;
@@ -579,6 +1113,8 @@ CK_RV C_Initialize(CK_VOID_PTR p)
 
 CK_RV C_Finalize(CK_VOID_PTR p)
 {
+	struct keychain_sign_coalesce_stats ss;
+
 	FUNCINITCHK(C_Finalize);
 
 	if (p) {
@@ -586,6 +1122,57 @@ CK_RV C_Finalize(CK_VOID_PTR p)
 		RET(C_Finalize, CKR_ARGUMENTS_BAD);
 	}
 
+	/*
+	 * Don't pull the rug out from under our background identity scan;
+	 * tell it to stop and give it a little while to do so.  If it's
+	 * stuck somewhere we can't interrupt, it still has id_mutex, so
+	 * all we can do is fail and let the application try again later.
+	 */
+
+	if (atomic_load(&id_scan_pending)) {
+		atomic_fetch_add(&id_scan_cancel, 1);
+		if (dispatch_group_wait(id_scan_group,
+					dispatch_time(DISPATCH_TIME_NOW,
+					FINALIZE_WAIT * NSEC_PER_SEC)) != 0) {
+			os_log_debug(logsys, "Identity scan still running "
+				     "after %d seconds, not finalizing",
+				     FINALIZE_WAIT);
+			RET(C_Finalize, CKR_FUNCTION_FAILED);
+		}
+		atomic_store(&id_scan_pending, false);
+	}
+
+	/*
+	 * A key prewarm still running has its own references; tell it to
+	 * stop after the key it's on.
+	 */
+
+	atomic_fetch_add(&prewarm_gen, 1);
+
+	atomic_store(&fork_cert_scan, false);
+	cert_refresh_stop();
+
+	/*
+	 * If a certificate scan is still running, ask it to stop and wait
+	 * (for a little while) for it to notice; it cleans up after itself.
+	 * If it doesn't stop in time it doesn't need any of the things we
+	 * are about to tear down, and if we get initialized again before it
+	 * notices, we may end up adopting it (see start_cert_scan()).
+	 */
+
+	pthread_mutex_lock(&cert_scan_mutex);
+	if (atomic_load(&cert_list_status) == initializing) {
+		os_log_debug(logsys, "Cancelling certificate scan in progress");
+		atomic_store(&cert_scan_want, 0);
+	}
+	pthread_mutex_unlock(&cert_scan_mutex);
+
+	if (cert_scan_group &&
+	    dispatch_group_wait(cert_scan_group, dispatch_time(
+			DISPATCH_TIME_NOW, FINALIZE_WAIT * NSEC_PER_SEC)) != 0)
+		os_log_debug(logsys, "Certificate scan still running after %d "
+			     "seconds, leaving it", FINALIZE_WAIT);
+
 	LOCK_MUTEX(id_mutex);
 	LOCK_MUTEX(sess_mutex);
 
@@ -595,22 +1182,61 @@ CK_RV C_Finalize(CK_VOID_PTR p)
 		lacontext_free(lacontext);
 	lacontext = NULL;
 	logged_in = false;
+	id_list_init = false;
+	handle_map_free();
+	mech_list_free();
+	slot_info_free();
+
+	if (vcache_enabled()) {
+		struct keychain_verify_cache_stats vs;
+
+		vcache_stats(&vs);
+		os_log_debug(logsys, "Verification cache: %lu hits, %lu "
+			     "misses, %lu evictions, %lu flushes", vs.hits,
+			     vs.misses, vs.evictions, vs.flushes);
+		vcache_free();
+	}
+
+	sflight_stats(&ss);
+	if (ss.mechanisms) {
+		os_log_debug(logsys, "Signature coalescing: %lu signatures "
+			     "made, %lu copied", ss.leaders, ss.followers);
+		sflight_free();
+	}
+
+	if (use_broker) {
+		broker_disconnect();
+		free(broker_label);
+		broker_label = NULL;
+		use_broker = false;
+	}
 
 	UNLOCK_MUTEX(sess_mutex);
 	UNLOCK_MUTEX(id_mutex);
 
-	DESTROY_MUTEX(id_mutex);
-	DESTROY_MUTEX(sess_mutex);
-
+	pthread_mutex_lock(&cert_scan_mutex);
 	if (atomic_load(&cert_list_status) == initialized) {
 		obj_free(&cert_obj_list, &cert_obj_count, &cert_obj_size);
 		cert_list_free();
+		certstore_dict_release(cert_dict);
+		cert_dict = NULL;
+		atomic_store(&cert_list_status, uninitialized);
 	}
+	pthread_mutex_unlock(&cert_scan_mutex);
+
+	DESTROY_MUTEX(id_mutex);
+	DESTROY_MUTEX(sess_mutex);
 
 	use_mutex = 0;
 	module_initialized = 0;
 	cert_slot_enabled = 0;
 
+	/*
+	 * Write out our trace buffers (if tracing is enabled)
+	 */
+
+	trace_flush();
+
 	RET(C_Finalize, CKR_OK);
 }
 
@@ -645,6 +1271,7 @@ CK_RV C_GetSlotList(CK_BBOOL token_present, CK_SLOT_ID_PTR slot_list,
 		    CK_ULONG_PTR slot_num)
 {
 	CK_RV rv;
+	bool fresh = false, locked = false, present;
 
 	FUNCINITCHK(C_GetSlotList);
 
@@ -652,8 +1279,32 @@ CK_RV C_GetSlotList(CK_BBOOL token_present, CK_SLOT_ID_PTR slot_list,
 		     "slot_num = %d", token_present, slot_list,
 		     (int) *slot_num);
 
+	fork_resume();
+
+	/*
+	 * If the identity scan we started in C_Initialize() is still
+	 * running, wait for it.  If it takes too long just say we don't
+	 * have a token yet (the application will ask again); the scan
+	 * has id_mutex locked, so we can't do anything else anyway.
+	 */
+
+	if (atomic_load(&id_scan_pending)) {
+		if (dispatch_group_wait(id_scan_group,
+					dispatch_time(DISPATCH_TIME_NOW,
+					ID_SCAN_WAIT * NSEC_PER_SEC)) != 0) {
+			os_log_debug(logsys, "Identity scan still running "
+				     "after %d seconds, reporting no token",
+				     ID_SCAN_WAIT);
+			present = false;
+			rv = CKR_OK;
+			goto slots;
+		}
+		fresh = atomic_exchange(&id_scan_pending, false);
+	}
+
 	/*
-	 * We will (re) check our identity list if slot_list is NULL.
+	 * We will (re) check our identity list if slot_list is NULL
+	 * (unless the background scan just finished).
 	 *
 	 * We've gone back and forth on this; before we only did a rescan
 	 * if C_Finalize()/C_Initialize() was called, but that doesn't
@@ -662,9 +1313,23 @@ CK_RV C_GetSlotList(CK_BBOOL token_present, CK_SLOT_ID_PTR slot_list,
 	 */
 
 	LOCK_MUTEX(id_mutex);
+	locked = true;
+
+	if ((! slot_list && ! fresh) || ! id_list_init) {
+		int ret;
+
+		if (use_broker) {
+			ret = broker_refresh();
+		} else {
+			uint64_t start = TRACE_NOW();
+			int phase = prof_enter(KEYCHAIN_PHASE_ID_SCAN);
+
+			ret = scan_identities();
+			prof_leave(phase);
+			TRACE_SPAN(TRACE_scan_identities, start, 0, ret);
+		}
 
-	if (! slot_list || ! id_list_init) {
-		if (scan_identities()) {
+		if (ret) {
 			rv = CKR_FUNCTION_FAILED;
 			goto out;
 		}
@@ -681,8 +1346,10 @@ CK_RV C_GetSlotList(CK_BBOOL token_present, CK_SLOT_ID_PTR slot_list,
 	 */
 
 	rv = CKR_OK;
+	present = id_list_count > 0;
 
-	if (!token_present || id_list_count > 0) {
+slots:
+	if (!token_present || present) {
 		if (slot_list) {
 			if (*slot_num < (cert_slot_enabled ? 2 : 1))
 				rv = CKR_BUFFER_TOO_SMALL;
@@ -710,7 +1377,8 @@ CK_RV C_GetSlotList(CK_BBOOL token_present, CK_SLOT_ID_PTR slot_list,
 	}
 
 out:
-	UNLOCK_MUTEX(id_mutex);
+	if (locked)
+		UNLOCK_MUTEX(id_mutex);
 	RET(C_GetSlotList, rv);
 }
 
@@ -720,6 +1388,8 @@ out:
 
 CK_RV C_GetSlotInfo(CK_SLOT_ID slot_id, CK_SLOT_INFO_PTR slot_info)
 {
+	struct slot_snapshot *snap;
+
 	FUNCINITCHK(C_GetSlotInfo);
 
 	os_log_debug(logsys, "slot_id = %d, slot_info = %p", (int) slot_id,
@@ -731,44 +1401,20 @@ CK_RV C_GetSlotInfo(CK_SLOT_ID slot_id, CK_SLOT_INFO_PTR slot_info)
 		RET(C_GetSlotInfo, CKR_ARGUMENTS_BAD);
 
 	/*
-	 * We can't really get any useful information out of the Security
-	 * framework in terms of information about the "slot" (the reader).
-	 * I don't really think it is useful anyway, so just fill in some
-	 * dummy values.  The one valid thing we return is the
-	 * CKF_TOKEN_PRESENT flag if we have a token inserted or not.
+	 * See slot_info_publish() for where this comes from.  If we
+	 * couldn't allocate even one snapshot, we have nothing to return.
 	 */
 
-	sprintfpad(slot_info->manufacturerID,
-		   sizeof(slot_info->manufacturerID), "%s",
-		   "U.S. Naval Research Lab");
-
-	switch (slot_id) {
-	case TOKEN_SLOT:
-		sprintfpad(slot_info->slotDescription,
-			   sizeof(slot_info->slotDescription), "%s",
-			   id_list_count > 0 ? id_list[0].label :
-				"Keychain PKCS#11 Bridge Library Virtual Slot");
-		slot_info->flags = CKF_HW_SLOT | CKF_REMOVABLE_DEVICE;
-
-		LOCK_MUTEX(id_mutex);
-		if (id_list_count > 0)
-			slot_info->flags |= CKF_TOKEN_PRESENT;
-		UNLOCK_MUTEX(id_mutex);
-		break;
-	case CERTIFICATE_SLOT:
-		sprintfpad(slot_info->slotDescription,
-			   sizeof(slot_info->slotDescription), "%s",
-			   "Keychain Certificates");
-		slot_info->flags = CKF_REMOVABLE_DEVICE;
-		if (atomic_load(&cert_list_status) == initialized)
-			slot_info->flags |= CKF_TOKEN_PRESENT;
-		break;
+	if (! (snap = slot_snap_hold())) {
+		slot_snap_release();
+		RET(C_GetSlotInfo, CKR_HOST_MEMORY);
 	}
+	*slot_info = snap->slot_info[slot_id - 1];
+	slot_snap_release();
 
-	slot_info->hardwareVersion.major = 1;
-	slot_info->hardwareVersion.minor = 0;
-	slot_info->firmwareVersion.major = 1;
-	slot_info->firmwareVersion.minor = 0;
+	if (slot_id == CERTIFICATE_SLOT &&
+	    atomic_load(&cert_list_status) == initialized)
+		slot_info->flags |= CKF_TOKEN_PRESENT;
 
 	RET(C_GetSlotInfo, CKR_OK);
 }
@@ -780,6 +1426,8 @@ CK_RV C_GetSlotInfo(CK_SLOT_ID slot_id, CK_SLOT_INFO_PTR slot_info)
 
 CK_RV C_GetTokenInfo(CK_SLOT_ID slot_id, CK_TOKEN_INFO_PTR token_info)
 {
+	struct slot_snapshot *snap;
+
 	FUNCINITCHK(C_GetTokenInfo);
 
 	os_log_debug(logsys, "slot_id = %d, token_info = %p", (int) slot_id,
@@ -791,154 +1439,94 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slot_id, CK_TOKEN_INFO_PTR token_info)
 		RET(C_GetTokenInfo, CKR_ARGUMENTS_BAD);
 
 	/*
-	 * We can't do any administrative operations, really, from the
-	 * Security framework, so basically make it so the token is
-	 * read/only.
+	 * See slot_info_publish() for where this comes from.  We don't
+	 * support read/write sessions, so all of our sessions are
+	 * read-only.
 	 */
-	token_info->flags = CKF_WRITE_PROTECTED |
-			    CKF_USER_PIN_INITIALIZED |
-			    CKF_TOKEN_INITIALIZED;
 
-	switch (slot_id) {
-	case TOKEN_SLOT:
-		/*
-		 * Since this is used as label in a number of places to display
-		 * to the user, make it something useful.  Pick the first
-		 * certificate found (if available) and return the subject
-		 * summary as the token label.
-		 */
+	if (! (snap = slot_snap_hold())) {
+		slot_snap_release();
+		RET(C_GetTokenInfo, CKR_HOST_MEMORY);
+	}
+	*token_info = snap->token_info[slot_id - 1];
+	slot_snap_release();
 
-		LOCK_MUTEX(id_mutex);
+	token_info->ulSessionCount = atomic_load(&slot_sessions[slot_id - 1]);
+	token_info->ulRwSessionCount = 0;
 
-		CFStringRef summary;
-		char *label;
+	/*
+	 * If the circuit breaker is failing our key operations, say so
+	 */
 
-		summary = SecCertificateCopySubjectSummary(id_list[0].cert);
+	if (slot_id == TOKEN_SLOT && circuit_tripped(&token_circuit))
+		token_info->flags |= CKF_ERROR_STATE;
 
-		if (summary) {
-			label = getstrcopy(summary);
-		} else {
-			label = strdup("Unknown Keychain Token");
-		}
+	RET(C_GetTokenInfo, CKR_OK);
+}
 
-		sprintfpad(token_info->label, sizeof(token_info->label),
-			   "%s", label);
+/*
+ * Return our list of mechanisms that we support.
+ */
 
-		free(label);
-		if (summary)
-			CFRelease(summary);
+CK_RV C_GetMechanismList(CK_SLOT_ID slot_id, CK_MECHANISM_TYPE_PTR mechlist,
+			 CK_ULONG_PTR mechnum)
+{
+	unsigned int count;
+	CK_RV rv = CKR_OK;
 
-		UNLOCK_MUTEX(id_mutex);
+	FUNCINITCHK(C_GetMechanismList);
 
-		token_info->flags |= CKF_LOGIN_REQUIRED;
+	if (! mechnum)
+		RET(C_GetMechanismList, CKR_ARGUMENTS_BAD);
 
-		/* 
-		 * If we were set to to NOT ask for a PIN in C_Login (see
-		 * the function C_Initialize for more info) then set the flag
-		 * CKF_PROTECTED_AUTHENTICATION_PATH.
-		 */
+	os_log_debug(logsys, "slot_id = %lu, mechlist = %p, mechnum = %lu",
+		     slot_id, mechlist, *mechnum);
 
-		if (ask_pin) {
-			os_log_debug(logsys, "We are NOT setting the flag "
-				     "CKF_PROTECTED_AUTHENTICATION_PATH");
-		} else {
-			os_log_debug(logsys, "We ARE setting the flag "
-				     "CKF_PROTECTED_AUTHENTICATION_PATH");
-			token_info->flags |= CKF_PROTECTED_AUTHENTICATION_PATH;
-		}
-
-		break;
-
-	case CERTIFICATE_SLOT:
-		sprintfpad(token_info->label, sizeof(token_info->label), "%s",
-			   "Keychain Certificates");
-		break;
-	}
-
-	sprintfpad(token_info->manufacturerID,
-		   sizeof(token_info->manufacturerID), "%s",
-		   "Unknown Manufacturer");
-	sprintfpad(token_info->model, sizeof(token_info->model), "%s",
-		   "Unknown Model");
-	sprintfpad(token_info->serialNumber, sizeof(token_info->serialNumber),
-		   "%s", "000001");
-
-	token_info->ulMaxSessionCount = CK_EFFECTIVELY_INFINITE;
-	token_info->ulSessionCount = CK_UNAVAILABLE_INFORMATION;
-	token_info->ulMaxRwSessionCount = 0;
-	token_info->ulRwSessionCount = 0;
-	token_info->ulMaxPinLen = 255;
-	token_info->ulMinPinLen = 1;
-	token_info->ulTotalPublicMemory = CK_UNAVAILABLE_INFORMATION;
-	token_info->ulFreePublicMemory = CK_UNAVAILABLE_INFORMATION;
-	token_info->ulTotalPrivateMemory = CK_UNAVAILABLE_INFORMATION;
-	token_info->ulFreePrivateMemory = CK_UNAVAILABLE_INFORMATION;
-	token_info->hardwareVersion.major = 1;
-	token_info->hardwareVersion.minor = 0;
-	token_info->firmwareVersion.major = 1;
-	token_info->firmwareVersion.minor = 0;
-	sprintfpad(token_info->utcTime, sizeof(token_info->utcTime),
-		   "%s", "1970010100000000");
-
-	RET(C_GetTokenInfo, CKR_OK);
-}
-
-/*
- * Return our list of mechanisms that we support.
- */
-
-CK_RV C_GetMechanismList(CK_SLOT_ID slot_id, CK_MECHANISM_TYPE_PTR mechlist,
-			 CK_ULONG_PTR mechnum)
-{
-	int i;
-
-	FUNCINITCHK(C_GetMechanismList);
-
-	os_log_debug(logsys, "slot_id = %lu, mechlist = %p, mechnum = %lu",
-		     slot_id, mechlist, *mechnum);
-
-	CHECKSLOT(slot_id, true);
+	CHECKSLOT(slot_id, true);
 
 	/*
-	 * It's hard to know exactly what all mechanisms are supported by
-	 * a particular token, but we can probably safely return all of the
-	 * RSA ones at least (since those should work with any RSA key)
+	 * We used to return every RSA mechanism we know about for both
+	 * slots; now we return what the keys in the token slot can really
+	 * do (see build_mech_list()).  The certificate slot doesn't have
+	 * any keys, so it doesn't have any mechanisms.
 	 */
 
-	/*
-	 * Return the list count (and CKR_OK) if mechlist was NULL
-	 */
+	LOCK_MUTEX(id_mutex);
 
-	if (!mechlist) {
-		*mechnum = keychain_mechmap_size;
-		RET(C_GetMechanismList, CKR_OK);
-	}
+	count = slot_id == TOKEN_SLOT ? token_mechcount : 0;
 
 	/*
-	 * Return our mechanisms (or CKR_BUFFER_TOO_SMALL)
+	 * Return the list count (and CKR_OK) if mechlist was NULL;
+	 * otherwise return our mechanisms (or CKR_BUFFER_TOO_SMALL)
 	 */
 
-	if (*mechnum < keychain_mechmap_size) {
-		*mechnum = keychain_mechmap_size;
-		RET(C_GetMechanismList, CKR_BUFFER_TOO_SMALL);
+	if (mechlist) {
+		if (*mechnum < count)
+			rv = CKR_BUFFER_TOO_SMALL;
+		else if (count)
+			memcpy(mechlist, token_mechlist,
+			       count * sizeof(*mechlist));
 	}
 
-	for (i = 0; i < keychain_mechmap_size; i++)
-		mechlist[i] = keychain_mechmap[i].cki_mech;
+	*mechnum = count;
+
+	UNLOCK_MUTEX(id_mutex);
 
-	RET(C_GetMechanismList, CKR_OK);
+	RET(C_GetMechanismList, rv);
 }
 
 /*
  * Return information on a particular mechanism.
  *
- * It's not clear how important this information is, at least for
- * callers of our library.  Return some stuff that seems reasonable.
+ * The key sizes are the smallest and largest keys we have that support
+ * the mechanism, and the flags are everything at least one of them can do
+ * with it.
  */
 
 CK_RV C_GetMechanismInfo(CK_SLOT_ID slot_id, CK_MECHANISM_TYPE mechtype,
 			 CK_MECHANISM_INFO_PTR mechinfo)
 {
+	CK_RV rv = CKR_MECHANISM_INVALID;
 	int i;
 
 	FUNCINITCHK(C_GetMechanismInfo);
@@ -948,16 +1536,23 @@ CK_RV C_GetMechanismInfo(CK_SLOT_ID slot_id, CK_MECHANISM_TYPE mechtype,
 
 	CHECKSLOT(slot_id, true);
 
-	for (i = 0; i < keychain_mechmap_size; i++) {
-		if (mechtype == keychain_mechmap[i].cki_mech) {
-			mechinfo->ulMinKeySize = keychain_mechmap[i].min_keylen;
-			mechinfo->ulMaxKeySize = keychain_mechmap[i].max_keylen;
-			mechinfo->flags = keychain_mechmap[i].usage_flags;
-			RET(C_GetMechanismInfo, CKR_OK);
-		}
+	if (! mechinfo)
+		RET(C_GetMechanismInfo, CKR_ARGUMENTS_BAD);
+
+	if (slot_id != TOKEN_SLOT ||
+	    (i = keychain_mechmap_index(mechtype)) < 0)
+		RET(C_GetMechanismInfo, CKR_MECHANISM_INVALID);
+
+	LOCK_MUTEX(id_mutex);
+
+	if (token_mechinfo && token_mechinfo[i].flags) {
+		*mechinfo = token_mechinfo[i];
+		rv = CKR_OK;
 	}
 
-	RET(C_GetMechanismInfo, CKR_MECHANISM_INVALID);
+	UNLOCK_MUTEX(id_mutex);
+
+	RET(C_GetMechanismInfo, rv);
 }
 
 NOTSUPPORTED(C_InitToken, (CK_SLOT_ID slot_id, CK_UTF8CHAR_PTR pin, CK_ULONG pinlen, CK_UTF8CHAR_PTR label))
@@ -981,6 +1576,8 @@ CK_RV C_OpenSession(CK_SLOT_ID slot_id, CK_FLAGS flags,
 		     "notify_callback = %p, session_handle = %p", (int) slot_id,
 		     flags, app_callback, notify_callback, session);
 
+	fork_resume();
+
 	CHECKSLOT(slot_id, true);
 
 	if (! (flags & CKF_SERIAL_SESSION))
@@ -989,27 +1586,6 @@ CK_RV C_OpenSession(CK_SLOT_ID slot_id, CK_FLAGS flags,
 	sess = malloc(sizeof(*sess));
 	CREATE_MUTEX(sess->mutex);
 
-	/*
-	 * Pick the right object list depending if we are using the
-	 * true hardware slot or the certificate hardware slot.
-	 */
-
-	switch (slot_id) {
-	case TOKEN_SLOT:
-		sess->obj_list = id_obj_list;
-		sess->obj_list_count = id_obj_count;
-		break;
-	case CERTIFICATE_SLOT:
-		if (atomic_load(&cert_list_status) == initialized) {
-			sess->obj_list = cert_obj_list;
-			sess->obj_list_count = cert_obj_count;
-		} else {
-			sess->obj_list = NULL;
-			sess->obj_list_count = 0;;
-		}
-		break;
-	}
-
 	sess->slot_id = slot_id;
 	sess->search_attrs = NULL;
 	sess->search_attrs_count = 0;
@@ -1017,6 +1593,10 @@ CK_RV C_OpenSession(CK_SLOT_ID slot_id, CK_FLAGS flags,
 	sess->ver_key = NULL;
 	sess->enc_key = NULL;
 	sess->dec_key = NULL;
+	sess->sig_obj = sess->ver_obj = sess->enc_obj = sess->dec_obj = 0;
+	atomic_init(&sess->cancel_gen, 0);
+	sess->op_gen = 0;
+	atomic_init(&sess->op_timeout, op_timeout);
 
 	LOCK_MUTEX(sess_mutex);
 
@@ -1049,6 +1629,7 @@ CK_RV C_OpenSession(CK_SLOT_ID slot_id, CK_FLAGS flags,
 
 	*session = ++sess_list_count;
 out:
+	atomic_fetch_add(&slot_sessions[slot_id - 1], 1);
 	UNLOCK_MUTEX(sess_mutex);
 
 	RET(C_OpenSession, CKR_OK);
@@ -1144,6 +1725,23 @@ CK_RV C_Login(CK_SESSION_HANDLE session, CK_USER_TYPE usertype,
 
 	CHECKSESSION(session, se);
 
+	if (use_broker) {
+		/*
+		 * The daemon owns the LocalAuthentication context, so have
+		 * it do the login; that way everyone using the daemon
+		 * shares it.  It may have to ask the user, so don't hold
+		 * any of our locks while we wait.
+		 */
+
+		if ((rv = broker_login(pin, pinlen)) == CKR_OK) {
+			LOCK_MUTEX(id_mutex);
+			logged_in = true;
+			UNLOCK_MUTEX(id_mutex);
+		}
+
+		RET(C_Login, rv);
+	}
+
 	LOCK_MUTEX(id_mutex);
 	LOCK_MUTEX(se->mutex);
 
@@ -1234,6 +1832,7 @@ CK_RV C_GetAttributeValue(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object,
 			  CK_ATTRIBUTE_PTR template, CK_ULONG count)
 {
 	struct session *se;
+	struct obj_info *obj;
 	CK_RV rv = CKR_OK;
 	int i;
 	CK_ATTRIBUTE_PTR attr;
@@ -1246,22 +1845,21 @@ CK_RV C_GetAttributeValue(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object,
 
 	CHECKSESSION(session, se);
 
+	LOCK_MUTEX(id_mutex);
 	LOCK_MUTEX(se->mutex);
 
-	object--;
-
-	if (object >= se->obj_list_count) {
+	if (! (obj = obj_lookup(se, object))) {
 		UNLOCK_MUTEX(se->mutex);
+		UNLOCK_MUTEX(id_mutex);
 		RET(C_GetAttributeValue, CKR_OBJECT_HANDLE_INVALID);
 	}
 
-	LOG_DEBUG_OBJECT(object, se);
+	LOG_DEBUG_OBJECT(obj);
 
 	for (i = 0; i < count; i++) {
 		os_log_debug(logsys, "Retrieving attribute: %s",
 			     getCKAName(template[i].type));
-		if ((attr = find_attribute(&se->obj_list[object],
-					   template[i].type))) {
+		if ((attr = find_attribute(obj, template[i].type))) {
 			if (! template[i].pValue) {
 				template[i].ulValueLen = attr->ulValueLen;
 				os_log_debug(logsys, "pValue was NULL, just "
@@ -1277,9 +1875,14 @@ CK_RV C_GetAttributeValue(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object,
 					template[i].ulValueLen =
 							attr->ulValueLen;
 					rv = CKR_BUFFER_TOO_SMALL;
+				} else if (! attr_copy(obj, attr,
+						       template[i].pValue)) {
+					os_log_debug(logsys, "Attribute: "
+						     "unable to unpack value");
+					template[i].ulValueLen =
+						CK_UNAVAILABLE_INFORMATION;
+					rv = CKR_FUNCTION_FAILED;
 				} else {
-					memcpy(template[i].pValue, attr->pValue,
-					       attr->ulValueLen);
 					os_log_debug(logsys, "Copied over "
 						     "attribute (%lu, %lu)",
 						     template[i].ulValueLen,
@@ -1296,6 +1899,7 @@ CK_RV C_GetAttributeValue(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object,
 	}
 
 	UNLOCK_MUTEX(se->mutex);
+	UNLOCK_MUTEX(id_mutex);
 
 	RET(C_GetAttributeValue, rv);
 }
@@ -1354,7 +1958,8 @@ CK_RV C_FindObjects(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE_PTR object,
 		    CK_ULONG maxcount, CK_ULONG_PTR count)
 {
 	struct session *se;
-	unsigned int rc = 0;
+	struct obj_info *list;
+	unsigned int rc = 0, list_count;
 
 	FUNCINITCHK(C_FindObjects);
 
@@ -1366,19 +1971,22 @@ CK_RV C_FindObjects(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE_PTR object,
 	if (! object || maxcount == 0)
 		RET(C_FindObjects, CKR_ARGUMENTS_BAD);
 
+	LOCK_MUTEX(id_mutex);
 	LOCK_MUTEX(se->mutex);
 
-	for (; se->obj_search_index < se->obj_list_count;
-						se->obj_search_index++) {
-		if (search_object(&se->obj_list[se->obj_search_index],
+	list = session_objects(se, &list_count);
+
+	for (; se->obj_search_index < list_count; se->obj_search_index++) {
+		if (search_object(&list[se->obj_search_index],
 				  se->search_attrs, se->search_attrs_count)) {
-			object[rc++] = se->obj_search_index + 1;
+			object[rc++] = list[se->obj_search_index].handle;
 			if (rc >= maxcount) {
 				*count = rc;
 				se->obj_search_index++;
 				os_log_debug(logsys, "Found %u object%s",
 					     rc, rc == 1 ? "" : "s");
 				UNLOCK_MUTEX(se->mutex);
+				UNLOCK_MUTEX(id_mutex);
 				RET(C_FindObjects, CKR_OK);
 			}
 		}
@@ -1388,6 +1996,7 @@ CK_RV C_FindObjects(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE_PTR object,
 	*count = rc;
 
 	UNLOCK_MUTEX(se->mutex);
+	UNLOCK_MUTEX(id_mutex);
 	RET(C_FindObjects, CKR_OK);
 }
 
@@ -1424,14 +2033,14 @@ CK_RV C_EncryptInit(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech,
 		    CK_OBJECT_HANDLE object)
 {
 	struct session *se;
+	struct obj_info *obj;
+	CK_RV rv;
 	int i;
 
 	FUNCINITCHK(C_EncryptInit);
 
 	CHECKSESSION(session, se);
 
-	LOCK_MUTEX(se->mutex);
-
 	if (! mech) {
 		os_log_debug(logsys, "mechanism pointer is NULL");
 		RET(C_EncryptInit, CKR_MECHANISM_INVALID);
@@ -1440,10 +2049,12 @@ CK_RV C_EncryptInit(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech,
 	os_log_debug(logsys, "session = %d, mech = %d, key = %d",
 		     (int) session, (int) mech->mechanism, (int) object);
 
-	object--;
+	LOCK_MUTEX(id_mutex);
+	LOCK_MUTEX(se->mutex);
 
-	if (object >= se->obj_list_count) {
+	if (! (obj = obj_lookup(se, object))) {
 		UNLOCK_MUTEX(se->mutex);
+		UNLOCK_MUTEX(id_mutex);
 		RET(C_EncryptInit, CKR_KEY_HANDLE_INVALID);
 	}
 
@@ -1451,40 +2062,45 @@ CK_RV C_EncryptInit(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech,
 	 * Right now we assume only a public key can perform encryption
 	 */
 
-	if (se->obj_list[object].class != CKO_PUBLIC_KEY) {
+	if (obj->class != CKO_PUBLIC_KEY) {
 		UNLOCK_MUTEX(se->mutex);
 		UNLOCK_MUTEX(id_mutex);
 		RET(C_EncryptInit, CKR_KEY_TYPE_INCONSISTENT);
 	}
 
 	/*
-	 * Map our mechanism onto what we need for signing
+	 * Map our mechanism onto what we need for encryption, and make
+	 * sure this key can actually do it.
 	 */
 
-	for (i = 0; i < keychain_mechmap_size; i++) {
-		if (mech->mechanism == keychain_mechmap[i].cki_mech) {
-			if (se->enc_key)
-				CFRelease(se->enc_key);
-			se->enc_key =
-				id_list[se->obj_list[object].id_index].pubkey;
-			CFRetain(se->enc_key);
-			se->enc_alg = *keychain_mechmap[i].sec_encmech;
-			if (keychain_mechmap[i].blocksize_out) {
-				se->enc_size = SecKeyGetBlockSize(se->enc_key);
-			} else {
-				se->enc_size = 0;
-			}
+	i = keychain_mechmap_index(mech->mechanism);
 
-			UNLOCK_MUTEX(se->mutex);
-			UNLOCK_MUTEX(id_mutex);
-			RET(C_EncryptInit, CKR_OK);
-		}
+	if ((rv = id_mech_check(obj->id_index, i, CKF_ENCRYPT)) != CKR_OK) {
+		UNLOCK_MUTEX(se->mutex);
+		UNLOCK_MUTEX(id_mutex);
+		RET(C_EncryptInit, rv);
+	}
+
+	sess_sync_cancel(se);
+
+	if (se->enc_key)
+		CFRelease(se->enc_key);
+	se->enc_key = id_list[obj->id_index].pubkey;
+	if (se->enc_key)
+		CFRetain(se->enc_key);
+	se->enc_obj = object;
+	se->enc_mech = mech->mechanism;
+	se->enc_alg = *keychain_mechmap[i].sec_encmech;
+	if (keychain_mechmap[i].blocksize_out) {
+		se->enc_size = id_list[obj->id_index].blocksize;
+	} else {
+		se->enc_size = 0;
 	}
 
 	UNLOCK_MUTEX(se->mutex);
 	UNLOCK_MUTEX(id_mutex);
 
-	RET(C_EncryptInit, CKR_MECHANISM_INVALID);
+	RET(C_EncryptInit, CKR_OK);
 }
 
 CK_RV C_Encrypt(CK_SESSION_HANDLE session, CK_BYTE_PTR indata,
@@ -1495,6 +2111,8 @@ CK_RV C_Encrypt(CK_SESSION_HANDLE session, CK_BYTE_PTR indata,
 	CFDataRef inref, outref;
 	CFErrorRef err = NULL;
 	CK_RV rv = CKR_OK;
+	uint64_t start, pstart;
+	bool id_locked = true;
 
 	FUNCINITCHK(C_Encrypt);
 
@@ -1507,6 +2125,12 @@ CK_RV C_Encrypt(CK_SESSION_HANDLE session, CK_BYTE_PTR indata,
 		     "outdata = %p, outlen = %d", (int) session, indata,
 		     (int) indatalen, outdata, (int) *outdatalen);
 
+	if (sess_sync_cancel(se)) {
+		UNLOCK_MUTEX(se->mutex);
+		UNLOCK_MUTEX(id_mutex);
+		RET(C_Encrypt, CKR_FUNCTION_CANCELED);
+	}
+
 	/*
 	 * If we know our mechanism output size, check first to see if the
 	 * output buffer is big enough.  Also, short-circuit this test if
@@ -1541,17 +2165,48 @@ CK_RV C_Encrypt(CK_SESSION_HANDLE session, CK_BYTE_PTR indata,
 	inref = CFDataCreateWithBytesNoCopy(NULL, indata, indatalen,
 					    kCFAllocatorNull);
 
-	outref = SecKeyCreateEncryptedData(se->enc_key, se->enc_alg, inref,
-					   &err);
+	if (use_broker) {
+		uint64_t gen = id_list_generation;
+
+		UNLOCK_ID_MUTEX(id_locked);
+		outref = broker_keyop(BROKER_ENCRYPT, gen, se->slot_id,
+				      se->enc_obj, se->enc_mech, inref, NULL,
+				      &err);
+	} else {
+		start = TRACE_NOW();
+		pstart = prof_now();
+		outref = SecKeyCreateEncryptedData(se->enc_key, se->enc_alg,
+						   inref, &err);
+		prof_record(PROF_SecKeyCreateEncryptedData,
+			    KEYCHAIN_PHASE_CRYPTO, pstart,
+			    outref ? 0 : cferr_code(err));
+		TRACE_SPAN(TRACE_SecKeyCreateEncryptedData, start,
+			   session + 1, outref == NULL);
+	}
 
 	CFRelease(inref);
 
+	if (sess_sync_cancel(se)) {
+		os_log_debug(logsys, "Operation was cancelled, discarding "
+			     "the result");
+		if (outref)
+			CFRelease(outref);
+		else
+			CFRelease(err);
+		UNLOCK_MUTEX(se->mutex);
+		UNLOCK_ID_MUTEX(id_locked);
+		RET(C_Encrypt, CKR_FUNCTION_CANCELED);
+	}
+
 	if (! outref) {
 		os_log_debug(logsys, "SecKeyCreateEncryptedData failed: "
 			     "%{public}@ (%ld)", err,
 			     (long) CFErrorGetCode(err));
+		rv = use_broker ? CFErrorGetCode(err) : CKR_GENERAL_ERROR;
 		CFRelease(err);
-		RET(C_Encrypt, CKR_GENERAL_ERROR);
+		UNLOCK_MUTEX(se->mutex);
+		UNLOCK_ID_MUTEX(id_locked);
+		RET(C_Encrypt, rv);
 	}
 
 	if (*outdatalen < CFDataGetLength(outref)) {
@@ -1562,8 +2217,10 @@ CK_RV C_Encrypt(CK_SESSION_HANDLE session, CK_BYTE_PTR indata,
 		/*
 		 * If the encryption was successful, release our key reference
 		 */
-		CFRelease(se->enc_key);
+		if (se->enc_key)
+			CFRelease(se->enc_key);
 		se->enc_key = NULL;
+		se->enc_obj = 0;
 		se->enc_size = 0;
 	}
 
@@ -1572,7 +2229,7 @@ CK_RV C_Encrypt(CK_SESSION_HANDLE session, CK_BYTE_PTR indata,
 	CFRelease(outref);
 
 	UNLOCK_MUTEX(se->mutex);
-	UNLOCK_MUTEX(id_mutex);
+	UNLOCK_ID_MUTEX(id_locked);
 
 	RET(C_Encrypt, rv);
 }
@@ -1588,14 +2245,14 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech,
 		    CK_OBJECT_HANDLE key)
 {
 	struct session *se;
+	struct obj_info *obj;
+	CK_RV rv;
 	int i;
 
 	FUNCINITCHK(C_DecryptInit);
 
 	CHECKSESSION(session, se);
 
-	LOCK_MUTEX(se->mutex);
-
 	if (! mech) {
 		os_log_debug(logsys, "mechanism pointer is NULL");
 		RET(C_DecryptInit, CKR_MECHANISM_INVALID);
@@ -1604,10 +2261,12 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech,
 	os_log_debug(logsys, "session = %d, mech = %d, key = %d",
 		     (int) session, (int) mech->mechanism, (int) key);
 
-	key--;
+	LOCK_MUTEX(id_mutex);
+	LOCK_MUTEX(se->mutex);
 
-	if (key >= se->obj_list_count) {
+	if (! (obj = obj_lookup(se, key))) {
 		UNLOCK_MUTEX(se->mutex);
+		UNLOCK_MUTEX(id_mutex);
 		RET(C_DecryptInit, CKR_KEY_HANDLE_INVALID);
 	}
 
@@ -1615,45 +2274,50 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech,
 	 * Right now we assume only a private key can perform decryption
 	 */
 
-	if (se->obj_list[key].class != CKO_PRIVATE_KEY) {
+	if (obj->class != CKO_PRIVATE_KEY) {
 		UNLOCK_MUTEX(se->mutex);
 		UNLOCK_MUTEX(id_mutex);
 		RET(C_DecryptInit, CKR_KEY_TYPE_INCONSISTENT);
 	}
 
 	/*
-	 * Map our mechanism onto what we need for signing
+	 * Map our mechanism onto what we need for decryption, and make
+	 * sure this key can actually do it.
 	 */
 
-	for (i = 0; i < keychain_mechmap_size; i++) {
-		if (mech->mechanism == keychain_mechmap[i].cki_mech) {
-			if (se->dec_key)
-				CFRelease(se->dec_key);
-			se->dec_key =
-				id_list[se->obj_list[key].id_index].privkey;
-			CFRetain(se->dec_key);
-			/*
-			 * Yeah, we're using the same algorithm for encryption
-			 * and decryption here.  If this changes we'll need to
-			 * expand the tables to support mixed algorithms.
-			 */
-			se->dec_alg = *keychain_mechmap[i].sec_encmech;
-			if (keychain_mechmap[i].blocksize_out) {
-				se->dec_size = SecKeyGetBlockSize(se->dec_key);
-			} else {
-				se->dec_size = 0;
-			}
+	i = keychain_mechmap_index(mech->mechanism);
 
-			UNLOCK_MUTEX(se->mutex);
-			UNLOCK_MUTEX(id_mutex);
-			RET(C_DecryptInit, CKR_OK);
-		}
+	if ((rv = id_mech_check(obj->id_index, i, CKF_DECRYPT)) != CKR_OK) {
+		UNLOCK_MUTEX(se->mutex);
+		UNLOCK_MUTEX(id_mutex);
+		RET(C_DecryptInit, rv);
+	}
+
+	sess_sync_cancel(se);
+
+	if (se->dec_key)
+		CFRelease(se->dec_key);
+	se->dec_key = id_list[obj->id_index].privkey;
+	if (se->dec_key)
+		CFRetain(se->dec_key);
+	se->dec_obj = key;
+	se->dec_mech = mech->mechanism;
+	/*
+	 * Yeah, we're using the same algorithm for encryption
+	 * and decryption here.  If this changes we'll need to
+	 * expand the tables to support mixed algorithms.
+	 */
+	se->dec_alg = *keychain_mechmap[i].sec_encmech;
+	if (keychain_mechmap[i].blocksize_out) {
+		se->dec_size = id_list[obj->id_index].blocksize;
+	} else {
+		se->dec_size = 0;
 	}
 
 	UNLOCK_MUTEX(se->mutex);
 	UNLOCK_MUTEX(id_mutex);
 
-	RET(C_DecryptInit, CKR_MECHANISM_INVALID);
+	RET(C_DecryptInit, CKR_OK);
 }
 
 
@@ -1665,6 +2329,8 @@ CK_RV C_Decrypt(CK_SESSION_HANDLE session, CK_BYTE_PTR indata,
 	CFDataRef inref, outref;
 	CFErrorRef err = NULL;
 	CK_RV rv = CKR_OK;
+	uint64_t start, opstart, pstart;
+	bool trial, id_locked = true;
 
 	FUNCINITCHK(C_Decrypt);
 
@@ -1677,6 +2343,12 @@ CK_RV C_Decrypt(CK_SESSION_HANDLE session, CK_BYTE_PTR indata,
 		     "outdata = %p, outlen = %d", (int) session, indata,
 		     (int) indatalen, outdata, (int) *outdatalen);
 
+	if (sess_sync_cancel(se)) {
+		UNLOCK_MUTEX(se->mutex);
+		UNLOCK_MUTEX(id_mutex);
+		RET(C_Decrypt, CKR_FUNCTION_CANCELED);
+	}
+
 	/*
 	 * If we know our mechanism output size, check first to see if the
 	 * output buffer is big enough.  Also, short-circuit this test if
@@ -1716,20 +2388,73 @@ CK_RV C_Decrypt(CK_SESSION_HANDLE session, CK_BYTE_PTR indata,
 		RET(C_Decrypt, CKR_BUFFER_TOO_SMALL);
 	}
 
+	if (! circuit_allow(&token_circuit, &trial)) {
+		os_log_debug(logsys, "Circuit breaker is open, failing "
+			     "decryption");
+		UNLOCK_MUTEX(se->mutex);
+		UNLOCK_MUTEX(id_mutex);
+		RET(C_Decrypt, CKR_DEVICE_ERROR);
+	}
+
 	inref = CFDataCreateWithBytesNoCopy(NULL, indata, indatalen,
 					    kCFAllocatorNull);
 
-	outref = SecKeyCreateDecryptedData(se->dec_key, se->dec_alg, inref,
-					   &err);
+	opstart = trace_now();
+
+	if (use_broker) {
+		uint64_t gen = id_list_generation;
+
+		UNLOCK_ID_MUTEX(id_locked);
+		outref = broker_keyop(BROKER_DECRYPT, gen, se->slot_id,
+				      se->dec_obj, se->dec_mech, inref, NULL,
+				      &err);
+	} else {
+		start = TRACE_NOW();
+		pstart = prof_now();
+		outref = seckey_call(se, SecKeyCreateDecryptedData,
+				     se->dec_key, se->dec_alg, inref, &err,
+				     &rv);
+		prof_record(PROF_SecKeyCreateDecryptedData,
+			    KEYCHAIN_PHASE_CRYPTO, pstart,
+			    outref ? 0 : err ? cferr_code(err) : rv);
+		TRACE_SPAN(TRACE_SecKeyCreateDecryptedData, start,
+			   session + 1, outref == NULL);
+	}
 
 	CFRelease(inref);
 
+	/*
+	 * If we have no error, seckey_call() gave up and set rv for us
+	 */
+
+	if (! outref && err)
+		rv = use_broker ? CFErrorGetCode(err) :
+				  cferr_rv(err, CKR_ENCRYPTED_DATA_INVALID);
+
+	circuit_record(&token_circuit, trial, rv, trace_now() - opstart);
+
+	if (sess_sync_cancel(se)) {
+		os_log_debug(logsys, "Operation was cancelled, discarding "
+			     "the result");
+		if (outref)
+			CFRelease(outref);
+		if (err)
+			CFRelease(err);
+		UNLOCK_MUTEX(se->mutex);
+		UNLOCK_ID_MUTEX(id_locked);
+		RET(C_Decrypt, CKR_FUNCTION_CANCELED);
+	}
+
 	if (! outref) {
-		os_log_debug(logsys, "SecKeyCreateDecryptedData failed: "
-			     "%{public}@ (%ld)", err,
-			     (long) CFErrorGetCode(err));
-		CFRelease(err);
-		RET(C_Decrypt, CKR_GENERAL_ERROR);
+		if (err) {
+			os_log_debug(logsys, "SecKeyCreateDecryptedData "
+				     "failed: %{public}@ (%ld)", err,
+				     (long) CFErrorGetCode(err));
+			CFRelease(err);
+		}
+		UNLOCK_MUTEX(se->mutex);
+		UNLOCK_ID_MUTEX(id_locked);
+		RET(C_Decrypt, rv);
 	}
 
 	if (*outdatalen < CFDataGetLength(outref)) {
@@ -1740,8 +2465,10 @@ CK_RV C_Decrypt(CK_SESSION_HANDLE session, CK_BYTE_PTR indata,
 		/*
 		 * If the decryption was successful, release our key reference
 		 */
-		CFRelease(se->dec_key);
+		if (se->dec_key)
+			CFRelease(se->dec_key);
 		se->dec_key = NULL;
+		se->dec_obj = 0;
 		se->dec_size = 0;
 	}
 
@@ -1750,7 +2477,7 @@ CK_RV C_Decrypt(CK_SESSION_HANDLE session, CK_BYTE_PTR indata,
 	CFRelease(outref);
 
 	UNLOCK_MUTEX(se->mutex);
-	UNLOCK_MUTEX(id_mutex);
+	UNLOCK_ID_MUTEX(id_locked);
 
 	RET(C_Decrypt, rv);
 }
@@ -1773,6 +2500,8 @@ CK_RV C_SignInit(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech,
 		 CK_OBJECT_HANDLE object)
 {
 	struct session *se;
+	struct obj_info *obj;
+	CK_RV rv;
 	int i;
 
 	FUNCINITCHK(C_SignInit);
@@ -1785,54 +2514,62 @@ CK_RV C_SignInit(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech,
 	LOCK_MUTEX(id_mutex);
 	LOCK_MUTEX(se->mutex);
 
-	object--;
-
-	if (object >= se->obj_list_count) {
+	if (! (obj = obj_lookup(se, object))) {
 		UNLOCK_MUTEX(se->mutex);
+		UNLOCK_MUTEX(id_mutex);
 		RET(C_SignInit, CKR_KEY_HANDLE_INVALID);
 	}
 
-	if (! id_list[se->obj_list[object].id_index].privcansign) {
-		UNLOCK_MUTEX(se->mutex);
-		RET(C_SignInit, CKR_KEY_FUNCTION_NOT_PERMITTED);
-	}
-
 	/*
 	 * Right now we are assuming only a private key can do signing.
 	 * Change this assumption in the future if necessary
 	 */
 
-	if (se->obj_list[object].class != CKO_PRIVATE_KEY) {
+	if (obj->class != CKO_PRIVATE_KEY) {
 		UNLOCK_MUTEX(se->mutex);
 		UNLOCK_MUTEX(id_mutex);
 		RET(C_SignInit, CKR_KEY_TYPE_INCONSISTENT);
 	}
 
+	if (! id_list[obj->id_index].privcansign) {
+		UNLOCK_MUTEX(se->mutex);
+		UNLOCK_MUTEX(id_mutex);
+		RET(C_SignInit, CKR_KEY_FUNCTION_NOT_PERMITTED);
+	}
+
 	/*
-	 * Map our mechanism onto what we need for signing
+	 * Map our mechanism onto what we need for signing, and make sure
+	 * this key can actually do it.
 	 */
 
-	for (i = 0; i < keychain_mechmap_size; i++) {
-		if (mech->mechanism == keychain_mechmap[i].cki_mech) {
-			if (se->sig_key)
-				CFRelease(se->sig_key);
-			se->sig_key =
-				id_list[se->obj_list[object].id_index].privkey;
-			CFRetain(se->sig_key);
-			se->sig_alg = *keychain_mechmap[i].sec_signmech;
-			if (keychain_mechmap[i].blocksize_out) {
-				se->sig_size = SecKeyGetBlockSize(se->sig_key);
-			} else {
-				se->sig_size = 0;
-			}
+	i = keychain_mechmap_index(mech->mechanism);
 
-			UNLOCK_MUTEX(se->mutex);
-			UNLOCK_MUTEX(id_mutex);
-			RET(C_SignInit, CKR_OK);
-		}
+	if ((rv = id_mech_check(obj->id_index, i, CKF_SIGN)) != CKR_OK) {
+		UNLOCK_MUTEX(se->mutex);
+		UNLOCK_MUTEX(id_mutex);
+		RET(C_SignInit, rv);
+	}
+
+	sess_sync_cancel(se);
+
+	if (se->sig_key)
+		CFRelease(se->sig_key);
+	se->sig_key = id_list[obj->id_index].privkey;
+	if (se->sig_key)
+		CFRetain(se->sig_key);
+	se->sig_obj = object;
+	se->sig_mech = mech->mechanism;
+	se->sig_alg = *keychain_mechmap[i].sec_signmech;
+	if (keychain_mechmap[i].blocksize_out) {
+		se->sig_size = id_list[obj->id_index].blocksize;
+	} else {
+		se->sig_size = 0;
 	}
 
-	RET(C_SignInit, CKR_MECHANISM_INVALID);
+	UNLOCK_MUTEX(se->mutex);
+	UNLOCK_MUTEX(id_mutex);
+
+	RET(C_SignInit, CKR_OK);
 }
 
 /*
@@ -1842,9 +2579,12 @@ CK_RV C_Sign(CK_SESSION_HANDLE session, CK_BYTE_PTR indata, CK_ULONG indatalen,
 	     CK_BYTE_PTR sig, CK_ULONG_PTR siglen)
 {
 	struct session *se;
+	struct sflight *flight = NULL;
 	CFDataRef inref, outref;
 	CFErrorRef err = NULL;
 	CK_RV rv = CKR_OK;
+	uint64_t start, opstart, pstart;
+	bool trial, id_locked = true;
 #ifdef KEYCHAIN_DEBUG
 	char *file;
 #endif /* KEYCHAIN_DEBUG */
@@ -1857,6 +2597,107 @@ CK_RV C_Sign(CK_SESSION_HANDLE session, CK_BYTE_PTR indata, CK_ULONG indatalen,
 
 	CHECKSESSION(session, se);
 
+	/*
+	 * If someone is already making this exact signature, wait for
+	 * them rather than doing it again.  This has to happen before we
+	 * take id_mutex, since the leader holds that while it signs.
+	 */
+
+	if (sig && use_mutex) {
+		CK_SLOT_ID slot_id;
+		CK_OBJECT_HANDLE obj;
+		CK_MECHANISM_TYPE mech;
+		unsigned long opgen;
+		bool eligible, leader;
+
+		LOCK_MUTEX(se->mutex);
+		slot_id = se->slot_id;
+		obj = se->sig_obj;
+		mech = se->sig_mech;
+		opgen = se->op_gen;
+		eligible = obj && sflight_eligible(mech) &&
+				! (se->sig_size && se->sig_size > *siglen);
+		UNLOCK_MUTEX(se->mutex);
+
+		if (eligible)
+			flight = sflight_join(slot_id, obj, mech, indata,
+					      indatalen, &leader);
+
+		if (flight && ! leader) {
+			const unsigned char *fsig;
+			size_t fsiglen;
+
+			rv = sflight_wait(flight, &se->cancel_gen, opgen,
+					  atomic_load(&se->op_timeout),
+					  &fsig, &fsiglen);
+
+			os_log_debug(logsys, "Coalesced signature, rv = %s",
+				     getCKRName(rv));
+
+			/*
+			 * If we were cancelled while we waited, the leader
+			 * is still signing (with id_mutex held), so don't
+			 * wait for that either; just clear out the session.
+			 */
+
+			if (rv == CKR_FUNCTION_CANCELED &&
+			    atomic_load(&se->cancel_gen) != opgen) {
+				sflight_release(flight);
+				LOCK_MUTEX(se->mutex);
+				sess_sync_cancel(se);
+				UNLOCK_MUTEX(se->mutex);
+				RET(C_Sign, CKR_FUNCTION_CANCELED);
+			}
+
+			/*
+			 * Same if we ran out of time waiting (or the leader
+			 * did); there's nothing to copy, and the leader may
+			 * still have id_mutex.  The leader's circuit_record()
+			 * covers the card, so we don't record anything.
+			 */
+
+			if (rv == CKR_DEVICE_ERROR) {
+				sflight_release(flight);
+				RET(C_Sign, CKR_DEVICE_ERROR);
+			}
+
+			/*
+			 * If the leader was cancelled before it got to the
+			 * card, that doesn't mean we were; fall through and
+			 * make the signature ourselves.
+			 */
+
+			if (rv != CKR_FUNCTION_CANCELED) {
+				LOCK_MUTEX(id_mutex);
+				LOCK_MUTEX(se->mutex);
+
+				if (sess_sync_cancel(se)) {
+					rv = CKR_FUNCTION_CANCELED;
+				} else if (rv == CKR_OK) {
+					if (*siglen < fsiglen) {
+						rv = CKR_BUFFER_TOO_SMALL;
+					} else {
+						memcpy(sig, fsig, fsiglen);
+						if (se->sig_key)
+							CFRelease(se->sig_key);
+						se->sig_key = NULL;
+						se->sig_obj = 0;
+						se->sig_size = 0;
+					}
+					*siglen = fsiglen;
+				}
+
+				UNLOCK_MUTEX(se->mutex);
+				UNLOCK_MUTEX(id_mutex);
+				sflight_release(flight);
+				RET(C_Sign, rv);
+			}
+
+			sflight_release(flight);
+			flight = NULL;
+		}
+	}
+
 	LOCK_MUTEX(id_mutex);
 	LOCK_MUTEX(se->mutex);
 
@@ -1880,6 +2721,16 @@ CK_RV C_Sign(CK_SESSION_HANDLE session, CK_BYTE_PTR indata, CK_ULONG indatalen,
 	 * sig is NULL.
 	 */
 
+	if (sess_sync_cancel(se)) {
+		UNLOCK_MUTEX(se->mutex);
+		UNLOCK_MUTEX(id_mutex);
+		if (flight) {
+			sflight_land(flight, CKR_FUNCTION_CANCELED, NULL, 0);
+			sflight_release(flight);
+		}
+		RET(C_Sign, CKR_FUNCTION_CANCELED);
+	}
+
 	if (! sig) {
 		if (! se->sig_size) {
 			/* Hmm, what to do here?  No idea! */
@@ -1901,21 +2752,95 @@ CK_RV C_Sign(CK_SESSION_HANDLE session, CK_BYTE_PTR indata, CK_ULONG indatalen,
 		*siglen = se->sig_size;
 		UNLOCK_MUTEX(se->mutex);
 		UNLOCK_MUTEX(id_mutex);
+		if (flight) {
+			sflight_land(flight, CKR_BUFFER_TOO_SMALL, NULL, 0);
+			sflight_release(flight);
+		}
 		RET(C_Sign, CKR_BUFFER_TOO_SMALL);
 	}
 
+	if (! circuit_allow(&token_circuit, &trial)) {
+		os_log_debug(logsys, "Circuit breaker is open, failing "
+			     "signature");
+		UNLOCK_MUTEX(se->mutex);
+		UNLOCK_MUTEX(id_mutex);
+		if (flight) {
+			sflight_land(flight, CKR_DEVICE_ERROR, NULL, 0);
+			sflight_release(flight);
+		}
+		RET(C_Sign, CKR_DEVICE_ERROR);
+	}
+
 	inref = CFDataCreateWithBytesNoCopy(NULL, indata, indatalen,
 					    kCFAllocatorNull);
 
-	outref = SecKeyCreateSignature(se->sig_key, se->sig_alg, inref, &err);
+	opstart = trace_now();
+
+	if (use_broker) {
+		uint64_t gen = id_list_generation;
+
+		UNLOCK_ID_MUTEX(id_locked);
+		outref = broker_keyop(BROKER_SIGN, gen, se->slot_id,
+				      se->sig_obj, se->sig_mech, inref, NULL,
+				      &err);
+	} else {
+		start = TRACE_NOW();
+		pstart = prof_now();
+		outref = seckey_call(se, SecKeyCreateSignature, se->sig_key,
+				     se->sig_alg, inref, &err, &rv);
+		prof_record(PROF_SecKeyCreateSignature, KEYCHAIN_PHASE_CRYPTO,
+			    pstart, outref ? 0 : err ? cferr_code(err) : rv);
+		TRACE_SPAN(TRACE_SecKeyCreateSignature, start, session + 1,
+			   outref == NULL);
+	}
 
 	CFRelease(inref);
 
+	/*
+	 * If we have no error, seckey_call() gave up and set rv for us
+	 */
+
+	if (! outref && err)
+		rv = use_broker ? CFErrorGetCode(err) :
+				  cferr_rv(err, CKR_DATA_INVALID);
+
+	circuit_record(&token_circuit, trial, rv, trace_now() - opstart);
+
+	/*
+	 * Our waiters have their own buffers (and weren't cancelled), so
+	 * they get the answer no matter what happens to us.
+	 */
+
+	if (flight) {
+		if (outref)
+			sflight_land(flight, CKR_OK, CFDataGetBytePtr(outref),
+				     CFDataGetLength(outref));
+		else
+			sflight_land(flight, rv, NULL, 0);
+		sflight_release(flight);
+	}
+
+	if (sess_sync_cancel(se)) {
+		os_log_debug(logsys, "Signature was cancelled, discarding "
+			     "the result");
+		if (outref)
+			CFRelease(outref);
+		if (err)
+			CFRelease(err);
+		UNLOCK_MUTEX(se->mutex);
+		UNLOCK_ID_MUTEX(id_locked);
+		RET(C_Sign, CKR_FUNCTION_CANCELED);
+	}
+
 	if (! outref) {
-		os_log_debug(logsys, "SecKeyCreateSignature failed: "
-			     "%{public}@", err);
-		CFRelease(err);
-		RET(C_Sign, CKR_GENERAL_ERROR);
+		if (err) {
+			os_log_debug(logsys, "SecKeyCreateSignature failed: "
+				     "%{public}@", err);
+			CFRelease(err);
+		}
+		UNLOCK_MUTEX(se->mutex);
+		UNLOCK_ID_MUTEX(id_locked);
+		RET(C_Sign, rv);
 	}
 
 	if (*siglen < CFDataGetLength(outref)) {
@@ -1925,8 +2850,10 @@ CK_RV C_Sign(CK_SESSION_HANDLE session, CK_BYTE_PTR indata, CK_ULONG indatalen,
 		/*
 		 * If the signature was successful, release our key reference
 		 */
-		CFRelease(se->sig_key);
+		if (se->sig_key)
+			CFRelease(se->sig_key);
 		se->sig_key = NULL;
+		se->sig_obj = 0;
 		se->sig_size = 0;
 	}
 
@@ -1935,7 +2862,7 @@ CK_RV C_Sign(CK_SESSION_HANDLE session, CK_BYTE_PTR indata, CK_ULONG indatalen,
 	CFRelease(outref);
 
 	UNLOCK_MUTEX(se->mutex);
-	UNLOCK_MUTEX(id_mutex);
+	UNLOCK_ID_MUTEX(id_locked);
 
 #if KEYCHAIN_DEBUG
 	if ((file = getenv("KEYCHAIN_PKCS11_SIGN_SIGFILE"))) {
@@ -1962,6 +2889,8 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech,
 		   CK_OBJECT_HANDLE key)
 {
 	struct session *se;
+	struct obj_info *obj;
+	CK_RV rv;
 	int i;
 
 	FUNCINITCHK(C_VerifyInit);
@@ -1974,48 +2903,52 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech,
 	LOCK_MUTEX(id_mutex);
 	LOCK_MUTEX(se->mutex);
 
-	key--;
-
-	if (key >= se->obj_list_count) {
+	if (! (obj = obj_lookup(se, key))) {
 		UNLOCK_MUTEX(se->mutex);
 		UNLOCK_MUTEX(id_mutex);
 		RET(C_VerifyInit, CKR_KEY_HANDLE_INVALID);
 	}
-		
-	if (! id_list[se->obj_list[key].id_index].pubcanverify) {
+
+	if (obj->class != CKO_PUBLIC_KEY) {
 		UNLOCK_MUTEX(se->mutex);
 		UNLOCK_MUTEX(id_mutex);
-		RET(C_VerifyInit, CKR_KEY_FUNCTION_NOT_PERMITTED);
+		RET(C_VerifyInit, CKR_KEY_TYPE_INCONSISTENT);
 	}
 
-	if (se->obj_list[key].class != CKO_PUBLIC_KEY) {
+	if (! id_list[obj->id_index].pubcanverify) {
 		UNLOCK_MUTEX(se->mutex);
 		UNLOCK_MUTEX(id_mutex);
-		RET(C_SignInit, CKR_KEY_TYPE_INCONSISTENT);
+		RET(C_VerifyInit, CKR_KEY_FUNCTION_NOT_PERMITTED);
 	}
 
 	/*
-	 * Map our mechanism onto what we need for verification
+	 * Map our mechanism onto what we need for verification, and make
+	 * sure this key can actually do it.
 	 */
 
-	for (i = 0; i < keychain_mechmap_size; i++) {
-		if (mech->mechanism == keychain_mechmap[i].cki_mech) {
-			if (se->ver_key)
-				CFRelease(se->ver_key);
-			se->ver_key =
-				id_list[se->obj_list[key].id_index].pubkey;
-			CFRetain(se->ver_key);
-			se->ver_alg = *keychain_mechmap[i].sec_signmech;
-			UNLOCK_MUTEX(se->mutex);
-			UNLOCK_MUTEX(id_mutex);
-			RET(C_VerifyInit, CKR_OK);
-		}
+	i = keychain_mechmap_index(mech->mechanism);
+
+	if ((rv = id_mech_check(obj->id_index, i, CKF_VERIFY)) != CKR_OK) {
+		UNLOCK_MUTEX(se->mutex);
+		UNLOCK_MUTEX(id_mutex);
+		RET(C_VerifyInit, rv);
 	}
 
+	sess_sync_cancel(se);
+
+	if (se->ver_key)
+		CFRelease(se->ver_key);
+	se->ver_key = id_list[obj->id_index].pubkey;
+	if (se->ver_key)
+		CFRetain(se->ver_key);
+	se->ver_obj = key;
+	se->ver_mech = mech->mechanism;
+	se->ver_alg = *keychain_mechmap[i].sec_signmech;
+
 	UNLOCK_MUTEX(se->mutex);
 	UNLOCK_MUTEX(id_mutex);
 
-	RET(C_VerifyInit, CKR_MECHANISM_INVALID);
+	RET(C_VerifyInit, CKR_OK);
 }
 
 CK_RV C_Verify(CK_SESSION_HANDLE session, CK_BYTE_PTR indata,
@@ -2025,6 +2958,10 @@ CK_RV C_Verify(CK_SESSION_HANDLE session, CK_BYTE_PTR indata,
 	CFDataRef inref, sigref;
 	CFErrorRef err = NULL;
 	CK_RV rv = CKR_OK;
+	uint64_t start, pstart, gen = 0;
+	Boolean verified;
+	unsigned char vkey[VCACHE_KEYLEN];
+	bool cached = false, id_locked = true;
 
 	FUNCINITCHK(C_Verify);
 
@@ -2034,6 +2971,35 @@ CK_RV C_Verify(CK_SESSION_HANDLE session, CK_BYTE_PTR indata,
 
 	CHECKSESSION(session, se);
 
+	/*
+	 * If we've verified this exact signature with this key before,
+	 * we don't need to do it again.
+	 */
+
+	if (vcache_enabled()) {
+		LOCK_MUTEX(se->mutex);
+		if (sess_sync_cancel(se)) {
+			UNLOCK_MUTEX(se->mutex);
+			RET(C_Verify, CKR_FUNCTION_CANCELED);
+		}
+		if (se->ver_obj) {
+			vcache_key(se->ver_obj, se->ver_mech, indata,
+				   indatalen, sig, siglen, vkey);
+			cached = true;
+			if (vcache_lookup(vkey)) {
+				os_log_debug(logsys, "Signature found in "
+					     "verification cache");
+				if (se->ver_key)
+					CFRelease(se->ver_key);
+				se->ver_key = NULL;
+				se->ver_obj = 0;
+				UNLOCK_MUTEX(se->mutex);
+				RET(C_Verify, CKR_OK);
+			}
+		}
+		UNLOCK_MUTEX(se->mutex);
+	}
+
 	inref = CFDataCreateWithBytesNoCopy(NULL, indata, indatalen,
 					    kCFAllocatorNull);
 	sigref = CFDataCreateWithBytesNoCopy(NULL, sig, siglen,
@@ -2042,25 +3008,75 @@ CK_RV C_Verify(CK_SESSION_HANDLE session, CK_BYTE_PTR indata,
 	LOCK_MUTEX(id_mutex);
 	LOCK_MUTEX(se->mutex);
 
-	if (!SecKeyVerifySignature(se->ver_key, se->ver_alg, inref, sigref,
-				   &err)) {
+	if (sess_sync_cancel(se)) {
+		UNLOCK_MUTEX(se->mutex);
+		UNLOCK_MUTEX(id_mutex);
+		CFRelease(inref);
+		CFRelease(sigref);
+		RET(C_Verify, CKR_FUNCTION_CANCELED);
+	}
+
+	if (use_broker) {
+		CFDataRef outref;
+
+		gen = id_list_generation;
+		UNLOCK_ID_MUTEX(id_locked);
+		outref = broker_keyop(BROKER_VERIFY, gen, se->slot_id,
+				      se->ver_obj, se->ver_mech, inref, sigref,
+				      &err);
+		verified = outref != NULL;
+		if (outref)
+			CFRelease(outref);
+	} else {
+		start = TRACE_NOW();
+		pstart = prof_now();
+		verified = SecKeyVerifySignature(se->ver_key, se->ver_alg,
+						 inref, sigref, &err);
+		prof_record(PROF_SecKeyVerifySignature, KEYCHAIN_PHASE_CRYPTO,
+			    pstart, verified ? 0 : cferr_code(err));
+		TRACE_SPAN(TRACE_SecKeyVerifySignature, start, session + 1,
+			   !verified);
+	}
+
+	if (sess_sync_cancel(se)) {
+		if (! verified)
+			CFRelease(err);
+		UNLOCK_MUTEX(se->mutex);
+		UNLOCK_ID_MUTEX(id_locked);
+		CFRelease(inref);
+		CFRelease(sigref);
+		RET(C_Verify, CKR_FUNCTION_CANCELED);
+	}
+
+	if (!verified) {
 		os_log_debug(logsys, "VerifySignature failed: %{public}@", err);
+		rv = use_broker ? CFErrorGetCode(err) : CKR_SIGNATURE_INVALID;
 		CFRelease(err);
-		rv = CKR_SIGNATURE_INVALID;
+	} else if (cached && ! use_broker) {
+		/*
+		 * We still have id_mutex, so the identity list can't have
+		 * changed since we verified this.
+		 */
+		vcache_insert(vkey);
 	}
 
 	/*
 	 * Always release the key reference at this point
 	 */
 
-	CFRelease(se->ver_key);
+	if (se->ver_key)
+		CFRelease(se->ver_key);
 	se->ver_key = NULL;
+	se->ver_obj = 0;
 
 	UNLOCK_MUTEX(se->mutex);
-	UNLOCK_MUTEX(id_mutex);
+	UNLOCK_ID_MUTEX(id_locked);
 	CFRelease(inref);
 	CFRelease(sigref);
 
+	if (verified && cached && use_broker)
+		broker_vcache_insert(vkey, gen);
+
 	RET(C_Verify, rv);
 }
 
@@ -2080,1937 +3096,4714 @@ NOTSUPPORTED(C_DeriveKey, (CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech, CK_
 NOTSUPPORTED(C_SeedRandom, (CK_SESSION_HANDLE session, CK_BYTE_PTR seed, CK_ULONG seedlen))
 NOTSUPPORTED(C_GenerateRandom, (CK_SESSION_HANDLE session, CK_BYTE_PTR randomdata, CK_ULONG randomlen))
 NOTSUPPORTED(C_GetFunctionStatus, (CK_SESSION_HANDLE session))
-NOTSUPPORTED(C_CancelFunction, (CK_SESSION_HANDLE session))
 NOTSUPPORTED(C_WaitForSlotEvent, (CK_SESSION_HANDLE session, CK_SLOT_ID_PTR slot_id, CK_VOID_PTR reserved))
 
 /*
- * Use the Security framework to scan for any identities that are provided
- * by a smartcard, and copy out useful information from them.
- *
- * So, how does this work?
- *
- * We call SecItemCopyMatching() to find any "identities" known by the
- * Security framework.  An identity is a private key with a matching
- * certificate.  We restrict the search to tokens that live on smartcards.
- * Returns -1 on failure, 0 on success.
- *
- * Should be called with id_mutex locked.
- */ 
+ * Cancel everything on this session: operations that have been
+ * initialized but not called, calls still waiting for our locks, and
+ * calls waiting on the card (or a PIN dialog).  The last kind stop
+ * waiting and return CKR_FUNCTION_CANCELED within a fraction of a second
+ * (see seckey_call()), but we can't interrupt the Security framework
+ * itself; its call carries on in the background and the result is thrown
+ * away.  Until it finishes the card (or the PIN dialog) is still busy,
+ * so the next operation on this session may end up waiting behind it.
+ * Either way the session is left with no operations active.  All we do
+ * here is bump the session's cancel generation; we can't take the
+ * session mutex, since a call in progress may be holding it.
+ */
 
-static int
-scan_identities(void)
+CK_RV C_CancelFunction(CK_SESSION_HANDLE session)
 {
-	CFDictionaryRef query;
-	CFTypeRef result = NULL;
-	unsigned int i, count;
-	int ret = 0;
+	struct session *se;
 
-	/*
-	 * Our keys to create our query dictionary; note that the order
-	 * keys and values need to match up.
-	 *
-	 * Here's what's the query dictionary means:
-	 *
-	 * kSecClass = kSecClassIdentity
-	 *	This means we're searching for "identities" (certificates
-	 *	with corresponding private key objects).
-	 * kSecMatchLimit = kSecMatchLimitAll
-	 *	Without this, we only get one identity.  Setting this means
-	 *	our return value could be a list of identities.  If we get
-	 *	more than one identity returned then the result will be
-	 *	a CFArrayRef, otherwise it will be a CFDictionaryRef
-	 *	(see below).
-	 * kSecAttrAccessGroup = kSecAttrAccessGroupToken
-	 *	This will limit the search to identities which are in the
-	 *	"Token" Access group; this means smartcards.  This isn't
-	 *	documented very well, but I see that the security tool
-	 *	"list-smartcards" command uses this so I feel it's pretty
-	 *	safe to rely on this search key for now.
-	 * kSecReturnPersistentRef = kCFBooleanTrue
-	 *	This means return a "persisistent" reference to the identity
-	 *      (in a CFDataRef).  In earlier versions we would use
-	 *      kSecReturnRef to get the SecIdentityRef, but we need to
-	 *      bind a LAContext to the identity, and we do that by
-	 *      using the persistent ref to retrieve the ACTUAL SecIdentityRef
-	 *      and feeding in the LAContext into that query by using
-	 *	kSecUseAUthenticationContext.  That actually happens later
-	 *	in add_identity().  See comments in localauth.m for more
-	 *	information.  The persistent ref ends up in the dictionary
-	 *	under the kSecValuePersistentRef.
-	 * kSecReturnAttributes = kCFBooleanTrue
-	 *	This means we return all of the attributes for each identity.
-	 *	We can use this to get access to things like the label
-	 *	for the identity.
-	 *
-	 * Because we ask for all of the Attributes using kSecReturnAttributes
-	 * the return value is a CFDictionaryRef containing all of the
-	 * various attributes.  If we get more than one identity back, then
-	 * we will get a CFArrayRef, with each entry in the array containing
-	 * the CFDictionaryRef for that attribute.
-	 *
-	 * Whew.
-	 */
+	FUNCINITCHK(C_CancelFunction);
 
-	const void *keys[] = {
-		kSecClass,
-		kSecMatchLimit,
-		kSecAttrAccessGroup,
-		kSecReturnPersistentRef,
-		kSecReturnAttributes,
-	};
-	const void *values[] = {
-		kSecClassIdentity,		/* kSecClass */
-		kSecMatchLimitAll,		/* kSecMatchLimit */
-		kSecAttrAccessGroupToken,	/* kSecAttrAccessGroup */
-		kCFBooleanTrue,			/* kSecReturnPersistentRef */
-		kCFBooleanTrue,			/* kSecReturnAttributes */
-	};
+	os_log_debug(logsys, "session = %d", (int) session);
 
-	os_log_debug(logsys, "Performing identity scan");
+	CHECKSESSION(session, se);
 
-	/*
-	 * Create the query dictionary for SecCopyItemMatching(); see above
-	 */
+	atomic_fetch_add(&se->cancel_gen, 1);
 
-	query = CFDictionaryCreate(NULL, keys, values,
-				   sizeof(keys)/sizeof(keys[0]),
-				   &kCFTypeDictionaryKeyCallBacks,
-				   &kCFTypeDictionaryValueCallBacks);
+	RET(C_CancelFunction, CKR_OK);
+}
 
-	if (query == NULL) {
-		os_log_debug(logsys, "query dictionary creation returned NULL");
-		return -1;
-	}
+/*
+ * Our vendor extensions (see keychain_vendor.h)
+ */
 
-	/*
-	 * This is where the actual query happens
-	 */
+CK_RV C_KeychainGetVerifyCacheStats(struct keychain_verify_cache_stats *stats)
+{
+	FUNCINITCHK(C_KeychainGetVerifyCacheStats);
 
-	ret = SecItemCopyMatching(query, &result);
+	if (! stats)
+		RET(C_KeychainGetVerifyCacheStats, CKR_ARGUMENTS_BAD);
 
-	CFRelease(query);
+	vcache_stats(stats);
 
-	/*
-	 * It turns out that to detect card insertions/removals, we need
-	 * to change things a bit (we used to scan for identities only once).
-	 * So here's what we do now; perform the following tests:
-	 *
-	 * Do we have the same number of identities?
-	 * Do we have the same public key hashes?
-	 *
-	 * If this is all the same, then we return.  Otherwise we perform
-	 * a full rescan.
-	 */
+	RET(C_KeychainGetVerifyCacheStats, CKR_OK);
+}
 
-	if (ret) {
-		/*
-		 * Handle the case where we just don't see any matching
-		 * results.
-		 */
+CK_RV C_KeychainSetOperationTimeout(CK_SESSION_HANDLE session,
+				    CK_ULONG milliseconds)
+{
+	struct session *se;
 
-		if (ret == errSecItemNotFound) {
-			os_log_debug(logsys, "No identities found");
+	FUNCINITCHK(C_KeychainSetOperationTimeout);
 
-			id_list_init = true;
+	os_log_debug(logsys, "session = %d, timeout = %lu ms", (int) session,
+		     milliseconds);
 
-			/*
-			 * If this is the same as before?  If so, then
-			 * just return here
-			 */
+	CHECKSESSION(session, se);
 
-			if (id_list_count == 0) {
-				return 0;
-			} else {
-				os_log_debug(logsys, "We now have no "
-					     "identities (previously had %u)",
-					     id_list_count);
-				count = 0;
-				goto rebuild;
-			}
-		} else {
-			LOG_SEC_ERR("SecItemCopyMatching failed: "
-				    "%{public}@", ret);
-			return -1;
-		}
-	}
+	if (milliseconds > UINT_MAX)
+		RET(C_KeychainSetOperationTimeout, CKR_ARGUMENTS_BAD);
 
-	/*
-	 * Check to see if we have the same number of entries
-	 * and the same public key hashes.
-	 *
-	 * Because right now we compare each entry in order to
-	 * the corresponding entry in id_list, we will trigger a
-	 * rescan if the identity order varies; as far as I can
-	 * tell this doesn't happen, but we'll need to fix that
-	 * in the future if it does.
-	 */
+	atomic_store(&se->op_timeout, (unsigned int) milliseconds);
 
-	count = cflistcount(result);
+	RET(C_KeychainSetOperationTimeout, CKR_OK);
+}
 
-	if (count != id_list_count) {
-		os_log_debug(logsys, "We have %u identities, previously we "
-			     "had %u", count, id_list_count);
-		goto rebuild;
-	}
+CK_RV C_KeychainGetSignCoalesceStats(struct keychain_sign_coalesce_stats *stats)
+{
+	FUNCINITCHK(C_KeychainGetSignCoalesceStats);
 
-	for (i = 0; i < count; i++) {
-		CFDictionaryRef dict;
-		CFDataRef data;
+	if (! stats)
+		RET(C_KeychainGetSignCoalesceStats, CKR_ARGUMENTS_BAD);
 
-		dict = cfgetindex(result, i);
+	sflight_stats(stats);
 
-		if (CFDictionaryGetValueIfPresent(dict, kSecAttrPublicKeyHash,
-						  (const void **) &data)) {
-			if (!CFEqual(data, id_list[i].pkeyhash)) {
-				os_log_debug(logsys, "public key hash for "
-					     "identity %u differs", i + 1);
-				goto rebuild;
-			}
-		}
-	}
+	RET(C_KeychainGetSignCoalesceStats, CKR_OK);
+}
 
-	os_log_debug(logsys, "Identity inventory unchanged");
+/*
+ * Everything one worker in C_KeychainVerifyBatch() needs
+ */
 
-	goto out;
+struct verify_batch {
+	struct session			*se;
+	unsigned long			gen;
+	uint64_t			id_gen;
+	CK_SESSION_HANDLE		session;
+	CK_SLOT_ID			slot_id;
+	CK_OBJECT_HANDLE		obj;
+	CK_MECHANISM_TYPE		mech;
+	SecKeyRef			key;
+	SecKeyAlgorithm			alg;
+	struct keychain_verify_item	*items;
+	CK_RV				*results;
+};
 
-	/*
-	 * Clear out all previous identity entries and object tree
-	 */
+/*
+ * Verify one item of a batch; called by dispatch_apply_f(), so this
+ * can run on many threads at once.  The caller holds id_mutex for us (or
+ * in broker mode, the session mutex).
+ */
 
-rebuild:
-	os_log_debug(logsys, "Rebuilding identity list and object tree");
+static void
+verify_batch_item(void *context, size_t i)
+{
+	struct verify_batch *vb = context;
+	struct keychain_verify_item *item = &vb->items[i];
+	CFDataRef inref, sigref;
+	CFErrorRef err = NULL;
+	unsigned char vkey[VCACHE_KEYLEN];
+	Boolean verified;
+	uint64_t start, pstart;
 
-	obj_free(&id_obj_list, &id_obj_count, &id_obj_size);
-	id_list_free();
+	if ((! item->data && item->data_len) || ! item->sig) {
+		vb->results[i] = CKR_ARGUMENTS_BAD;
+		return;
+	}
 
-	if (lacontext != NULL)
-		lacontext_free(lacontext);
+	if (atomic_load(&vb->se->cancel_gen) != vb->gen) {
+		vb->results[i] = CKR_FUNCTION_CANCELED;
+		return;
+	}
 
-	lacontext = lacontext_new();
+	if (vcache_enabled()) {
+		vcache_key(vb->obj, vb->mech, item->data, item->data_len,
+			   item->sig, item->sig_len, vkey);
+		if (vcache_lookup(vkey)) {
+			vb->results[i] = CKR_OK;
+			return;
+		}
+	}
 
-	os_log_debug(logsys, "%u identities found", count);
+	inref = CFDataCreateWithBytesNoCopy(NULL, item->data, item->data_len,
+					    kCFAllocatorNull);
+	sigref = CFDataCreateWithBytesNoCopy(NULL, item->sig, item->sig_len,
+					     kCFAllocatorNull);
 
-	for (i = 0; i < count; i++)  {
-		os_log_debug(logsys, "Copying identity %u", i + 1);
+	if (use_broker) {
+		CFDataRef outref = broker_keyop(BROKER_VERIFY, vb->id_gen,
+						vb->slot_id, vb->obj, vb->mech,
+						inref, sigref, &err);
+		verified = outref != NULL;
+		if (outref)
+			CFRelease(outref);
+	} else {
+		start = TRACE_NOW();
+		pstart = prof_now();
+		verified = SecKeyVerifySignature(vb->key, vb->alg, inref,
+						 sigref, &err);
+		prof_record(PROF_SecKeyVerifySignature, KEYCHAIN_PHASE_CRYPTO,
+			    pstart, verified ? 0 : cferr_code(err));
+		TRACE_SPAN(TRACE_SecKeyVerifySignature, start,
+			   vb->session + 1, !verified);
+	}
 
-		if (add_identity(cfgetindex(result, i))) {
-			ret = -1;
-			goto out;
-		}
+	if (verified) {
+		vb->results[i] = CKR_OK;
+		if (vcache_enabled() && ! use_broker)
+			vcache_insert(vkey);
+	} else {
+		os_log_debug(logsys, "Batch item %zu failed to verify: "
+			     "%{public}@", i, err);
+		vb->results[i] = use_broker ? CFErrorGetCode(err) :
+							CKR_SIGNATURE_INVALID;
+		CFRelease(err);
 	}
 
-	/*
-	 * Rebuild our object tree since we've finished the identity scan
-	 */
+	CFRelease(inref);
+	CFRelease(sigref);
+}
 
-	build_id_objects(0);
+CK_RV C_KeychainVerifyBatch(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech,
+			    CK_OBJECT_HANDLE key,
+			    struct keychain_verify_item *items, CK_ULONG count,
+			    CK_RV *results)
+{
+	struct session *se;
+	struct obj_info *obj;
+	struct verify_batch vb;
+	CK_RV rv;
+	CK_ULONG i;
+	int mi;
 
-	id_list_init = true;
+	FUNCINITCHK(C_KeychainVerifyBatch);
 
-out:
-	if (result)
-		CFRelease(result);
-	return ret;
-}
+	os_log_debug(logsys, "session = %d, object = %d, count = %lu",
+		     (int) session, (int) key, count);
 
-/*
- * Add an identity to our identity list.  Takes a CFDictionaryRef with
- * all of the identity attributes (and persistent reference) in it.
- */
+	if (! mech || (count && (! items || ! results)))
+		RET(C_KeychainVerifyBatch, CKR_ARGUMENTS_BAD);
 
-static int
-add_identity(CFDictionaryRef dict)
-{
-	CFStringRef label;
-	CFNumberRef keytype;
-	CFTypeRef refresult;
-	CFDictionaryRef refquery, keydict;
-	CFDataRef p_ref;
-	CFIndex numitems;
-	OSStatus ret;
-	int i = id_list_count;
+	CHECKSESSION(session, se);
 
 	/*
-	 * Our query dictionary for SecItemCopyMatching.  Here are the
-	 * components of our query dictionary:
-	 *
-	 * kSecClass = kSecClassIdentity
-	 *	See scan_identities() for more details, but this limits us to
-	 *	only retrieving identities.
-	 * kSecMatchLimit = kSecMatchLimitOne
-	 *	Because we're using the persistent reference (see below)
-	 *	we really only want one response (and we should only get one)
-	 *	so set the match limit to one so we only get back a single
-	 *	response.
-	 * kSecReturnRef = kCFBooleanTrue
-	 *	We set this to indicate that we want an identity reference
-	 *	back (SecIdentityRef); this should be the only thing returned
-	 *	because we set no other return keys and we are requesting
-	 *	only one.
-	 * kSecUseAuthenticationContext = LAContext
-	 *	This is covered in more detail in localauth.m, but the idea
-	 *	here is this is a Local Authentication context created by
-	 *	the LAContext class.  When converting from a persistent ref
-	 *	to a SecIdentityRef and an auth context is passed in via
-	 *	kSecUseAuthenticationContext, it is converted by the Security
-	 *	framework internally to an ACM context and we can then later
-	 *	use the LAContext methods to authentication to the token.
-	 * kSecValuePersistentRef = persistent reference
-	 *	This is the persistent reference generated in the attribute
-	 *	dictionary when we did the search for all identities in
-	 *	scan_identities().  The reason we get a persistent reference
-	 *	in scan_identities() and then convert it to a "real" reference
-	 *	(e.g., SecIdentityRef) is so we can bind the LAContext
-	 *	to the identity so we have the ability to input the PIN
-	 *	via the PKCS#11 API (rather than let the Security framework
-	 *	ask for it).  It is worth noting that there is ALSO an
-	 *	attribute key called "kSecAttrPersistentReference"; as far
-	 *	as I can tell, that key is not used for anything.  The
-	 *	Apple documentation says to convert a persistent reference
-	 *	to a normal reference you should pass in the persistent
-	 *	reference in a CFArray using the kSecMatchItemList, but
-	 *	I can definitely say that at least for me, this did not work.
+	 * A C_CancelFunction() from now on stops the items we haven't
+	 * started yet.
 	 */
 
-	const void *keys[] = {
-		kSecClass,
-		kSecMatchLimit,
-		kSecReturnRef,
-		kSecValuePersistentRef,
-#define P_REF_INDEX	3
-		kSecUseAuthenticationContext,
-#define AUTHC_INDEX	4
-	};
+	vb.gen = atomic_load(&se->cancel_gen);
 
-	const void *values[] = {
-		kSecClassIdentity,		/* kSecClass */
-		kSecMatchLimitOne,		/* kSecMatchLimit */
-		kCFBooleanTrue,			/* kSecReturnRef */
-		NULL,				/* PersistentReference */
-		NULL,				/* UseAuthtenticationContext */
-	};
+	LOCK_MUTEX(id_mutex);
+	LOCK_MUTEX(se->mutex);
 
 	/*
-	 * Just in case ...
+	 * Same checks as C_VerifyInit(), but we leave the session's own
+	 * verify state alone.
 	 */
 
-	if (dict == NULL) {
-		os_log_debug(logsys, "Identity dictionary is NULL, returning!");
-		return -1;
+	if (! (obj = obj_lookup(se, key))) {
+		rv = CKR_KEY_HANDLE_INVALID;
+	} else if (obj->class != CKO_PUBLIC_KEY) {
+		rv = CKR_KEY_TYPE_INCONSISTENT;
+	} else if (! id_list[obj->id_index].pubcanverify) {
+		rv = CKR_KEY_FUNCTION_NOT_PERMITTED;
+	} else {
+		mi = keychain_mechmap_index(mech->mechanism);
+		rv = id_mech_check(obj->id_index, mi, CKF_VERIFY);
 	}
 
-	/*
-	 * If we don't have enough id entries, allocate some more.
-	 */
+	UNLOCK_MUTEX(se->mutex);
 
-	if (++id_list_count > id_list_size) {
-		id_list_size += 5;
-		id_list = realloc(id_list, sizeof(*id_list) * id_list_size);
+	if (rv != CKR_OK) {
+		UNLOCK_MUTEX(id_mutex);
+		RET(C_KeychainVerifyBatch, rv);
 	}
 
-	id_list[i].ident = NULL;
-	id_list[i].cert = NULL;
-	id_list[i].privkey = NULL;
-	id_list[i].pubkey = NULL;
-	id_list[i].label = NULL;
-	id_list[i].secaccess = NULL;
-	id_list[i].pkeyhash = NULL;
-
-	if (! CFDictionaryGetValueIfPresent(dict, kSecValuePersistentRef,
-					    (const void **)&p_ref)) {
-		os_log_debug(logsys, "Persistent id reference not found");
-		return -1;
-	}
+	vb.se = se;
+	vb.id_gen = id_list_generation;
+	vb.session = session;
+	vb.slot_id = se->slot_id;
+	vb.obj = key;
+	vb.mech = mech->mechanism;
+	vb.key = id_list[obj->id_index].pubkey;
+	vb.alg = *keychain_mechmap[mi].sec_signmech;
+	vb.items = items;
+	vb.results = results;
 
 	/*
-	 * Use our shared LAContext and feed it into the query using the
-	 * kSecUseAuthenticationContext key.  We also feed in the persistent
-	 * reference to extract the REAL identity reference (SecIdentityRef).
-	 * This will attach the LAContext to the identity.
+	 * The items are independent, so spread them over all of the CPUs;
+	 * the Security framework is happy to have one key used on many
+	 * threads, and the broker gives each request its own connection.
+	 * Normally we keep id_mutex the whole time (like C_Verify() does)
+	 * so the key and our cache entries can't go stale underneath us.
+	 * In broker mode we hold the session mutex instead, and only cache
+	 * what verified if our catalog didn't change while we waited.
 	 */
 
-	values[P_REF_INDEX] = p_ref;
-	values[AUTHC_INDEX] = lacontext;
+	if (use_broker) {
+		LOCK_MUTEX(se->mutex);
+		UNLOCK_MUTEX(id_mutex);
+	}
 
-	/*
-	 * It turns out that in some cases (if you are running under
-	 * 32 bit mode, for example), you won't be able to allocate a
-	 * lacontext.  So if that happens we need to be sure not to
-	 * put the lacontext into our dictionary.  We can't use kCFNull
-	 * because that will cause the SecItemCopyMatching call later
-	 * to fail; just make sure the lacontext is at the end and if
-	 * if lacontext is NULL just subtract one from the dictionary
-	 * item count.
-	 */
+	if (count < 2) {
+		for (i = 0; i < count; i++)
+			verify_batch_item(&vb, i);
+	} else {
+		dispatch_apply_f(count, dispatch_get_global_queue(
+					DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+				 &vb, verify_batch_item);
+	}
 
-	numitems = sizeof(keys)/sizeof(keys[0]) - (lacontext ? 0 : 1);
+	if (use_broker) {
+		unsigned char vkey[VCACHE_KEYLEN];
 
-	refquery = CFDictionaryCreate(NULL, keys, values, numitems,
-				      &kCFTypeDictionaryKeyCallBacks,
-				      &kCFTypeDictionaryValueCallBacks);
+		UNLOCK_MUTEX(se->mutex);
 
-	if (refquery == NULL) {
-		os_log_debug(logsys, "Persistent ref query dictionary "
-			     "creation returned NULL");
-		return -1;
+		for (i = 0; vcache_enabled() && i < count; i++) {
+			if (results[i] != CKR_OK)
+				continue;
+			vcache_key(vb.obj, vb.mech, items[i].data,
+				   items[i].data_len, items[i].sig,
+				   items[i].sig_len, vkey);
+			broker_vcache_insert(vkey, vb.id_gen);
+		}
+	} else {
+		UNLOCK_MUTEX(id_mutex);
 	}
 
-	ret = SecItemCopyMatching(refquery, &refresult);
+	if (atomic_load(&se->cancel_gen) != vb.gen)
+		RET(C_KeychainVerifyBatch, CKR_FUNCTION_CANCELED);
 
-	CFRelease(refquery);
+	RET(C_KeychainVerifyBatch, CKR_OK);
+}
 
-	if (ret) {
-		LOG_SEC_ERR("Persistent ref SecItemCopyMatching "
-			    "failed: %{public}@", ret);
-		return -1;
-	}
+CK_RV C_KeychainGetCircuitStats(CK_SLOT_ID slot_id,
+				struct keychain_circuit_stats *stats)
+{
+	FUNCINITCHK(C_KeychainGetCircuitStats);
 
-	if (CFGetTypeID(refresult) != SecIdentityGetTypeID()) {
-		logtype("Was expecting a SecIdentityRef, but got", refresult);
-		CFRelease(refresult);
-		return -1;
-	}
+	os_log_debug(logsys, "slot_id = %lu, stats = %p", slot_id, stats);
 
-	/*
-	 * No need to retain; we own this as a result of it coming out of
-	 * SecItemCopyMatching
-	 */
+	CHECKSLOT(slot_id, false);
 
-	id_list[i].ident = (SecIdentityRef) refresult;
+	if (! stats)
+		RET(C_KeychainGetCircuitStats, CKR_ARGUMENTS_BAD);
 
 	/*
-	 * Extract out of the dictionary all of the things we need.
-	 * Note that since we are following the "Get Rule" and this
-	 * dictionary should be de-allocated soon, we need to CFRetain()
-	 * everything we want for later.
-	 *
-	 * Key items:
-	 *
-	 * Attribute label (display string for the identity)
-	 * SecIdentityRef (used by Security Framework)
-	 * Various attribute flags (we use those for returning
-	 * object information)
-	 *
-	 * To make things easier, we extract the private key object
-	 * and the certificate from the identity.  Those are copies and
-	 * we don't need to retain those objects.
+	 * The certificate slot has no key operations, so no breaker
 	 */
 
-	if (CFDictionaryGetValueIfPresent(dict, kSecAttrLabel,
-					  (const void **) &label)) {
-		id_list[i].label = getstrcopy(label);
-		os_log_debug(logsys, "Identity label: %{public}@", label);
-	} else {
-		id_list[i].label = strdup("Hardware token");
-		os_log_debug(logsys, "No label, using default");
-	}
-	
-#if 0
-	if (! CFDictionaryGetValueIfPresent(dict, kSecValueRef,
-					    (const void **)&id_list[i].ident)) {
-		os_log_debug(logsys, "Identity reference not found");
-		return -1;
-	}
+	if (slot_id == TOKEN_SLOT)
+		circuit_stats(&token_circuit, stats);
+	else
+		memset(stats, 0, sizeof(*stats));
 
-	CFRetain(id_list[i].ident);
-#endif
+	RET(C_KeychainGetCircuitStats, CKR_OK);
+}
 
-#if 0
-	if (! CFDictionaryGetValueIfPresent(dict, kSecAttrAccessControl,
-				    (const void **) &id_list[i].secaccess)) {
-		os_log_debug(logsys, "Access Control object not found");
-		return -1;
-	}
+CK_RV C_KeychainGetBackendProfile(struct keychain_backend_probe *probes,
+				  CK_ULONG_PTR count)
+{
+	unsigned int n;
+	CK_RV rv = CKR_OK;
 
-	CFRetain(id_list[i].secaccess);
-#endif
+	FUNCINITCHK(C_KeychainGetBackendProfile);
 
-	if (! CFDictionaryGetValueIfPresent(dict, kSecAttrKeyType,
-					    (const void **) &keytype)) {
-		os_log_debug(logsys, "Key type not found");
-		return -1;
-	}
+	if (! count)
+		RET(C_KeychainGetBackendProfile, CKR_ARGUMENTS_BAD);
 
-	id_list[i].keytype = convert_keytype(keytype);
+	os_log_debug(logsys, "probes = %p, count = %lu", probes, *count);
 
-	if (! CFDictionaryGetValueIfPresent(dict, kSecAttrPublicKeyHash,
-					    (const void **)
-							&id_list[i].pkeyhash)) {
-		os_log_debug(logsys, "Public key hash not found");
-		return -1;
-	}
+	/*
+	 * A probe can be called for the first time between the caller
+	 * asking for the count and asking for the list; if so they get
+	 * CKR_BUFFER_TOO_SMALL and the new count.
+	 */
 
-	CFRetain(id_list[i].pkeyhash);
+	n = prof_get(probes, probes ? *count : 0);
 
-	id_list[i].privcansign = boolfromdict("Can-Sign", dict,
-					      kSecAttrCanSign);
-	id_list[i].privcandecrypt = boolfromdict("Can-Decrypt", dict,
-						 kSecAttrCanDecrypt);
+	if (probes && *count < n)
+		rv = CKR_BUFFER_TOO_SMALL;
 
-	ret = SecIdentityCopyCertificate(id_list[i].ident, &id_list[i].cert);
+	*count = n;
 
-	if (ret)
-		LOG_SEC_ERR("CopyCertificate failed: %{public}@", ret);
+	RET(C_KeychainGetBackendProfile, rv);
+}
 
-	if (! ret) {
-		ret = SecIdentityCopyPrivateKey(id_list[i].ident,
-						&id_list[i].privkey);
-		if (ret)
-			LOG_SEC_ERR("CopyPrivateKey failed: %{public}@", ret);
-		else {
-			if (! (id_list[i].secaccess =
-					getaccesscontrol(dict)))
-				return -1;
-		}
-	}
+CK_RV C_KeychainResetBackendProfile(void)
+{
+	FUNCINITCHK(C_KeychainResetBackendProfile);
 
-	if ( !ret) {
-		ret = SecCertificateCopyPublicKey(id_list[i].cert,
-						  &id_list[i].pubkey);
-		if (ret)
-			LOG_SEC_ERR("CopyPublicKey failed: %{public}@", ret);
-	}
+	prof_reset();
 
-	/*
-	 * Get our public key attributes
-	 */
+	RET(C_KeychainResetBackendProfile, CKR_OK);
+}
 
-	if (! ret) {
+/*
+ * Where the next value goes in a C_KeychainGetAttributeValues() buffer;
+ * we keep them aligned so CK_ULONG values can be read in place.
+ */
+
+#define ATTR_ALIGN(len) \
+	(((len) + sizeof(CK_ULONG) - 1) & ~(sizeof(CK_ULONG) - 1))
+
+CK_RV C_KeychainGetAttributeValues(CK_SESSION_HANDLE session,
+				   CK_OBJECT_HANDLE_PTR objects,
+				   CK_ULONG object_count,
+				   CK_ATTRIBUTE_TYPE *types,
+				   CK_ULONG type_count,
+				   CK_ATTRIBUTE_PTR values,
+				   CK_BYTE_PTR buffer,
+				   CK_ULONG_PTR buffer_len,
+				   CK_RV *results)
+{
+	struct session *se;
+	struct obj_info *obj;
+	CK_ATTRIBUTE_PTR attr, val;
+	CK_ULONG i, j, need = 0, off = 0;
+	CK_RV rv = CKR_OK;
+
+	FUNCINITCHK(C_KeychainGetAttributeValues);
+
+	os_log_debug(logsys, "session = %d, objects = %p, object_count = %lu, "
+		     "types = %p, type_count = %lu, buffer = %p",
+		     (int) session, objects, object_count, types, type_count,
+		     buffer);
+
+	if (! buffer_len || (object_count && (! objects || ! results)) ||
+	    (type_count && (! types || (object_count && ! values))) ||
+	    (type_count && object_count > ULONG_MAX / type_count))
+		RET(C_KeychainGetAttributeValues, CKR_ARGUMENTS_BAD);
+
+	CHECKSESSION(session, se);
+
+	LOCK_MUTEX(id_mutex);
+	LOCK_MUTEX(se->mutex);
+
+	/*
+	 * Size everything first, so we never hand back half of it
+	 */
+
+	for (i = 0; i < object_count; i++) {
+		obj = obj_lookup(se, objects[i]);
+		results[i] = obj ? CKR_OK : CKR_OBJECT_HANDLE_INVALID;
+
+		for (j = 0; j < type_count; j++) {
+			val = &values[i * type_count + j];
+			val->type = types[j];
+
+			val->pValue = NULL;
+
+			if (obj && (attr = find_attribute(obj, types[j]))) {
+				val->ulValueLen = attr->ulValueLen;
+				need += ATTR_ALIGN(attr->ulValueLen);
+			} else {
+				val->ulValueLen = CK_UNAVAILABLE_INFORMATION;
+				if (obj)
+					results[i] = CKR_ATTRIBUTE_TYPE_INVALID;
+			}
+		}
+	}
+
+	if (buffer && *buffer_len < need) {
+		os_log_debug(logsys, "Buffer too small (%lu, %lu)",
+			     *buffer_len, need);
+		rv = CKR_BUFFER_TOO_SMALL;
+	}
+
+	/*
+	 * Then copy (and unpack, if we have to) whatever we found
+	 */
+
+	for (i = 0; buffer && rv == CKR_OK && i < object_count; i++) {
+		if (! (obj = obj_lookup(se, objects[i])))
+			continue;
+
+		for (j = 0; j < type_count; j++) {
+			if (! (attr = find_attribute(obj, types[j])))
+				continue;
+
+			val = &values[i * type_count + j];
+
+			if (attr_copy(obj, attr, buffer + off)) {
+				val->pValue = buffer + off;
+			} else {
+				val->ulValueLen = CK_UNAVAILABLE_INFORMATION;
+				results[i] = CKR_FUNCTION_FAILED;
+			}
+
+			off += ATTR_ALIGN(attr->ulValueLen);
+		}
+	}
+
+	*buffer_len = need;
+
+	UNLOCK_MUTEX(se->mutex);
+	UNLOCK_MUTEX(id_mutex);
+
+	RET(C_KeychainGetAttributeValues, rv);
+}
+
+/*
+ * Called by the dispatch system to do our first identity scan (see
+ * C_Initialize()); our argument is the value of id_scan_cancel when we
+ * were started.  If it fails (or gets cancelled) C_GetSlotList() will
+ * try again.
+ */
+
+static void
+background_id_scan(void *arg)
+{
+	uint64_t start = TRACE_NOW();
+	int ret, phase;
+
+	id_scan_thread = true;
+	id_scan_gen = (unsigned long) arg;
+
+	LOCK_MUTEX(id_mutex);
+	if (atomic_load(&id_scan_cancel) != id_scan_gen) {
+		ret = -1;
+	} else {
+		phase = prof_enter(KEYCHAIN_PHASE_ID_SCAN);
+		ret = scan_identities();
+		prof_leave(phase);
+	}
+	UNLOCK_MUTEX(id_mutex);
+
+	id_scan_thread = false;
+
+	TRACE_SPAN(TRACE_scan_identities, start, 0, ret);
+}
+
+/*
+ * Start prewarming the private keys in our identity list (see the top of
+ * the file).  Call with id_mutex locked; we hand the background thread
+ * its own references, so it never has to look at the identity list.
+ */
+
+static void
+prewarm_start(void)
+{
+	struct prewarm_job *job;
+	unsigned int i;
+	uint64_t gen = atomic_fetch_add(&prewarm_gen, 1) + 1;
+
+	/*
+	 * We don't have any key references if the broker gave us our
+	 * identities, and after a fork() the ones we have belong to the
+	 * parent.
+	 */
+
+	if (! prewarm_keys || use_broker || id_refs_stale)
+		return;
+
+	/*
+	 * Prewarming is only an optimization, so if we run out of memory
+	 * we just skip it.
+	 */
+
+	if (! (job = calloc(1, sizeof(*job))))
+		return;
+
+	job->gen = gen;
+	job->keys = calloc(id_list_count, sizeof(*job->keys));
+	job->mechflags = calloc(id_list_count, sizeof(*job->mechflags));
+
+	if (! job->keys || ! job->mechflags) {
+		prewarm_job_free(job);
+		return;
+	}
+
+	for (i = 0; i < id_list_count; i++) {
+		if (! id_list[i].privkey || ! id_list[i].mechflags)
+			continue;
+		if (! (job->mechflags[job->count] =
+			malloc(keychain_mechmap_size * sizeof(CK_FLAGS)))) {
+			prewarm_job_free(job);
+			return;
+		}
+		memcpy(job->mechflags[job->count], id_list[i].mechflags,
+		       keychain_mechmap_size * sizeof(CK_FLAGS));
+		job->keys[job->count] = id_list[i].privkey;
+		CFRetain(job->keys[job->count]);
+		job->count++;
+	}
+
+	if (job->count == 0) {
+		prewarm_job_free(job);
+		return;
+	}
+
+	dispatch_async_f(dispatch_get_global_queue(
+			  DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0),
+			 job, background_prewarm);
+}
+
+/*
+ * Do the work the first key operation would otherwise have to do.  None
+ * of this needs a PIN: SecKeyCopyAttributes() makes the Security
+ * framework load the key from the token driver, SecKeyGetBlockSize()
+ * works out the key size from the private key itself, and we ask
+ * SecKeyIsAlgorithmSupported() about every mechanism this key can sign
+ * or decrypt with so those answers are cached as well.
+ */
+
+static void
+background_prewarm(void *arg)
+{
+	struct prewarm_job *job = arg;
+	struct mechanism_map *m;
+	CFDictionaryRef attrs;
+	uint64_t start = TRACE_NOW(), pstart;
+	unsigned int i, j, done = 0;
+
+	for (i = 0; i < job->count; i++) {
+		if (atomic_load(&prewarm_gen) != job->gen)
+			break;
+
+		pstart = prof_now();
+		attrs = SecKeyCopyAttributes(job->keys[i]);
+		PROF_RECORD(SecKeyCopyAttributes, pstart,
+			    attrs ? 0 : PROF_FAILED);
+		if (attrs)
+			CFRelease(attrs);
+
+		(void) SecKeyGetBlockSize(job->keys[i]);
+
+		for (j = 0; j < keychain_mechmap_size; j++) {
+			m = &keychain_mechmap[j];
+			if ((job->mechflags[i][j] & CKF_SIGN) &&
+			    m->sec_signmech)
+				(void) key_supports(job->keys[i],
+						kSecKeyOperationTypeSign,
+						*m->sec_signmech);
+			if ((job->mechflags[i][j] & CKF_DECRYPT) &&
+			    m->sec_encmech)
+				(void) key_supports(job->keys[i],
+						kSecKeyOperationTypeDecrypt,
+						*m->sec_encmech);
+		}
+
+		done++;
+	}
+
+	TRACE_SPAN(TRACE_prewarm_keys, start, 0, done != job->count);
+
+	os_log_debug(logsys, "Prewarmed %u of %u private key%s", done,
+		     job->count, job->count == 1 ? "" : "s");
+
+	prewarm_job_free(job);
+}
+
+/*
+ * Free a prewarm job, and the keys and flags it has copies of so far
+ */
+
+static void
+prewarm_job_free(struct prewarm_job *job)
+{
+	unsigned int i;
+
+	for (i = 0; i < job->count; i++) {
+		CFRelease(job->keys[i]);
+		free(job->mechflags[i]);
+	}
+
+	free(job->keys);
+	free(job->mechflags);
+	free(job);
+}
+
+/*
+ * Use the Security framework to scan for any identities that are provided
+ * by a smartcard, and copy out useful information from them.
+ *
+ * So, how does this work?
+ *
+ * We call SecItemCopyMatching() to find any "identities" known by the
+ * Security framework.  An identity is a private key with a matching
+ * certificate.  We restrict the search to tokens that live on smartcards.
+ * Returns -1 on failure, 0 on success.
+ *
+ * Should be called with id_mutex locked.
+ */ 
+
+static int
+scan_identities(void)
+{
+	CFDictionaryRef query;
+	CFTypeRef result = NULL;
+	unsigned int i, count;
+	int ret = 0, phase;
+	uint64_t start, pstart;
+
+	/*
+	 * Our keys to create our query dictionary; note that the order
+	 * keys and values need to match up.
+	 *
+	 * Here's what's the query dictionary means:
+	 *
+	 * kSecClass = kSecClassIdentity
+	 *	This means we're searching for "identities" (certificates
+	 *	with corresponding private key objects).
+	 * kSecMatchLimit = kSecMatchLimitAll
+	 *	Without this, we only get one identity.  Setting this means
+	 *	our return value could be a list of identities.  If we get
+	 *	more than one identity returned then the result will be
+	 *	a CFArrayRef, otherwise it will be a CFDictionaryRef
+	 *	(see below).
+	 * kSecAttrAccessGroup = kSecAttrAccessGroupToken
+	 *	This will limit the search to identities which are in the
+	 *	"Token" Access group; this means smartcards.  This isn't
+	 *	documented very well, but I see that the security tool
+	 *	"list-smartcards" command uses this so I feel it's pretty
+	 *	safe to rely on this search key for now.
+	 * kSecReturnPersistentRef = kCFBooleanTrue
+	 *	This means return a "persisistent" reference to the identity
+	 *      (in a CFDataRef).  In earlier versions we would use
+	 *      kSecReturnRef to get the SecIdentityRef, but we need to
+	 *      bind a LAContext to the identity, and we do that by
+	 *      using the persistent ref to retrieve the ACTUAL SecIdentityRef
+	 *      and feeding in the LAContext into that query by using
+	 *	kSecUseAUthenticationContext.  That actually happens later
+	 *	in add_identity().  See comments in localauth.m for more
+	 *	information.  The persistent ref ends up in the dictionary
+	 *	under the kSecValuePersistentRef.
+	 * kSecReturnAttributes = kCFBooleanTrue
+	 *	This means we return all of the attributes for each identity.
+	 *	We can use this to get access to things like the label
+	 *	for the identity.
+	 *
+	 * Because we ask for all of the Attributes using kSecReturnAttributes
+	 * the return value is a CFDictionaryRef containing all of the
+	 * various attributes.  If we get more than one identity back, then
+	 * we will get a CFArrayRef, with each entry in the array containing
+	 * the CFDictionaryRef for that attribute.
+	 *
+	 * Whew.
+	 */
+
+	const void *keys[] = {
+		kSecClass,
+		kSecMatchLimit,
+		kSecAttrAccessGroup,
+		kSecReturnPersistentRef,
+		kSecReturnAttributes,
+	};
+	const void *values[] = {
+		kSecClassIdentity,		/* kSecClass */
+		kSecMatchLimitAll,		/* kSecMatchLimit */
+		kSecAttrAccessGroupToken,	/* kSecAttrAccessGroup */
+		kCFBooleanTrue,			/* kSecReturnPersistentRef */
+		kCFBooleanTrue,			/* kSecReturnAttributes */
+	};
+
+	os_log_debug(logsys, "Performing identity scan");
+
+	/*
+	 * Create the query dictionary for SecCopyItemMatching(); see above
+	 */
+
+	query = CFDictionaryCreate(NULL, keys, values,
+				   sizeof(keys)/sizeof(keys[0]),
+				   &kCFTypeDictionaryKeyCallBacks,
+				   &kCFTypeDictionaryValueCallBacks);
+
+	if (query == NULL) {
+		os_log_debug(logsys, "query dictionary creation returned NULL");
+		return -1;
+	}
+
+	/*
+	 * This is where the actual query happens
+	 */
+
+	start = TRACE_NOW();
+	pstart = prof_now();
+	ret = secitem_copy_matching(query, &result);
+	PROF_RECORD(SecItemCopyMatching, pstart, ret);
+	TRACE_SPAN(TRACE_SecItemCopyMatching, start, TOKEN_SLOT, ret);
+
+	CFRelease(query);
+
+	/*
+	 * It turns out that to detect card insertions/removals, we need
+	 * to change things a bit (we used to scan for identities only once).
+	 * So here's what we do now; perform the following tests:
+	 *
+	 * Do we have the same number of identities?
+	 * Do we have the same public key hashes?
+	 *
+	 * If this is all the same, then we return.  Otherwise we perform
+	 * a full rescan.
+	 */
+
+	if (ret) {
+		/*
+		 * Handle the case where we just don't see any matching
+		 * results.
+		 */
+
+		if (ret == errSecItemNotFound) {
+			os_log_debug(logsys, "No identities found");
+
+			id_list_init = true;
+
+			/*
+			 * If this is the same as before?  If so, then
+			 * just return here
+			 */
+
+			if (id_list_count == 0) {
+				return 0;
+			} else {
+				os_log_debug(logsys, "We now have no "
+					     "identities (previously had %u)",
+					     id_list_count);
+				count = 0;
+				goto rebuild;
+			}
+		} else {
+			LOG_SEC_ERR("SecItemCopyMatching failed: "
+				    "%{public}@", ret);
+			return -1;
+		}
+	}
+
+	/*
+	 * Check to see if we have the same number of entries
+	 * and the same public key hashes.
+	 *
+	 * Because right now we compare each entry in order to
+	 * the corresponding entry in id_list, we will trigger a
+	 * rescan if the identity order varies; as far as I can
+	 * tell this doesn't happen, but we'll need to fix that
+	 * in the future if it does.
+	 */
+
+	count = cflistcount(result);
+
+	if (count != id_list_count) {
+		os_log_debug(logsys, "We have %u identities, previously we "
+			     "had %u", count, id_list_count);
+		goto rebuild;
+	}
+
+	for (i = 0; i < count; i++) {
+		CFDictionaryRef dict;
+		CFDataRef data;
+
+		dict = cfgetindex(result, i);
+
+		if (CFDictionaryGetValueIfPresent(dict, kSecAttrPublicKeyHash,
+						  (const void **) &data)) {
+			if (!CFEqual(data, id_list[i].pkeyhash)) {
+				os_log_debug(logsys, "public key hash for "
+					     "identity %u differs", i + 1);
+				goto rebuild;
+			}
+		}
+	}
+
+	os_log_debug(logsys, "Identity inventory unchanged");
+
+	/*
+	 * If we are a child process then our identities are the same as
+	 * our parent's but our references to them are useless; get new
+	 * ones, but keep the object tree we inherited.
+	 */
+
+	if (id_refs_stale) {
+		os_log_debug(logsys, "Refreshing identity references after "
+			     "fork");
+
+		id_list_forget();
+
+		if (lacontext == NULL)
+			lacontext = lacontext_new();
+
+		for (i = 0; i < count; i++) {
+			if (add_identity(cfgetindex(result, i))) {
+				obj_free(&id_obj_list, &id_obj_count,
+					 &id_obj_size);
+				id_list_free();
+				id_list_changed();
+				ret = -1;
+				goto out;
+			}
+		}
+
+		id_list_changed();
+	}
+
+	goto out;
+
+	/*
+	 * Clear out all previous identity entries and object tree
+	 */
+
+rebuild:
+	os_log_debug(logsys, "Rebuilding identity list and object tree");
+
+	id_list_generation++;
+
+	obj_free(&id_obj_list, &id_obj_count, &id_obj_size);
+	id_list_free();
+
+	if (lacontext != NULL)
+		lacontext_free(lacontext);
+
+	lacontext = lacontext_new();
+
+	os_log_debug(logsys, "%u identities found", count);
+
+	for (i = 0; i < count; i++)  {
+		os_log_debug(logsys, "Copying identity %u", i + 1);
+
+		if (add_identity(cfgetindex(result, i))) {
+			ret = -1;
+			id_list_changed();
+			goto out;
+		}
+	}
+
+	id_list_changed();
+
+	/*
+	 * Rebuild our object tree since we've finished the identity scan
+	 */
+
+	start = TRACE_NOW();
+	phase = prof_enter(KEYCHAIN_PHASE_OBJECT_BUILD);
+	if (! shared_catalog || ! shared_id_import()) {
+		build_id_objects(0);
+		if (shared_catalog)
+			shared_publish(SHM_CATALOG_TOKEN);
+	}
+	prof_leave(phase);
+	TRACE_SPAN(TRACE_build_id_objects, start, TOKEN_SLOT, 0);
+
+	id_list_init = true;
+
+out:
+	if (result)
+		CFRelease(result);
+	return ret;
+}
+
+/*
+ * Add an identity to our identity list.  Takes a CFDictionaryRef with
+ * all of the identity attributes (and persistent reference) in it.
+ */
+
+static int
+add_identity(CFDictionaryRef dict)
+{
+	CFStringRef label;
+	CFNumberRef keytype;
+	CFTypeRef refresult;
+	CFDictionaryRef refquery, keydict;
+	CFDataRef p_ref;
+	CFIndex numitems;
+	OSStatus ret;
+	int i = id_list_count;
+	uint64_t start, pstart;
+
+	/*
+	 * Our query dictionary for SecItemCopyMatching.  Here are the
+	 * components of our query dictionary:
+	 *
+	 * kSecClass = kSecClassIdentity
+	 *	See scan_identities() for more details, but this limits us to
+	 *	only retrieving identities.
+	 * kSecMatchLimit = kSecMatchLimitOne
+	 *	Because we're using the persistent reference (see below)
+	 *	we really only want one response (and we should only get one)
+	 *	so set the match limit to one so we only get back a single
+	 *	response.
+	 * kSecReturnRef = kCFBooleanTrue
+	 *	We set this to indicate that we want an identity reference
+	 *	back (SecIdentityRef); this should be the only thing returned
+	 *	because we set no other return keys and we are requesting
+	 *	only one.
+	 * kSecUseAuthenticationContext = LAContext
+	 *	This is covered in more detail in localauth.m, but the idea
+	 *	here is this is a Local Authentication context created by
+	 *	the LAContext class.  When converting from a persistent ref
+	 *	to a SecIdentityRef and an auth context is passed in via
+	 *	kSecUseAuthenticationContext, it is converted by the Security
+	 *	framework internally to an ACM context and we can then later
+	 *	use the LAContext methods to authentication to the token.
+	 * kSecValuePersistentRef = persistent reference
+	 *	This is the persistent reference generated in the attribute
+	 *	dictionary when we did the search for all identities in
+	 *	scan_identities().  The reason we get a persistent reference
+	 *	in scan_identities() and then convert it to a "real" reference
+	 *	(e.g., SecIdentityRef) is so we can bind the LAContext
+	 *	to the identity so we have the ability to input the PIN
+	 *	via the PKCS#11 API (rather than let the Security framework
+	 *	ask for it).  It is worth noting that there is ALSO an
+	 *	attribute key called "kSecAttrPersistentReference"; as far
+	 *	as I can tell, that key is not used for anything.  The
+	 *	Apple documentation says to convert a persistent reference
+	 *	to a normal reference you should pass in the persistent
+	 *	reference in a CFArray using the kSecMatchItemList, but
+	 *	I can definitely say that at least for me, this did not work.
+	 */
+
+	const void *keys[] = {
+		kSecClass,
+		kSecMatchLimit,
+		kSecReturnRef,
+		kSecValuePersistentRef,
+#define P_REF_INDEX	3
+		kSecUseAuthenticationContext,
+#define AUTHC_INDEX	4
+	};
+
+	const void *values[] = {
+		kSecClassIdentity,		/* kSecClass */
+		kSecMatchLimitOne,		/* kSecMatchLimit */
+		kCFBooleanTrue,			/* kSecReturnRef */
+		NULL,				/* PersistentReference */
+		NULL,				/* UseAuthtenticationContext */
+	};
+
+	/*
+	 * Just in case ...
+	 */
+
+	if (dict == NULL) {
+		os_log_debug(logsys, "Identity dictionary is NULL, returning!");
+		return -1;
+	}
+
+	/*
+	 * If we don't have enough id entries, allocate some more.
+	 */
+
+	if (++id_list_count > id_list_size) {
+		id_list_size += 5;
+		id_list = realloc(id_list, sizeof(*id_list) * id_list_size);
+	}
+
+	id_list[i].ident = NULL;
+	id_list[i].cert = NULL;
+	id_list[i].privkey = NULL;
+	id_list[i].pubkey = NULL;
+	id_list[i].label = NULL;
+	id_list[i].secaccess = NULL;
+	id_list[i].pkeyhash = NULL;
+	id_list[i].blocksize = 0;
+	id_list[i].keybits = 0;
+	id_list[i].mechflags = NULL;
+
+	if (! CFDictionaryGetValueIfPresent(dict, kSecValuePersistentRef,
+					    (const void **)&p_ref)) {
+		os_log_debug(logsys, "Persistent id reference not found");
+		return -1;
+	}
+
+	/*
+	 * Use our shared LAContext and feed it into the query using the
+	 * kSecUseAuthenticationContext key.  We also feed in the persistent
+	 * reference to extract the REAL identity reference (SecIdentityRef).
+	 * This will attach the LAContext to the identity.
+	 */
+
+	values[P_REF_INDEX] = p_ref;
+	values[AUTHC_INDEX] = lacontext;
+
+	/*
+	 * It turns out that in some cases (if you are running under
+	 * 32 bit mode, for example), you won't be able to allocate a
+	 * lacontext.  So if that happens we need to be sure not to
+	 * put the lacontext into our dictionary.  We can't use kCFNull
+	 * because that will cause the SecItemCopyMatching call later
+	 * to fail; just make sure the lacontext is at the end and if
+	 * if lacontext is NULL just subtract one from the dictionary
+	 * item count.
+	 */
+
+	numitems = sizeof(keys)/sizeof(keys[0]) - (lacontext ? 0 : 1);
+
+	refquery = CFDictionaryCreate(NULL, keys, values, numitems,
+				      &kCFTypeDictionaryKeyCallBacks,
+				      &kCFTypeDictionaryValueCallBacks);
+
+	if (refquery == NULL) {
+		os_log_debug(logsys, "Persistent ref query dictionary "
+			     "creation returned NULL");
+		return -1;
+	}
+
+	start = TRACE_NOW();
+	pstart = prof_now();
+	ret = secitem_copy_matching(refquery, &refresult);
+	PROF_RECORD(SecItemCopyMatching, pstart, ret);
+	TRACE_SPAN(TRACE_SecItemCopyMatching, start, TOKEN_SLOT, ret);
+
+	CFRelease(refquery);
+
+	if (ret) {
+		LOG_SEC_ERR("Persistent ref SecItemCopyMatching "
+			    "failed: %{public}@", ret);
+		return -1;
+	}
+
+	if (CFGetTypeID(refresult) != SecIdentityGetTypeID()) {
+		logtype("Was expecting a SecIdentityRef, but got", refresult);
+		CFRelease(refresult);
+		return -1;
+	}
+
+	/*
+	 * No need to retain; we own this as a result of it coming out of
+	 * SecItemCopyMatching
+	 */
+
+	id_list[i].ident = (SecIdentityRef) refresult;
+
+	/*
+	 * Extract out of the dictionary all of the things we need.
+	 * Note that since we are following the "Get Rule" and this
+	 * dictionary should be de-allocated soon, we need to CFRetain()
+	 * everything we want for later.
+	 *
+	 * Key items:
+	 *
+	 * Attribute label (display string for the identity)
+	 * SecIdentityRef (used by Security Framework)
+	 * Various attribute flags (we use those for returning
+	 * object information)
+	 *
+	 * To make things easier, we extract the private key object
+	 * and the certificate from the identity.  Those are copies and
+	 * we don't need to retain those objects.
+	 */
+
+	if (CFDictionaryGetValueIfPresent(dict, kSecAttrLabel,
+					  (const void **) &label)) {
+		id_list[i].label = getstrcopy(label);
+		os_log_debug(logsys, "Identity label: %{public}@", label);
+	} else {
+		id_list[i].label = strdup("Hardware token");
+		os_log_debug(logsys, "No label, using default");
+	}
+	
+#if 0
+	if (! CFDictionaryGetValueIfPresent(dict, kSecValueRef,
+					    (const void **)&id_list[i].ident)) {
+		os_log_debug(logsys, "Identity reference not found");
+		return -1;
+	}
+
+	CFRetain(id_list[i].ident);
+#endif
+
+#if 0
+	if (! CFDictionaryGetValueIfPresent(dict, kSecAttrAccessControl,
+				    (const void **) &id_list[i].secaccess)) {
+		os_log_debug(logsys, "Access Control object not found");
+		return -1;
+	}
+
+	CFRetain(id_list[i].secaccess);
+#endif
+
+	if (! CFDictionaryGetValueIfPresent(dict, kSecAttrKeyType,
+					    (const void **) &keytype)) {
+		os_log_debug(logsys, "Key type not found");
+		return -1;
+	}
+
+	id_list[i].keytype = convert_keytype(keytype);
+
+	if (! CFDictionaryGetValueIfPresent(dict, kSecAttrPublicKeyHash,
+					    (const void **)
+							&id_list[i].pkeyhash)) {
+		os_log_debug(logsys, "Public key hash not found");
+		return -1;
+	}
+
+	CFRetain(id_list[i].pkeyhash);
+
+	id_list[i].privcansign = boolfromdict("Can-Sign", dict,
+					      kSecAttrCanSign);
+	id_list[i].privcandecrypt = boolfromdict("Can-Decrypt", dict,
+						 kSecAttrCanDecrypt);
+
+	pstart = prof_now();
+	ret = SecIdentityCopyCertificate(id_list[i].ident, &id_list[i].cert);
+	PROF_RECORD(SecIdentityCopyCertificate, pstart, ret);
+
+	if (ret)
+		LOG_SEC_ERR("CopyCertificate failed: %{public}@", ret);
+
+	if (! ret) {
+		pstart = prof_now();
+		ret = SecIdentityCopyPrivateKey(id_list[i].ident,
+						&id_list[i].privkey);
+		PROF_RECORD(SecIdentityCopyPrivateKey, pstart, ret);
+		if (ret)
+			LOG_SEC_ERR("CopyPrivateKey failed: %{public}@", ret);
+		else {
+			if (! (id_list[i].secaccess =
+					getaccesscontrol(dict)))
+				return -1;
+		}
+	}
+
+	if ( !ret) {
+		pstart = prof_now();
+		ret = SecCertificateCopyPublicKey(id_list[i].cert,
+						  &id_list[i].pubkey);
+		PROF_RECORD(SecCertificateCopyPublicKey, pstart, ret);
+		if (ret)
+			LOG_SEC_ERR("CopyPublicKey failed: %{public}@", ret);
+	}
+
+	/*
+	 * Get our public key attributes
+	 */
+
+	if (! ret) {
+		CFNumberRef keybits;
+
+		pstart = prof_now();
 		keydict = SecKeyCopyAttributes(id_list[i].pubkey);
+		PROF_RECORD(SecKeyCopyAttributes, pstart,
+			    keydict ? 0 : PROF_FAILED);
+
+		id_list[i].blocksize = SecKeyGetBlockSize(id_list[i].pubkey);
+
+		if (CFDictionaryGetValueIfPresent(keydict, kSecAttrKeySizeInBits,
+						  (const void **) &keybits))
+			CFNumberGetValue(keybits, kCFNumberLongType,
+					 &id_list[i].keybits);
+
+		if (! id_list[i].keybits)
+			id_list[i].keybits = id_list[i].blocksize * 8;
+
+		id_list[i].pubcanverify = boolfromdict("Can-Verify", keydict,
+						        kSecAttrCanVerify);
+		id_list[i].pubcanencrypt = boolfromdict("Can-Encrypt", keydict,
+							kSecAttrCanEncrypt);
+		id_list[i].pubcanwrap = boolfromdict("Can-Wrap", keydict,
+						     kSecAttrCanWrap);
+		/*
+		 * We're going to cheat here JUST a bit.  It turns out
+		 * if a public key is set to allow wrapping, it can also
+		 * do generic encryption.  So if we have wrapping set, also
+		 * set encryption.
+		 */
+
+		if (id_list[i].pubcanwrap)
+			id_list[i].pubcanencrypt = true;
+
+		CFRelease(keydict);
+
+		id_mechs_get(&id_list[i]);
+	}
+
+	if (ret)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Work out which of our mechanisms an identity's keys support, using
+ * SecKeyIsAlgorithmSupported().  As far as I can tell this only looks at
+ * the key's algorithm and token capabilities, and doesn't need to do a
+ * key operation, so it doesn't prompt for a PIN.  Mechanisms that are
+ * outside of the key size range in keychain_mechmap are left out.
+ */
+
+static void
+id_mechs_get(struct id_info *id)
+{
+	unsigned int i;
+	struct mechanism_map *m;
+	CK_FLAGS f;
+
+	id->mechflags = calloc(keychain_mechmap_size, sizeof(CK_FLAGS));
+
+	for (i = 0; i < keychain_mechmap_size; i++) {
+		m = &keychain_mechmap[i];
+		f = 0;
+
+		if (id->keybits < m->min_keylen || id->keybits > m->max_keylen)
+			continue;
+
+		if ((m->usage_flags & CKF_SIGN) && m->sec_signmech &&
+		    id->privkey &&
+		    key_supports(id->privkey, kSecKeyOperationTypeSign,
+				 *m->sec_signmech))
+			f |= CKF_SIGN;
+		if ((m->usage_flags & CKF_VERIFY) && m->sec_signmech &&
+		    id->pubkey &&
+		    key_supports(id->pubkey, kSecKeyOperationTypeVerify,
+				 *m->sec_signmech))
+			f |= CKF_VERIFY;
+		if ((m->usage_flags & CKF_ENCRYPT) && m->sec_encmech &&
+		    id->pubkey &&
+		    key_supports(id->pubkey, kSecKeyOperationTypeEncrypt,
+				 *m->sec_encmech))
+			f |= CKF_ENCRYPT;
+		if ((m->usage_flags & CKF_DECRYPT) && m->sec_encmech &&
+		    id->privkey &&
+		    key_supports(id->privkey, kSecKeyOperationTypeDecrypt,
+				 *m->sec_encmech))
+			f |= CKF_DECRYPT;
+
+		id->mechflags[i] = f;
+
+		os_log_debug(logsys, "Identity \"%{public}s\" %s: %#lx",
+			     id->label, getCKMName(m->cki_mech), f);
+	}
+}
+
+/*
+ * SecKeyIsAlgorithmSupported(), with a probe around it
+ */
+
+static bool
+key_supports(SecKeyRef key, SecKeyOperationType op, SecKeyAlgorithm alg)
+{
+	uint64_t pstart = prof_now();
+	bool ret = SecKeyIsAlgorithmSupported(key, op, alg);
+
+	PROF_RECORD(SecKeyIsAlgorithmSupported, pstart, 0);
+
+	return ret;
+}
+
+/*
+ * When we don't have any key references (we got our identities from the
+ * broker) guess at the mechanisms from the key's capability flags and
+ * size; the broker checks them for real when it does the operation.
+ */
+
+static void
+id_mechs_fallback(struct id_info *id)
+{
+	unsigned int i;
+	struct mechanism_map *m;
+	CK_FLAGS caps = 0;
+
+	if (id->keytype != CKK_RSA)
+		return;
+
+	caps |= id->privcansign ? CKF_SIGN : 0;
+	caps |= id->pubcanverify ? CKF_VERIFY : 0;
+	caps |= id->pubcanencrypt ? CKF_ENCRYPT : 0;
+	caps |= id->privcandecrypt ? CKF_DECRYPT : 0;
+
+	id->keybits = id->blocksize * 8;
+	id->mechflags = calloc(keychain_mechmap_size, sizeof(CK_FLAGS));
+
+	for (i = 0; i < keychain_mechmap_size; i++) {
+		m = &keychain_mechmap[i];
+		if (id->keybits >= m->min_keylen &&
+		    id->keybits <= m->max_keylen)
+			id->mechflags[i] = m->usage_flags & caps;
+	}
+}
+
+/*
+ * Build the token slot mechanism information from the mechanisms each
+ * of our keys support.  Call with id_mutex locked whenever the identity
+ * list changes.
+ */
+
+static void
+build_mech_list(void)
+{
+	unsigned int i, j;
+	CK_MECHANISM_INFO *mi;
+	CK_FLAGS f;
+
+	mech_list_free();
+
+	token_mechinfo = calloc(keychain_mechmap_size,
+				sizeof(*token_mechinfo));
+	token_mechlist = calloc(keychain_mechmap_size,
+				sizeof(*token_mechlist));
+
+	for (i = 0; i < id_list_count; i++) {
+		if (! id_list[i].mechflags)
+			continue;
+		for (j = 0; j < keychain_mechmap_size; j++) {
+			if (! (f = id_list[i].mechflags[j]))
+				continue;
+			mi = &token_mechinfo[j];
+			if (! mi->flags ||
+			    id_list[i].keybits < mi->ulMinKeySize)
+				mi->ulMinKeySize = id_list[i].keybits;
+			if (id_list[i].keybits > mi->ulMaxKeySize)
+				mi->ulMaxKeySize = id_list[i].keybits;
+			mi->flags |= f | (keychain_mechmap[j].usage_flags &
+					  CKF_HW);
+		}
+	}
+
+	for (j = 0; j < keychain_mechmap_size; j++)
+		if (token_mechinfo[j].flags)
+			token_mechlist[token_mechcount++] =
+					keychain_mechmap[j].cki_mech;
+
+	os_log_debug(logsys, "Token slot supports %u mechanism%s",
+		     token_mechcount, token_mechcount == 1 ? "" : "s");
+}
+
+static void
+mech_list_free(void)
+{
+	free(token_mechinfo);
+	free(token_mechlist);
+	token_mechinfo = NULL;
+	token_mechlist = NULL;
+	token_mechcount = 0;
+}
+
+/*
+ * Called (with id_mutex locked) whenever our identity list changes, to
+ * rebuild everything that we derive from it.
+ */
+
+static void
+id_list_changed(void)
+{
+	build_mech_list();
+	slot_info_publish();
+	vcache_flush();
+	circuit_reset(&token_circuit);
+	prewarm_start();
+}
+
+/*
+ * Build a new snapshot of our slot and token information and publish it.
+ * Most of this is fabricated; we can't really get any useful information
+ * out of the Security framework about the "slot" (the reader) and a lot
+ * of the token information deals with things we don't support.  Call
+ * with id_mutex locked.  If we can't allocate a new snapshot we keep
+ * the old one.
+ */
+
+static void
+slot_info_publish(void)
+{
+	struct slot_snapshot *snap = calloc(1, sizeof(*snap)), *old;
+	CK_SLOT_INFO *si;
+	CK_TOKEN_INFO *ti;
+	CFStringRef summary = NULL;
+	char *label;
+	int i;
+
+	if (! snap) {
+		os_log_debug(logsys, "Unable to allocate slot information, "
+			     "keeping the old one");
+		return;
+	}
+
+	for (i = 0; i < 2; i++) {
+		si = &snap->slot_info[i];
+		ti = &snap->token_info[i];
+
+		sprintfpad(si->manufacturerID, sizeof(si->manufacturerID),
+			   "%s", "U.S. Naval Research Lab");
+		si->hardwareVersion.major = 1;
+		si->hardwareVersion.minor = 0;
+		si->firmwareVersion.major = 1;
+		si->firmwareVersion.minor = 0;
+
+		/*
+		 * We can't do any administrative operations, really, from
+		 * the Security framework, so basically make it so the token
+		 * is read/only.
+		 */
+
+		ti->flags = CKF_WRITE_PROTECTED | CKF_USER_PIN_INITIALIZED |
+			    CKF_TOKEN_INITIALIZED;
+
+		sprintfpad(ti->manufacturerID, sizeof(ti->manufacturerID),
+			   "%s", "Unknown Manufacturer");
+		sprintfpad(ti->model, sizeof(ti->model), "%s",
+			   "Unknown Model");
+		sprintfpad(ti->serialNumber, sizeof(ti->serialNumber),
+			   "%s", "000001");
+
+		ti->ulMaxSessionCount = CK_EFFECTIVELY_INFINITE;
+		ti->ulMaxRwSessionCount = 0;
+		ti->ulMaxPinLen = 255;
+		ti->ulMinPinLen = 1;
+		ti->ulTotalPublicMemory = CK_UNAVAILABLE_INFORMATION;
+		ti->ulFreePublicMemory = CK_UNAVAILABLE_INFORMATION;
+		ti->ulTotalPrivateMemory = CK_UNAVAILABLE_INFORMATION;
+		ti->ulFreePrivateMemory = CK_UNAVAILABLE_INFORMATION;
+		ti->hardwareVersion.major = 1;
+		ti->hardwareVersion.minor = 0;
+		ti->firmwareVersion.major = 1;
+		ti->firmwareVersion.minor = 0;
+		sprintfpad(ti->utcTime, sizeof(ti->utcTime), "%s",
+			   "1970010100000000");
+	}
+
+	/*
+	 * The token slot.  The one valid thing in the slot information
+	 * is the CKF_TOKEN_PRESENT flag if we have a token inserted or not.
+	 */
+
+	si = &snap->slot_info[TOKEN_SLOT - 1];
+	ti = &snap->token_info[TOKEN_SLOT - 1];
+
+	sprintfpad(si->slotDescription, sizeof(si->slotDescription), "%s",
+		   id_list_count > 0 ? id_list[0].label :
+				"Keychain PKCS#11 Bridge Library Virtual Slot");
+	si->flags = CKF_HW_SLOT | CKF_REMOVABLE_DEVICE;
+	if (id_list_count > 0)
+		si->flags |= CKF_TOKEN_PRESENT;
+
+	/*
+	 * Since the token label is used in a number of places to display
+	 * to the user, make it something useful.  Pick the first
+	 * certificate found (if available) and return the subject
+	 * summary as the token label.  If we're using the broker we
+	 * don't have a certificate reference, but the broker gave us
+	 * the label.
+	 */
+
+	if (use_broker && broker_label && *broker_label) {
+		label = strdup(broker_label);
+	} else if (! use_broker && id_list_count > 0 &&
+		   (summary = SecCertificateCopySubjectSummary(
+							id_list[0].cert))) {
+		label = getstrcopy(summary);
+	} else {
+		label = strdup("Unknown Keychain Token");
+	}
+
+	sprintfpad(ti->label, sizeof(ti->label), "%s", label);
+
+	free(label);
+	if (summary)
+		CFRelease(summary);
+
+	ti->flags |= CKF_LOGIN_REQUIRED;
+
+	/*
+	 * If we were set to to NOT ask for a PIN in C_Login (see
+	 * the function C_Initialize for more info) then set the flag
+	 * CKF_PROTECTED_AUTHENTICATION_PATH.
+	 */
+
+	if (! ask_pin)
+		ti->flags |= CKF_PROTECTED_AUTHENTICATION_PATH;
+
+	/*
+	 * The certificate slot; CKF_TOKEN_PRESENT gets added when we copy
+	 * this if the certificate scan is done.
+	 */
+
+	si = &snap->slot_info[CERTIFICATE_SLOT - 1];
+	ti = &snap->token_info[CERTIFICATE_SLOT - 1];
+
+	sprintfpad(si->slotDescription, sizeof(si->slotDescription), "%s",
+		   "Keychain Certificates");
+	si->flags = CKF_REMOVABLE_DEVICE;
+
+	sprintfpad(ti->label, sizeof(ti->label), "%s",
+		   "Keychain Certificates");
+
+	os_log_debug(logsys, "Published slot information, token label "
+		     "\"%{public}.32s\"",
+		     snap->token_info[TOKEN_SLOT - 1].label);
+
+	/*
+	 * Anyone who starts reading after the exchange gets the new
+	 * snapshot, so if nobody is reading once it's done, nobody can
+	 * be looking at a retired one.
+	 */
+
+	if ((old = atomic_exchange(&slot_snap, snap))) {
+		old->prev = slot_retired;
+		slot_retired = old;
+	}
+
+	if (atomic_load(&slot_readers) == 0) {
+		for (old = slot_retired; old; old = snap) {
+			snap = old->prev;
+			free(old);
+		}
+		slot_retired = NULL;
+	}
+}
+
+/*
+ * Get the current snapshot for reading (which may be NULL), and say
+ * we're done with it.  Every call to slot_snap_hold() must be matched
+ * by a call to slot_snap_release().
+ */
+
+static struct slot_snapshot *
+slot_snap_hold(void)
+{
+	atomic_fetch_add(&slot_readers, 1);
+	return atomic_load(&slot_snap);
+}
+
+static void
+slot_snap_release(void)
+{
+	atomic_fetch_sub(&slot_readers, 1);
+}
+
+/*
+ * Free all of our slot information snapshots.  Only C_Finalize() calls
+ * this, and no other thread may be calling into us by then.
+ */
+
+static void
+slot_info_free(void)
+{
+	struct slot_snapshot *snap, *prev;
+
+	free(atomic_exchange(&slot_snap, NULL));
+
+	for (snap = slot_retired; snap; snap = prev) {
+		prev = snap->prev;
+		free(snap);
+	}
+
+	slot_retired = NULL;
+}
+
+/*
+ * Check to see if an identity's key can be used with a mechanism (given
+ * as an index into keychain_mechmap) for a particular operation.  Call
+ * with id_mutex locked.
+ */
+
+static CK_RV
+id_mech_check(unsigned int id, int mech, CK_FLAGS usage)
+{
+	if (mech < 0) {
+		os_log_debug(logsys, "Mechanism is not supported");
+		return CKR_MECHANISM_INVALID;
+	}
+
+	if (id_list[id].keybits &&
+	    (id_list[id].keybits < keychain_mechmap[mech].min_keylen ||
+	     id_list[id].keybits > keychain_mechmap[mech].max_keylen)) {
+		os_log_debug(logsys, "Key size %lu is out of range for %s",
+			     id_list[id].keybits,
+			     getCKMName(keychain_mechmap[mech].cki_mech));
+		return CKR_KEY_SIZE_RANGE;
+	}
+
+	if (! id_list[id].mechflags ||
+	    ! (id_list[id].mechflags[mech] & usage)) {
+		os_log_debug(logsys, "Key does not support %s for this "
+			     "operation", getCKMName(
+				     keychain_mechmap[mech].cki_mech));
+		return CKR_KEY_TYPE_INCONSISTENT;
+	}
+
+	return CKR_OK;
+}
+
+/*
+ * Mark that we have a certificate scan running and start it; if one
+ * is running then don't start another.
+ *
+ * Applications that cycle C_Finalize()/C_Initialize() (module probes,
+ * mostly) can come back while the scan from the last round is still
+ * running.  C_Finalize() asked that scan to stop, but if it is looking
+ * for the same certificates we just take it back instead of starting
+ * over.  If it isn't, we let it notice that it was cancelled and queue
+ * up a new one behind it.
+ *
+ * If we got the certificate slot from the broker then
+ * it's already marked as initialized and we skip this.
+ * If someone else recently published the certificate slot
+ * we just copy it and skip the scan.
+ */
+
+static void
+start_cert_scan(void)
+{
+	enum certstate status = uninitialized;
+	struct cert_scan *job;
+	char **certs;
+
+	certs = prefkey_arrayget("certificateList", default_cert_search);
+
+	pthread_mutex_lock(&cert_scan_mutex);
+
+	if (! atomic_compare_exchange_strong(&cert_list_status, &status,
+					     initializing)) {
+		if (status == initialized)
+			goto out;
+
+		if (cert_scan_current &&
+		    array_equal(cert_scan_current->match, certs)) {
+			os_log_debug(logsys, "Adopting certificate scan "
+				     "%llu already in progress",
+				     cert_scan_current->gen);
+			atomic_store(&cert_scan_want, cert_scan_current->gen);
+			goto out;
+		}
+
+		os_log_debug(logsys, "Certificate scan in progress does not "
+			     "match our certificate list, starting over");
+	} else if (shared_catalog && shared_cert_import(certs)) {
+		atomic_store(&cert_list_status, initialized);
+		goto out;
+	}
+
+	/*
+	 * If we can't start a scan, put things back the way we found
+	 * them so the next C_Initialize() can try again.  If we were
+	 * starting over, the scan we meant to replace still owns the
+	 * status and sets it when it finishes or is cancelled.
+	 */
+
+	if (! (job = malloc(sizeof(*job)))) {
+		if (status == uninitialized)
+			atomic_store(&cert_list_status, uninitialized);
+		goto out;
+	}
+
+	job->gen = ++cert_scan_gen;
+	job->match = certs;
+	job->cancelled = false;
+	job->stamp = 0;
+	certs = NULL;
+
+	cert_scan_current = job;
+	atomic_store(&cert_scan_want, job->gen);
+
+	if (! cert_scan_group)
+		cert_scan_group = dispatch_group_create();
+
+	dispatch_group_async_f(cert_scan_group, dispatch_get_global_queue(
+				DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+			       job, background_cert_scan);
+
+out:
+	pthread_mutex_unlock(&cert_scan_mutex);
+
+	if (certs)
+		array_free(certs);
+}
+
+/*
+ * This function is called by the dispatch system and will call
+ * scan_certificates() and build_cert_objects() and the appropriate
+ * memory barrier functions.  If we get cancelled along the way, free
+ * whatever we built; unless there is a newer scan waiting to run, the
+ * certificate slot goes back to uninitialized.
+ */
+
+static void
+background_cert_scan(void *arg)
+{
+	struct cert_scan *job = arg;
+	uint64_t start;
+	bool done = false;
+	int phase;
+
+	pthread_mutex_lock(&cert_scan_serial);
+
+	/*
+	 * Take the Keychain stamp before we look, so anything that changes
+	 * while we're scanning makes our catalog look out of date.
+	 */
+
+	if (shared_catalog)
+		job->stamp = shm_keychain_stamp(job->match);
+
+	start = TRACE_NOW();
+	phase = prof_enter(KEYCHAIN_PHASE_CERT_SCAN);
+	if (scan_certificates(job) != 0)
+		goto cancel;
+	TRACE_SPAN(TRACE_scan_certificates, start, CERTIFICATE_SLOT, 0);
+
+	start = TRACE_NOW();
+	prof_enter(KEYCHAIN_PHASE_OBJECT_BUILD);
+	if (build_cert_objects(job) != 0)
+		goto cancel;
+	TRACE_SPAN(TRACE_build_cert_objects, start, CERTIFICATE_SLOT, 0);
+
+	pthread_mutex_lock(&cert_scan_mutex);
+	if (atomic_load(&cert_scan_want) == job->gen) {
+		atomic_store(&cert_list_status, initialized);
+		done = true;
+	}
+	if (cert_scan_current == job)
+		cert_scan_current = NULL;
+	pthread_mutex_unlock(&cert_scan_mutex);
+
+	if (done) {
+		atomic_store(&cert_list_stamp, job->stamp);
+		if (shared_catalog)
+			shared_publish(SHM_CATALOG_CERTS);
+		goto out;
+	}
+
+cancel:
+	os_log_debug(logsys, "Certificate scan %llu cancelled", job->gen);
+
+	obj_free(&cert_obj_list, &cert_obj_count, &cert_obj_size);
+	cert_list_free();
+
+	pthread_mutex_lock(&cert_scan_mutex);
+	if (! cert_scan_current)
+		atomic_store(&cert_list_status, uninitialized);
+	pthread_mutex_unlock(&cert_scan_mutex);
+
+out:
+	prof_leave(phase);
+	pthread_mutex_unlock(&cert_scan_serial);
+
+	array_free(job->match);
+	free(job);
+}
+
+/*
+ * Our cancellation point; returns true if nobody wants this scan anymore.
+ * Once we decide that a scan is cancelled it stays that way, so it can't
+ * be adopted out from under us while it is cleaning up.  The fast path
+ * doesn't take the lock, so it's fine to call this once per certificate.
+ */
+
+static bool
+cert_scan_cancelled(struct cert_scan *job)
+{
+	if (job->cancelled)
+		return true;
+
+	if (atomic_load(&cert_scan_want) == job->gen)
+		return false;
+
+	pthread_mutex_lock(&cert_scan_mutex);
+
+	if (atomic_load(&cert_scan_want) != job->gen) {
+		job->cancelled = true;
+		if (cert_scan_current == job)
+			cert_scan_current = NULL;
+	}
+
+	pthread_mutex_unlock(&cert_scan_mutex);
+
+	return job->cancelled;
+}
+
+/*
+ * Start and stop checking for certificate changes.  Our timer runs on its
+ * own serial queue, so once we have cancelled it, running an empty block
+ * on that queue waits for a refresh in progress to finish.
+ */
+
+static void
+cert_refresh_start(void)
+{
+	if (! cert_refresh_queue)
+		cert_refresh_queue = dispatch_queue_create(
+			"mil.navy.nrl.cmf.pkcs11.certrefresh", NULL);
+
+	cert_refresh_timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER,
+						    0, 0, cert_refresh_queue);
+	dispatch_source_set_timer(cert_refresh_timer,
+				  dispatch_time(DISPATCH_TIME_NOW,
+				      CERT_REFRESH_INTERVAL * NSEC_PER_SEC),
+				  CERT_REFRESH_INTERVAL * NSEC_PER_SEC,
+				  10 * NSEC_PER_SEC);
+	dispatch_source_set_event_handler_f(cert_refresh_timer, cert_refresh);
+	dispatch_resume(cert_refresh_timer);
+}
+
+static void
+cert_refresh_noop(void *dummy)
+{
+}
+
+static void
+cert_refresh_stop(void)
+{
+	if (! cert_refresh_timer)
+		return;
+
+	dispatch_source_cancel(cert_refresh_timer);
+	dispatch_sync_f(cert_refresh_queue, NULL, cert_refresh_noop);
+	dispatch_release(cert_refresh_timer);
+	cert_refresh_timer = NULL;
+}
+
+/*
+ * Scan the Keychain for certificates and add them to our object database
+ *
+ * This uses SecItemCopyMatching, but searches for certificates that
+ * have a subject name that matches one of our match strings.  Once we
+ * find that certificate then we chase down all certificates issued
+ * by that certificate; this means you should only need to list Root CAs
+ * in your match string list.
+ *
+ * Returns -1 if the scan was cancelled, 0 otherwise.
+ */
+
+static int
+scan_certificates(struct cert_scan *job)
+{
+	char **certs = job->match, **p;
+	CFMutableArrayRef cmatch = NULL;
+	CFDictionaryRef query = NULL;
+	CFTypeRef result = NULL;
+	OSStatus ret;
+	unsigned int i, count, *order = NULL;
+	struct certscan_cert *cs = NULL;
+	uint64_t start, pstart;
+	int rv = 0, picked;
+
+	/*
+	 * I tried, at first, to use the built-in searching features
+	 * available in SecItemCopyMatching(), but that turned out to be
+	 * a failure for two reasons:
+	 *
+	 * Matching on the subject name (using kSecMatchSubjectContains)
+	 * SORT-of worked, except if you have a hardware token you will
+	 * get certificates on the hardware token included in the list
+	 * EVEN THOUGH the subject names don't match.
+	 *
+	 * Matching based on issuer (using kSecMatchIssuers) only works
+	 * for IDENTITIES, for some strange reason (really, there is no
+	 * good reason for this that I can tell).
+	 *
+	 * Because SecItemCopyMatching is kind of expensive, what I finally
+	 * decided on was this:
+	 *
+	 * Get a list of ALL certificates.
+	 *
+	 * Index them by issuer (see certscan.h), and walk down from the
+	 * ones that match our list.
+	 *
+	 * Sigh.  Apple, why did you have to make this so hard?
+	 */
+
+	/*
+	 * We need to retrieve all valid certificates from our Keychains.
+	 *
+	 * Our query dictionary:
+	 *
+	 * kSecClass = kSecClassCertificate
+	 *	This means we're searching for certificates only,
+	 *	and we don't need private key objects
+	 * kSecMatchLimit = kSecMatchLimitAll
+	 *	Return all matching certificates
+	 * kSecMatchTrustedOnly = kCFBooleanTrue
+	 *	Only match trusted certificates
+	 * kSecReturnRef = kCFBooleanTrue
+	 *	This means return a reference to the certificate
+	 *	object (a SecCertificateRef).  Because we also use
+	 *	kSecReturnAttributes that means the certificate
+	 *	reference ends up in the attribute dictionary.
+	 * kSecReturnAttributes = kCFBooleanTrue
+	 *	This means we return all of the attributes for each 
+	 *	certificate.
+	 */
+
+	const void *keys[] = { 
+		kSecClass,
+		kSecMatchLimit,
+		kSecMatchTrustedOnly,
+		kSecReturnRef,
+		kSecReturnAttributes,
+	};
+
+	const void *values[] = {
+		kSecClassCertificate,	/* kSecClass */
+		kSecMatchLimitAll,	/* kSecMatchLimit */
+		kCFBooleanTrue,		/* kSecMatchTrustedOnly */
+		kCFBooleanTrue,		/* kSecReturnRef */
+		kCFBooleanTrue,		/* kSecReturnAttributes */
+	};
+
+	/*
+	 * Short circuit the search if "none" is the first entry
+	 */
+
+	if (certs[0] && strcasecmp(certs[0], "none") == 0) {
+		os_log_debug(logsys, "Special entry \"none\" found, not "
+			     "importing Keychain certificates");
+		goto out;
+	}
+
+	cmatch = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+
+	if (! cmatch) {
+		os_log_debug(logsys, "Unable to create match array!");
+		goto out;
+	}
+
+	for (p = certs; *p != NULL; p++) {
+		CFStringRef cm = CFStringCreateWithCString(NULL, *p,
+						   kCFStringEncodingUTF8);
+		CFArrayAppendValue(cmatch, cm);
+		CFRelease(cm);
+	}
+
+	/*
+	 * This shouldn't be 0, but JUST in case ...
+	 */
+
+	if (CFArrayGetCount(cmatch) == 0) {
+		os_log_debug(logsys, "No certificate match strings found, "
+			     "not importing certificates");
+		goto out;
+	}
+
+	/*
+	 * Get a list of all certificates
+	 */
+
+	query = CFDictionaryCreate(NULL, keys, values,
+				   sizeof(keys)/sizeof(keys[0]),
+				   &kCFTypeDictionaryKeyCallBacks,
+				   &kCFTypeDictionaryValueCallBacks);
+
+	if (! query) {
+		os_log_debug(logsys, "Unable to create query "
+			     "dictionary for match string \"%s\"", *p);
+		goto out;
+	}
+
+	if (cert_scan_cancelled(job)) {
+		rv = -1;
+		goto out;
+	}
+
+	os_log_debug(logsys, "About to call SecItemCopyMatching");
+
+	start = TRACE_NOW();
+	pstart = prof_now();
+	ret = secitem_copy_matching(query, &result);
+	PROF_RECORD(SecItemCopyMatching, pstart, ret);
+	TRACE_SPAN(TRACE_SecItemCopyMatching, start, CERTIFICATE_SLOT, ret);
+
+	os_log_debug(logsys, "SecItemCopyMatching finished");
+
+	/*
+	 * If we didn't find ANY certificates at all (really? None?)
+	 * then return.
+	 */
+
+	if (ret) {
+		if (ret == errSecItemNotFound) {
+			os_log_debug(logsys, "No valid certificates found; "
+				     "that doesn't seem right!");
+			goto out;
+		} else {
+			LOG_SEC_ERR("Certificate SecItemCopyMatching "
+				    "failed: %{public}@", ret);
+			goto out;
+		}
+	}
+
+	/*
+	 * That could have taken a while, so see if anyone still wants us
+	 */
+
+	if (cert_scan_cancelled(job)) {
+		rv = -1;
+		goto out;
+	}
+
+	count = cflistcount(result);
+
+	os_log_debug(logsys, "Searching %u certificates", count);
+
+	/*
+	 * Describe every certificate for certscan_select(), which picks
+	 * out the ones we want.  This is a cancellation point for the
+	 * certificate scan; once the scan is cancelled we stop adding
+	 * anything.
+	 */
+
+	cs = calloc(count ? count : 1, sizeof(*cs));
+	order = calloc(count ? count : 1, sizeof(*order));
+
+	if (! cs || ! order) {
+		os_log_debug(logsys, "Unable to allocate certificate list!");
+		goto out;
+	}
+
+	for (i = 0; i < count; i++)
+		cert_describe(cfgetindex(result, i), cmatch, &cs[i]);
+
+	if ((picked = certscan_select(cs, count, order, cert_scan_stop,
+				      job)) < 0) {
+		rv = -1;
+		goto out;
+	}
+
+	if (picked == 0)
+		os_log_debug(logsys, "No matching certificates found");
+
+	for (i = 0; i < picked; i++)
+		add_certificate(cfgetindex(result, order[i]));
+
+	os_log_debug(logsys, "%u certificates added", cert_list_count);
+
+out:
+	free(cs);
+	free(order);
+	if (cmatch)
+		CFRelease(cmatch);
+	if (query)
+		CFRelease(query);
+	if (result)
+		CFRelease(result);
+
+	return rv;
+}
+
+/*
+ * Free our cert_list
+ */
+
+static void
+cert_list_free(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < cert_list_count; i++) {
+		if (cert_list[i].cert)
+			CFRelease(cert_list[i].cert);
+		if (cert_list[i].pkeyhash)
+			CFRelease(cert_list[i].pkeyhash);
+	}
+
+	free(cert_list);
+
+	cert_list = NULL;
+	cert_list_count = cert_list_size = 0;
+}
+
+/*
+ * Fill in what certscan_select() needs to know about a certificate from
+ * its Keychain attributes.  The names point into the dictionary, so it
+ * has to stay around until we're done with them.
+ */
+
+static void
+cert_describe(CFDictionaryRef dict, CFArrayRef cnmatch,
+	      struct certscan_cert *cs)
+{
+	SecCertificateRef cert;
+	CFStringRef val;
+	CFDataRef data;
+
+	memset(cs, 0, sizeof(*cs));
+
+	/*
+	 * We never want hardware tokens in this list, and can't do anything
+	 * with a certificate we don't have a reference for
+	 */
+
+	if ((CFDictionaryGetValueIfPresent(dict, kSecAttrAccessGroup,
+					   (const void **) &val) &&
+	     CFEqual(val, kSecAttrAccessGroupToken)) ||
+	    ! CFDictionaryGetValueIfPresent(dict, kSecValueRef,
+					    (const void **) &cert)) {
+		cs->skip = true;
+		return;
+	}
+
+	if (CFDictionaryGetValueIfPresent(dict, kSecAttrPublicKeyHash,
+					  (const void **) &data)) {
+		cs->keyhash = CFDataGetBytePtr(data);
+		cs->keyhash_len = CFDataGetLength(data);
+	}
+
+	if (CFDictionaryGetValueIfPresent(dict, kSecAttrSubject,
+					  (const void **) &data)) {
+		cs->subject = CFDataGetBytePtr(data);
+		cs->subject_len = CFDataGetLength(data);
+	}
+
+	if (CFDictionaryGetValueIfPresent(dict, kSecAttrIssuer,
+					  (const void **) &data)) {
+		cs->issuer = CFDataGetBytePtr(data);
+		cs->issuer_len = CFDataGetLength(data);
+	}
+
+	cs->root = cn_match(cert, cnmatch);
+}
+
+/*
+ * Return true if the common name of a certificate contains one of our
+ * match strings
+ */
+
+static bool
+cn_match(SecCertificateRef cert, CFArrayRef cnmatch)
+{
+	CFStringRef cn = NULL;
+	unsigned int i, count;
+	OSStatus ret;
+	uint64_t pstart;
+	bool match = false;
+
+	pstart = prof_now();
+	ret = SecCertificateCopyCommonName(cert, &cn);
+	PROF_RECORD(SecCertificateCopyCommonName, pstart, ret);
+
+	if (ret) {
+		LOG_SEC_ERR("CopyCommonName failed: %{public}@", ret);
+		return false;
+	}
+
+	if (! cn) {
+		os_log_debug(logsys, "SecCertificateCopyCommonName "
+			     "returned NULL");
+		return false;
+	}
+
+	count = CFArrayGetCount(cnmatch);
+
+	for (i = 0; i < count && ! match; i++) {
+		CFStringRef str = CFArrayGetValueAtIndex(cnmatch, i);
+
+		match = CFStringFind(cn, str, 0).length > 0;
+	}
+
+	CFRelease(cn);
+
+	return match;
+}
+
+static bool
+cert_scan_stop(void *job)
+{
+	return cert_scan_cancelled(job);
+}
+
+/*
+ * Add a certificate that certscan_select() picked to our internal list
+ * that ends up on the list of trusted certificates we present from our
+ * certificate slot.
+ */
+
+static void
+add_certificate(CFDictionaryRef dict)
+{
+	unsigned int c = cert_list_count;
+
+	if (++cert_list_count > cert_list_size) {
+		cert_list_size = cert_list_size ? cert_list_size * 2 : 64;
+
+		cert_list = realloc(cert_list,
+				    sizeof(*cert_list) * cert_list_size);
+	}
+
+	cert_list[c].cert = (SecCertificateRef)
+			CFRetain(CFDictionaryGetValue(dict, kSecValueRef));
+	cert_list[c].pkeyhash = CFRetain(CFDictionaryGetValue(dict,
+						kSecAttrPublicKeyHash));
+}
+
+/*
+ * Get the SecAccessControl object from the identity.
+ *
+ * This is a little subtle; we don't actually want the SecAccessControl
+ * object for the IDENTITY, we want it for the private key (as it turns
+ * out, they are different).  So what we need to do is get the attributes
+ * for the key using SecItemCopyMatching(); the SecAccessControl object
+ * will be in there.
+ */
+
+static SecAccessControlRef
+getaccesscontrol(CFDictionaryRef dict)
+{
+	SecAccessControlRef accret;
+	CFDictionaryRef accquery, attrdict;
+	CFDataRef label;
+	OSStatus ret;
+	uint64_t start, pstart;
+
+	/*
+	 * Our keys for our query dictionary for SecItemCopyMaching().
+	 *
+	 * In order:
+	 *
+	 * kSecClass = kSecClassKey
+	 *	This means we're searching for keys (instead of identities
+	 *	or certificates)
+	 * kSecAttrKeyClass = kSecAttrKeyClassPrivate
+	 *	We want to match on the private key
+	 * kSecAttrApplicationLabel
+	 *	This is the "application label" of the key.  We get this
+	 *	from the identity dictionary, and it makes sure we get the
+	 *	private key associated with this identity.
+	 * kSecMatchLimit = kSecMatchLimitOne
+	 *	We only want one match (really, we should only have one
+	 *	match, but let's be safe)
+	 * kSecReturnAttributes = kCFBooleanTrue
+	 *	We want to get all of the attributes so we can find the
+	 *	SecAccessControlRef
+	 */
+
+	const void *keys[] = {
+		kSecClass,
+		kSecAttrKeyClass,
+		kSecAttrApplicationLabel,
+#define ATTR_LABEL_INDEX 2
+		kSecMatchLimit,
+		kSecReturnAttributes,
+	};
+
+	const void *values[] = {
+		kSecClassKey,		/* kSecClass */
+		kSecAttrKeyClassPrivate,/* kSecAttrKeyClass */
+		NULL,			/* Application Label, fill in later */
+		kSecMatchLimitOne,	/* kSecMatchLimit */
+		kCFBooleanTrue,		/* kSecReturnAttributes */
+	};
+
+	/*
+	 * Build our query dictionary to retrieve the key attributes.  We
+	 * need the application label from the original identity (this is
+	 * passed down in "dict")
+	 */
+
+	if (! CFDictionaryGetValueIfPresent(dict, kSecAttrApplicationLabel,
+				    (const void **) &label)) {
+		os_log_debug(logsys, "Application Label object not found");
+		return NULL;
+	}
+
+	values[ATTR_LABEL_INDEX] = label;
+
+	accquery = CFDictionaryCreate(NULL, keys, values,
+				      sizeof(keys)/sizeof(keys[0]),
+				      &kCFTypeDictionaryKeyCallBacks,
+				      &kCFTypeDictionaryValueCallBacks);
+
+	if (accquery == NULL) {
+		os_log_debug(logsys, "Access control ref query dictionary "
+			     "creation returned NULL");
+		return NULL;
+	}
+
+	/*
+	 * Perform the actual query
+	 */
+
+	start = TRACE_NOW();
+	pstart = prof_now();
+	ret = secitem_copy_matching(accquery, (CFTypeRef *) &attrdict);
+	PROF_RECORD(getaccesscontrol, pstart, ret);
+	TRACE_SPAN(TRACE_SecItemCopyMatching, start, TOKEN_SLOT, ret);
+
+	CFRelease(accquery);
+
+	if (ret) {
+		LOG_SEC_ERR("Access control ref SecItemCopyMatching "
+			    "failed: %{public}@", ret);
+		return NULL;
+	}
+
+	/*
+	 * Just in case, make sure we got a CFDictionaryRef
+	 */
+
+	if (CFGetTypeID(attrdict) != CFDictionaryGetTypeID()) {
+		logtype("Was expecting a CFDictionary, but got", attrdict);
+		CFRelease(attrdict);
+		return NULL;
+	}
+
+	if (! CFDictionaryGetValueIfPresent(attrdict, kSecAttrAccessControl,
+					    (const void **) &accret)) {
+		os_log_debug(logsys, "Access Control object not found");
+		CFRelease(attrdict);
+		return NULL;
+	}
+
+	CFRetain(accret);
+	CFRelease(attrdict);
+
+	return accret;
+}
+
+/*
+ * Return the user-printable label for a key.
+ *
+ * Sigh.  It turns out some applications REALLY want a printable label
+ * associated with a key; we'll fetch the key label from the attribute
+ * dictionary.  Returns string that must always be free()d.
+ */
+
+static char *
+getkeylabel(SecKeyRef key)
+{
+	CFDictionaryRef keyattr = NULL, query = NULL, result = NULL;
+	CFStringRef label;
+	OSStatus ret;
+	char *retstr;
+	uint64_t start, pstart;
+
+	/*
+	 * Slightly more complicated than I would like, but we're trying to
+	 * conform to the Security framework APIs as I understand them.
+	 *
+	 * Fetch the key attributes using SecKeyCopyAttributes (the label
+	 * isn't one of the supported attributes that SecKeyCopyAttributes
+	 * is supposed to return).
+	 *
+	 * Use the KeyClass and application label in a query dictionary
+	 * to retrieve the complete attribute dictionary, and return the
+	 * kSecAttrLabel value.
+	 */
+
+	/*
+	 * Our query dictionary; see above for greater detail
+	 *
+	 * kSecClass = kSecClassKey
+	 * kSecAttrKeyClass (from key)
+	 * kSecAttrApplicationLabel (from key)
+	 * kSecMatchLimit = kSecMatchLimitOne
+	 * kSecReturnAttributes = kCFBooleanTrue
+	 */
+
+	const void *keys[] = {
+		kSecClass,
+#define KEYCLASS_INDEX 1
+		kSecAttrKeyClass,
+#define KEYLABEL_INDEX 2
+		kSecAttrApplicationLabel,
+		kSecMatchLimit,
+		kSecReturnAttributes,
+	};
+
+	const void *values[] = {
+		kSecClassKey,		/* kSecClass */
+		NULL,			/* kSecAttrKeyClass */
+		NULL,			/* kSecAttrApplicationLabel */
+		kSecMatchLimitOne,	/* kSecMatchLimit */
+		kCFBooleanTrue,		/* kSecReturnAttributes */
+	};
+
+	pstart = prof_now();
+	keyattr = SecKeyCopyAttributes(key);
+	PROF_RECORD(SecKeyCopyAttributes, pstart, keyattr ? 0 : PROF_FAILED);
+
+	if (! keyattr) {
+		os_log_debug(logsys, "SecKeyCopyAttr returned NULL");
+		retstr = strdup("Unknown key");
+		goto out;
+	}
+
+	if (! CFDictionaryGetValueIfPresent(keyattr, kSecAttrKeyClass,
+					    &values[KEYCLASS_INDEX])) {
+		os_log_debug(logsys, "Cannot find KeyClass in dict");
+		retstr = strdup("Unknown key");
+		goto out;
+	}
+
+	if (! CFDictionaryGetValueIfPresent(keyattr, kSecAttrApplicationLabel,
+					    &values[KEYLABEL_INDEX])) {
+		os_log_debug(logsys, "Cannot find AppLabel in dict");
+		retstr = strdup("Unknown key");
+		goto out;
+	}
+
+	query = CFDictionaryCreate(NULL, keys, values,
+				   sizeof(keys)/sizeof(keys[0]),
+				   &kCFTypeDictionaryKeyCallBacks,
+				   &kCFTypeDictionaryValueCallBacks);
+
+	if (! query) {
+		os_log_debug(logsys, "Unable to create query dictionary");
+		retstr = strdup("Unknown key");
+		goto out;
+	}
+
+	start = TRACE_NOW();
+	pstart = prof_now();
+	ret = secitem_copy_matching(query, (CFTypeRef *) &result);
+	PROF_RECORD(getkeylabel, pstart, ret);
+	TRACE_SPAN(TRACE_SecItemCopyMatching, start, TOKEN_SLOT, ret);
+
+	if (ret) {
+		LOG_SEC_ERR("SecItemCopyMatching failed: %{public}@", ret);
+		retstr = strdup("Unknown key");
+		goto out;
+	}
+
+	if (CFGetTypeID(result) != CFDictionaryGetTypeID()) {
+		logtype("Was expecting a CFDictionaryRef, but got", result);
+		retstr = strdup("Unknown key");
+		goto out;
+	}
+
+	if (! CFDictionaryGetValueIfPresent(result, kSecAttrLabel,
+					    (const void **) &label)) {
+		os_log_debug(logsys, "Unable to find key label");
+		retstr = strdup("Unknown key");
+	} else {
+		retstr = getstrcopy(label);
+	}
+
+out:
+	if (keyattr)
+		CFRelease(keyattr);
+	if (query)
+		CFRelease(query);
+	if (result)
+		CFRelease(result);
+
+	return retstr;
+}
+
+/*
+ * A "safe" version of CFArrayGetCount().
+ *
+ * SecItemCopyMatching can sometimes return a single entry or a CFArrayRef
+ * with multiple entries.  So to be as robust as possible, handle this case
+ * here.  If we have something OTHER than a CFArrayRef, then just return a
+ * count of "1".  Otherwise return the real array count.
+ */
+
+static unsigned int
+cflistcount(CFTypeRef ref)
+{
+	if (CFGetTypeID(ref) == CFArrayGetTypeID()) {
+		return CFArrayGetCount((CFArrayRef) ref);
+	} else {
+		return 1;
+	}
+}
+
+/*
+ * A "safe" version of CFArrayGetValueAtIndex
+ *
+ * If the passed-in type is a CFArray, then return the appropriate value
+ * at the passed-in index.  If it is a CFDictionaryRef, then just return
+ * passed-in value if the index is 0; anything else, return a NULL.
+ */
+
+static CFDictionaryRef
+cfgetindex(CFTypeRef ref, unsigned int index)
+{
+	if (CFGetTypeID(ref) == CFArrayGetTypeID()) {
+		return CFArrayGetValueAtIndex((CFArrayRef) ref, index);
+	} else if (CFGetTypeID(ref) == CFDictionaryGetTypeID() && index == 0) {
+		return ref;
+	} else {
+		return NULL;
+	}
+}
+
+/*
+ * Make sure the our custom logging system is enabled
+ */
+
+static void
+log_init(void *context)
+{
+	logsys = os_log_create(APPIDENTIFIER, "general");
+	trace_init();
+	recorder_init(&function_list);
+}
+
+/*
+ * Free our identity list
+ */
+
+static void
+id_list_free(void)
+{
+	int i;
+
+	if (id_refs_stale)
+		id_list_forget();
+
+	for (i = 0; i < id_list_count; i++) {
+		if (id_list[i].label)
+			free(id_list[i].label);
+		if (id_list[i].ident)
+			CFRelease(id_list[i].ident);
+		if (id_list[i].privkey)
+			CFRelease(id_list[i].privkey);
+		if (id_list[i].pubkey)
+			CFRelease(id_list[i].pubkey);
+		if (id_list[i].cert)
+			CFRelease(id_list[i].cert);
+		if (id_list[i].secaccess)
+			CFRelease(id_list[i].secaccess);
+		if (id_list[i].pkeyhash)
+			CFRelease(id_list[i].pkeyhash);
+		free(id_list[i].mechflags);
+	}
+
+	if (id_list)
+		free(id_list);
+
+	id_list = NULL;
+	id_list_count = id_list_size = 0;
+}
+
+/*
+ * Like id_list_free(), but don't release any of our Security framework
+ * references, since they belong to our parent process.  We keep the
+ * array around since we are usually about to refill it.
+ */
+
+static void
+id_list_forget(void)
+{
+	int i;
+
+	for (i = 0; i < id_list_count; i++) {
+		free(id_list[i].label);
+		free(id_list[i].mechflags);
+		memset(&id_list[i], 0, sizeof(id_list[i]));
+	}
+
+	id_list_count = 0;
+	id_refs_stale = false;
+}
+
+/*
+ * A version of snprintf() which does space-padding
+ */
+
+static void
+sprintfpad(unsigned char *dest, size_t destsize, const char *fmt, ...)
+{
+	char *s;
+	va_list ap;
+	int rc;
+
+	va_start(ap, fmt);
+	rc = vasprintf(&s, fmt, ap);
+	va_end(ap);
+
+	if (rc < 1) {
+		memset(dest, ' ', destsize);
+	} else {
+		/* We are relying on strncpy not doing \0 at end for trunc */
+		strncpy((char *) dest, s, destsize);
+		if (rc < destsize)
+			memset(dest + rc, ' ', destsize - rc);
+		free(s);
+	}
+}
+
+/*
+ * Return a boolean value based on a dictionary key.  If the key is not
+ * set then return false.
+ */
+
+bool
+boolfromdict(const char *keyname, CFDictionaryRef dict, CFTypeRef key)
+{
+	CFTypeRef val;
+
+	if (! CFDictionaryGetValueIfPresent(dict, key, &val)) {
+		os_log_debug(logsys, "No value for %s in dictionary, "
+			     "returning FALSE", keyname);
+		return false;
+	}
+
+	if (CFGetTypeID(val) != CFBooleanGetTypeID() &&
+	    CFGetTypeID(val) != CFNumberGetTypeID()) {
+		os_log_debug(logsys, "%s was not a boolean, but exists, so "
+			     "returning TRUE", keyname);
+		return true;
+	}
+
+	os_log_debug(logsys, "%s is set to %{bool}d", keyname,
+		     CFBooleanGetValue(val));
+
+	return CFBooleanGetValue(val);
+}
+
+/*
+ * Get a C string from a CFStringRef (assumes UTF-8 encoding).
+ * Allocates memory that must be free()d.
+ */
+
+static char *
+getstrcopy(CFStringRef string)
+{
+	const char *s = CFStringGetCStringPtr(string, kCFStringEncodingUTF8);
+
+	if (! s) {
+		CFIndex len = CFStringGetLength(string);
+		CFIndex size = CFStringGetMaximumSizeForEncoding(len,
+						 kCFStringEncodingUTF8) + 1;
+		char *p = malloc(size);
+
+		if (! CFStringGetCString(string, p, size,
+					 kCFStringEncodingUTF8)) {
+			free(p);
+			return strdup("Unknown string");
+		}
+
+		return p;
+	} else {
+		return strdup(s);
+	}
+}
+
+/*
+ * Log this object's type
+ */
+
+void
+logtype(const char *string, CFTypeRef ref)
+{
+	CFTypeID id = CFGetTypeID(ref);
+	CFStringRef str = CFCopyTypeIDDescription(id);
+
+	os_log_debug(logsys, "%s: %{public}@", string, str);
+
+	CFRelease(str);
+}
+
+#if defined(KEYCHAIN_DEBUG)
+/*
+ * Dump the contents of a dictionary
+ */
+
+void
+dumpdict(const char *string, CFDictionaryRef dict)
+{
+	unsigned int i, count = CFDictionaryGetCount(dict);
+	const void **keys, **values;
+
+	os_log_debug(logsys, "Dumping dictionary for %s", string);
+	os_log_debug(logsys, "Dictionary contains %u key/value pairs", count);
+
+	keys = malloc(sizeof(void *) * count);
+	values = malloc(sizeof(void *) * count);
+
+	CFDictionaryGetKeysAndValues(dict, keys, values);
+
+	for (i = 0; i < count; i++) {
+		os_log_debug(logsys, "Dictionary entry %d", (int) i);
+		os_log_debug(logsys, "Key value: %{public}@", keys[i]);
+		logtype("Value type", values[i]);
+		os_log_debug(logsys, "Value value: %{public}@", values[i]);
+	}
+
+	free(keys);
+	free(values);
+}
+#endif /* KEYCHAIN_DEBUG */
+
+/*
+ * Convert Security framework key types to PKCS#11 key types.
+ *
+ * Sigh.  This is a lot harder than I would like.  The Apple API is in flux;
+ * what the attribute dictionary returns is a CFNumber, but the constants
+ * you use are actually CFStrings which happen to have string values which
+ * correspond to the CFNumbers.  The numbers correspond to the values of
+ * CSSM_ALGORITHMS in cssmtype.h.  So that means a RSA key, for example,
+ * shows up in the attribute dictionary as a CFNumber with a value of 42,
+ * but the constant kSecAttrKeyTypeRSA is a CFString with the value of "42".
+ * (There is magic in the Security framework that lets you use things like
+ * kSecAttrKeyTypeRSA as an input key for kSecAttrKeyType).
+ *
+ * I am hesitant to include cssmtype.h, so what I have decided to do is
+ * convert the dictionary number we are given to a string and compare it
+ * against the relevant "new" API constants.  Hopefully we don't have that
+ * many.
+ */
+
+static CK_KEY_TYPE
+convert_keytype(CFNumberRef type)
+{
+	int i;
+	CFStringRef str = CFStringCreateWithFormat(NULL, NULL, CFSTR("%@"),
+						   type);
+
+	for (i = 0; keytype_map[i].keyname; i++) {
+		if (CFEqual(str, *keytype_map[i].sec_keytype)) {
+			os_log_debug(logsys, "This is a %s",
+				     keytype_map[i].keyname);
+			CFRelease(str);
+			return keytype_map[i].pkcs11_keytype;
+		}
+	}
+
+	CFRelease(str);
+
+	os_log_debug(logsys, "Keytype is unknown, returning VENDOR_DEFINED");
+
+	return CKK_VENDOR_DEFINED;
+}
+
+/*
+ * Build our list of objects based on our identities
+ */
+
+#define ADD_ATTR_SIZE(name, attribute, var, size) \
+do { \
+	void *p = malloc(size); \
+	memcpy(p, var, size); \
+	if ( name ## _obj_list[ name ## _obj_count ].attr_count >= \
+	    name ## _obj_list[ name ## _obj_count ].attr_size) { \
+		name ## _obj_list[ name ## _obj_count ].attr_size += 5; \
+		name ## _obj_list[ name ## _obj_count ].attrs = realloc( name ## _obj_list[ name ## _obj_count ].attrs, \
+			name ## _obj_list[ name ## _obj_count ].attr_size * sizeof(CK_ATTRIBUTE)); \
+	} \
+	name ## _obj_list[ name ## _obj_count ].attrs[ name ## _obj_list[ name ## _obj_count].attr_count].type = attribute; \
+	name ## _obj_list[ name ## _obj_count ].attrs[ name ## _obj_list[ name ## _obj_count].attr_count].pValue = p; \
+	name ## _obj_list[ name ## _obj_count ].attrs[ name ## _obj_list[ name ## _obj_count ].attr_count].ulValueLen = size; \
+	name ## _obj_list[ name ## _obj_count ].attr_count++; \
+} while (0)
+
+#define ADD_ATTR(name, attr, var) ADD_ATTR_SIZE(name, attr, &var, sizeof(var))
+
+#define ADD_ATTR_DATA(name, attr, data) \
+do { \
+	if (data) \
+		ADD_ATTR_SIZE(name, attr, CFDataGetBytePtr(data), \
+			      CFDataGetLength(data)); \
+} while (0)
+
+/*
+ * Add the attributes we precompute for a certificate object: the
+ * SubjectPublicKeyInfo, key hashes, validity dates, and the check value
+ * (the first three bytes of the SHA-1 hash of the certificate).
+ */
+
+#define ADD_CERT_PARTS(name, parts) \
+do { \
+	ADD_ATTR_DATA(name, CKA_PUBLIC_KEY_INFO, (parts).spki); \
+	ADD_ATTR_DATA(name, CKA_HASH_OF_SUBJECT_PUBLIC_KEY, (parts).keyhash); \
+	ADD_ATTR_DATA(name, CKA_HASH_OF_ISSUER_PUBLIC_KEY, \
+		      (parts).issuerhash); \
+	if ((parts).spki) { \
+		ADD_ATTR(name, CKA_START_DATE, (parts).start); \
+		ADD_ATTR(name, CKA_END_DATE, (parts).end); \
+	} \
+	if ((parts).hash && CFDataGetLength((parts).hash) >= 3) \
+		ADD_ATTR_SIZE(name, CKA_CHECK_VALUE, \
+			      CFDataGetBytePtr((parts).hash), 3); \
+} while (0)
+
+#define NEW_OBJECT(name) \
+do { \
+	if (++ name ## _obj_count >= name ## _obj_size) { \
+		name ## _obj_size = name ## _obj_size ? \
+					name ## _obj_size * 2 : 16; \
+		name ## _obj_list = realloc( name ## _obj_list, name ## _obj_size * sizeof(* name ## _obj_list )); \
+	} \
+} while (0)
+
+#define OBJINIT(name) \
+do { \
+	name ## _obj_list[ name ## _obj_count ].id_index = i; \
+	name ## _obj_list[ name ## _obj_count ].handle = \
+						name ## _obj_count + 1; \
+	name ## _obj_list[ name ## _obj_count ].attrs = NULL; \
+	name ## _obj_list[ name ## _obj_count ].attr_count = 0; \
+	name ## _obj_list[ name ## _obj_count ].attr_size = 0; \
+	name ## _obj_list[ name ## _obj_count ].store = NULL; \
+} while (0)
+
+/*
+ * Build up a list of objects based on our identity list
+ */
+
+static void
+build_id_objects(int lock)
+{
+	int i;
+	CK_OBJECT_CLASS cl;
+	CK_CERTIFICATE_TYPE ct = CKC_X_509;	/* Only this for now */
+	CK_ULONG t;
+	CK_BBOOL b;
+	char *label;
+
+	if (lock)
+		LOCK_MUTEX(id_mutex);
+
+	if (id_list_count > 0) {
+		/* Prime the pump */
+		NEW_OBJECT(id);
+		id_obj_count--;
+	}
+
+	for (i = 0; i < id_list_count; i++) {
+		struct certparts parts;
+		CFDataRef subject, keydata = NULL, modulus = NULL;
+		CFDataRef exponent = NULL, idkey;
+		CFErrorRef error;
+		const void *idval;
+		CK_ULONG idlen, idx = i;
+		uint64_t pstart;
+
+		/*
+		 * We only know the issuer's key if the certificate
+		 * is self-issued (certparts_get() handles that).
+		 */
+
+		certparts_get(id_list[i].cert, &parts);
+		subject = parts.subject;
+
+		/*
+		 * Our CKA_ID (and our handles) come from the public key
+		 * hash the keychain gave us; if we don't have that, use
+		 * the hash of the certificate's key, and as a last resort
+		 * the identity index.
+		 */
+
+		if (! (idkey = id_list[i].pkeyhash))
+			idkey = parts.keyhash ? parts.keyhash : parts.hash;
+
+		if (idkey) {
+			idval = CFDataGetBytePtr(idkey);
+			idlen = CFDataGetLength(idkey);
+		} else {
+			idval = &idx;
+			idlen = sizeof(idx);
+		}
+
+		OBJINIT(id);
+
+		/*
+		 * Add in the object for each identity; cert, public key,
+		 * private key.  Add in attributes we need.
+		 */
+
+		cl = CKO_CERTIFICATE;
+		id_obj_list[id_obj_count].class = cl;
+		if (idkey)
+			id_obj_list[id_obj_count].handle = obj_handle(idkey, cl);
+		ADD_ATTR(id, CKA_CLASS, cl);
+		ADD_ATTR_SIZE(id, CKA_ID, idval, idlen);
+		ADD_ATTR(id, CKA_CERTIFICATE_TYPE, ct);
+		b = CK_TRUE;
+		ADD_ATTR(id, CKA_TOKEN, b);
+		ADD_ATTR_SIZE(id, CKA_LABEL, id_list[i].label,
+			      strlen(id_list[i].label));
+		ADD_ATTR_DATA(id, CKA_VALUE, parts.value);
+		ADD_ATTR_DATA(id, CKA_SUBJECT, parts.subject);
+		ADD_ATTR_DATA(id, CKA_ISSUER, parts.issuer);
+		ADD_ATTR_DATA(id, CKA_SERIAL_NUMBER, parts.serial);
+		ADD_CERT_PARTS(id, parts);
+
+		NEW_OBJECT(id);
+		OBJINIT(id);
+
+		cl = CKO_PUBLIC_KEY;
+		id_obj_list[id_obj_count].class = cl;
+		if (idkey)
+			id_obj_list[id_obj_count].handle = obj_handle(idkey, cl);
+		ADD_ATTR(id, CKA_CLASS, cl);
+		ADD_ATTR_SIZE(id, CKA_ID, idval, idlen);
+		ADD_ATTR(id, CKA_KEY_TYPE, id_list[i].keytype);
+		b = CK_TRUE;
+		ADD_ATTR(id, CKA_TOKEN, b);
+		b = id_list[i].pubcanencrypt;
+		ADD_ATTR(id, CKA_ENCRYPT, b);
+		b = id_list[i].pubcanverify;
+		ADD_ATTR(id, CKA_VERIFY, b);
+		if (subject)
+			ADD_ATTR_SIZE(id, CKA_SUBJECT,
+				      CFDataGetBytePtr(subject),
+				      CFDataGetLength(subject));
+
+		/*
+		 * Sigh.  It seems like the public part of an identity
+		 * doesn't actually get a label attribute, at least with
+		 * the release I tested.  So for now, get the label from
+		 * the identity label, and maybe check later if this
+		 * changes; keep the code around here if it does.
+		 *
+		 * label = getkeylabel(id_list[i].pubkey);
+		 * ADD_ATTR_SIZE(id, CKA_LABEL, label, strlen(label));
+		 * free(label);
+		 */
+
+		ADD_ATTR_SIZE(id, CKA_LABEL, id_list[i].label,
+			      strlen(id_list[i].label));
+
+		/*
+		 * It turns out some implementations want CKA_MODULUS_BITS,
+		 * and the modulus and public exponent.  For RSA keys the
+		 * modulus size is equal to the block size, and we can get
+		 * modulus and public exponent from the "external
+		 * representation" of the public key.  Note that the block
+		 * size is returned in bytes, and we need bits.
+		 */
+
+		t = id_list[i].keybits ? id_list[i].keybits :
+					 id_list[i].blocksize * 8;
+		ADD_ATTR(id, CKA_MODULUS_BITS, t);
+
+		pstart = prof_now();
+		keydata = SecKeyCopyExternalRepresentation(id_list[i].pubkey,
+							   &error);
+		PROF_RECORD(SecKeyCopyExternalRepresentation, pstart,
+			    keydata ? 0 : cferr_code(error));
+
+		if (keydata) {
+			if (get_pubkey_info(keydata, &modulus, &exponent)) {
+				ADD_ATTR_SIZE(id, CKA_MODULUS,
+					      CFDataGetBytePtr(modulus),
+					      CFDataGetLength(modulus));
+				ADD_ATTR_SIZE(id, CKA_PUBLIC_EXPONENT,
+					      CFDataGetBytePtr(exponent),
+					      CFDataGetLength(exponent));
+			}
+		} else {
+			os_log_debug(logsys, "SecKeyCopyExternalRepresentation "
+				     "failed: %{public}@", error);
+			CFRelease(error);
+		}
+
+		ADD_ATTR_DATA(id, CKA_PUBLIC_KEY_INFO, parts.spki);
+
+		b = CK_FALSE;
+		ADD_ATTR(id, CKA_WRAP, b);
+		ADD_ATTR(id, CKA_DERIVE, b);
+
+		NEW_OBJECT(id);
+		OBJINIT(id);
+
+		cl = CKO_PRIVATE_KEY;
+		id_obj_list[id_obj_count].class = cl;
+		if (idkey)
+			id_obj_list[id_obj_count].handle = obj_handle(idkey, cl);
+		ADD_ATTR(id, CKA_CLASS, cl);
+		ADD_ATTR_SIZE(id, CKA_ID, idval, idlen);
+		ADD_ATTR(id, CKA_KEY_TYPE, id_list[i].keytype);
+		b = CK_TRUE;
+		ADD_ATTR(id, CKA_TOKEN, b);
+		ADD_ATTR(id, CKA_PRIVATE, b);
+		b = id_list[i].privcandecrypt;
+		ADD_ATTR(id, CKA_DECRYPT, b);
+		b = id_list[i].privcansign;
+		ADD_ATTR(id, CKA_SIGN, b);
+		if (subject)
+			ADD_ATTR_SIZE(id, CKA_SUBJECT,
+				      CFDataGetBytePtr(subject),
+				      CFDataGetLength(subject));
+
+		label = getkeylabel(id_list[i].privkey);
+		ADD_ATTR_SIZE(id, CKA_LABEL, label, strlen(label));
+		free(label);
 
-		id_list[i].pubcanverify = boolfromdict("Can-Verify", keydict,
-						        kSecAttrCanVerify);
-		id_list[i].pubcanencrypt = boolfromdict("Can-Encrypt", keydict,
-							kSecAttrCanEncrypt);
-		id_list[i].pubcanwrap = boolfromdict("Can-Wrap", keydict,
-						     kSecAttrCanWrap);
 		/*
-		 * We're going to cheat here JUST a bit.  It turns out
-		 * if a public key is set to allow wrapping, it can also
-		 * do generic encryption.  So if we have wrapping set, also
-		 * set encryption.
+		 * I guess some applications want the modulus and public
+		 * exponent as attributes in the private key object.
+		 * Use this information we extracted previously.
 		 */
 
-		if (id_list[i].pubcanwrap)
-			id_list[i].pubcanencrypt = true;
+		if (keydata) {
+			ADD_ATTR_SIZE(id, CKA_MODULUS,
+				      CFDataGetBytePtr(modulus),
+				      CFDataGetLength(modulus));
+			ADD_ATTR_SIZE(id, CKA_PUBLIC_EXPONENT,
+				      CFDataGetBytePtr(exponent),
+				      CFDataGetLength(exponent));
+		}
 
-		CFRelease(keydict);
-	}
+		ADD_ATTR_DATA(id, CKA_PUBLIC_KEY_INFO, parts.spki);
 
-	if (ret)
-		return -1;
+		b = CK_TRUE;
+		ADD_ATTR(id, CKA_SENSITIVE, b);
+		b = CK_FALSE;
+		ADD_ATTR(id, CKA_ALWAYS_AUTHENTICATE, b);
+		ADD_ATTR(id, CKA_UNWRAP, b);
+		ADD_ATTR(id, CKA_DERIVE, b);
+		ADD_ATTR(id, CKA_EXTRACTABLE, b);
 
-	return 0;
-}
+		NEW_OBJECT(id);
 
-/*
- * This function is called by the dispatch system and will call
- * scan_certificates() and build_cert_objects() and the appropriate
- * memory barrier functions
- */
+		certparts_free(&parts);
 
-static void
-background_cert_scan(void *dummy)
-{
-	scan_certificates();
-	build_cert_objects();
+		if (keydata)
+			CFRelease(keydata);
+		if (modulus)
+			CFRelease(modulus);
+		if (exponent)
+			CFRelease(exponent);
+	}
 
-	atomic_store(&cert_list_status, initialized);
+	if (lock)
+		UNLOCK_MUTEX(id_mutex);
 }
 
 /*
- * Scan the Keychain for certificates and add them to our object database
- *
- * This uses SecItemCopyMatching, but searches for certificates that
- * have a subject name that matches one of our match strings.  Once we
- * find that certificate then we chase down all certificates issued
- * by that certificate; this means you should only need to list Root CAs
- * in your match string list.
+ * Build up a list of certificate objects.  Returns -1 if the certificate
+ * scan was cancelled partway through.
  */
 
-static void
-scan_certificates(void)
+static int
+build_cert_objects(struct cert_scan *job)
 {
-	char **certs = NULL, **p;
-	CFMutableArrayRef cmatch = NULL;
-	CFMutableSetRef certset = NULL;
-	CFDictionaryRef query = NULL;
-	CFTypeRef result = NULL;
-	OSStatus ret;
-	unsigned int i, count;
-	struct certlist *cl;
+	struct obj_info *new_obj_list = NULL;
+	unsigned int new_obj_count = 0, new_obj_size = 0;
+	struct certparts *parts;
+	int i;
 
 	/*
-	 * I tried, at first, to use the built-in searching features
-	 * available in SecItemCopyMatching(), but that turned out to be
-	 * a failure for two reasons:
-	 *
-	 * Matching on the subject name (using kSecMatchSubjectContains)
-	 * SORT-of worked, except if you have a hardware token you will
-	 * get certificates on the hardware token included in the list
-	 * EVEN THOUGH the subject names don't match.
-	 *
-	 * Matching based on issuer (using kSecMatchIssuers) only works
-	 * for IDENTITIES, for some strange reason (really, there is no
-	 * good reason for this that I can tell).
-	 *
-	 * Because SecItemCopyMatching is kind of expensive, what I finally
-	 * decided on was this:
-	 *
-	 * Get a list of ALL certificates.
-	 *
-	 * Generate a CFMutableSet from the original certificate array.
-	 *
-	 * As we add each certificate, remove it from the CFSet
-	 * (to improve on later searching).
-	 *
-	 * Sigh.  Apple, why did you have to make this so hard?
+	 * Pick apart all of the certificates first, so we can find the
+	 * issuer of each one in our list.
 	 */
 
-	/*
-	 * We need to retrieve all valid certificates from our Keychains.
-	 *
-	 * Our query dictionary:
-	 *
-	 * kSecClass = kSecClassCertificate
-	 *	This means we're searching for certificates only,
-	 *	and we don't need private key objects
-	 * kSecMatchLimit = kSecMatchLimitAll
-	 *	Return all matching certificates
-	 * kSecMatchTrustedOnly = kCFBooleanTrue
-	 *	Only match trusted certificates
-	 * kSecReturnRef = kCFBooleanTrue
-	 *	This means return a reference to the certificate
-	 *	object (a SecCertificateRef).  Because we also use
-	 *	kSecReturnAttributes that means the certificate
-	 *	reference ends up in the attribute dictionary.
-	 * kSecReturnAttributes = kCFBooleanTrue
-	 *	This means we return all of the attributes for each 
-	 *	certificate.
-	 */
+	parts = calloc(cert_list_count ? cert_list_count : 1, sizeof(*parts));
 
-	const void *keys[] = { 
-		kSecClass,
-		kSecMatchLimit,
-		kSecMatchTrustedOnly,
-		kSecReturnRef,
-		kSecReturnAttributes,
-	};
+	for (i = 0; i < cert_list_count; i++) {
+		if (cert_scan_cancelled(job))
+			goto cancel;
+		certparts_get(cert_list[i].cert, &parts[i]);
+	}
 
-	const void *values[] = {
-		kSecClassCertificate,	/* kSecClass */
-		kSecMatchLimitAll,	/* kSecMatchLimit */
-		kCFBooleanTrue,		/* kSecMatchTrustedOnly */
-		kCFBooleanTrue,		/* kSecReturnRef */
-		kCFBooleanTrue,		/* kSecReturnAttributes */
-	};
+	cert_issuers_find(parts, cert_list_count);
 
-	/*
-	 * Short circuit the search if "none" is the first entry
-	 */
+	for (i = 0; i < cert_list_count; i++) {
+		if (cert_scan_cancelled(job))
+			goto cancel;
 
-	certs = prefkey_arrayget("certificateList", default_cert_search);
+		cert_objects_add(&new_obj_list, &new_obj_count, &new_obj_size,
+				 i, &parts[i], new_obj_count + 1);
 
-	if (certs[0] && strcasecmp(certs[0], "none") == 0) {
-		os_log_debug(logsys, "Special entry \"none\" found, not "
-			     "importing Keychain certificates");
-		goto out;
+		certparts_free(&parts[i]);
 	}
 
-	cmatch = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+	free(parts);
 
-	if (! cmatch) {
-		os_log_debug(logsys, "Unable to create match array!");
-		goto out;
-	}
+	if (compress_certs)
+		cert_objects_pack(new_obj_list, new_obj_count, true);
 
-	for (p = certs; *p != NULL; p++) {
-		CFStringRef cm = CFStringCreateWithCString(NULL, *p,
-						   kCFStringEncodingUTF8);
-		CFArrayAppendValue(cmatch, cm);
-		CFRelease(cm);
-	}
+	cert_obj_list = new_obj_list;
+	cert_obj_count = new_obj_count;
+	cert_obj_size = new_obj_size;
 
-	/*
-	 * This shouldn't be 0, but JUST in case ...
-	 */
+	return 0;
 
-	if (CFArrayGetCount(cmatch) == 0) {
-		os_log_debug(logsys, "No certificate match strings found, "
-			     "not importing certificates");
-		goto out;
-	}
+cancel:
+	for (i = 0; i < cert_list_count; i++)
+		certparts_free(&parts[i]);
 
-	/*
-	 * Get a list of all certificates
-	 */
+	free(parts);
 
-	query = CFDictionaryCreate(NULL, keys, values,
-				   sizeof(keys)/sizeof(keys[0]),
-				   &kCFTypeDictionaryKeyCallBacks,
-				   &kCFTypeDictionaryValueCallBacks);
+	obj_free(&new_obj_list, &new_obj_count, &new_obj_size);
 
-	if (! query) {
-		os_log_debug(logsys, "Unable to create query "
-			     "dictionary for match string \"%s\"", *p);
-		goto out;
-	}
+	return -1;
+}
 
-	os_log_debug(logsys, "About to call SecItemCopyMatching");
+/*
+ * Fill in the issuer key hash for our certificates.  We only trust the
+ * issuer key hash if exactly one certificate has the issuer's name; if
+ * there is more than one (a CA rollover, say) we can't tell which key
+ * signed it without checking signatures, so leave it out.  Certificates
+ * without an issuer name are skipped (but can still be issuers).  See
+ * certscan_issuers() for the matching.
+ */
 
-	ret = SecItemCopyMatching(query, &result);
+#define CS_DATA(field, data) \
+do { \
+	if (data) { \
+		field = CFDataGetBytePtr(data); \
+		field ## _len = CFDataGetLength(data); \
+	} \
+} while (0)
 
-	os_log_debug(logsys, "SecItemCopyMatching finished");
+static void
+cert_issuers_find(struct certparts *parts, unsigned int count)
+{
+	struct certscan_cert *cs;
+	unsigned int i;
+	int *issuer;
 
-	/*
-	 * If we didn't find ANY certificates at all (really? None?)
-	 * then return.
-	 */
+	cs = calloc(count ? count : 1, sizeof(*cs));
+	issuer = calloc(count ? count : 1, sizeof(*issuer));
 
-	if (ret) {
-		if (ret == errSecItemNotFound) {
-			os_log_debug(logsys, "No valid certificates found; "
-				     "that doesn't seem right!");
-			goto out;
-		} else {
-			LOG_SEC_ERR("Certificate SecItemCopyMatching "
-				    "failed: %{public}@", ret);
-			goto out;
-		}
+	if (! cs || ! issuer) {
+		os_log_debug(logsys, "Unable to allocate issuer list!");
+		goto out;
 	}
 
-	count = cflistcount(result);
+	for (i = 0; i < count; i++) {
+		CS_DATA(cs[i].subject, parts[i].subject);
+		CS_DATA(cs[i].issuer, parts[i].issuer);
+		CS_DATA(cs[i].keyhash, parts[i].keyhash);
+	}
 
-	os_log_debug(logsys, "Searching %u certificates", count);
-	
-	/*
-	 * Before we do anything else, add all of the certificates
-	 * entries to our set.
-	 */
+	certscan_issuers(cs, count, issuer);
 
-	certset = CFSetCreateMutable(NULL, 0, &kCFTypeSetCallBacks);
+	for (i = 0; i < count; i++)
+		if (! parts[i].issuerhash && issuer[i] >= 0)
+			parts[i].issuerhash = CFRetain(parts[issuer[i]].keyhash);
 
-	if (! certset) {
-		os_log_debug(logsys, "Unable to create certificate set!");
-		goto out;
-	}
+out:
+	free(cs);
+	free(issuer);
+}
 
-	for (i = 0; i < count; i++)
-		CFSetAddValue(certset, cfgetindex(result, i));
+/*
+ * Add the certificate and trust objects for cert_list[i] to the end of
+ * an object list.  The certificate object gets the given handle, and the
+ * trust object the one after it; our CKA_ID comes from the handle, so the
+ * handles we use for each certificate need to be odd.
+ */
+
+static void
+cert_objects_add(struct obj_info **list, unsigned int *count,
+		 unsigned int *size, int i, struct certparts *parts,
+		 CK_OBJECT_HANDLE handle)
+{
+	struct obj_info *new_obj_list = *list;
+	unsigned int new_obj_count = *count, new_obj_size = *size;
+	CFDataRef subject = parts->subject, issuer = parts->issuer;
+	CFDataRef serial = parts->serial, hash = parts->hash;
+	CK_OBJECT_CLASS cl;
+	CK_CERTIFICATE_TYPE ct = CKC_X_509;	/* Only this for now */
+	CK_TRUST trust = CKT_NSS_TRUSTED_DELEGATOR;
+	CK_ULONG t;
+	CK_BBOOL b;
+	CFStringRef subjstr;
+	char *subjc;
+	uint64_t pstart;
+
+	/* Prime the pump */
+	NEW_OBJECT(new);
+	new_obj_count--;
+
+	OBJINIT(new);
 
 	/*
-	 * Search all of our certificate for matches, and add the
-	 * results.
+	 * Add in an object for each certificate.
 	 */
 
-	cl = search_certs(certset, cmatch, NULL);
-
-	if (! cl) {
-		os_log_debug(logsys, "No matching certificates found");
-	} else {
-		struct certlist *c;
+	t = (handle - 1) / 2 + 0xff00;		/* offset so no collision */
+	cl = CKO_CERTIFICATE;
+	new_obj_list[new_obj_count].class = cl;
+	new_obj_list[new_obj_count].handle = handle;
+	ADD_ATTR(new, CKA_CLASS, cl);
+	ADD_ATTR(new, CKA_ID, t);
+	ADD_ATTR(new, CKA_CERTIFICATE_TYPE, ct);
+	b = CK_TRUE;
+	ADD_ATTR(new, CKA_TOKEN, b);
+
+	pstart = prof_now();
+	subjstr = SecCertificateCopySubjectSummary(cert_list[i].cert);
+	PROF_RECORD(SecCertificateCopySubjectSummary, pstart,
+		    subjstr ? 0 : PROF_FAILED);
+	subjc = getstrcopy(subjstr);
+
+	ADD_ATTR_SIZE(new, CKA_LABEL, subjc, strlen(subjc));
+
+	free(subjc);
+	CFRelease(subjstr);
+
+	ADD_ATTR_DATA(new, CKA_VALUE, parts->value);
+
+	if (subject)
+		ADD_ATTR_SIZE(new, CKA_SUBJECT,
+			      CFDataGetBytePtr(subject),
+			      CFDataGetLength(subject));
+	if (issuer)
+		ADD_ATTR_SIZE(new, CKA_ISSUER,
+			      CFDataGetBytePtr(issuer),
+			      CFDataGetLength(issuer));
+	if (serial)
+		ADD_ATTR_SIZE(new, CKA_SERIAL_NUMBER,
+			      CFDataGetBytePtr(serial),
+			      CFDataGetLength(serial));
+	ADD_CERT_PARTS(new, *parts);
+
+	NEW_OBJECT(new);
+	OBJINIT(new);
+
+	cl = CKO_NSS_TRUST;
+	new_obj_list[new_obj_count].class = cl;
+	new_obj_list[new_obj_count].handle = handle + 1;
+	ADD_ATTR(new, CKA_CLASS, cl);
+	b = CK_TRUE;
+	ADD_ATTR(new, CKA_TOKEN, b);
+
+	if (issuer)
+		ADD_ATTR_SIZE(new, CKA_ISSUER,
+			      CFDataGetBytePtr(issuer),
+			      CFDataGetLength(issuer));
+	if (serial)
+		ADD_ATTR_SIZE(new, CKA_SERIAL_NUMBER,
+			      CFDataGetBytePtr(serial),
+			      CFDataGetLength(serial));
+	if (hash)
+		ADD_ATTR_SIZE(new, CKA_CERT_SHA1_HASH,
+			      CFDataGetBytePtr(hash),
+			      CFDataGetLength(hash));
 
-		for (c = cl; c != NULL; c = c->next)
-			add_certificate(c->certdict, certset);
+	/*
+	 * As far as I can tell, CAs should have these various
+	 * trust objects set, but other certificates (servers,
+	 * users) should NOT.
+	 */
 
-		free_certlist(cl);
+	if (is_cert_ca(cert_list[i].cert)) {
+		ADD_ATTR(new, CKA_TRUST_SERVER_AUTH, trust);
+		ADD_ATTR(new, CKA_TRUST_CLIENT_AUTH, trust);
+		ADD_ATTR(new, CKA_TRUST_EMAIL_PROTECTION, trust);
+		ADD_ATTR(new, CKA_TRUST_CODE_SIGNING, trust);
+#if 0
+		ADD_ATTR(new, CKA_TRUST_STEP_UP_APPROVED, trust);
+#endif
 	}
 
-	os_log_debug(logsys, "%u certificates added", cert_list_count);
+	NEW_OBJECT(new);
 
-out:
-	if (certs)
-		array_free(certs);
-	if (cmatch)
-		CFRelease(cmatch);
-	if (certset)
-		CFRelease(certset);
-	if (query)
-		CFRelease(query);
-	if (result)
-		CFRelease(result);
+	*list = new_obj_list;
+	*count = new_obj_count;
+	*size = new_obj_size;
 }
 
 /*
- * Free our cert_list
+ * See if the certificates we should have in our certificate slot have
+ * changed, and if so update it.  We have to redo the Keychain search, but
+ * we match what we find against our current certificate objects (using
+ * the DER certificate) and only pick apart and build objects for the
+ * certificates that are new.  The certificates we keep also keep their
+ * attributes; if a new certificate makes a kept certificate's issuer
+ * ambiguous, its issuer key hash will be out of date until the next full
+ * scan.
  */
 
 static void
-cert_list_free(void)
+cert_refresh(void *dummy)
 {
-	unsigned int i;
-
-	for (i = 0; i < cert_list_count; i++) {
-		if (cert_list[i].cert)
-			CFRelease(cert_list[i].cert);
-		if (cert_list[i].pkeyhash)
-			CFRelease(cert_list[i].pkeyhash);
-	}
-
-	free(cert_list);
-
-	cert_list = NULL;
+	struct cert_scan job = { 0, NULL, false, 0 };
+	struct obj_info *new_obj_list = NULL, *old_list;
+	unsigned int new_obj_count = 0, new_obj_size = 0, old_count;
+	unsigned int i, j, k, *oldpos = NULL, added = 0, removed = 0;
+	CFMutableDictionaryRef old_certs = NULL;
+	CK_OBJECT_HANDLE handle = 1;
+	CK_ATTRIBUTE_PTR attr;
+	struct certparts *parts = NULL;
+	bool *moved = NULL;
+	uint64_t start = TRACE_NOW(), pstart;
+	int phase = prof_enter(KEYCHAIN_PHASE_CERT_SCAN);
+	const void *v;
+	CFDataRef data;
 
-	atomic_store(&cert_list_status, uninitialized);
-}
+	pthread_mutex_lock(&cert_scan_serial);
 
-/*
- * Search our set of certificates, either based on the common name
- * or the issuer.  If we get passed in cnmatch then match based on
- * a substring search of the common names, otherwise match on an
- * identical issuer.
- *
- * We return a pointer to the head of a certlist.
- */
+	/*
+	 * If a scan is running it will get the latest certificates anyway
+	 */
 
-static struct certlist *
-search_certs(CFMutableSetRef certs, CFArrayRef cnmatch, CFDataRef issuer)
-{
-	struct certcontext cc;
-	CFSetApplierFunction fn;
+	if (atomic_load(&cert_list_status) != initialized)
+		goto out;
 
-	cc.head = NULL;
-	cc.tail = NULL;
+	/*
+	 * cert_list is only used while we are building the object list,
+	 * so just rescan into it.  Nobody can cancel us (C_Finalize()
+	 * waits for us instead), so take the current generation.
+	 */
 
-	if (cnmatch) {
-		fn = &cn_match;
-		cc.match = cnmatch;
-	} else if (issuer) {
-		fn = &issuer_match;
-		cc.match = issuer;
-	} else {
-		os_log_debug(logsys, "Internal error: cnmatch and issuer "
-			     "are both NULL");
-		return NULL;
-	}
+	job.gen = atomic_load(&cert_scan_want);
+	job.match = prefkey_arrayget("certificateList", default_cert_search);
 
-	CFSetApplyFunction(certs, fn, &cc);
+	if (shared_catalog)
+		job.stamp = shm_keychain_stamp(job.match);
 
-	return cc.head;
-}
+	cert_list_free();
+	scan_certificates(&job);
+	prof_enter(KEYCHAIN_PHASE_OBJECT_BUILD);
 
-/*
- * Our matching function when we are matching based on the certificate
- * common name.
- */
+	/*
+	 * We don't get told if the search failed, but we should never go
+	 * from some certificates to none; assume something went wrong.
+	 */
 
-static void
-cn_match(const void *value, void *context)
-{
-	struct certcontext *cc = (struct certcontext *) context;
-	CFDictionaryRef dict = (CFDictionaryRef) value;
-	CFArrayRef cnmatch = (CFArrayRef) cc->match;
-	CFStringRef cn = NULL;
-	SecCertificateRef cert;
-	unsigned int i, count;
-	OSStatus ret;
+	if (cert_list_count == 0 && cert_obj_count > 0) {
+		os_log_debug(logsys, "No certificates found on refresh, "
+			     "keeping the ones we have");
+		goto out;
+	}
 
 	/*
-	 * Extract out our common name from the certificate.  Get the
-	 * certificate ref and then use SecCertificateCopyCommonName()
+	 * Index our current certificate objects by their value.  Sessions
+	 * only read the object list, and we're the only one who changes it,
+	 * so we don't need id_mutex for this.
 	 */
 
-	if (! CFDictionaryGetValueIfPresent(dict, kSecValueRef,
-					    (const void **) &cert)) {
-		os_log_debug(logsys, "Warning: unable to retrieve certificate "
-			     "from dictionary");
-		return;
+	old_certs = CFDictionaryCreateMutable(NULL, 0,
+					      &kCFTypeDictionaryKeyCallBacks,
+					      NULL);
+	moved = calloc(cert_obj_count + 1, sizeof(*moved));
+	oldpos = calloc(cert_list_count + 1, sizeof(*oldpos));
+	parts = calloc(cert_list_count + 1, sizeof(*parts));
+
+	for (j = 0; j < cert_obj_count; j++) {
+		if (cert_obj_list[j].handle >= handle)
+			handle = cert_obj_list[j].handle + 1;
+		if (cert_obj_list[j].class != CKO_CERTIFICATE ||
+		    ! (attr = find_attribute(&cert_obj_list[j], CKA_VALUE)))
+			continue;
+		if (attr_packed(&cert_obj_list[j], attr))
+			data = obj_attr_data(&cert_obj_list[j], CKA_VALUE);
+		else
+			data = CFDataCreateWithBytesNoCopy(NULL, attr->pValue,
+							   attr->ulValueLen,
+							   kCFAllocatorNull);
+		if (! data)
+			continue;
+		CFDictionarySetValue(old_certs, data, (void *) (uintptr_t) j);
+		CFRelease(data);
 	}
 
-	ret = SecCertificateCopyCommonName(cert, &cn);
+	if (! (handle & 1))
+		handle++;
 
-	if (ret) {
-		LOG_SEC_ERR("CopyCommonName failed: %{public}@", ret);
-		return;
+	/*
+	 * Match up what we found.  Certificates we already have only need
+	 * their subject and key hash (so they can be found as issuers).
+	 */
+
+	for (i = 0; i < cert_list_count; i++) {
+		pstart = prof_now();
+		data = SecCertificateCopyData(cert_list[i].cert);
+		PROF_RECORD(SecCertificateCopyData, pstart,
+			    data ? 0 : PROF_FAILED);
+
+		if (data && CFDictionaryGetValueIfPresent(old_certs, data, &v) &&
+		    ! moved[(uintptr_t) v]) {
+			j = (uintptr_t) v;
+			oldpos[i] = j + 1;
+			for (k = j; k < cert_obj_count &&
+			     cert_obj_list[k].id_index ==
+					cert_obj_list[j].id_index; k++)
+				moved[k] = true;
+			parts[i].subject = obj_attr_data(&cert_obj_list[j],
+							 CKA_SUBJECT);
+			parts[i].keyhash = obj_attr_data(&cert_obj_list[j],
+					CKA_HASH_OF_SUBJECT_PUBLIC_KEY);
+		} else {
+			certparts_get(cert_list[i].cert, &parts[i]);
+			added++;
+		}
+
+		if (data)
+			CFRelease(data);
 	}
 
-	if (! cn) {
-		os_log_debug(logsys, "SecCertificateCopyCommonName "
-			     "returned NULL");
-		return;
+	for (j = 0; j < cert_obj_count; j++)
+		if (! moved[j] && cert_obj_list[j].class == CKO_CERTIFICATE)
+			removed++;
+
+	if (added == 0 && removed == 0) {
+		os_log_debug(logsys, "Certificate slot is up to date");
+		/*
+		 * Something in the Keychain changed, just not our
+		 * certificates; republish so nobody else has to rescan.
+		 */
+		if (shared_catalog &&
+		    atomic_exchange(&cert_list_stamp, job.stamp) != job.stamp)
+			shared_publish(SHM_CATALOG_CERTS);
+		goto out;
 	}
 
-	count = CFArrayGetCount(cnmatch);
+	cert_issuers_find(parts, cert_list_count);
 
-	for (i = 0; i < count; i++) {
-		CFStringRef str = CFArrayGetValueAtIndex(cnmatch, i);
-		CFRange range;
+	/*
+	 * Build our new object list; the objects we keep are just moved
+	 * over, and get their new certificate index.
+	 */
 
-		range = CFStringFind(cn, str, 0);
+	for (i = 0; i < cert_list_count; i++) {
+		if (! oldpos[i]) {
+			cert_objects_add(&new_obj_list, &new_obj_count,
+					 &new_obj_size, i, &parts[i], handle);
+			handle += 2;
+			continue;
+		}
 
-		if (range.length > 0) {
-			/*
-			 * We have a match!
-			 */
-			add_cert_to_list(dict, cc);
-			break;
+		j = oldpos[i] - 1;
+
+		for (k = j; k < cert_obj_count && cert_obj_list[k].id_index ==
+						cert_obj_list[j].id_index; k++) {
+			/* Prime the pump */
+			NEW_OBJECT(new);
+			new_obj_count--;
+			new_obj_list[new_obj_count] = cert_obj_list[k];
+			new_obj_list[new_obj_count].id_index = i;
+			NEW_OBJECT(new);
 		}
 	}
 
-	CFRelease(cn);
+	if (compress_certs)
+		cert_objects_pack(new_obj_list, new_obj_count, false);
 
-	return;
-}
+	LOCK_MUTEX(id_mutex);
+	old_list = cert_obj_list;
+	old_count = cert_obj_count;
+	cert_obj_list = new_obj_list;
+	cert_obj_count = new_obj_count;
+	cert_obj_size = new_obj_size;
+	UNLOCK_MUTEX(id_mutex);
 
-/*
- * Match a certificate based on the issuer, and add it to our linked list
- * if it matches.
- */
+	for (j = 0; j < old_count; j++)
+		if (! moved[j])
+			obj_attrs_free(&old_list[j]);
 
-static void
-issuer_match(const void *value, void *context)
-{
-	struct certcontext *cc = (struct certcontext *) context;
-	CFDictionaryRef dict = (CFDictionaryRef) value;
-	CFDataRef match_issuer = (CFDataRef) cc->match;
-	CFDataRef issuer;
+	free(old_list);
 
-	/*
-	 * Get the issuer out of our certificate dictionary
-	 */
+	os_log_debug(logsys, "Certificate slot refreshed, %u certificate%s "
+		     "added, %u removed", added, added == 1 ? "" : "s",
+		     removed);
 
-	if (! CFDictionaryGetValueIfPresent(dict, kSecAttrIssuer,
-					    (const void **) &issuer)) {
-		os_log_debug(logsys, "Warning: cannot retrieve issuer from "
-			     "certificate");
-		return;
-	}
+	atomic_store(&cert_list_stamp, job.stamp);
 
-	if (CFEqual(issuer, match_issuer))
-		add_cert_to_list(dict, cc);
+	if (shared_catalog)
+		shared_publish(SHM_CATALOG_CERTS);
 
+	TRACE_SPAN(TRACE_refresh_certificates, start, CERTIFICATE_SLOT, 0);
+
+out:
+	for (i = 0; parts && i < cert_list_count; i++)
+		certparts_free(&parts[i]);
+	free(parts);
+	free(oldpos);
+	free(moved);
+	if (old_certs)
+		CFRelease(old_certs);
+	array_free(job.match);
+
+	prof_leave(phase);
+	pthread_mutex_unlock(&cert_scan_serial);
 }
 
 /*
- * Add a certificate dictionary to our linked list.
- *
- * Note that to prevent the dictionary from getting reclaimed underneath
- * us, we CFRetain() it; that means when you free the linked list you need
- * to release those objects.
+ * Return a copy of an object attribute as a CFData, or NULL if the
+ * object doesn't have it.
  */
 
-static void
-add_cert_to_list(CFDictionaryRef dict, struct certcontext *cc)
+static CFDataRef
+obj_attr_data(struct obj_info *obj, CK_ATTRIBUTE_TYPE type)
 {
-	struct certlist *cl = malloc(sizeof(*cl));
+	CK_ATTRIBUTE_PTR attr = find_attribute(obj, type);
+	CFDataRef data = NULL;
+	void *buf;
 
-	cl->certdict = dict;
-	CFRetain(cl->certdict);
-	cl->next = NULL;
+	if (! attr)
+		return NULL;
 
-	if (! cc->head) {
-		cc->head = cc->tail = cl;
-	} else {
-		cc->tail->next = cl;
-		cc->tail = cl;
-	}
-}
+	if (! attr_packed(obj, attr))
+		return CFDataCreate(NULL, attr->pValue, attr->ulValueLen);
 
-/*
- * Free a certificate list
- */
+	if ((buf = malloc(attr->ulValueLen ? attr->ulValueLen : 1)) &&
+	    attr_copy(obj, attr, buf))
+		data = CFDataCreate(NULL, buf, attr->ulValueLen);
 
-static void
-free_certlist(struct certlist *cl)
-{
-	struct certlist *cl2;
+	free(buf);
 
-	while (cl != NULL) {
-		cl2 = cl->next;
-		CFRelease(cl->certdict);
-		free(cl);
-		cl = cl2;
-	}
+	return data;
 }
 
 /*
- * Add a certificate to our internal list that ends up on the list of
- * trusted certificates we present from our certificate slot.
+ * Pack the certificates in an object list into our certificate store (see
+ * certstore.h); objects that are already packed are left alone.  If
+ * "train" is set (or we don't have one) we build a new dictionary from
+ * the names in this list first.  Call before the list is published.
  */
 
 static void
-add_certificate(CFDictionaryRef dict, CFMutableSetRef certs)
+cert_objects_pack(struct obj_info *list, unsigned int count, bool train)
 {
-	SecCertificateRef cert;
-	CFStringRef val;
-	CFDataRef pkey, subject;
-	struct certlist *cl, *ce;
-	unsigned int i, c = cert_list_count;
+	static const CK_ATTRIBUTE_TYPE name_types[CERTSTORE_NAMES_MAX] = {
+		CKA_SUBJECT, CKA_ISSUER, CKA_SERIAL_NUMBER,
+	};
+	struct certstore_sample *samples, names[CERTSTORE_NAMES_MAX];
+	struct certstore_packer *pk;
+	struct certstore_entry *e;
+	struct certstore_stats st;
+	struct obj_info *trust;
+	CK_ATTRIBUTE_PTR value, attr, tattr;
+	unsigned int i, k, n = 0, packed = 0;
+
+	if (train || ! cert_dict) {
+		samples = calloc(count * 2 + 1, sizeof(*samples));
+
+		for (i = 0; i < count; i++) {
+			if (list[i].class != CKO_CERTIFICATE)
+				continue;
+			for (k = 0; k < 2; k++) {
+				if (! (attr = find_attribute(&list[i],
+							     name_types[k])))
+					continue;
+				samples[n].data = attr->pValue;
+				samples[n++].len = attr->ulValueLen;
+			}
+		}
 
-#if 0
-	if (os_log_debug_enabled(logsys)) {
-		CFStringRef label = CFDictionaryGetValue(dict, kSecAttrLabel);
-		os_log_debug(logsys, "Adding certificate \"%{public}@\"",
-			     label ? label : CFSTR("Unknown certificate"));
+		certstore_dict_release(cert_dict);
+		cert_dict = certstore_dict_new(samples, n);
+		free(samples);
 	}
-#endif
 
-	/*
-	 * Before we do anything else, remove us from the certificate
-	 * set so we don't try to match on us again.
-	 */
+	if (! (pk = certstore_packer_new(cert_dict))) {
+		os_log_debug(logsys, "Unable to pack certificates");
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (list[i].class != CKO_CERTIFICATE || list[i].store ||
+		    ! (value = find_attribute(&list[i], CKA_VALUE)) ||
+		    ! value->pValue)
+			continue;
+
+		for (k = 0; k < CERTSTORE_NAMES_MAX; k++) {
+			attr = find_attribute(&list[i], name_types[k]);
+			names[k].data = attr ? attr->pValue : NULL;
+			names[k].len = attr ? attr->ulValueLen : 0;
+		}
 
-	CFSetRemoveValue(certs, dict);
+		if (! (e = certstore_pack(pk, value->pValue,
+					  value->ulValueLen, names,
+					  CERTSTORE_NAMES_MAX)))
+			continue;
 
-	/*
-	 * We never want hardware tokens in this list
-	 */
+		list[i].store = e;
+		free(value->pValue);
+		value->pValue = NULL;
 
-	if (CFDictionaryGetValueIfPresent(dict, kSecAttrAccessGroup,
-					  (const void **) &val)) {
-		if (CFEqual(val, kSecAttrAccessGroupToken)) {
-			os_log_debug(logsys, "Certificate is on hardware "
-				     "token, skipping");
-			return;
+		/*
+		 * The trust object right after the certificate has the
+		 * same issuer and serial number, so it can share them too.
+		 */
+
+		trust = NULL;
+		if (i + 1 < count && list[i + 1].class == CKO_NSS_TRUST &&
+		    list[i + 1].id_index == list[i].id_index &&
+		    ! list[i + 1].store) {
+			trust = &list[i + 1];
+			trust->store = certstore_retain(e);
 		}
-	}
 
-	/*
-	 * Extract our the certificate reference and public key hash; use
-	 * the public key hash to see if we have it already
-	 */
+		for (k = 0; k < CERTSTORE_NAMES_MAX; k++) {
+			if (! certstore_name(e, k) ||
+			    ! (attr = find_attribute(&list[i], name_types[k])))
+				continue;
+			if (trust &&
+			    (tattr = find_attribute(trust, name_types[k])) &&
+			    tattr->ulValueLen == attr->ulValueLen &&
+			    memcmp(tattr->pValue, attr->pValue,
+				   attr->ulValueLen) == 0) {
+				free(tattr->pValue);
+				tattr->pValue = (void *) certstore_name(e, k);
+			}
+			free(attr->pValue);
+			attr->pValue = (void *) certstore_name(e, k);
+		}
 
-	if (! CFDictionaryGetValueIfPresent(dict, kSecValueRef,
-					    (const void **) &cert)) {
-		os_log_debug(logsys, "No certificate reference found, "
-			     "skipping!");
-		return;
+		packed++;
 	}
 
-	if (! CFDictionaryGetValueIfPresent(dict, kSecAttrPublicKeyHash,
-					   (const void **) &pkey)) {
-		os_log_debug(logsys, "No public key hash found, skipping!");
-		return;
-	}
+	certstore_packer_free(pk);
 
-	/*
-	 * Search to see if we have this already.  I realize this will
-	 * start to perform poorly if we get a lot of certificates, but
-	 * we only do this once.
-	 */
+	certstore_stats(&st);
+	os_log_debug(logsys, "Packed %u certificate%s with a %zu byte "
+		     "dictionary; store has %llu bytes of certificates in "
+		     "%llu", packed, packed == 1 ? "" : "s",
+		     certstore_dict_size(cert_dict),
+		     (unsigned long long) st.value_bytes,
+		     (unsigned long long) st.stored_bytes);
+}
 
-	for (i = 0; i < cert_list_count; i++) {
-		if (CFEqual(pkey, cert_list[i].pkeyhash)) {
-			os_log_debug(logsys, "Certificate is already in list, "
-				     "skipping");
-			return;
-		}
-	}
+/*
+ * Return true if this attribute is a certificate we packed (which has
+ * no pValue of its own)
+ */
 
-	/*
-	 * Add this to our certificate list.
-	 */
+static bool
+attr_packed(struct obj_info *obj, CK_ATTRIBUTE_PTR attr)
+{
+	return obj->store && attr->type == CKA_VALUE && ! attr->pValue;
+}
 
-	if (++cert_list_count > cert_list_size) {
-		cert_list_size += 5;
+/*
+ * Copy an attribute value into a buffer big enough for it, unpacking it
+ * if we need to.  Returns false if we couldn't.
+ */
 
-		cert_list = realloc(cert_list,
-				    sizeof(*cert_list) * cert_list_size);
-	}
+static bool
+attr_copy(struct obj_info *obj, CK_ATTRIBUTE_PTR attr, void *buf)
+{
+	if (attr_packed(obj, attr))
+		return certstore_copy(obj->store, buf);
 
-	cert_list[c].cert = cert;
-	CFRetain(cert_list[c].cert);
-	cert_list[c].pkeyhash = pkey;
-	CFRetain(cert_list[c].pkeyhash);
+	memcpy(buf, attr->pValue, attr->ulValueLen);
 
-	/*
-	 * Generate a list of certificates ISSUED by this certificate,
-	 * and add them.
-	 */
+	return true;
+}
 
-	if (! CFDictionaryGetValueIfPresent(dict, kSecAttrSubject,
-					    (const void **) &subject)) {
-		os_log_debug(logsys, "Unable to retrieve subject, returning");
-		return;
-	}
+/*
+ * Free the attributes of an object (but not the object itself); values
+ * kept in the certificate store belong to it, not us.
+ */
 
-	cl = search_certs(certs, NULL, subject);
+static void
+obj_attrs_free(struct obj_info *obj)
+{
+	int i;
 
-	for (ce = cl; ce != NULL; ce = ce->next)
-		add_certificate(ce->certdict, certs);
+	for (i = 0; i < obj->attr_count; i++)
+		if (! certstore_owns(obj->store, obj->attrs[i].pValue))
+			free(obj->attrs[i].pValue);
 
-	free_certlist(cl);
+	free(obj->attrs);
+	certstore_release(obj->store);
 
-	return;
+	obj->attrs = NULL;
+	obj->attr_count = obj->attr_size = 0;
+	obj->store = NULL;
 }
 
 /*
- * Get the SecAccessControl object from the identity.
- *
- * This is a little subtle; we don't actually want the SecAccessControl
- * object for the IDENTITY, we want it for the private key (as it turns
- * out, they are different).  So what we need to do is get the attributes
- * for the key using SecItemCopyMatching(); the SecAccessControl object
- * will be in there.
+ * Pick apart a certificate into a certparts structure; anything we can't
+ * get is left NULL.  If the certificate is self-issued then the issuer
+ * key hash is the same as the subject key hash.
  */
 
-static SecAccessControlRef
-getaccesscontrol(CFDictionaryRef dict)
+static void
+certparts_get(SecCertificateRef cert, struct certparts *parts)
 {
-	SecAccessControlRef accret;
-	CFDictionaryRef accquery, attrdict;
-	CFDataRef label;
-	OSStatus ret;
+	uint64_t pstart;
 
-	/*
-	 * Our keys for our query dictionary for SecItemCopyMaching().
-	 *
-	 * In order:
-	 *
-	 * kSecClass = kSecClassKey
-	 *	This means we're searching for keys (instead of identities
-	 *	or certificates)
-	 * kSecAttrKeyClass = kSecAttrKeyClassPrivate
-	 *	We want to match on the private key
-	 * kSecAttrApplicationLabel
-	 *	This is the "application label" of the key.  We get this
-	 *	from the identity dictionary, and it makes sure we get the
-	 *	private key associated with this identity.
-	 * kSecMatchLimit = kSecMatchLimitOne
-	 *	We only want one match (really, we should only have one
-	 *	match, but let's be safe)
-	 * kSecReturnAttributes = kCFBooleanTrue
-	 *	We want to get all of the attributes so we can find the
-	 *	SecAccessControlRef
-	 */
+	memset(parts, 0, sizeof(*parts));
 
-	const void *keys[] = {
-		kSecClass,
-		kSecAttrKeyClass,
-		kSecAttrApplicationLabel,
-#define ATTR_LABEL_INDEX 2
-		kSecMatchLimit,
-		kSecReturnAttributes,
-	};
+	pstart = prof_now();
+	parts->value = SecCertificateCopyData(cert);
+	PROF_RECORD(SecCertificateCopyData, pstart,
+		    parts->value ? 0 : PROF_FAILED);
 
-	const void *values[] = {
-		kSecClassKey,		/* kSecClass */
-		kSecAttrKeyClassPrivate,/* kSecAttrKeyClass */
-		NULL,			/* Application Label, fill in later */
-		kSecMatchLimitOne,	/* kSecMatchLimit */
-		kCFBooleanTrue,		/* kSecReturnAttributes */
-	};
+	if (! parts->value)
+		return;
 
-	/*
-	 * Build our query dictionary to retrieve the key attributes.  We
-	 * need the application label from the original identity (this is
-	 * passed down in "dict")
-	 */
+	get_certificate_info(parts->value, &parts->serial, &parts->issuer,
+			     &parts->subject);
+	parts->hash = get_hash(kSecDigestSHA1, 0, parts->value);
+	get_certificate_keyinfo(parts->value, &parts->spki, &parts->keyhash,
+				&parts->start, &parts->end);
 
-	if (! CFDictionaryGetValueIfPresent(dict, kSecAttrApplicationLabel,
-				    (const void **) &label)) {
-		os_log_debug(logsys, "Application Label object not found");
-		return NULL;
+	if (parts->keyhash && parts->subject && parts->issuer &&
+	    CFEqual(parts->subject, parts->issuer))
+		parts->issuerhash = CFRetain(parts->keyhash);
+}
+
+static void
+certparts_free(struct certparts *parts)
+{
+	CFDataRef *d[] = { &parts->value, &parts->subject, &parts->issuer,
+			   &parts->serial, &parts->hash, &parts->spki,
+			   &parts->keyhash, &parts->issuerhash };
+	int i;
+
+	for (i = 0; i < sizeof(d) / sizeof(d[0]); i++) {
+		if (*d[i])
+			CFRelease(*d[i]);
+		*d[i] = NULL;
 	}
+}
 
-	values[ATTR_LABEL_INDEX] = label;
+/*
+ * Copy the objects for one catalog slot into one of our object lists
+ */
 
-	accquery = CFDictionaryCreate(NULL, keys, values,
-				      sizeof(keys)/sizeof(keys[0]),
-				      &kCFTypeDictionaryKeyCallBacks,
-				      &kCFTypeDictionaryValueCallBacks);
+#define CATALOG_IMPORT(name, buf, slot) \
+do { \
+	const struct catalog_header *hdr = buf; \
+	unsigned int j, k; \
+	if (hdr->obj_count[slot] > 0) { \
+		NEW_OBJECT(name); \
+		name ## _obj_count--; \
+	} \
+	for (j = 0; j < hdr->obj_count[slot]; j++) { \
+		const struct catalog_object *obj = \
+					catalog_object(buf, slot, j); \
+		i = obj->id_index; \
+		OBJINIT(name); \
+		name ## _obj_list[ name ## _obj_count ].class = obj->class; \
+		if (obj->handle) \
+			name ## _obj_list[ name ## _obj_count ].handle = \
+								obj->handle; \
+		for (k = 0; k < obj->attr_count; k++) { \
+			const struct catalog_attr *attr = \
+						catalog_attr(buf, obj, k); \
+			ADD_ATTR_SIZE(name, attr->type, \
+				      catalog_value(buf, attr), attr->length); \
+		} \
+		NEW_OBJECT(name); \
+	} \
+} while (0)
 
-	if (accquery == NULL) {
-		os_log_debug(logsys, "Access control ref query dictionary "
-			     "creation returned NULL");
-		return NULL;
-	}
+/*
+ * Replace our identity list and object list with the contents of a
+ * catalog we got from the broker.  Since we don't have any Security
+ * framework references in broker mode all of the reference fields in
+ * our identity list are NULL.
+ *
+ * The broker's certificate slot is only imported once, the first time
+ * we see it; we never rescan the certificate slot locally either.
+ *
+ * Should be called with id_mutex locked.
+ */
 
-	/*
-	 * Perform the actual query
-	 */
+static void
+catalog_import(const void *buf)
+{
+	const struct catalog_header *hdr = buf;
+	const struct catalog_ident *id;
+	enum certstate status = uninitialized;
+	int i;
 
-	ret = SecItemCopyMatching(accquery, (CFTypeRef *) &attrdict);
+	os_log_debug(logsys, "Importing broker catalog generation %llu: "
+		     "%u identities, %u objects, %u certificate objects",
+		     (unsigned long long) hdr->generation, hdr->ident_count,
+		     hdr->obj_count[0], hdr->obj_count[1]);
 
-	CFRelease(accquery);
+	obj_free(&id_obj_list, &id_obj_count, &id_obj_size);
+	id_list_free();
 
-	if (ret) {
-		LOG_SEC_ERR("Access control ref SecItemCopyMatching "
-			    "failed: %{public}@", ret);
-		return NULL;
-	}
+	for (i = 0; i < hdr->ident_count; i++) {
+		id = catalog_ident(buf, i);
 
-	/*
-	 * Just in case, make sure we got a CFDictionaryRef
-	 */
+		if (++id_list_count > id_list_size) {
+			id_list_size += 5;
+			id_list = realloc(id_list,
+					  sizeof(*id_list) * id_list_size);
+		}
 
-	if (CFGetTypeID(attrdict) != CFDictionaryGetTypeID()) {
-		logtype("Was expecting a CFDictionary, but got", attrdict);
-		CFRelease(attrdict);
-		return NULL;
+		memset(&id_list[i], 0, sizeof(id_list[i]));
+		id_list[i].label = strdup(catalog_string(buf, id->label));
+		id_list[i].keytype = id->keytype;
+		id_list[i].blocksize = id->blocksize;
+		id_list[i].privcansign = id->flags & CATALOG_ID_SIGN;
+		id_list[i].privcandecrypt = id->flags & CATALOG_ID_DECRYPT;
+		id_list[i].pubcanverify = id->flags & CATALOG_ID_VERIFY;
+		id_list[i].pubcanencrypt = id->flags & CATALOG_ID_ENCRYPT;
+		id_list[i].pubcanwrap = id->flags & CATALOG_ID_WRAP;
+		id_mechs_fallback(&id_list[i]);
 	}
 
-	if (! CFDictionaryGetValueIfPresent(attrdict, kSecAttrAccessControl,
-					    (const void **) &accret)) {
-		os_log_debug(logsys, "Access Control object not found");
-		CFRelease(attrdict);
-		return NULL;
-	}
+	CATALOG_IMPORT(id, buf, 0);
 
-	CFRetain(accret);
-	CFRelease(attrdict);
+	free(broker_label);
+	broker_label = strdup(catalog_string(buf, hdr->token_label));
+
+	id_list_changed();
 
-	return accret;
+	id_list_generation = hdr->generation;
+	id_list_init = true;
+
+	if ((hdr->flags & CATALOG_HAS_CERTS) &&
+	    atomic_compare_exchange_strong(&cert_list_status, &status,
+					   initializing)) {
+		CATALOG_IMPORT(cert, buf, 1);
+		if (compress_certs)
+			cert_objects_pack(cert_obj_list, cert_obj_count, true);
+		atomic_store(&cert_list_status, initialized);
+	}
 }
 
 /*
- * Return the user-printable label for a key.
+ * Build a catalog out of our identity list and token objects (if "ids" is
+ * set) and our certificate objects (if "certs" is set).  Returns a buffer
+ * that must be free()d, or NULL if we ran out of memory.
  *
- * Sigh.  It turns out some applications REALLY want a printable label
- * associated with a key; we'll fetch the key label from the attribute
- * dictionary.  Returns string that must always be free()d.
+ * If ids is set this should be called with id_mutex locked.
  */
 
-static char *
-getkeylabel(SecKeyRef key)
+static void *
+catalog_export(bool ids, bool certs, size_t *len)
 {
-	CFDictionaryRef keyattr = NULL, query = NULL, result = NULL;
-	CFStringRef label;
-	OSStatus ret;
-	char *retstr;
-
-	/*
-	 * Slightly more complicated than I would like, but we're trying to
-	 * conform to the Security framework APIs as I understand them.
-	 *
-	 * Fetch the key attributes using SecKeyCopyAttributes (the label
-	 * isn't one of the supported attributes that SecKeyCopyAttributes
-	 * is supposed to return).
-	 *
-	 * Use the KeyClass and application label in a query dictionary
-	 * to retrieve the complete attribute dictionary, and return the
-	 * kSecAttrLabel value.
-	 */
+	struct catalog *cat;
+	CFStringRef summary;
+	uint32_t flags = 0;
+	char *label;
+	int i;
 
-	/*
-	 * Our query dictionary; see above for greater detail
-	 *
-	 * kSecClass = kSecClassKey
-	 * kSecAttrKeyClass (from key)
-	 * kSecAttrApplicationLabel (from key)
-	 * kSecMatchLimit = kSecMatchLimitOne
-	 * kSecReturnAttributes = kCFBooleanTrue
-	 */
+	if (! (cat = catalog_new()))
+		return NULL;
 
-	const void *keys[] = {
-		kSecClass,
-#define KEYCLASS_INDEX 1
-		kSecAttrKeyClass,
-#define KEYLABEL_INDEX 2
-		kSecAttrApplicationLabel,
-		kSecMatchLimit,
-		kSecReturnAttributes,
-	};
+	if (ids && id_list_count > 0 &&
+	    (summary = SecCertificateCopySubjectSummary(id_list[0].cert))) {
+		label = getstrcopy(summary);
+		catalog_set_token_label(cat, label);
+		free(label);
+		CFRelease(summary);
+	}
 
-	const void *values[] = {
-		kSecClassKey,		/* kSecClass */
-		NULL,			/* kSecAttrKeyClass */
-		NULL,			/* kSecAttrApplicationLabel */
-		kSecMatchLimitOne,	/* kSecMatchLimit */
-		kCFBooleanTrue,		/* kSecReturnAttributes */
-	};
+	for (i = 0; ids && i < id_list_count; i++)
+		catalog_add_ident(cat, id_list[i].label,
+			(id_list[i].privcansign ? CATALOG_ID_SIGN : 0) |
+			(id_list[i].privcandecrypt ? CATALOG_ID_DECRYPT : 0) |
+			(id_list[i].pubcanverify ? CATALOG_ID_VERIFY : 0) |
+			(id_list[i].pubcanencrypt ? CATALOG_ID_ENCRYPT : 0) |
+			(id_list[i].pubcanwrap ? CATALOG_ID_WRAP : 0),
+			id_list[i].keytype, id_list[i].blocksize);
+
+	for (i = 0; ids && i < id_obj_count; i++)
+		catalog_add_object(cat, 0, id_obj_list[i].class,
+				   id_obj_list[i].id_index,
+				   id_obj_list[i].handle,
+				   id_obj_list[i].attrs,
+				   id_obj_list[i].attr_count);
+
+	if (certs) {
+		flags |= CATALOG_HAS_CERTS;
+		catalog_set_stamp(cat, atomic_load(&cert_list_stamp));
+		for (i = 0; i < cert_obj_count; i++)
+			cert_object_export(cat, &cert_obj_list[i]);
+	}
 
-	keyattr = SecKeyCopyAttributes(key);
+	return catalog_finish(cat, id_list_generation, flags, len);
+}
 
-	if (! keyattr) {
-		os_log_debug(logsys, "SecKeyCopyAttr returned NULL");
-		retstr = strdup("Unknown key");
-		goto out;
-	}
+/*
+ * Add a certificate slot object to a catalog.  Catalogs always get the
+ * certificate itself, so if we packed it we unpack a copy.
+ */
 
-	if (! CFDictionaryGetValueIfPresent(keyattr, kSecAttrKeyClass,
-					    &values[KEYCLASS_INDEX])) {
-		os_log_debug(logsys, "Cannot find KeyClass in dict");
-		retstr = strdup("Unknown key");
-		goto out;
-	}
+static void
+cert_object_export(struct catalog *cat, struct obj_info *obj)
+{
+	CK_ATTRIBUTE_PTR attrs = obj->attrs, attr;
+	void *buf = NULL;
+
+	if ((attr = find_attribute(obj, CKA_VALUE)) && attr_packed(obj, attr)) {
+		attrs = malloc(obj->attr_count * sizeof(*attrs));
+		buf = malloc(attr->ulValueLen ? attr->ulValueLen : 1);
+
+		if (! attrs || ! buf || ! attr_copy(obj, attr, buf)) {
+			os_log_debug(logsys, "Unable to unpack certificate "
+				     "%lu for catalog", obj->handle);
+			free(attrs);
+			free(buf);
+			return;
+		}
 
-	if (! CFDictionaryGetValueIfPresent(keyattr, kSecAttrApplicationLabel,
-					    &values[KEYLABEL_INDEX])) {
-		os_log_debug(logsys, "Cannot find AppLabel in dict");
-		retstr = strdup("Unknown key");
-		goto out;
+		memcpy(attrs, obj->attrs, obj->attr_count * sizeof(*attrs));
+		attrs[attr - obj->attrs].pValue = buf;
 	}
 
-	query = CFDictionaryCreate(NULL, keys, values,
-				   sizeof(keys)/sizeof(keys[0]),
-				   &kCFTypeDictionaryKeyCallBacks,
-				   &kCFTypeDictionaryValueCallBacks);
+	catalog_add_object(cat, 1, obj->class, obj->id_index, obj->handle,
+			   attrs, obj->attr_count);
 
-	if (! query) {
-		os_log_debug(logsys, "Unable to create query dictionary");
-		retstr = strdup("Unknown key");
-		goto out;
-	}
+	if (attrs != obj->attrs)
+		free(attrs);
+	free(buf);
+}
 
-	ret = SecItemCopyMatching(query, (CFTypeRef *) &result);
+/*
+ * Export our identity list and object lists as a catalog; this is used
+ * by the broker daemon.  Returns a buffer that must be free()d.
+ */
 
-	if (ret) {
-		LOG_SEC_ERR("SecItemCopyMatching failed: %{public}@", ret);
-		retstr = strdup("Unknown key");
-		goto out;
-	}
+void *
+keychain_catalog_export(size_t *len, uint64_t *generation)
+{
+	void *buf;
 
-	if (CFGetTypeID(result) != CFDictionaryGetTypeID()) {
-		logtype("Was expecting a CFDictionaryRef, but got", result);
-		retstr = strdup("Unknown key");
-		goto out;
-	}
+	LOCK_MUTEX(id_mutex);
 
-	if (! CFDictionaryGetValueIfPresent(result, kSecAttrLabel,
-					    (const void **) &label)) {
-		os_log_debug(logsys, "Unable to find key label");
-		retstr = strdup("Unknown key");
-	} else {
-		retstr = getstrcopy(label);
-	}
+	*generation = id_list_generation;
+	buf = catalog_export(true, atomic_load(&cert_list_status) ==
+			     initialized, len);
 
-out:
-	if (keyattr)
-		CFRelease(keyattr);
-	if (query)
-		CFRelease(query);
-	if (result)
-		CFRelease(result);
+	UNLOCK_MUTEX(id_mutex);
 
-	return retstr;
+	return buf;
 }
 
 /*
- * A "safe" version of CFArrayGetCount().
- *
- * SecItemCopyMatching can sometimes return a single entry or a CFArrayRef
- * with multiple entries.  So to be as robust as possible, handle this case
- * here.  If we have something OTHER than a CFArrayRef, then just return a
- * count of "1".  Otherwise return the real array count.
+ * Publish one of our catalogs in shared memory.  The token slot catalog
+ * should be published with id_mutex locked.
  */
 
-static unsigned int
-cflistcount(CFTypeRef ref)
+static void
+shared_publish(int which)
 {
-	if (CFGetTypeID(ref) == CFArrayGetTypeID()) {
-		return CFArrayGetCount((CFArrayRef) ref);
-	} else {
-		return 1;
+	size_t len;
+	void *buf;
+
+	buf = catalog_export(which == SHM_CATALOG_TOKEN,
+			     which == SHM_CATALOG_CERTS, &len);
+
+	if (buf) {
+		os_log_debug(logsys, "Publishing shared %{public}s catalog "
+			     "(%zu bytes)", which == SHM_CATALOG_TOKEN ?
+			     "token" : "certificate", len);
+		shm_catalog_publish(which, buf, len);
+		free(buf);
 	}
 }
 
 /*
- * A "safe" version of CFArrayGetValueAtIndex
+ * Try to build our token objects from the shared token catalog.  We can
+ * only use it if it was built from the same identities we just found;
+ * since every identity gets a certificate object, we check that the
+ * certificate objects match our identity list.  Returns true if we used
+ * the shared catalog.
  *
- * If the passed-in type is a CFArray, then return the appropriate value
- * at the passed-in index.  If it is a CFDictionaryRef, then just return
- * passed-in value if the index is 0; anything else, return a NULL.
+ * Should be called with id_mutex locked, after the identity list has been
+ * built.
  */
 
-static CFDictionaryRef
-cfgetindex(CFTypeRef ref, unsigned int index)
+static bool
+shared_id_import(void)
 {
-	if (CFGetTypeID(ref) == CFArrayGetTypeID()) {
-		return CFArrayGetValueAtIndex((CFArrayRef) ref, index);
-	} else if (CFGetTypeID(ref) == CFDictionaryGetTypeID() && index == 0) {
-		return ref;
-	} else {
-		return NULL;
+	const struct catalog_header *hdr;
+	const struct catalog_object *obj;
+	const struct catalog_attr *attr;
+	const struct catalog_ident *id;
+	unsigned int j, k, certs = 0;
+	bool match = true;
+	CFDataRef data;
+	uint64_t gen, pstart;
+	size_t len;
+	void *buf;
+	int i;
+
+	if (! (buf = shm_catalog_fetch(SHM_CATALOG_TOKEN, 0, &len, &gen)))
+		return false;
+
+	hdr = buf;
+
+	if (hdr->ident_count != id_list_count)
+		match = false;
+
+	for (i = 0; match && i < id_list_count; i++) {
+		id = catalog_ident(buf, i);
+		if (strcmp(catalog_string(buf, id->label),
+			   id_list[i].label) != 0)
+			match = false;
 	}
-}
 
-/*
- * Make sure the our custom logging system is enabled
- */
+	for (j = 0; match && j < hdr->obj_count[0]; j++) {
+		obj = catalog_object(buf, 0, j);
 
-static void
-log_init(void *context)
-{
-	logsys = os_log_create(APPIDENTIFIER, "general");
+		if (obj->class != CKO_CERTIFICATE)
+			continue;
+
+		certs++;
+
+		for (k = 0; k < obj->attr_count; k++) {
+			attr = catalog_attr(buf, obj, k);
+			if (attr->type == CKA_VALUE)
+				break;
+		}
+
+		if (k == obj->attr_count) {
+			match = false;
+			break;
+		}
+
+		pstart = prof_now();
+		data = SecCertificateCopyData(id_list[obj->id_index].cert);
+		PROF_RECORD(SecCertificateCopyData, pstart,
+			    data ? 0 : PROF_FAILED);
+
+		if (! data || CFDataGetLength(data) != attr->length ||
+		    memcmp(CFDataGetBytePtr(data), catalog_value(buf, attr),
+			   attr->length) != 0)
+			match = false;
+
+		if (data)
+			CFRelease(data);
+	}
+
+	if (! match || certs != id_list_count) {
+		os_log_debug(logsys, "Shared token catalog generation %llu "
+			     "does not match our identities",
+			     (unsigned long long) gen);
+		free(buf);
+		return false;
+	}
+
+	os_log_debug(logsys, "Using shared token catalog generation %llu",
+		     (unsigned long long) gen);
+
+	CATALOG_IMPORT(id, buf, 0);
+
+	free(buf);
+
+	return true;
 }
 
 /*
- * Free our identity list
+ * Try to build our certificate objects from the shared certificate
+ * catalog.  It is only good if it was built from the same Keychain files
+ * (and certificate search) we'd be looking at now, and was published
+ * recently.  Returns true if we used the shared catalog.
  */
 
-static void
-id_list_free(void)
+static bool
+shared_cert_import(char **certs)
 {
+	const struct catalog_header *hdr;
+	uint64_t gen, stamp;
+	size_t len;
+	void *buf;
 	int i;
 
-	for (i = 0; i < id_list_count; i++) {
-		if (id_list[i].label)
-			free(id_list[i].label);
-		if (id_list[i].ident)
-			CFRelease(id_list[i].ident);
-		if (id_list[i].privkey)
-			CFRelease(id_list[i].privkey);
-		if (id_list[i].pubkey)
-			CFRelease(id_list[i].pubkey);
-		if (id_list[i].cert)
-			CFRelease(id_list[i].cert);
-		if (id_list[i].secaccess)
-			CFRelease(id_list[i].secaccess);
-		if (id_list[i].pkeyhash)
-			CFRelease(id_list[i].pkeyhash);
+	if (! (buf = shm_catalog_fetch(SHM_CATALOG_CERTS, SHARED_CERT_MAXAGE,
+				       &len, &gen)))
+		return false;
+
+	hdr = buf;
+	stamp = shm_keychain_stamp(certs);
+
+	if (! (hdr->flags & CATALOG_HAS_CERTS)) {
+		free(buf);
+		return false;
 	}
 
-	if (id_list)
-		free(id_list);
+	if (hdr->stamp != stamp) {
+		os_log_debug(logsys, "Shared certificate catalog generation "
+			     "%llu is out of date", (unsigned long long) gen);
+		free(buf);
+		return false;
+	}
 
-	id_list = NULL;
-	id_list_count = id_list_size = 0;
+	atomic_store(&cert_list_stamp, stamp);
+
+	os_log_debug(logsys, "Using shared certificate catalog generation "
+		     "%llu", (unsigned long long) gen);
+
+	CATALOG_IMPORT(cert, buf, 1);
+
+	if (compress_certs)
+		cert_objects_pack(cert_obj_list, cert_obj_count, true);
+
+	free(buf);
+
+	return true;
 }
 
 /*
- * A version of snprintf() which does space-padding
+ * Return the current generation of our identity list
  */
 
-static void
-sprintfpad(unsigned char *dest, size_t destsize, const char *fmt, ...)
+uint64_t
+keychain_generation(void)
 {
-	char *s;
-	va_list ap;
-	int rc;
+	uint64_t gen;
 
-	va_start(ap, fmt);
-	rc = vasprintf(&s, fmt, ap);
-	va_end(ap);
+	LOCK_MUTEX(id_mutex);
+	gen = id_list_generation;
+	UNLOCK_MUTEX(id_mutex);
 
-	if (rc < 1) {
-		memset(dest, ' ', destsize);
-	} else {
-		/* We are relying on strncpy not doing \0 at end for trunc */
-		strncpy((char *) dest, s, destsize);
-		if (rc < destsize)
-			memset(dest + rc, ' ', destsize - rc);
-		free(s);
-	}
+	return gen;
 }
 
 /*
- * Return a boolean value based on a dictionary key.  If the key is not
- * set then return false.
+ * Ask the broker for its catalog; if it has changed since the last time
+ * we asked, import it.  Returns -1 on failure, 0 on success.
+ *
+ * Should be called with id_mutex locked; we let go of it while we wait
+ * for the daemon.
  */
 
-bool
-boolfromdict(const char *keyname, CFDictionaryRef dict, CFTypeRef key)
+static int
+broker_refresh(void)
 {
-	CFTypeRef val;
+	struct broker_msg msg;
+	void *reply;
+	uint64_t start;
+	CK_RV rv;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = BROKER_CATALOG;
+	msg.arg[0] = id_list_init ? id_list_generation : 0;
+
+	/*
+	 * The daemon may rescan before it answers, so don't make everyone
+	 * else wait for that.
+	 */
+
+	UNLOCK_MUTEX(id_mutex);
+
+	start = TRACE_NOW();
+	rv = broker_call(&msg, NULL, 0, &reply);
+	TRACE_SPAN(TRACE_broker_call, start, BROKER_CATALOG, rv);
+
+	LOCK_MUTEX(id_mutex);
+
+	if (rv != CKR_OK) {
+		os_log_debug(logsys, "Broker catalog request failed: %s",
+			     getCKRName(rv));
+		return -1;
+	}
 
-	if (! CFDictionaryGetValueIfPresent(dict, key, &val)) {
-		os_log_debug(logsys, "No value for %s in dictionary, "
-			     "returning FALSE", keyname);
-		return false;
+	if (msg.length == 0) {
+		os_log_debug(logsys, "Broker catalog unchanged");
+		return 0;
 	}
 
-	if (CFGetTypeID(val) != CFBooleanGetTypeID() &&
-	    CFGetTypeID(val) != CFNumberGetTypeID()) {
-		os_log_debug(logsys, "%s was not a boolean, but exists, so "
-			     "returning TRUE", keyname);
-		return true;
+	if (! catalog_valid(reply, msg.length)) {
+		os_log_debug(logsys, "Broker sent us an invalid catalog!");
+		free(reply);
+		return -1;
 	}
 
-	os_log_debug(logsys, "%s is set to %{bool}d", keyname,
-		     CFBooleanGetValue(val));
+	/*
+	 * Someone else may have imported a catalog while we were waiting;
+	 * only replace it if ours is newer.
+	 */
 
-	return CFBooleanGetValue(val);
+	if (id_list_init && ((const struct catalog_header *)
+			     reply)->generation <= id_list_generation) {
+		os_log_debug(logsys, "Broker catalog already imported");
+		free(reply);
+		return 0;
+	}
+
+	catalog_import(reply);
+	free(reply);
+
+	return 0;
 }
 
 /*
- * Get a C string from a CFStringRef (assumes UTF-8 encoding).
- * Allocates memory that must be free()d.
+ * Perform a key operation using the broker.  This looks like the
+ * SecKey functions it replaces; on failure we return NULL and set
+ * an error whose code is the CK_RV the broker returned.  The generation
+ * is the one our key handle came from; callers don't hold id_mutex
+ * while we wait for the daemon, so they pass it in.
  */
 
-static char *
-getstrcopy(CFStringRef string)
+static CFDataRef
+broker_keyop(uint32_t op, uint64_t generation, CK_SLOT_ID slot,
+	     CK_OBJECT_HANDLE obj, CK_MECHANISM_TYPE mech, CFDataRef in,
+	     CFDataRef sig, CFErrorRef *err)
 {
-	const char *s = CFStringGetCStringPtr(string, kCFStringEncodingUTF8);
+	struct broker_msg msg;
+	CFIndex inlen = CFDataGetLength(in);
+	CFIndex siglen = sig ? CFDataGetLength(sig) : 0;
+	unsigned char *data;
+	CFDataRef out;
+	void *reply;
+	uint64_t start;
+	CK_RV rv;
 
-	if (! s) {
-		CFIndex len = CFStringGetLength(string);
-		CFIndex size = CFStringGetMaximumSizeForEncoding(len,
-						 kCFStringEncodingUTF8) + 1;
-		char *p = malloc(size);
+	memset(&msg, 0, sizeof(msg));
+	msg.type = op;
+	msg.generation = generation;
+	msg.arg[0] = slot;
+	msg.arg[1] = obj;
+	msg.arg[2] = mech;
+	msg.arg[3] = inlen;
 
-		if (! CFStringGetCString(string, p, size,
-					 kCFStringEncodingUTF8)) {
-			free(p);
-			return strdup("Unknown string");
-		}
+	data = malloc(inlen + siglen + 1);
+	memcpy(data, CFDataGetBytePtr(in), inlen);
+	if (sig)
+		memcpy(data + inlen, CFDataGetBytePtr(sig), siglen);
 
-		return p;
-	} else {
-		return strdup(s);
+	start = TRACE_NOW();
+	rv = broker_call(&msg, data, inlen + siglen, &reply);
+	TRACE_SPAN(TRACE_broker_call, start, op, rv);
+
+	free(data);
+
+	if (rv != CKR_OK) {
+		free(reply);
+		*err = CFErrorCreate(NULL, CFSTR(APPIDENTIFIER), rv, NULL);
+		return NULL;
 	}
+
+	out = CFDataCreate(NULL, reply, msg.length);
+	free(reply);
+
+	return out;
 }
 
 /*
- * Log this object's type
+ * Remember a verification we did through the broker.  We didn't hold
+ * id_mutex while we waited for it, so it's only good if our catalog is
+ * still the one the key handle came from.
  */
 
-void
-logtype(const char *string, CFTypeRef ref)
+static void
+broker_vcache_insert(const unsigned char *vkey, uint64_t generation)
 {
-	CFTypeID id = CFGetTypeID(ref);
-	CFStringRef str = CFCopyTypeIDDescription(id);
-
-	os_log_debug(logsys, "%s: %{public}@", string, str);
-
-	CFRelease(str);
+	LOCK_MUTEX(id_mutex);
+	if (id_list_generation == generation)
+		vcache_insert(vkey);
+	UNLOCK_MUTEX(id_mutex);
 }
 
-#if defined(KEYCHAIN_DEBUG)
 /*
- * Dump the contents of a dictionary
+ * Log in using the broker.  The daemon doesn't care about our catalog
+ * generation for this, and we're called without id_mutex.
  */
 
-void
-dumpdict(const char *string, CFDictionaryRef dict)
+static CK_RV
+broker_login(CK_UTF8CHAR_PTR pin, CK_ULONG pinlen)
 {
-	unsigned int i, count = CFDictionaryGetCount(dict);
-	const void **keys, **values;
-
-	os_log_debug(logsys, "Dumping dictionary for %s", string);
-	os_log_debug(logsys, "Dictionary contains %u key/value pairs", count);
+	struct broker_msg msg;
+	void *reply;
+	uint64_t start;
+	CK_RV rv;
 
-	keys = malloc(sizeof(void *) * count);
-	values = malloc(sizeof(void *) * count);
+	memset(&msg, 0, sizeof(msg));
+	msg.type = BROKER_LOGIN;
+	msg.arg[0] = pin != NULL;
 
-	CFDictionaryGetKeysAndValues(dict, keys, values);
+	start = TRACE_NOW();
+	rv = broker_call(&msg, pin, pin ? pinlen : 0, &reply);
+	TRACE_SPAN(TRACE_broker_call, start, BROKER_LOGIN, rv);
 
-	for (i = 0; i < count; i++) {
-		os_log_debug(logsys, "Dictionary entry %d", (int) i);
-		os_log_debug(logsys, "Key value: %{public}@", keys[i]);
-		logtype("Value type", values[i]);
-		os_log_debug(logsys, "Value value: %{public}@", values[i]);
-	}
+	free(reply);
 
-	free(keys);
-	free(values);
+	return rv;
 }
-#endif /* KEYCHAIN_DEBUG */
 
 /*
- * Convert Security framework key types to PKCS#11 key types.
- *
- * Sigh.  This is a lot harder than I would like.  The Apple API is in flux;
- * what the attribute dictionary returns is a CFNumber, but the constants
- * you use are actually CFStrings which happen to have string values which
- * correspond to the CFNumbers.  The numbers correspond to the values of
- * CSSM_ALGORITHMS in cssmtype.h.  So that means a RSA key, for example,
- * shows up in the attribute dictionary as a CFNumber with a value of 42,
- * but the constant kSecAttrKeyTypeRSA is a CFString with the value of "42".
- * (There is magic in the Security framework that lets you use things like
- * kSecAttrKeyTypeRSA as an input key for kSecAttrKeyType).
- *
- * I am hesitant to include cssmtype.h, so what I have decided to do is
- * convert the dictionary number we are given to a string and compare it
- * against the relevant "new" API constants.  Hopefully we don't have that
- * many.
+ * Free our object list and all associated data
  */
 
-static CK_KEY_TYPE
-convert_keytype(CFNumberRef type)
+static void
+obj_free(struct obj_info **obj, unsigned int *count, unsigned int *size)
 {
 	int i;
-	CFStringRef str = CFStringCreateWithFormat(NULL, NULL, CFSTR("%@"),
-						   type);
-
-	for (i = 0; keytype_map[i].keyname; i++) {
-		if (CFEqual(str, *keytype_map[i].sec_keytype)) {
-			os_log_debug(logsys, "This is a %s",
-				     keytype_map[i].keyname);
-			CFRelease(str);
-			return keytype_map[i].pkcs11_keytype;
-		}
-	}
 
-	CFRelease(str);
+	for (i = 0; i < *count; i++)
+		obj_attrs_free(&(*obj)[i]);
 
-	os_log_debug(logsys, "Keytype is unknown, returning VENDOR_DEFINED");
+	free(*obj);
 
-	return CKK_VENDOR_DEFINED;
+	*obj = NULL;
+	*count = *size = 0;
 }
 
 /*
- * Build our list of objects based on our identities
+ * Return the handle for a token object belonging to the identity with
+ * the given key.  If we've handed out a handle for it before we return
+ * that; otherwise we make one up from the key (so it's the same in every
+ * process, which the broker depends on) and remember it.  Call with
+ * id_mutex locked.
  */
 
-#define ADD_ATTR_SIZE(name, attribute, var, size) \
-do { \
-	void *p = malloc(size); \
-	memcpy(p, var, size); \
-	if ( name ## _obj_list[ name ## _obj_count ].attr_count >= \
-	    name ## _obj_list[ name ## _obj_count ].attr_size) { \
-		name ## _obj_list[ name ## _obj_count ].attr_size += 5; \
-		name ## _obj_list[ name ## _obj_count ].attrs = realloc( name ## _obj_list[ name ## _obj_count ].attrs, \
-			name ## _obj_list[ name ## _obj_count ].attr_size * sizeof(CK_ATTRIBUTE)); \
-	} \
-	name ## _obj_list[ name ## _obj_count ].attrs[ name ## _obj_list[ name ## _obj_count].attr_count].type = attribute; \
-	name ## _obj_list[ name ## _obj_count ].attrs[ name ## _obj_list[ name ## _obj_count].attr_count].pValue = p; \
-	name ## _obj_list[ name ## _obj_count ].attrs[ name ## _obj_list[ name ## _obj_count ].attr_count].ulValueLen = size; \
-	name ## _obj_list[ name ## _obj_count ].attr_count++; \
-} while (0)
+static CK_OBJECT_HANDLE
+obj_handle(CFDataRef key, CK_OBJECT_CLASS class)
+{
+	const unsigned char *p = CFDataGetBytePtr(key);
+	CK_OBJECT_HANDLE h;
+	int i;
 
-#define ADD_ATTR(name, attr, var) ADD_ATTR_SIZE(name, attr, &var, sizeof(var))
+	for (i = 0; i < handle_map_count; i++)
+		if (handle_map[i].class == class &&
+		    CFEqual(handle_map[i].key, key))
+			return handle_map[i].handle;
 
-#define NEW_OBJECT(name) \
-do { \
-	if (++ name ## _obj_count >= name ## _obj_size) { \
-		name ## _obj_size += 5; \
-		name ## _obj_list = realloc( name ## _obj_list, name ## _obj_size * sizeof(* name ## _obj_list )); \
-	} \
-} while (0)
+	/*
+	 * Use the first three bytes of the key, and the class in the
+	 * bottom two bits (we only have three classes of token objects).
+	 * If that collides with a handle we already gave out, keep
+	 * looking.
+	 */
 
-#define OBJINIT(name) \
-do { \
-	name ## _obj_list[ name ## _obj_count ].id_index = i; \
-	name ## _obj_list[ name ## _obj_count ].attrs = NULL; \
-	name ## _obj_list[ name ## _obj_count ].attr_count = 0; \
-	name ## _obj_list[ name ## _obj_count ].attr_size = 0; \
-} while (0)
+	h = class & 3;
+	if (CFDataGetLength(key) >= 3)
+		h |= ((p[0] << 18) | (p[1] << 10) | (p[2] << 2)) & 0x3ffffffc;
 
-/*
- * Build up a list of objects based on our identity list
- */
+again:
+	for (i = 0; i < handle_map_count; i++)
+		if (handle_map[i].handle == (h | TOKEN_HANDLE_BASE)) {
+			h = (h + 4) & 0x3fffffff;
+			goto again;
+		}
+
+	if (handle_map_count >= handle_map_size) {
+		handle_map_size += 16;
+		handle_map = realloc(handle_map, handle_map_size *
+						 sizeof(*handle_map));
+	}
+
+	handle_map[handle_map_count].key = CFRetain(key);
+	handle_map[handle_map_count].class = class;
+	handle_map[handle_map_count].handle = h | TOKEN_HANDLE_BASE;
+
+	return handle_map[handle_map_count++].handle;
+}
 
 static void
-build_id_objects(int lock)
+handle_map_free(void)
 {
 	int i;
-	CK_OBJECT_CLASS cl;
-	CK_CERTIFICATE_TYPE ct = CKC_X_509;	/* Only this for now */
-	CK_ULONG t;
-	CK_BBOOL b;
-	CFDataRef d;
-	char *label;
 
-	if (lock)
-		LOCK_MUTEX(id_mutex);
+	for (i = 0; i < handle_map_count; i++)
+		CFRelease(handle_map[i].key);
 
-	if (id_list_count > 0) {
-		/* Prime the pump */
-		NEW_OBJECT(id);
-		id_obj_count--;
+	free(handle_map);
+
+	handle_map = NULL;
+	handle_map_count = handle_map_size = 0;
+}
+
+/*
+ * Return the current object list for a session's slot.  Call with
+ * id_mutex locked.
+ */
+
+static struct obj_info *
+session_objects(struct session *se, unsigned int *count)
+{
+	if (se->slot_id == TOKEN_SLOT) {
+		*count = id_obj_count;
+		return id_obj_list;
 	}
 
-	for (i = 0; i < id_list_count; i++) {
-		SecCertificateRef cert = id_list[i].cert;
-		CFDataRef subject = NULL, issuer = NULL, serial = NULL;
-		CFDataRef keydata = NULL, modulus = NULL, exponent = NULL;
-		CFErrorRef error;
+	if (atomic_load(&cert_list_status) == initialized) {
+		*count = cert_obj_count;
+		return cert_obj_list;
+	}
 
-		OBJINIT(id);
+	*count = 0;
+	return NULL;
+}
 
-		/*
-		 * Add in the object for each identity; cert, public key,
-		 * private key.  Add in attributes we need.
-		 */
+/*
+ * Find the object with the given handle in a session's slot, or return
+ * NULL if there isn't one.  Most of the time handles line up with the
+ * list index (they always do in the certificate slot until it gets
+ * refreshed), so try that first.  Call with id_mutex locked.
+ */
 
-		cl = CKO_CERTIFICATE;
-		id_obj_list[id_obj_count].class = cl;
-		ADD_ATTR(id, CKA_CLASS, cl);
-		t = i;
-		ADD_ATTR(id, CKA_ID, t);
-		ADD_ATTR(id, CKA_CERTIFICATE_TYPE, ct);
-		b = CK_TRUE;
-		ADD_ATTR(id, CKA_TOKEN, b);
-		ADD_ATTR_SIZE(id, CKA_LABEL, id_list[i].label,
-			      strlen(id_list[i].label));
-		d = SecCertificateCopyData(cert);
-		ADD_ATTR_SIZE(id, CKA_VALUE, CFDataGetBytePtr(d),
-			      CFDataGetLength(d));
-		get_certificate_info(d, &serial, &issuer, &subject);
-		CFRelease(d);
+static struct obj_info *
+obj_lookup(struct session *se, CK_OBJECT_HANDLE h)
+{
+	struct obj_info *list;
+	unsigned int count, i;
 
-		if (subject)
-			ADD_ATTR_SIZE(id, CKA_SUBJECT,
-				      CFDataGetBytePtr(subject),
-				      CFDataGetLength(subject));
-		if (issuer)
-			ADD_ATTR_SIZE(id, CKA_ISSUER, CFDataGetBytePtr(issuer),
-				      CFDataGetLength(issuer));
-		if (serial)
-			ADD_ATTR_SIZE(id, CKA_SERIAL_NUMBER,
-				      CFDataGetBytePtr(serial),
-				      CFDataGetLength(serial));
+	list = session_objects(se, &count);
 
-		NEW_OBJECT(id);
-		OBJINIT(id);
+	if (h > 0 && h <= count && list[h - 1].handle == h)
+		return &list[h - 1];
 
-		cl = CKO_PUBLIC_KEY;
-		id_obj_list[id_obj_count].class = cl;
-		ADD_ATTR(id, CKA_CLASS, cl);
-		t = i;
-		ADD_ATTR(id, CKA_ID, t);
-		ADD_ATTR(id, CKA_KEY_TYPE, id_list[i].keytype);
-		b = CK_TRUE;
-		ADD_ATTR(id, CKA_TOKEN, b);
-		b = id_list[i].pubcanencrypt;
-		ADD_ATTR(id, CKA_ENCRYPT, b);
-		b = id_list[i].pubcanverify;
-		ADD_ATTR(id, CKA_VERIFY, b);
-		if (subject)
-			ADD_ATTR_SIZE(id, CKA_SUBJECT,
-				      CFDataGetBytePtr(subject),
-				      CFDataGetLength(subject));
+	for (i = 0; i < count; i++)
+		if (list[i].handle == h)
+			return &list[i];
 
-		/*
-		 * Sigh.  It seems like the public part of an identity
-		 * doesn't actually get a label attribute, at least with
-		 * the release I tested.  So for now, get the label from
-		 * the identity label, and maybe check later if this
-		 * changes; keep the code around here if it does.
-		 *
-		 * label = getkeylabel(id_list[i].pubkey);
-		 * ADD_ATTR_SIZE(id, CKA_LABEL, label, strlen(label));
-		 * free(label);
-		 */
+	return NULL;
+}
 
-		ADD_ATTR_SIZE(id, CKA_LABEL, id_list[i].label,
-			      strlen(id_list[i].label));
+/*
+ * Called with the session mutex held.  If C_CancelFunction() has been
+ * called since we last looked, throw away every operation on the session
+ * and return true.
+ */
 
-		/*
-		 * It turns out some implementations want CKA_MODULUS_BITS,
-		 * and the modulus and public exponent.  For RSA keys the
-		 * modulus size is equal to the block size, and we can get
-		 * modulus and public exponent from the "external
-		 * representation" of the public key.  Note that the block
-		 * size is returned in bytes, and we need bits.
-		 */
+static bool
+sess_sync_cancel(struct session *se)
+{
+	unsigned long gen = atomic_load(&se->cancel_gen);
+
+	if (gen == se->op_gen)
+		return false;
+
+	os_log_debug(logsys, "Session operations were cancelled");
+
+	if (se->sig_key)
+		CFRelease(se->sig_key);
+	if (se->ver_key)
+		CFRelease(se->ver_key);
+	if (se->enc_key)
+		CFRelease(se->enc_key);
+	if (se->dec_key)
+		CFRelease(se->dec_key);
+	se->sig_key = se->ver_key = se->enc_key = se->dec_key = NULL;
+	se->sig_obj = se->ver_obj = se->enc_obj = se->dec_obj = 0;
+	se->sig_size = se->enc_size = se->dec_size = 0;
+	se->op_gen = gen;
 
-		t = SecKeyGetBlockSize(id_list[i].pubkey) * 8;
-		ADD_ATTR(id, CKA_MODULUS_BITS, t);
+	return true;
+}
 
-		keydata = SecKeyCopyExternalRepresentation(id_list[i].pubkey,
-							   &error);
+/*
+ * A SecKey call we're making on a worker thread (see seckey_call()).
+ * Everything in here belongs to the job, so an abandoned worker can
+ * clean up without us.
+ */
 
-		if (keydata) {
-			if (get_pubkey_info(keydata, &modulus, &exponent)) {
-				ADD_ATTR_SIZE(id, CKA_MODULUS,
-					      CFDataGetBytePtr(modulus),
-					      CFDataGetLength(modulus));
-				ADD_ATTR_SIZE(id, CKA_PUBLIC_EXPONENT,
-					      CFDataGetBytePtr(exponent),
-					      CFDataGetLength(exponent));
-			}
-		} else {
-			os_log_debug(logsys, "SecKeyCopyExternalRepresentation "
-				     "failed: %{public}@", error);
-			CFRelease(error);
-		}
+struct seckey_job {
+	seckey_func	func;
+	SecKeyRef	key;
+	SecKeyAlgorithm	alg;
+	CFDataRef	in;
+	CFDataRef	out;
+	CFErrorRef	err;
+};
 
-		b = CK_FALSE;
-		ADD_ATTR(id, CKA_WRAP, b);
-		ADD_ATTR(id, CKA_DERIVE, b);
+static void
+seckey_job_run(void *arg)
+{
+	struct seckey_job *job = arg;
 
-		NEW_OBJECT(id);
-		OBJINIT(id);
+	job->out = job->func(job->key, job->alg, job->in, &job->err);
+}
 
-		cl = CKO_PRIVATE_KEY;
-		id_obj_list[id_obj_count].class = cl;
-		ADD_ATTR(id, CKA_CLASS, cl);
-		t = i;
-		ADD_ATTR(id, CKA_ID, t);
-		ADD_ATTR(id, CKA_KEY_TYPE, id_list[i].keytype);
-		b = CK_TRUE;
-		ADD_ATTR(id, CKA_TOKEN, b);
-		ADD_ATTR(id, CKA_PRIVATE, b);
-		b = id_list[i].privcandecrypt;
-		ADD_ATTR(id, CKA_DECRYPT, b);
-		b = id_list[i].privcansign;
-		ADD_ATTR(id, CKA_SIGN, b);
-		if (subject)
-			ADD_ATTR_SIZE(id, CKA_SUBJECT,
-				      CFDataGetBytePtr(subject),
-				      CFDataGetLength(subject));
+static void
+seckey_job_free(void *arg)
+{
+	struct seckey_job *job = arg;
+
+	CFRelease(job->key);
+	if (job->in)
+		CFRelease(job->in);
+	if (job->out)
+		CFRelease(job->out);
+	if (job->err)
+		CFRelease(job->err);
+	free(job);
+}
 
-		label = getkeylabel(id_list[i].privkey);
-		ADD_ATTR_SIZE(id, CKA_LABEL, label, strlen(label));
-		free(label);
+/*
+ * Make a private key call (SecKeyCreateSignature() or
+ * SecKeyCreateDecryptedData()) subject to the session's deadline and
+ * C_CancelFunction().  Called with the session mutex held.  Even with no
+ * deadline we make the call on a worker thread, since that's the only
+ * way we can stop waiting for it when we're cancelled.  If we give up we
+ * return NULL with *err set to NULL and *rv set to CKR_DEVICE_ERROR (out
+ * of time), CKR_FUNCTION_CANCELED or CKR_HOST_MEMORY (we couldn't start
+ * the call).
+ */
 
-		/*
-		 * I guess some applications want the modulus and public
-		 * exponent as attributes in the private key object.
-		 * Use this information we extracted previously.
-		 */
+static CFDataRef
+seckey_call(struct session *se, seckey_func func, SecKeyRef key,
+	    SecKeyAlgorithm alg, CFDataRef in, CFErrorRef *err, CK_RV *rv)
+{
+	unsigned int timeout = atomic_load(&se->op_timeout);
+	struct seckey_job *job;
+	CFDataRef out;
 
-		if (keydata) {
-			ADD_ATTR_SIZE(id, CKA_MODULUS,
-				      CFDataGetBytePtr(modulus),
-				      CFDataGetLength(modulus));
-			ADD_ATTR_SIZE(id, CKA_PUBLIC_EXPONENT,
-				      CFDataGetBytePtr(exponent),
-				      CFDataGetLength(exponent));
-		}
+	if (! key)
+		return func(key, alg, in, err);
 
-		b = CK_TRUE;
-		ADD_ATTR(id, CKA_SENSITIVE, b);
-		b = CK_FALSE;
-		ADD_ATTR(id, CKA_ALWAYS_AUTHENTICATE, b);
-		ADD_ATTR(id, CKA_UNWRAP, b);
-		ADD_ATTR(id, CKA_DERIVE, b);
-		ADD_ATTR(id, CKA_EXTRACTABLE, b);
+	/*
+	 * Our input data doesn't belong to us (it's the application's
+	 * buffer), so the worker needs its own copy.
+	 */
 
-		NEW_OBJECT(id);
+	if (! (job = calloc(1, sizeof(*job)))) {
+		*rv = CKR_HOST_MEMORY;
+		*err = NULL;
+		return NULL;
+	}
 
-		if (subject)
-			CFRelease(subject);
-		if (issuer)
-			CFRelease(issuer);
-		if (serial)
-			CFRelease(serial);
+	job->func = func;
+	job->key = (SecKeyRef) CFRetain(key);
+	job->alg = alg;
 
-		if (keydata)
-			CFRelease(keydata);
-		if (modulus)
-			CFRelease(modulus);
-		if (exponent)
-			CFRelease(exponent);
+	if (! (job->in = CFDataCreateCopy(NULL, in))) {
+		seckey_job_free(job);
+		*rv = CKR_HOST_MEMORY;
+		*err = NULL;
+		return NULL;
 	}
 
-	if (lock)
-		UNLOCK_MUTEX(id_mutex);
+	switch (deadline_run(seckey_job_run, seckey_job_free, job,
+			     timeout ? timeout : DEADLINE_FOREVER,
+			     &se->cancel_gen, se->op_gen)) {
+	case DEADLINE_DONE:
+		out = job->out;
+		*err = job->err;
+		job->out = NULL;
+		job->err = NULL;
+		seckey_job_free(job);
+		return out;
+	case DEADLINE_EXPIRED:
+		os_log_debug(logsys, "Key operation took longer than %u ms, "
+			     "abandoning it", timeout);
+		*rv = CKR_DEVICE_ERROR;
+		break;
+	case DEADLINE_CANCELLED:
+		os_log_debug(logsys, "Key operation cancelled while waiting "
+			     "for it");
+		*rv = CKR_FUNCTION_CANCELED;
+		break;
+	case DEADLINE_FAILED:
+		seckey_job_free(job);
+		*rv = CKR_HOST_MEMORY;
+		break;
+	}
+
+	*err = NULL;
+	return NULL;
 }
 
 /*
- * Build up a list of certificate objects
+ * Same idea for our Keychain queries, using the scan deadline.  If we
+ * give up we return errSecIO (or errSecAllocate if we couldn't start the
+ * query), which our callers treat like any other failed query (we keep what we had and try again next time).  Queries
+ * made by the background identity scan can also be cancelled by
+ * C_Finalize(), so they always go through deadline_run().
  */
 
+struct secitem_job {
+	CFDictionaryRef	query;
+	CFTypeRef	result;
+	OSStatus	ret;
+};
+
 static void
-build_cert_objects(void)
+secitem_job_run(void *arg)
 {
-	int i;
-	CK_OBJECT_CLASS cl;
-	CK_CERTIFICATE_TYPE ct = CKC_X_509;	/* Only this for now */
-	CK_TRUST trust = CKT_NSS_TRUSTED_DELEGATOR;
-	CK_ULONG t;
-	CK_BBOOL b;
-	CFDataRef d;
-
-	if (cert_list_count > 0) {
-		/* Prime the pump */
-		NEW_OBJECT(cert);
-		cert_obj_count--;
-	}
+	struct secitem_job *job = arg;
 
-	for (i = 0; i < cert_list_count; i++) {
-		SecCertificateRef cert = cert_list[i].cert;
-		CFDataRef subject = NULL, issuer = NULL, serial = NULL;
-		CFDataRef hash = NULL;
-		CFStringRef subjstr;
-		char *subjc;
+	job->ret = SecItemCopyMatching(job->query, &job->result);
+}
 
-		OBJINIT(cert);
+static void
+secitem_job_free(void *arg)
+{
+	struct secitem_job *job = arg;
 
-		/*
-		 * Add in an object for each certificate.
-		 */
+	CFRelease(job->query);
+	if (job->result)
+		CFRelease(job->result);
+	free(job);
+}
 
-		t = i + 0xff00;		/* offset so no collision */
-		cl = CKO_CERTIFICATE;
-		cert_obj_list[cert_obj_count].class = cl;
-		ADD_ATTR(cert, CKA_CLASS, cl);
-		ADD_ATTR(cert, CKA_ID, t);
-		ADD_ATTR(cert, CKA_CERTIFICATE_TYPE, ct);
-		b = CK_TRUE;
-		ADD_ATTR(cert, CKA_TOKEN, b);
+static OSStatus
+secitem_copy_matching(CFDictionaryRef query, CFTypeRef *result)
+{
+	struct secitem_job *job;
+	enum deadline_result dr;
+	OSStatus ret;
 
-		subjstr = SecCertificateCopySubjectSummary(cert_list[i].cert);
-		subjc = getstrcopy(subjstr);
+	if (! scan_timeout && ! id_scan_thread)
+		return SecItemCopyMatching(query, result);
 
-		ADD_ATTR_SIZE(cert, CKA_LABEL, subjc, strlen(subjc));
+	if (! (job = calloc(1, sizeof(*job))))
+		return errSecAllocate;
 
-		free(subjc);
-		CFRelease(subjstr);
+	job->query = CFRetain(query);
 
-		d = SecCertificateCopyData(cert);
-		ADD_ATTR_SIZE(cert, CKA_VALUE, CFDataGetBytePtr(d),
-			      CFDataGetLength(d));
-		get_certificate_info(d, &serial, &issuer, &subject);
-		hash = get_hash(kSecDigestSHA1, 0, d);
-		CFRelease(d);
+	dr = deadline_run(secitem_job_run, secitem_job_free, job,
+			  scan_timeout ? scan_timeout : DEADLINE_FOREVER,
+			  id_scan_thread ? &id_scan_cancel : NULL, id_scan_gen);
 
-		if (subject)
-			ADD_ATTR_SIZE(cert, CKA_SUBJECT,
-				      CFDataGetBytePtr(subject),
-				      CFDataGetLength(subject));
-		if (issuer)
-			ADD_ATTR_SIZE(cert, CKA_ISSUER,
-				      CFDataGetBytePtr(issuer),
-				      CFDataGetLength(issuer));
-		if (serial)
-			ADD_ATTR_SIZE(cert, CKA_SERIAL_NUMBER,
-				      CFDataGetBytePtr(serial),
-				      CFDataGetLength(serial));
-
-		NEW_OBJECT(cert);
-		OBJINIT(cert);
-
-		cl = CKO_NSS_TRUST;
-		cert_obj_list[cert_obj_count].class = cl;
-		ADD_ATTR(cert, CKA_CLASS, cl);
-		b = CK_TRUE;
-		ADD_ATTR(cert, CKA_TOKEN, b);
-
-		if (issuer)
-			ADD_ATTR_SIZE(cert, CKA_ISSUER,
-				      CFDataGetBytePtr(issuer),
-				      CFDataGetLength(issuer));
-		if (serial)
-			ADD_ATTR_SIZE(cert, CKA_SERIAL_NUMBER,
-				      CFDataGetBytePtr(serial),
-				      CFDataGetLength(serial));
-		if (hash)
-			ADD_ATTR_SIZE(cert, CKA_CERT_SHA1_HASH,
-				      CFDataGetBytePtr(hash),
-				      CFDataGetLength(hash));
+	if (dr == DEADLINE_FAILED) {
+		secitem_job_free(job);
+		return errSecAllocate;
+	} else if (dr == DEADLINE_CANCELLED) {
+		os_log_debug(logsys, "Keychain query cancelled");
+		return errSecIO;
+	} else if (dr != DEADLINE_DONE) {
+		os_log_debug(logsys, "Keychain query took longer than %u ms, "
+			     "abandoning it", scan_timeout);
+		return errSecIO;
+	}
 
-		/*
-		 * As far as I can tell, CAs should have these various
-		 * trust objects set, but other certificates (servers,
-		 * users) should NOT.
-		 */
+	ret = job->ret;
+	*result = job->result;
+	job->result = NULL;
+	secitem_job_free(job);
 
-		if (is_cert_ca(cert)) {
-			ADD_ATTR(cert, CKA_TRUST_SERVER_AUTH, trust);
-			ADD_ATTR(cert, CKA_TRUST_CLIENT_AUTH, trust);
-			ADD_ATTR(cert, CKA_TRUST_EMAIL_PROTECTION, trust);
-			ADD_ATTR(cert, CKA_TRUST_CODE_SIGNING, trust);
-#if 0
-			ADD_ATTR(cert, CKA_TRUST_STEP_UP_APPROVED, trust);
-#endif
-		}
+	return ret;
+}
 
-		NEW_OBJECT(cert);
+/*
+ * The error code we give the profiler (see profile.h) for a call that
+ * returned a CFErrorRef
+ */
 
-		if (subject)
-			CFRelease(subject);
-		if (issuer)
-			CFRelease(issuer);
-		if (serial)
-			CFRelease(serial);
-		if (hash)
-			CFRelease(hash);
-	}
+static long
+cferr_code(CFErrorRef err)
+{
+	return err ? CFErrorGetCode(err) : PROF_FAILED;
 }
 
 /*
- * Free our object list and all associated data
+ * Turn the error from a failed private key operation into a CK_RV.  A
+ * lot of what we get back is about the user (they hit Cancel, or got the
+ * PIN wrong) or the input rather than the card, and the circuit breaker
+ * (see circuit.h) must not count those against the card; anything we
+ * don't recognize is CKR_GENERAL_ERROR.  Errors can come from the
+ * Security framework itself, LocalAuthentication (which runs the PIN
+ * dialog) or CryptoTokenKit (which talks to the card); the last two
+ * don't have C headers, so we spell out their domains and codes.
+ * "invalid" is what to return if the input was bad.
  */
 
-static void
-obj_free(struct obj_info **obj, unsigned int *count, unsigned int *size)
+#define LA_ERROR_DOMAIN		CFSTR("com.apple.LocalAuthentication")
+#define LA_AUTH_FAILED		-1	/* LAErrorAuthenticationFailed */
+#define LA_USER_CANCEL		-2	/* LAErrorUserCancel */
+#define LA_USER_FALLBACK	-3	/* LAErrorUserFallback */
+#define LA_SYSTEM_CANCEL	-4	/* LAErrorSystemCancel */
+#define LA_APP_CANCEL		-9	/* LAErrorAppCancel */
+#define LA_NOT_INTERACTIVE	-1004	/* LAErrorNotInteractive */
+
+#define TK_ERROR_DOMAIN		CFSTR("CryptoTokenKit")
+#define TK_CORRUPTED_DATA	-3	/* TKErrorCodeCorruptedData */
+#define TK_CANCELED		-4	/* TKErrorCodeCanceledByUser */
+#define TK_AUTH_FAILED		-5	/* TKErrorCodeAuthenticationFailed */
+#define TK_BAD_PARAMETER	-8	/* TKErrorCodeBadParameter */
+#define TK_AUTH_NEEDED		-9	/* TKErrorCodeAuthenticationNeeded */
+
+static CK_RV
+cferr_rv(CFErrorRef err, CK_RV invalid)
 {
-	int i, j;
-
-	for (i = 0; i < *count; i++) {
-		for (j = 0; j < (*obj)[i].attr_count; j++)
-			free((*obj)[i].attrs[j].pValue);
-		free((*obj)[i].attrs);
+	CFStringRef domain = CFErrorGetDomain(err);
+	CFIndex code = CFErrorGetCode(err);
+
+	if (CFEqual(domain, kCFErrorDomainOSStatus)) {
+		switch (code) {
+		case errSecUserCanceled:
+			return CKR_FUNCTION_CANCELED;
+		case errSecAuthFailed:
+			return CKR_PIN_INCORRECT;
+		case errSecInteractionNotAllowed:
+			return CKR_USER_NOT_LOGGED_IN;
+		case errSecDecode:
+		case errSecParam:
+			return invalid;
+		}
+	} else if (CFEqual(domain, LA_ERROR_DOMAIN)) {
+		switch (code) {
+		case LA_USER_CANCEL:
+		case LA_USER_FALLBACK:
+		case LA_SYSTEM_CANCEL:
+		case LA_APP_CANCEL:
+			return CKR_FUNCTION_CANCELED;
+		case LA_AUTH_FAILED:
+			return CKR_PIN_INCORRECT;
+		case LA_NOT_INTERACTIVE:
+			return CKR_USER_NOT_LOGGED_IN;
+		}
+	} else if (CFEqual(domain, TK_ERROR_DOMAIN)) {
+		switch (code) {
+		case TK_CANCELED:
+			return CKR_FUNCTION_CANCELED;
+		case TK_AUTH_FAILED:
+			return CKR_PIN_INCORRECT;
+		case TK_AUTH_NEEDED:
+			return CKR_USER_NOT_LOGGED_IN;
+		case TK_CORRUPTED_DATA:
+		case TK_BAD_PARAMETER:
+			return invalid;
+		}
 	}
 
-	free(*obj);
-
-	*obj = NULL;
-	*count = *size = 0;
+	return CKR_GENERAL_ERROR;
 }
 
 /*
@@ -4045,6 +7838,16 @@ search_object(struct obj_info *obj, CK_ATTRIBUTE_PTR attrs,
 				 * if the attribute doesn't match then
 				 * we can short-circuit the match now
 				 */
+				if (attr_packed(obj, &obj->attrs[j])) {
+					if (attrs[i].pValue &&
+					    certstore_equal(obj->store,
+							    attrs[i].pValue,
+							    attrs[i].ulValueLen))
+						goto next;
+					else
+						return false;
+				}
+
 				if ((obj->attrs[j].pValue == NULL ||
 				     attrs[i].pValue == NULL) &&
 				    (obj->attrs[j].pValue != attrs[i].pValue))
@@ -4116,12 +7919,23 @@ dump_attribute(const char *str, CK_ATTRIBUTE_PTR attr)
 			     getCKAName(attr->type), cn);
 		free(cn);
 		break;
+	case CKA_START_DATE:
+	case CKA_END_DATE:
+		if (attr->ulValueLen != sizeof(CK_DATE))
+			goto unknown;
+		os_log_debug(logsys, "%s: %s: %.4s-%.2s-%.2s", str,
+			     getCKAName(attr->type),
+			     ((CK_DATE *) attr->pValue)->year,
+			     ((CK_DATE *) attr->pValue)->month,
+			     ((CK_DATE *) attr->pValue)->day);
+		break;
 	case CKA_TOKEN:
 		os_log_debug(logsys, "%s: %s: %{bool}d", str,
 			     getCKAName(attr->type),
 			     (int) ((unsigned char *) attr->pValue)[0]);
 		break;
 	default:
+	unknown:
 		os_log_debug(logsys, "%s: %s, len = %lu, val = %p", str,
 			     getCKAName(attr->type), attr->ulValueLen,
 					attr->pValue);
@@ -4206,6 +8020,43 @@ prefkey_arrayget(const char *key, const char **default_list)
 	return ret;
 }
 
+/*
+ * Get a numeric preference.  It may be a number or a string containing
+ * one; if it's missing (or negative, or something else entirely) we
+ * return the default.
+ */
+
+static unsigned int
+prefkey_number(const char *key, unsigned int default_value)
+{
+	CFPropertyListRef propref;
+	CFStringRef keyref;
+	unsigned int ret = default_value;
+	int value = -1;
+
+	keyref = CFStringCreateWithCString(NULL, key, kCFStringEncodingUTF8);
+
+	propref = CFPreferencesCopyAppValue(keyref, CFSTR(APPIDENTIFIER));
+	CFRelease(keyref);
+
+	if (! propref)
+		return ret;
+
+	if (CFGetTypeID(propref) == CFNumberGetTypeID())
+		CFNumberGetValue(propref, kCFNumberIntType, &value);
+	else if (CFGetTypeID(propref) == CFStringGetTypeID())
+		value = CFStringGetIntValue(propref);
+	else
+		logtype("Unknown preference return type", propref);
+
+	if (value >= 0)
+		ret = value;
+
+	CFRelease(propref);
+
+	return ret;
+}
+
 /*
  * See if a particular key is set in our preferences dictionary.
  *
@@ -4270,6 +8121,23 @@ array_free(char **array)
 	free(array);
 }
 
+/*
+ * Returns true if two NULL-terminated string arrays hold the same strings
+ */
+
+static bool
+array_equal(char **a, char **b)
+{
+	if (! a || ! b)
+		return a == b;
+
+	for (; *a != NULL && *b != NULL; a++, b++)
+		if (strcmp(*a, *b) != 0)
+			return false;
+
+	return *a == NULL && *b == NULL;
+}
+
 /*
  * Free a session
  */
@@ -4300,6 +8168,7 @@ sess_free(struct session *se)
 
 	UNLOCK_MUTEX(se->mutex);
 	DESTROY_MUTEX(se->mutex);
+	atomic_fetch_sub(&slot_sessions[se->slot_id - 1], 1);
 	free(se);
 }
 
@@ -4323,6 +8192,165 @@ sess_list_free(void)
 	sess_list = NULL;
 }
 
+/*
+ * Throw away all sessions without touching them; they belong to our
+ * parent process, and another thread may have been in the middle of
+ * using them when we were forked, so we just leak them.
+ */
+
+static void
+sess_list_forget(void)
+{
+	sess_list_count = sess_list_size = 0;
+	sess_list = NULL;
+
+	atomic_store(&slot_sessions[0], 0);
+	atomic_store(&slot_sessions[1], 0);
+}
+
+/*
+ * Our fork handler (see the comments above fork_once).  All we do in
+ * the child is reset locks and remember what state we were in; if the
+ * parent was initialized, the child is now uninitialized until it calls
+ * C_Initialize(), which calls fork_reinit().  The broker connection,
+ * tracer and friends reset their own locks.
+ */
+
+static void
+fork_register(void)
+{
+	pthread_atfork(NULL, NULL, fork_child);
+}
+
+static void
+fork_child(void)
+{
+	if (module_initialized) {
+		forked = true;
+		fork_dirty = atomic_load(&list_locks_held) != 0;
+		module_initialized = 0;
+	}
+
+	atomic_store(&list_locks_held, 0);
+	atomic_store(&slot_readers, 0);
+
+	/*
+	 * An identity scan in progress didn't come with us either (and it
+	 * holds id_mutex, so we're dirty).  Its dispatch group belongs to
+	 * the parent; C_Initialize() makes a new one if it needs it.
+	 */
+
+	if (atomic_exchange(&id_scan_pending, false))
+		id_scan_group = NULL;
+
+	cert_refresh_timer = NULL;
+	cert_scan_forked();
+	sflight_forked();
+	circuit_forked(&token_circuit);
+	certstore_forked();
+	broker_forked();
+	trace_forked();
+	recorder_forked();
+}
+
+/*
+ * The thread running a certificate scan or refresh (if any) didn't come
+ * with us into the child, and it might have been holding our scan locks.
+ * Reset the locks and forget about that scan; the lists it was building
+ * belong to the parent's copy of that thread, so just drop them.  We
+ * start over when the child first uses the certificate slot.
+ */
+
+static void
+cert_scan_forked(void)
+{
+	bool busy = pthread_mutex_trylock(&cert_scan_serial) != 0;
+
+	pthread_mutex_init(&cert_scan_mutex, NULL);
+	pthread_mutex_init(&cert_scan_serial, NULL);
+
+	cert_scan_current = NULL;
+	cert_scan_group = NULL;
+	atomic_store(&cert_scan_want, 0);
+
+	if (busy) {
+		cert_list = NULL;
+		cert_list_count = cert_list_size = 0;
+	}
+
+	if (atomic_load(&cert_list_status) == initializing) {
+		cert_obj_list = NULL;
+		cert_obj_count = cert_obj_size = 0;
+		atomic_store(&cert_list_status, uninitialized);
+	}
+}
+
+/*
+ * Called by C_Initialize() in a child process.  Our sessions aren't
+ * inherited (the PKCS#11 spec says so), and our Security framework
+ * references are marked stale; the next identity scan replaces them
+ * without rebuilding our object tree.  We can't use the parent's
+ * LAContext either, so we aren't logged in anymore.  If our lists were
+ * being changed when we were forked we can't trust (or free) them, so
+ * we drop them and do a full scan instead.
+ *
+ * We don't start any background work here; if we need a certificate
+ * scan, fork_resume() starts it the first time we're asked about slots.
+ */
+
+static void
+fork_reinit(void)
+{
+	LOCK_MUTEX(id_mutex);
+	LOCK_MUTEX(sess_mutex);
+
+	sess_list_forget();
+
+	if (fork_dirty) {
+		os_log_debug(logsys, "Reinitializing after fork while our "
+			     "lists were being changed, starting over");
+		id_list = NULL;
+		id_list_count = id_list_size = 0;
+		id_obj_list = NULL;
+		id_obj_count = id_obj_size = 0;
+		if (atomic_load(&cert_list_status) == initialized) {
+			cert_obj_list = NULL;
+			cert_obj_count = cert_obj_size = 0;
+			atomic_store(&cert_list_status, uninitialized);
+		}
+		handle_map = NULL;
+		handle_map_count = handle_map_size = 0;
+		fork_dirty = false;
+	} else {
+		os_log_debug(logsys, "Reinitializing after fork, keeping %u "
+			     "identities and %u objects", id_list_count,
+			     id_obj_count);
+	}
+
+	id_refs_stale = ! use_broker && id_list_count > 0;
+	id_list_init = false;
+	lacontext = NULL;
+	logged_in = false;
+
+	UNLOCK_MUTEX(sess_mutex);
+	UNLOCK_MUTEX(id_mutex);
+
+	atomic_store(&fork_cert_scan, cert_slot_enabled);
+	forked = false;
+}
+
+/*
+ * Start the certificate scan a forked child put off; called by the
+ * functions an application has to use before it can get at a slot.
+ */
+
+static void
+fork_resume(void)
+{
+	if (atomic_exchange(&fork_cert_scan, false))
+		start_cert_scan();
+}
+
 /*
  * Logout from our token
  */
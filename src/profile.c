@@ -0,0 +1,146 @@
+/*
+ * Our backend call profiler (see profile.h for the overview).
+ *
+ * There is one fixed slot for every probe in every phase, so recording a
+ * call is just a few atomic operations and nothing ever has to be
+ * allocated or locked.  A reader can see a slot halfway through an
+ * update (the count bumped but not the total yet, say); that's fine for
+ * statistics.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "mypkcs11.h"
+#include "keychain_vendor.h"
+#include "profile.h"
+
+struct prof_slot {
+	_Atomic(uint64_t)	count;		/* Number of calls */
+	_Atomic(uint64_t)	errors;		/* ... that failed */
+	_Atomic(long)		last_error;	/* Most recent error */
+	_Atomic(uint64_t)	total_ns;	/* Total time */
+	_Atomic(uint64_t)	max_ns;		/* Longest call */
+};
+
+static struct prof_slot prof_slots[PROF_PROBE_MAX][KEYCHAIN_PHASE_COUNT];
+
+static const char *prof_names[] = {
+#define PROF_PROBE(name) #name,
+	PROF_PROBE_LIST
+#undef PROF_PROBE
+};
+
+static __thread int prof_cur_phase = KEYCHAIN_PHASE_OTHER;
+
+uint64_t
+prof_now(void)
+{
+	return clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+}
+
+void
+prof_record(enum prof_probe probe, int phase, uint64_t start, long err)
+{
+	struct prof_slot *s;
+	uint64_t ns = prof_now() - start, max;
+
+	if (probe >= PROF_PROBE_MAX || phase < 0 ||
+	    phase >= KEYCHAIN_PHASE_COUNT)
+		return;
+
+	s = &prof_slots[probe][phase];
+
+	atomic_fetch_add_explicit(&s->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&s->total_ns, ns, memory_order_relaxed);
+
+	max = atomic_load_explicit(&s->max_ns, memory_order_relaxed);
+	while (ns > max && ! atomic_compare_exchange_weak_explicit(&s->max_ns,
+					&max, ns, memory_order_relaxed,
+					memory_order_relaxed))
+		;
+
+	if (err) {
+		atomic_fetch_add_explicit(&s->errors, 1, memory_order_relaxed);
+		atomic_store_explicit(&s->last_error, err,
+				      memory_order_relaxed);
+	}
+}
+
+int
+prof_phase(void)
+{
+	return prof_cur_phase;
+}
+
+int
+prof_enter(int phase)
+{
+	int old = prof_cur_phase;
+
+	prof_cur_phase = phase;
+
+	return old;
+}
+
+void
+prof_leave(int phase)
+{
+	prof_cur_phase = phase;
+}
+
+void
+prof_reset(void)
+{
+	unsigned int i, j;
+	struct prof_slot *s;
+
+	for (i = 0; i < PROF_PROBE_MAX; i++) {
+		for (j = 0; j < KEYCHAIN_PHASE_COUNT; j++) {
+			s = &prof_slots[i][j];
+			atomic_store(&s->count, 0);
+			atomic_store(&s->errors, 0);
+			atomic_store(&s->last_error, 0);
+			atomic_store(&s->total_ns, 0);
+			atomic_store(&s->max_ns, 0);
+		}
+	}
+}
+
+unsigned int
+prof_get(struct keychain_backend_probe *probes, unsigned int max)
+{
+	struct keychain_backend_probe *p;
+	struct prof_slot *s;
+	unsigned int i, j, n = 0;
+	uint64_t count;
+
+	for (i = 0; i < PROF_PROBE_MAX; i++) {
+		for (j = 0; j < KEYCHAIN_PHASE_COUNT; j++) {
+			s = &prof_slots[i][j];
+
+			if (! (count = atomic_load(&s->count)))
+				continue;
+
+			if (probes && n < max) {
+				p = &probes[n];
+				memset(p, 0, sizeof(*p));
+				strlcpy(p->name, prof_names[i],
+					sizeof(p->name));
+				p->phase = j;
+				p->count = count;
+				p->errors = atomic_load(&s->errors);
+				p->last_error = atomic_load(&s->last_error);
+				p->total_us = atomic_load(&s->total_ns) / 1000;
+				p->max_us = atomic_load(&s->max_ns) / 1000;
+			}
+
+			n++;
+		}
+	}
+
+	return n;
+}
@@ -0,0 +1,779 @@
+/*
+ * Our Cryptoki call recorder (see recorder.h for the overview and the
+ * file format).
+ *
+ * We wrap the functions we actually implement; everything else in our
+ * function list just returns CKR_FUNCTION_NOT_SUPPORTED, and is passed
+ * straight through unrecorded.  Each wrapper builds its record on the
+ * stack (switching to the heap if the application hands us a large
+ * template) and writes it with a single writev() under a mutex, so a
+ * recording from a process that crashes is still good up to the crash.
+ * That makes recording expensive, but it is only ever turned on to
+ * capture a workload, never to measure one.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "mypkcs11.h"
+#include "keychain_pkcs11.h"
+#include "trace.h"
+#include "recorder.h"
+
+#define REC_FIXED_ARGS	16
+
+struct rec_buf {
+	struct rec_call	call;			/* The call record */
+	struct rec_arg	*args;			/* Our arguments */
+	unsigned int	size;			/* Allocated arguments */
+	uint64_t	start;			/* Start time */
+	struct rec_arg	fixed[REC_FIXED_ARGS];	/* Usually enough */
+};
+
+static pthread_mutex_t rec_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int rec_fd = -1;
+static char *rec_file = NULL;
+static uint64_t rec_epoch = 0;
+static CK_FUNCTION_LIST_PTR rec_real = NULL;
+static CK_FUNCTION_LIST rec_functions;
+static __thread uint64_t rec_thread = 0;
+
+static void rec_open(void);
+static uint64_t rec_hash(const void *, CK_ULONG);
+static void rec_begin(struct rec_buf *, uint32_t);
+static void rec_add(struct rec_buf *, uint32_t, uint32_t, uint64_t, uint64_t);
+static void rec_num(struct rec_buf *, CK_ULONG);
+static void rec_data(struct rec_buf *, const void *, CK_ULONG);
+static void rec_length(struct rec_buf *, const void *, CK_ULONG);
+static void rec_buffer(struct rec_buf *, const void *, CK_ULONG_PTR);
+static void rec_out(struct rec_buf *, CK_RV, CK_ULONG_PTR);
+static void rec_handles(struct rec_buf *, CK_RV, const CK_ULONG *,
+			CK_ULONG_PTR);
+static void rec_mech(struct rec_buf *, CK_MECHANISM_PTR);
+static void rec_template(struct rec_buf *, CK_ATTRIBUTE_PTR, CK_ULONG);
+static void rec_end(struct rec_buf *, CK_RV);
+static void rec_wrap(CK_FUNCTION_LIST_PTR);
+
+void
+recorder_init(CK_FUNCTION_LIST_PTR real)
+{
+	const char *file = getenv("KEYCHAIN_PKCS11_RECORD");
+
+	if (! file || *file == '\0')
+		return;
+
+	rec_file = strdup(file);
+	rec_epoch = trace_now();
+	rec_open();
+
+	if (rec_fd != -1)
+		rec_wrap(real);
+}
+
+CK_FUNCTION_LIST_PTR
+recorder_list(void)
+{
+	return rec_real ? &rec_functions : NULL;
+}
+
+/*
+ * Our file descriptor is shared with our parent, so writing more records
+ * into it would just make a mess.  Start our own recording if we can.
+ */
+
+void
+recorder_forked(void)
+{
+	pthread_mutex_init(&rec_mutex, NULL);
+
+	if (rec_fd == -1)
+		return;
+
+	close(rec_fd);
+	rec_fd = -1;
+
+	if (strstr(rec_file, "%d")) {
+		rec_epoch = trace_now();
+		rec_open();
+	}
+}
+
+/*
+ * Open our recording file and write the header
+ */
+
+static void
+rec_open(void)
+{
+	struct rec_header hdr;
+	char *filename;
+
+	if (! (filename = trace_filename(rec_file)))
+		return;
+
+	rec_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND |
+		      O_CLOEXEC, 0600);
+
+	if (rec_fd == -1) {
+		os_log_debug(logsys, "Unable to open call recording \"%{public}s"
+			     "\": %{darwin.errno}d", filename, errno);
+		free(filename);
+		return;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	strncpy(hdr.magic, REC_MAGIC, sizeof(hdr.magic));
+	hdr.version = REC_VERSION;
+	hdr.arg_size = sizeof(struct rec_arg);
+	hdr.pid = getpid();
+
+	if (write(rec_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		close(rec_fd);
+		rec_fd = -1;
+	} else {
+		os_log_debug(logsys, "Recording calls to \"%{public}s\"",
+			     filename);
+	}
+
+	free(filename);
+}
+
+/*
+ * FNV-1a; we only need to tell values apart, not keep secrets (we never
+ * hash anything secret).  Short values are kept as they are.
+ */
+
+static uint64_t
+rec_hash(const void *data, CK_ULONG len)
+{
+	const unsigned char *p = data;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	CK_ULONG i;
+
+	if (len <= REC_INLINE_MAX) {
+		hash = 0;
+		memcpy(&hash, data, len);
+		return hash;
+	}
+
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static void
+rec_begin(struct rec_buf *rb, uint32_t id)
+{
+	if (! rec_thread)
+		pthread_threadid_np(NULL, &rec_thread);
+
+	memset(&rb->call, 0, sizeof(rb->call));
+	rb->call.id = id;
+	rb->call.thread = rec_thread;
+	rb->args = rb->fixed;
+	rb->size = REC_FIXED_ARGS;
+	rb->start = trace_now();
+}
+
+static void
+rec_add(struct rec_buf *rb, uint32_t kind, uint32_t type, uint64_t value,
+	uint64_t hash)
+{
+	struct rec_arg *a;
+
+	if (rb->call.arg_count == rb->size) {
+		if (rb->args == rb->fixed) {
+			if (! (a = malloc(rb->size * 2 * sizeof(*a))))
+				return;
+			memcpy(a, rb->fixed, sizeof(rb->fixed));
+		} else if (! (a = realloc(rb->args,
+					  rb->size * 2 * sizeof(*a)))) {
+			return;
+		}
+		rb->args = a;
+		rb->size *= 2;
+	}
+
+	a = &rb->args[rb->call.arg_count++];
+	a->kind = kind;
+	a->type = type;
+	a->value = value;
+	a->hash = hash;
+}
+
+static void
+rec_num(struct rec_buf *rb, CK_ULONG value)
+{
+	rec_add(rb, REC_ULONG, 0, value, 0);
+}
+
+static void
+rec_data(struct rec_buf *rb, const void *data, CK_ULONG len)
+{
+	if (! data)
+		rec_add(rb, REC_NULL, 0, len, 0);
+	else
+		rec_add(rb, REC_DATA, 0, len, rec_hash(data, len));
+}
+
+/*
+ * Data we must not keep in any form (a PIN or plaintext); just its length
+ */
+
+static void
+rec_length(struct rec_buf *rb, const void *data, CK_ULONG len)
+{
+	rec_add(rb, data ? REC_DATA : REC_NULL, 0, len, 0);
+}
+
+/*
+ * An output buffer and its length; the length is what tells the replay
+ * how the application sized its buffer.
+ */
+
+static void
+rec_buffer(struct rec_buf *rb, const void *buf, CK_ULONG_PTR len)
+{
+	rec_add(rb, buf ? REC_BUFFER : REC_NULL, 0, len ? *len : 0, 0);
+}
+
+/*
+ * A number we returned (if we were given somewhere to put it)
+ */
+
+static void
+rec_out(struct rec_buf *rb, CK_RV rv, CK_ULONG_PTR value)
+{
+	if (! value)
+		rec_add(rb, REC_NULL, 0, 0, 0);
+	else
+		rec_add(rb, REC_OUT_ULONG, 0,
+			rv == CKR_OK || rv == CKR_BUFFER_TOO_SMALL ? *value : 0,
+			0);
+}
+
+/*
+ * A list of handles (slots, mechanisms or objects) we returned
+ */
+
+static void
+rec_handles(struct rec_buf *rb, CK_RV rv, const CK_ULONG *list,
+	    CK_ULONG_PTR count)
+{
+	CK_ULONG i;
+
+	rec_out(rb, rv, count);
+
+	if (rv != CKR_OK || ! list || ! count)
+		return;
+
+	for (i = 0; i < *count; i++)
+		rec_add(rb, REC_OUT_ULONG, 0, list[i], 0);
+}
+
+static void
+rec_mech(struct rec_buf *rb, CK_MECHANISM_PTR mech)
+{
+	const unsigned char *p;
+	CK_ULONG i, n;
+	uint64_t chunk;
+
+	if (! mech) {
+		rec_add(rb, REC_NULL, 0, 0, 0);
+		return;
+	}
+
+	rec_add(rb, REC_MECH, mech->mechanism, mech->ulParameterLen, 0);
+
+	if (! (p = mech->pParameter))
+		return;
+
+	for (i = 0; i < mech->ulParameterLen; i += sizeof(chunk)) {
+		n = mech->ulParameterLen - i;
+		if (n > sizeof(chunk))
+			n = sizeof(chunk);
+		chunk = 0;
+		memcpy(&chunk, p + i, n);
+		rec_add(rb, REC_PARAM, 0, n, chunk);
+	}
+}
+
+/*
+ * A template we were passed.  For C_GetAttributeValue() the values are
+ * output buffers, so we just record their lengths.
+ */
+
+static void
+rec_template(struct rec_buf *rb, CK_ATTRIBUTE_PTR tmpl, CK_ULONG count)
+{
+	CK_ULONG i;
+
+	for (i = 0; tmpl && i < count; i++) {
+		if (! tmpl[i].pValue)
+			rec_add(rb, REC_ATTR_NULL, tmpl[i].type,
+				tmpl[i].ulValueLen, 0);
+		else if (rb->call.id == TRACE_C_GetAttributeValue)
+			rec_add(rb, REC_BUFFER, tmpl[i].type,
+				tmpl[i].ulValueLen, 0);
+		else
+			rec_add(rb, REC_ATTR, tmpl[i].type,
+				tmpl[i].ulValueLen,
+				rec_hash(tmpl[i].pValue, tmpl[i].ulValueLen));
+	}
+}
+
+static void
+rec_end(struct rec_buf *rb, CK_RV rv)
+{
+	struct iovec iov[2];
+
+	rb->call.rv = (uint32_t) rv;
+	rb->call.timestamp = rb->start - rec_epoch;
+	rb->call.duration = trace_now() - rb->start;
+
+	iov[0].iov_base = &rb->call;
+	iov[0].iov_len = sizeof(rb->call);
+	iov[1].iov_base = rb->args;
+	iov[1].iov_len = rb->call.arg_count * sizeof(*rb->args);
+
+	pthread_mutex_lock(&rec_mutex);
+	if (rec_fd != -1)
+		(void) writev(rec_fd, iov, 2);
+	pthread_mutex_unlock(&rec_mutex);
+
+	if (rb->args != rb->fixed)
+		free(rb->args);
+}
+
+/*
+ * Our wrappers, in PKCS#11 order
+ */
+
+static CK_RV
+rec_C_Initialize(CK_VOID_PTR p)
+{
+	CK_C_INITIALIZE_ARGS_PTR args = p;
+	struct rec_buf rb;
+	CK_RV rv;
+
+	rec_begin(&rb, TRACE_C_Initialize);
+	rec_num(&rb, args ? args->flags : 0);
+	rv = rec_real->C_Initialize(p);
+	rec_end(&rb, rv);
+
+	return rv;
+}
+
+static CK_RV
+rec_C_Finalize(CK_VOID_PTR p)
+{
+	struct rec_buf rb;
+	CK_RV rv;
+
+	rec_begin(&rb, TRACE_C_Finalize);
+	rv = rec_real->C_Finalize(p);
+	rec_end(&rb, rv);
+
+	return rv;
+}
+
+static CK_RV
+rec_C_GetInfo(CK_INFO_PTR info)
+{
+	struct rec_buf rb;
+	CK_RV rv;
+
+	rec_begin(&rb, TRACE_C_GetInfo);
+	rv = rec_real->C_GetInfo(info);
+	rec_end(&rb, rv);
+
+	return rv;
+}
+
+static CK_RV
+rec_C_GetSlotList(CK_BBOOL present, CK_SLOT_ID_PTR list, CK_ULONG_PTR count)
+{
+	struct rec_buf rb;
+	CK_RV rv;
+
+	rec_begin(&rb, TRACE_C_GetSlotList);
+	rec_num(&rb, present);
+	rec_buffer(&rb, list, count);
+	rv = rec_real->C_GetSlotList(present, list, count);
+	rec_handles(&rb, rv, list, count);
+	rec_end(&rb, rv);
+
+	return rv;
+}
+
+static CK_RV
+rec_C_GetSlotInfo(CK_SLOT_ID slot_id, CK_SLOT_INFO_PTR info)
+{
+	struct rec_buf rb;
+	CK_RV rv;
+
+	rec_begin(&rb, TRACE_C_GetSlotInfo);
+	rec_num(&rb, slot_id);
+	rv = rec_real->C_GetSlotInfo(slot_id, info);
+	rec_end(&rb, rv);
+
+	return rv;
+}
+
+static CK_RV
+rec_C_GetTokenInfo(CK_SLOT_ID slot_id, CK_TOKEN_INFO_PTR info)
+{
+	struct rec_buf rb;
+	CK_RV rv;
+
+	rec_begin(&rb, TRACE_C_GetTokenInfo);
+	rec_num(&rb, slot_id);
+	rv = rec_real->C_GetTokenInfo(slot_id, info);
+	rec_end(&rb, rv);
+
+	return rv;
+}
+
+static CK_RV
+rec_C_GetMechanismList(CK_SLOT_ID slot_id, CK_MECHANISM_TYPE_PTR list,
+		       CK_ULONG_PTR count)
+{
+	struct rec_buf rb;
+	CK_RV rv;
+
+	rec_begin(&rb, TRACE_C_GetMechanismList);
+	rec_num(&rb, slot_id);
+	rec_buffer(&rb, list, count);
+	rv = rec_real->C_GetMechanismList(slot_id, list, count);
+	rec_handles(&rb, rv, list, count);
+	rec_end(&rb, rv);
+
+	return rv;
+}
+
+static CK_RV
+rec_C_GetMechanismInfo(CK_SLOT_ID slot_id, CK_MECHANISM_TYPE type,
+		       CK_MECHANISM_INFO_PTR info)
+{
+	struct rec_buf rb;
+	CK_RV rv;
+
+	rec_begin(&rb, TRACE_C_GetMechanismInfo);
+	rec_num(&rb, slot_id);
+	rec_num(&rb, type);
+	rv = rec_real->C_GetMechanismInfo(slot_id, type, info);
+	rec_end(&rb, rv);
+
+	return rv;
+}
+
+static CK_RV
+rec_C_OpenSession(CK_SLOT_ID slot_id, CK_FLAGS flags, CK_VOID_PTR app,
+		  CK_NOTIFY notify, CK_SESSION_HANDLE_PTR session)
+{
+	struct rec_buf rb;
+	CK_RV rv;
+
+	rec_begin(&rb, TRACE_C_OpenSession);
+	rec_num(&rb, slot_id);
+	rec_num(&rb, flags);
+	rv = rec_real->C_OpenSession(slot_id, flags, app, notify, session);
+	rec_out(&rb, rv, session);
+	rec_end(&rb, rv);
+
+	return rv;
+}
+
+static CK_RV
+rec_C_CloseSession(CK_SESSION_HANDLE session)
+{
+	struct rec_buf rb;
+	CK_RV rv;
+
+	rec_begin(&rb, TRACE_C_CloseSession);
+	rec_num(&rb, session);
+	rv = rec_real->C_CloseSession(session);
+	rec_end(&rb, rv);
+
+	return rv;
+}
+
+static CK_RV
+rec_C_CloseAllSessions(CK_SLOT_ID slot_id)
+{
+	struct rec_buf rb;
+	CK_RV rv;
+
+	rec_begin(&rb, TRACE_C_CloseAllSessions);
+	rec_num(&rb, slot_id);
+	rv = rec_real->C_CloseAllSessions(slot_id);
+	rec_end(&rb, rv);
+
+	return rv;
+}
+
+static CK_RV
+rec_C_GetSessionInfo(CK_SESSION_HANDLE session, CK_SESSION_INFO_PTR info)
+{
+	struct rec_buf rb;
+	CK_RV rv;
+
+	rec_begin(&rb, TRACE_C_GetSessionInfo);
+	rec_num(&rb, session);
+	rv = rec_real->C_GetSessionInfo(session, info);
+	rec_end(&rb, rv);
+
+	return rv;
+}
+
+/*
+ * Never the PIN, not even hashed; just its length
+ */
+
+static CK_RV
+rec_C_Login(CK_SESSION_HANDLE session, CK_USER_TYPE user, CK_UTF8CHAR_PTR pin,
+	    CK_ULONG pinlen)
+{
+	struct rec_buf rb;
+	CK_RV rv;
+
+	rec_begin(&rb, TRACE_C_Login);
+	rec_num(&rb, session);
+	rec_num(&rb, user);
+	rec_length(&rb, pin, pinlen);
+	rv = rec_real->C_Login(session, user, pin, pinlen);
+	rec_end(&rb, rv);
+
+	return rv;
+}
+
+static CK_RV
+rec_C_Logout(CK_SESSION_HANDLE session)
+{
+	struct rec_buf rb;
+	CK_RV rv;
+
+	rec_begin(&rb, TRACE_C_Logout);
+	rec_num(&rb, session);
+	rv = rec_real->C_Logout(session);
+	rec_end(&rb, rv);
+
+	return rv;
+}
+
+static CK_RV
+rec_C_GetAttributeValue(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object,
+			CK_ATTRIBUTE_PTR tmpl, CK_ULONG count)
+{
+	struct rec_buf rb;
+	CK_ULONG i;
+	CK_RV rv;
+
+	rec_begin(&rb, TRACE_C_GetAttributeValue);
+	rec_num(&rb, session);
+	rec_num(&rb, object);
+	rec_template(&rb, tmpl, count);
+	rv = rec_real->C_GetAttributeValue(session, object, tmpl, count);
+
+	/*
+	 * Record what we returned; the replay uses the hashes to match up
+	 * values the application later searches for.
+	 */
+
+	for (i = 0; tmpl && i < count; i++)
+		rec_add(&rb, REC_OUT_ATTR, tmpl[i].type, tmpl[i].ulValueLen,
+			tmpl[i].pValue &&
+			tmpl[i].ulValueLen != CK_UNAVAILABLE_INFORMATION ?
+			rec_hash(tmpl[i].pValue, tmpl[i].ulValueLen) : 0);
+
+	rec_end(&rb, rv);
+
+	return rv;
+}
+
+static CK_RV
+rec_C_FindObjectsInit(CK_SESSION_HANDLE session, CK_ATTRIBUTE_PTR tmpl,
+		      CK_ULONG count)
+{
+	struct rec_buf rb;
+	CK_RV rv;
+
+	rec_begin(&rb, TRACE_C_FindObjectsInit);
+	rec_num(&rb, session);
+	rec_template(&rb, tmpl, count);
+	rv = rec_real->C_FindObjectsInit(session, tmpl, count);
+	rec_end(&rb, rv);
+
+	return rv;
+}
+
+static CK_RV
+rec_C_FindObjects(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE_PTR objects,
+		  CK_ULONG max, CK_ULONG_PTR count)
+{
+	struct rec_buf rb;
+	CK_RV rv;
+
+	rec_begin(&rb, TRACE_C_FindObjects);
+	rec_num(&rb, session);
+	rec_num(&rb, max);
+	rv = rec_real->C_FindObjects(session, objects, max, count);
+	rec_handles(&rb, rv, objects, count);
+	rec_end(&rb, rv);
+
+	return rv;
+}
+
+static CK_RV
+rec_C_FindObjectsFinal(CK_SESSION_HANDLE session)
+{
+	struct rec_buf rb;
+	CK_RV rv;
+
+	rec_begin(&rb, TRACE_C_FindObjectsFinal);
+	rec_num(&rb, session);
+	rv = rec_real->C_FindObjectsFinal(session);
+	rec_end(&rb, rv);
+
+	return rv;
+}
+
+/*
+ * All of our Init functions look the same, and so do C_Sign(),
+ * C_Encrypt() and C_Decrypt(), so generate those.
+ */
+
+#define REC_INIT(name) \
+static CK_RV \
+rec_ ## name(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech, \
+	     CK_OBJECT_HANDLE key) \
+{ \
+	struct rec_buf rb; \
+	CK_RV rv; \
+\
+	rec_begin(&rb, TRACE_ ## name); \
+	rec_num(&rb, session); \
+	rec_mech(&rb, mech); \
+	rec_num(&rb, key); \
+	rv = rec_real->name(session, mech, key); \
+	rec_end(&rb, rv); \
+\
+	return rv; \
+}
+
+/*
+ * "input" is how we record the input: rec_data(), or rec_length() for
+ * plaintext.
+ */
+
+#define REC_CRYPT(name, input) \
+static CK_RV \
+rec_ ## name(CK_SESSION_HANDLE session, CK_BYTE_PTR in, CK_ULONG inlen, \
+	     CK_BYTE_PTR out, CK_ULONG_PTR outlen) \
+{ \
+	struct rec_buf rb; \
+	CK_RV rv; \
+\
+	rec_begin(&rb, TRACE_ ## name); \
+	rec_num(&rb, session); \
+	input(&rb, in, inlen); \
+	rec_buffer(&rb, out, outlen); \
+	rv = rec_real->name(session, in, inlen, out, outlen); \
+	rec_out(&rb, rv, outlen); \
+	rec_end(&rb, rv); \
+\
+	return rv; \
+}
+
+REC_INIT(C_EncryptInit)
+REC_CRYPT(C_Encrypt, rec_length)
+REC_INIT(C_DecryptInit)
+REC_CRYPT(C_Decrypt, rec_data)
+REC_INIT(C_SignInit)
+REC_CRYPT(C_Sign, rec_data)
+REC_INIT(C_VerifyInit)
+
+static CK_RV
+rec_C_Verify(CK_SESSION_HANDLE session, CK_BYTE_PTR data, CK_ULONG datalen,
+	     CK_BYTE_PTR sig, CK_ULONG siglen)
+{
+	struct rec_buf rb;
+	CK_RV rv;
+
+	rec_begin(&rb, TRACE_C_Verify);
+	rec_num(&rb, session);
+	rec_data(&rb, data, datalen);
+	rec_data(&rb, sig, siglen);
+	rv = rec_real->C_Verify(session, data, datalen, sig, siglen);
+	rec_end(&rb, rv);
+
+	return rv;
+}
+
+static CK_RV
+rec_C_CancelFunction(CK_SESSION_HANDLE session)
+{
+	struct rec_buf rb;
+	CK_RV rv;
+
+	rec_begin(&rb, TRACE_C_CancelFunction);
+	rec_num(&rb, session);
+	rv = rec_real->C_CancelFunction(session);
+	rec_end(&rb, rv);
+
+	return rv;
+}
+
+/*
+ * Build our function list: a copy of the real one with our wrappers
+ * swapped in
+ */
+
+static void
+rec_wrap(CK_FUNCTION_LIST_PTR real)
+{
+	rec_functions = *real;
+
+#define REC_WRAP(name) rec_functions.name = rec_ ## name
+	REC_WRAP(C_Initialize);
+	REC_WRAP(C_Finalize);
+	REC_WRAP(C_GetInfo);
+	REC_WRAP(C_GetSlotList);
+	REC_WRAP(C_GetSlotInfo);
+	REC_WRAP(C_GetTokenInfo);
+	REC_WRAP(C_GetMechanismList);
+	REC_WRAP(C_GetMechanismInfo);
+	REC_WRAP(C_OpenSession);
+	REC_WRAP(C_CloseSession);
+	REC_WRAP(C_CloseAllSessions);
+	REC_WRAP(C_GetSessionInfo);
+	REC_WRAP(C_Login);
+	REC_WRAP(C_Logout);
+	REC_WRAP(C_GetAttributeValue);
+	REC_WRAP(C_FindObjectsInit);
+	REC_WRAP(C_FindObjects);
+	REC_WRAP(C_FindObjectsFinal);
+	REC_WRAP(C_EncryptInit);
+	REC_WRAP(C_Encrypt);
+	REC_WRAP(C_DecryptInit);
+	REC_WRAP(C_Decrypt);
+	REC_WRAP(C_SignInit);
+	REC_WRAP(C_Sign);
+	REC_WRAP(C_VerifyInit);
+	REC_WRAP(C_Verify);
+	REC_WRAP(C_CancelFunction);
+#undef REC_WRAP
+
+	rec_real = real;
+}
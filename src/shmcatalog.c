@@ -0,0 +1,338 @@
+/*
+ * Our shared-memory catalogs (see shmcatalog.h for the overview).
+ *
+ * Each segment starts with a small header followed by the catalog.  The
+ * header has a sequence number that works as a seqlock: a writer bumps
+ * it to an odd number, copies in the new catalog, and bumps it to the
+ * next even number.  Readers copy the catalog out and then make sure
+ * the sequence number didn't change while they were doing it.  Since
+ * every publish bumps the sequence number, it also serves as the
+ * generation of the catalog.
+ *
+ * MacOS X won't let you resize a POSIX shared memory segment once it has
+ * been sized, so we create every segment at our maximum size; pages that
+ * are never written don't take up any memory.
+ *
+ * Segments are only accessible by the user who created them, and are
+ * per-user (the uid is part of the name).
+ *
+ * The certificate slot catalog carries a stamp of the Keychain files it
+ * was built from (see shm_keychain_stamp()), so a reader can tell if it
+ * is out of date without looking at the certificates themselves.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "catalog.h"
+#include "shmcatalog.h"
+
+#define SHM_CATALOG_MAGIC	0x4d48534b	/* "KSHM" */
+#define SHM_CATALOG_SIZE	(16 * 1024 * 1024)
+
+/*
+ * If a writer has held the segment for this long, assume it died and
+ * take over.
+ */
+
+#define SHM_CATALOG_STALE	10
+
+struct shm_catalog_header {
+	uint32_t		magic;		/* SHM_CATALOG_MAGIC */
+	uint32_t		version;	/* CATALOG_VERSION */
+	_Atomic uint64_t	sequence;	/* Odd while being written */
+	uint64_t		size;		/* Size of catalog */
+	int64_t			published;	/* Time of last publish */
+	int64_t			writing;	/* Time writer started */
+};
+
+static const char *segment_names[] = {
+	"token",
+	"certs",
+};
+
+/*
+ * Where the Keychain files live; "~" is our home directory.  Newer
+ * Keychains live in a subdirectory, so we look one level down too.
+ */
+
+static const char *keychain_dirs[] = {
+	"~/Library/Keychains",
+	"/Library/Keychains",
+	"/System/Library/Keychains",
+	NULL,
+};
+
+#define KEYCHAIN_DIR_DEPTH	1
+
+#ifdef __APPLE__
+#define ST_MTIME_NSEC(st)	((st).st_mtimespec.tv_nsec)
+#else
+#define ST_MTIME_NSEC(st)	((st).st_mtim.tv_nsec)
+#endif /* __APPLE__ */
+
+/*
+ * Open (and map) one of our segments.  Returns the mapping, or NULL.
+ * POSIX shared memory names are pretty short on MacOS X (31 characters),
+ * so keep this compact.
+ */
+
+static struct shm_catalog_header *
+shm_catalog_map(int which, int writable)
+{
+	struct shm_catalog_header *hdr;
+	struct stat st;
+	char name[32];
+	int fd;
+
+	snprintf(name, sizeof(name), "/kcpkcs11.%lu.%s",
+		 (unsigned long) getuid(), segment_names[which]);
+
+	if (writable)
+		fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+	else
+		fd = shm_open(name, O_RDONLY, 0);
+
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || st.st_uid != getuid()) {
+		close(fd);
+		return NULL;
+	}
+
+	if (st.st_size == 0 && writable &&
+	    ftruncate(fd, SHM_CATALOG_SIZE) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	if (st.st_size != 0 && st.st_size != SHM_CATALOG_SIZE) {
+		close(fd);
+		return NULL;
+	}
+
+	hdr = mmap(NULL, SHM_CATALOG_SIZE,
+		   writable ? PROT_READ | PROT_WRITE : PROT_READ,
+		   MAP_SHARED, fd, 0);
+
+	close(fd);
+
+	return hdr == MAP_FAILED ? NULL : hdr;
+}
+
+/*
+ * FNV-1a, which is plenty for noticing that something changed
+ */
+
+static uint64_t
+stamp_hash(uint64_t h, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len-- > 0)
+		h = (h ^ *p++) * 0x100000001b3ULL;
+
+	return h;
+}
+
+/*
+ * Add up the stamps of every file in a directory.  We add them rather
+ * than hashing them in order since readdir() doesn't promise any order.
+ * SQLite's shared memory index ("-shm") changes when a Keychain is only
+ * being read, so we skip those.
+ */
+
+static uint64_t
+stamp_dir(const char *dir, int depth)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	struct stat st;
+	uint64_t sum = 0, h, v;
+	size_t len;
+	DIR *d;
+
+	if (! (d = opendir(dir)))
+		return 0;
+
+	while ((de = readdir(d))) {
+		len = strlen(de->d_name);
+		if (de->d_name[0] == '.' ||
+		    (len > 4 && strcmp(de->d_name + len - 4, "-shm") == 0))
+			continue;
+
+		if (snprintf(path, sizeof(path), "%s/%s", dir,
+			     de->d_name) >= sizeof(path) ||
+		    lstat(path, &st) < 0)
+			continue;
+
+		if (S_ISDIR(st.st_mode)) {
+			if (depth > 0)
+				sum += stamp_dir(path, depth - 1);
+			continue;
+		}
+
+		h = stamp_hash(0xcbf29ce484222325ULL, path, strlen(path));
+		v = st.st_ino;
+		h = stamp_hash(h, &v, sizeof(v));
+		v = st.st_size;
+		h = stamp_hash(h, &v, sizeof(v));
+		v = st.st_mtime;
+		h = stamp_hash(h, &v, sizeof(v));
+		v = ST_MTIME_NSEC(st);
+		h = stamp_hash(h, &v, sizeof(v));
+		sum += h;
+	}
+
+	closedir(d);
+
+	return sum;
+}
+
+uint64_t
+shm_keychain_stamp(char **match)
+{
+	char dir[PATH_MAX];
+	const char *home = getenv("HOME");
+	uint64_t stamp = 0xcbf29ce484222325ULL;
+	int i;
+
+	for (i = 0; match && match[i]; i++)
+		stamp = stamp_hash(stamp, match[i], strlen(match[i]) + 1);
+
+	for (i = 0; keychain_dirs[i]; i++) {
+		if (keychain_dirs[i][0] == '~') {
+			if (! home)
+				continue;
+			snprintf(dir, sizeof(dir), "%s%s", home,
+				 keychain_dirs[i] + 1);
+		} else {
+			snprintf(dir, sizeof(dir), "%s", keychain_dirs[i]);
+		}
+		stamp += stamp_dir(dir, KEYCHAIN_DIR_DEPTH) * (2 * i + 1);
+	}
+
+	return stamp;
+}
+
+void *
+shm_catalog_fetch(int which, unsigned int maxage, size_t *len,
+		  uint64_t *generation)
+{
+	struct shm_catalog_header *hdr;
+	uint64_t seq;
+	void *buf = NULL;
+	size_t size;
+	int tries;
+
+	if (! (hdr = shm_catalog_map(which, 0)))
+		return NULL;
+
+	if (hdr->magic != SHM_CATALOG_MAGIC ||
+	    hdr->version != CATALOG_VERSION)
+		goto out;
+
+	for (tries = 0; tries < 5; tries++) {
+		seq = atomic_load_explicit(&hdr->sequence,
+					   memory_order_acquire);
+
+		if (seq == 0)
+			goto out;
+
+		if (seq & 1) {
+			usleep(1000);
+			continue;
+		}
+
+		size = hdr->size;
+
+		if (size > SHM_CATALOG_SIZE - sizeof(*hdr))
+			goto out;
+
+		if (maxage && time(NULL) - hdr->published > maxage)
+			goto out;
+
+		free(buf);
+		if (! (buf = malloc(size)))
+			goto out;
+
+		memcpy(buf, hdr + 1, size);
+
+		atomic_thread_fence(memory_order_acquire);
+
+		if (atomic_load_explicit(&hdr->sequence,
+					 memory_order_relaxed) == seq) {
+			munmap(hdr, SHM_CATALOG_SIZE);
+			if (! catalog_valid(buf, size)) {
+				free(buf);
+				return NULL;
+			}
+			*len = size;
+			*generation = seq >> 1;
+			return buf;
+		}
+	}
+
+out:
+	free(buf);
+	munmap(hdr, SHM_CATALOG_SIZE);
+	return NULL;
+}
+
+void
+shm_catalog_publish(int which, const void *buf, size_t len)
+{
+	struct shm_catalog_header *hdr;
+	uint64_t seq, next;
+
+	if (len > SHM_CATALOG_SIZE - sizeof(*hdr))
+		return;
+
+	if (! (hdr = shm_catalog_map(which, 1)))
+		return;
+
+	/*
+	 * Grab the segment by making the sequence number odd.  If someone
+	 * else has it, leave them alone unless they've been at it for
+	 * far too long (and probably died).  Between publishes "writing"
+	 * is set far into the future, so we can't mistake a writer that
+	 * has just grabbed the segment for a dead one.
+	 */
+
+	seq = atomic_load(&hdr->sequence);
+
+	if (seq & 1) {
+		if (time(NULL) - hdr->writing < SHM_CATALOG_STALE)
+			goto out;
+		next = seq + 2;
+	} else {
+		next = seq + 1;
+	}
+
+	if (! atomic_compare_exchange_strong(&hdr->sequence, &seq, next))
+		goto out;
+
+	hdr->writing = time(NULL);
+	hdr->magic = SHM_CATALOG_MAGIC;
+	hdr->version = CATALOG_VERSION;
+	hdr->size = len;
+	memcpy(hdr + 1, buf, len);
+	hdr->published = time(NULL);
+	hdr->writing = INT64_MAX;
+
+	atomic_fetch_add_explicit(&hdr->sequence, 1, memory_order_release);
+
+out:
+	munmap(hdr, SHM_CATALOG_SIZE);
+}
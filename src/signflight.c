@@ -0,0 +1,272 @@
+/*
+ * Our signature coalescing (see signflight.h for the overview).
+ *
+ * Flights in progress live on a simple linked list; there are only ever
+ * as many as there are threads signing at once, so there is no point in
+ * anything fancier.  A flight leaves the list as soon as its leader
+ * lands, so late arrivals start a new one, but the structure sticks
+ * around (reference counted) until the last waiter has copied out the
+ * answer.  One mutex protects the list and the counters, and each flight
+ * has a condition variable for its waiters.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "mypkcs11.h"
+#include "keychain_vendor.h"
+#include "signflight.h"
+
+/*
+ * How often a waiter checks whether it has been cancelled
+ */
+
+#define SF_POLL_MS	100
+
+struct sflight {
+	struct sflight		*next;		/* Next flight in the air */
+	CK_SLOT_ID		slot_id;	/* Slot of the key */
+	CK_OBJECT_HANDLE	obj;		/* Private key object */
+	CK_MECHANISM_TYPE	mech;		/* Signing mechanism */
+	const void		*data;		/* Leader's input data */
+	size_t			datalen;	/* Length of the input */
+	unsigned int		refcount;	/* Leader plus waiters */
+	bool			landed;		/* Leader is done */
+	pthread_cond_t		cond;		/* Signalled on landing */
+	CK_RV			rv;		/* Leader's return value */
+	unsigned char		*sig;		/* Leader's signature */
+	size_t			siglen;		/* Length of signature */
+};
+
+static pthread_mutex_t sf_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct sflight *sf_list = NULL;
+static CK_MECHANISM_TYPE *sf_mechs = NULL;
+static unsigned int sf_mech_count = 0;
+static uint64_t sf_leaders = 0;
+static uint64_t sf_followers = 0;
+
+/*
+ * This is only called from C_Initialize() and C_Finalize(), so nobody can
+ * be looking at the mechanism list while we change it.
+ */
+
+void
+sflight_init(const CK_MECHANISM_TYPE *mechs, unsigned int count)
+{
+	pthread_mutex_lock(&sf_mutex);
+
+	free(sf_mechs);
+	sf_mechs = NULL;
+	sf_mech_count = 0;
+	sf_leaders = sf_followers = 0;
+
+	if (count > 0 && (sf_mechs = malloc(count * sizeof(*sf_mechs)))) {
+		memcpy(sf_mechs, mechs, count * sizeof(*sf_mechs));
+		sf_mech_count = count;
+	}
+
+	pthread_mutex_unlock(&sf_mutex);
+}
+
+void
+sflight_free(void)
+{
+	sflight_init(NULL, 0);
+}
+
+bool
+sflight_eligible(CK_MECHANISM_TYPE mech)
+{
+	unsigned int i;
+
+	for (i = 0; i < sf_mech_count; i++)
+		if (sf_mechs[i] == mech)
+			return true;
+
+	return false;
+}
+
+struct sflight *
+sflight_join(CK_SLOT_ID slot_id, CK_OBJECT_HANDLE obj, CK_MECHANISM_TYPE mech,
+	     const void *data, size_t datalen, bool *leader)
+{
+	struct sflight *f;
+
+	pthread_mutex_lock(&sf_mutex);
+
+	for (f = sf_list; f; f = f->next)
+		if (f->slot_id == slot_id && f->obj == obj &&
+		    f->mech == mech && f->datalen == datalen &&
+		    memcmp(f->data, data, datalen) == 0)
+			break;
+
+	if (f) {
+		f->refcount++;
+		sf_followers++;
+		*leader = false;
+	} else if ((f = calloc(1, sizeof(*f)))) {
+		f->slot_id = slot_id;
+		f->obj = obj;
+		f->mech = mech;
+		f->data = data;
+		f->datalen = datalen;
+		f->refcount = 1;
+		pthread_cond_init(&f->cond, NULL);
+		f->next = sf_list;
+		sf_list = f;
+		sf_leaders++;
+		*leader = true;
+	}
+
+	pthread_mutex_unlock(&sf_mutex);
+
+	return f;
+}
+
+void
+sflight_land(struct sflight *f, CK_RV rv, const void *sig, size_t siglen)
+{
+	struct sflight **p;
+
+	pthread_mutex_lock(&sf_mutex);
+
+	/*
+	 * Take ourselves off the list first; our data pointer belongs to
+	 * the leader, and is about to go away.
+	 */
+
+	for (p = &sf_list; *p && *p != f; p = &(*p)->next)
+		;
+	if (*p)
+		*p = f->next;
+
+	f->data = NULL;
+	f->rv = rv;
+
+	/*
+	 * If we can't keep a copy of the signature, tell our waiters the
+	 * same thing as if we had been cancelled, so they make their own.
+	 */
+
+	if (rv == CKR_OK && siglen > 0) {
+		if ((f->sig = malloc(siglen))) {
+			memcpy(f->sig, sig, siglen);
+			f->siglen = siglen;
+		} else {
+			f->rv = CKR_FUNCTION_CANCELED;
+		}
+	}
+
+	f->landed = true;
+	pthread_cond_broadcast(&f->cond);
+
+	pthread_mutex_unlock(&sf_mutex);
+}
+
+/*
+ * The signature we return belongs to the flight, so copy it out before
+ * calling sflight_release().  We wake up every SF_POLL_MS to see if the
+ * value at "cancel" has moved on from "gen", and give up once "ms"
+ * milliseconds have gone by (0 means no limit).
+ */
+
+CK_RV
+sflight_wait(struct sflight *f, _Atomic(unsigned long) *cancel,
+	     unsigned long gen, unsigned int ms, const unsigned char **sig,
+	     size_t *siglen)
+{
+	struct timespec ts;
+	unsigned int waited = 0, slice;
+	CK_RV rv;
+
+	*sig = NULL;
+	*siglen = 0;
+
+	pthread_mutex_lock(&sf_mutex);
+
+	while (! f->landed) {
+		if (atomic_load(cancel) != gen) {
+			pthread_mutex_unlock(&sf_mutex);
+			return CKR_FUNCTION_CANCELED;
+		}
+
+		if (ms && waited >= ms) {
+			pthread_mutex_unlock(&sf_mutex);
+			return CKR_DEVICE_ERROR;
+		}
+
+		slice = SF_POLL_MS;
+		if (ms && ms - waited < slice)
+			slice = ms - waited;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += slice * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		if (pthread_cond_timedwait(&f->cond, &sf_mutex, &ts) ==
+		    ETIMEDOUT)
+			waited += slice;
+	}
+
+	rv = f->rv;
+	*sig = f->sig;
+	*siglen = f->siglen;
+
+	pthread_mutex_unlock(&sf_mutex);
+
+	return rv;
+}
+
+void
+sflight_release(struct sflight *f)
+{
+	bool last;
+
+	pthread_mutex_lock(&sf_mutex);
+	last = --f->refcount == 0;
+	pthread_mutex_unlock(&sf_mutex);
+
+	if (last) {
+		pthread_cond_destroy(&f->cond);
+		free(f->sig);
+		free(f);
+	}
+}
+
+/*
+ * Nobody in the child is waiting on the flights we inherited, and
+ * nobody will land them; just forget about them (the memory belongs to
+ * threads that only exist in the parent).
+ */
+
+void
+sflight_forked(void)
+{
+	pthread_mutex_init(&sf_mutex, NULL);
+	sf_list = NULL;
+}
+
+void
+sflight_stats(struct keychain_sign_coalesce_stats *stats)
+{
+	struct sflight *f;
+
+	pthread_mutex_lock(&sf_mutex);
+
+	stats->mechanisms = sf_mech_count;
+	stats->leaders = sf_leaders;
+	stats->followers = sf_followers;
+	stats->in_flight = 0;
+	for (f = sf_list; f; f = f->next)
+		stats->in_flight++;
+
+	pthread_mutex_unlock(&sf_mutex);
+}
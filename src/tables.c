@@ -4,6 +4,8 @@
  */
 
 #include <Security/Security.h>
+#include <pthread.h>
+#include <string.h>
 #include "mypkcs11.h"
 #include "tables.h"
 
@@ -13,28 +15,73 @@ struct mechanism_map keychain_mechmap[] = {
 	  &kSecKeyAlgorithmRSAEncryptionPKCS1,
 	  &kSecKeyAlgorithmRSASignatureDigestPKCS1v15Raw,
 	  NULL, 0	/* Special case - no digest algoritm specified */,
-	  true },
+	  true, true },
 	{ CKM_SHA1_RSA_PKCS, 1024, 8192, CKF_HW|CKF_SIGN|CKF_VERIFY,
 	  NULL,
 	  &kSecKeyAlgorithmRSASignatureDigestPKCS1v15SHA1,
-	  &kSecDigestSHA1, 0, true},
+	  &kSecDigestSHA1, 0, true, true },
 	{ CKM_SHA256_RSA_PKCS, 1024, 8192, CKF_HW|CKF_SIGN|CKF_VERIFY,
 	  NULL,
 	  &kSecKeyAlgorithmRSASignatureDigestPKCS1v15SHA256,
-	  &kSecDigestSHA2, 256, true },
+	  &kSecDigestSHA2, 256, true, true },
 	{ CKM_SHA384_RSA_PKCS, 1024, 8192, CKF_HW|CKF_SIGN|CKF_VERIFY,
 	  NULL,
 	  &kSecKeyAlgorithmRSASignatureDigestPKCS1v15SHA384,
-	  &kSecDigestSHA2, 384, true },
+	  &kSecDigestSHA2, 384, true, true },
 	{ CKM_SHA512_RSA_PKCS, 1024, 8192, CKF_HW|CKF_SIGN|CKF_VERIFY,
 	  NULL,
 	  &kSecKeyAlgorithmRSASignatureDigestPKCS1v15SHA512,
-	  &kSecDigestSHA2, 512, true },
+	  &kSecDigestSHA2, 512, true, true },
 };
 
 unsigned int keychain_mechmap_size = sizeof(keychain_mechmap)/
 						sizeof(keychain_mechmap[0]);
 
+/*
+ * Our hash table of mechanisms (see keychain_mechmap_index()).  This is
+ * open addressing with linear probing; the size needs to be a power of
+ * two and comfortably larger than keychain_mechmap.
+ */
+
+#define MECHMAP_HASH_SIZE	64
+#define MECHMAP_HASH(mech)	(((mech) ^ ((mech) >> 6)) & \
+				 (MECHMAP_HASH_SIZE - 1))
+
+static int mechmap_hash[MECHMAP_HASH_SIZE];
+static pthread_once_t mechmap_once = PTHREAD_ONCE_INIT;
+
+static void
+mechmap_hash_init(void)
+{
+	unsigned int i, h;
+
+	memset(mechmap_hash, 0xff, sizeof(mechmap_hash));
+
+	for (i = 0; i < keychain_mechmap_size; i++) {
+		h = MECHMAP_HASH(keychain_mechmap[i].cki_mech);
+		while (mechmap_hash[h] >= 0)
+			h = (h + 1) & (MECHMAP_HASH_SIZE - 1);
+		mechmap_hash[h] = i;
+	}
+}
+
+int
+keychain_mechmap_index(CK_MECHANISM_TYPE mech)
+{
+	unsigned int h = MECHMAP_HASH(mech);
+	int i;
+
+	pthread_once(&mechmap_once, mechmap_hash_init);
+
+	while ((i = mechmap_hash[h]) >= 0) {
+		if (keychain_mechmap[i].cki_mech == mech)
+			return i;
+		h = (h + 1) & (MECHMAP_HASH_SIZE - 1);
+	}
+
+	return -1;
+}
+
 /*
  * Mapping of Security framework constants to Cryptoki constants
  */
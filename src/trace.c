@@ -0,0 +1,486 @@
+/*
+ * Our binary ring-buffer tracer.
+ *
+ * How this works:
+ *
+ * Every thread that calls into us gets its own ring buffer of fixed-size
+ * trace records (see trace.h).  Since only the owning thread ever writes
+ * into a ring we don't need any locks on the hot path; we write the
+ * record and then publish the new head index with a release store.
+ * The first time a thread records something we allocate its ring and
+ * push it onto a global list with a compare-and-swap, so we can find
+ * all of the rings again when it is time to write them out.
+ *
+ * Rings are never freed.  Threads hold on to a pointer to their ring in
+ * thread-local storage, and we have no way of knowing when an application
+ * thread goes away.  Instead we just reset the rings after every flush
+ * and reuse them across C_Finalize()/C_Initialize() cycles.
+ *
+ * Tracing is enabled by setting the environment variable
+ * KEYCHAIN_PKCS11_TRACE to the name of a file; the trace records are
+ * written to that file by C_Finalize().  Setting KEYCHAIN_PKCS11_TRACE_JSON
+ * will also (or instead) write the trace out in the Chrome trace-event
+ * JSON format, which is handy for looking at with Perfetto.  If either
+ * file name contains a "%d" it is replaced with the process ID.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "mypkcs11.h"
+#include "keychain_pkcs11.h"
+#include "debug.h"
+#include "trace.h"
+
+/*
+ * Number of records in each per-thread ring; must be a power of 2
+ */
+
+#define TRACE_RING_SIZE	4096
+
+struct trace_ring {
+	_Atomic uint64_t	head;		/* Next record to write */
+	uint64_t		thread;		/* Owning thread */
+	struct trace_ring	*next;		/* Next ring in global list */
+	struct trace_record	records[TRACE_RING_SIZE];
+};
+
+/*
+ * The state of the Cryptoki call in progress on this thread
+ */
+
+struct trace_call {
+	uint32_t	id;			/* Function identifier */
+	uint64_t	start;			/* Start time */
+	uint64_t	handle;			/* Handle, if we have one */
+};
+
+bool trace_enabled = false;
+
+static _Atomic(struct trace_ring *) ring_list = NULL;
+static __thread struct trace_ring *ring = NULL;
+static __thread struct trace_call call = { TRACE_ID_NONE, 0, 0 };
+static char *trace_file = NULL;
+static char *json_file = NULL;
+
+static struct trace_ring *ring_get(void);
+static void write_binary(struct trace_header *, struct trace_record *);
+static void write_json(struct trace_header *, struct trace_record *);
+
+/*
+ * Check to see if tracing is requested, and if it is turn it on
+ */
+
+void
+trace_init(void)
+{
+	const char *file = getenv("KEYCHAIN_PKCS11_TRACE");
+	const char *json = getenv("KEYCHAIN_PKCS11_TRACE_JSON");
+
+	if (file && *file != '\0') {
+		trace_file = strdup(file);
+		os_log_debug(logsys, "Binary tracing enabled, writing trace "
+			     "to \"%{public}s\"", trace_file);
+	}
+
+	if (json && *json != '\0') {
+		json_file = strdup(json);
+		os_log_debug(logsys, "JSON tracing enabled, writing trace "
+			     "to \"%{public}s\"", json_file);
+	}
+
+	trace_enabled = trace_file != NULL || json_file != NULL;
+}
+
+/*
+ * Return the current time in nanoseconds.  We use the raw uptime clock
+ * as it is cheap to read and doesn't jump around.
+ */
+
+uint64_t
+trace_now(void)
+{
+	return clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+}
+
+/*
+ * Mark the start of a Cryptoki function
+ */
+
+void
+trace_begin(uint32_t id)
+{
+	call.id = id;
+	call.handle = 0;
+	call.start = trace_now();
+}
+
+/*
+ * Attach a handle to the function in progress
+ */
+
+void
+trace_handle(uint64_t handle)
+{
+	call.handle = handle;
+}
+
+/*
+ * Mark the end of a Cryptoki function and write out a record for it.
+ * If we don't have a function in progress (some functions don't call
+ * FUNCINIT) then just ignore it.
+ */
+
+void
+trace_end(uint32_t rv)
+{
+	if (call.id == TRACE_ID_NONE)
+		return;
+
+	trace_record(call.id, call.start, call.handle, rv);
+
+	call.id = TRACE_ID_NONE;
+}
+
+/*
+ * Write a trace record into our per-thread ring
+ */
+
+void
+trace_record(uint32_t id, uint64_t start, uint64_t handle, uint32_t rv)
+{
+	struct trace_ring *r = ring_get();
+	struct trace_record *rec;
+	uint64_t head;
+
+	if (! r)
+		return;
+
+	head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	rec = &r->records[head & (TRACE_RING_SIZE - 1)];
+
+	rec->timestamp = start;
+	rec->duration = trace_now() - start;
+	rec->thread = r->thread;
+	rec->handle = handle;
+	rec->id = id;
+	rec->rv = rv;
+
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+/*
+ * Write out all of our trace rings to our trace files and reset them.
+ *
+ * This is called from C_Finalize(); if another thread is still busy
+ * writing records into its ring while we do this, we might capture a
+ * partially written record.  That seems an acceptable tradeoff versus
+ * taking a lock on every record.
+ */
+
+void
+trace_flush(void)
+{
+	struct trace_header hdr;
+	struct trace_record *records;
+	struct trace_ring *r;
+	uint64_t n = 0;
+
+	if (! trace_enabled)
+		return;
+
+	memset(&hdr, 0, sizeof(hdr));
+	strncpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = TRACE_VERSION;
+	hdr.record_size = sizeof(struct trace_record);
+	hdr.pid = getpid();
+
+	for (r = atomic_load(&ring_list); r != NULL; r = r->next) {
+		uint64_t head = atomic_load_explicit(&r->head,
+						     memory_order_acquire);
+		if (head > TRACE_RING_SIZE) {
+			hdr.dropped += head - TRACE_RING_SIZE;
+			hdr.record_count += TRACE_RING_SIZE;
+		} else {
+			hdr.record_count += head;
+		}
+	}
+
+	if (! (records = calloc(hdr.record_count ? hdr.record_count : 1,
+				sizeof(*records)))) {
+		os_log_debug(logsys, "Unable to allocate memory for %llu "
+			     "trace records", hdr.record_count);
+		return;
+	}
+
+	/*
+	 * Copy out each ring starting at the oldest record.  A ring may
+	 * have grown since we counted above, so don't overrun our buffer.
+	 */
+
+	for (r = atomic_load(&ring_list); r != NULL; r = r->next) {
+		uint64_t head = atomic_load_explicit(&r->head,
+						     memory_order_acquire);
+		uint64_t i = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+		for (; i < head && n < hdr.record_count; i++)
+			records[n++] = r->records[i & (TRACE_RING_SIZE - 1)];
+
+		atomic_store_explicit(&r->head, 0, memory_order_relaxed);
+	}
+
+	hdr.record_count = n;
+
+	if (trace_file)
+		write_binary(&hdr, records);
+	if (json_file)
+		write_json(&hdr, records);
+
+	free(records);
+}
+
+/*
+ * Called in a child process after fork().  The records in our rings
+ * were written by our parent (which will write them out itself), so
+ * start over.  Rings for threads that didn't come with us just stay
+ * empty.
+ */
+
+void
+trace_forked(void)
+{
+	struct trace_ring *r;
+
+	for (r = atomic_load(&ring_list); r != NULL; r = r->next)
+		atomic_store_explicit(&r->head, 0, memory_order_relaxed);
+
+	call.id = TRACE_ID_NONE;
+}
+
+/*
+ * Write out our records in our binary format.  Don't bother sorting
+ * them; the decoder does that.
+ */
+
+static void
+write_binary(struct trace_header *hdr, struct trace_record *records)
+{
+	char *filename;
+	FILE *f;
+
+	if (! (filename = trace_filename(trace_file)))
+		return;
+
+	if (! (f = fopen(filename, "w"))) {
+		os_log_debug(logsys, "Unable to open trace file \"%{public}s\": "
+			     "%{darwin.errno}d", filename, errno);
+		free(filename);
+		return;
+	}
+
+	fwrite(hdr, sizeof(*hdr), 1, f);
+	fwrite(records, sizeof(*records), hdr->record_count, f);
+	fclose(f);
+
+	os_log_debug(logsys, "Wrote %llu trace records (%llu dropped) to "
+		     "\"%{public}s\"", hdr->record_count, hdr->dropped,
+		     filename);
+
+	free(filename);
+}
+
+/*
+ * Write out our records as a Chrome trace-event JSON file, which can
+ * be loaded into Perfetto or chrome://tracing.  Each record becomes a
+ * begin ("B") and an end ("E") event.  Those have to be in timestamp
+ * order for each thread so the viewer can match them up, so sort them
+ * first.
+ */
+
+struct json_event {
+	uint64_t	ts;		/* Event timestamp */
+	uint64_t	duration;	/* Duration of the whole record */
+	uint32_t	index;		/* Index into record array */
+	char		phase;		/* 'B' or 'E' */
+};
+
+static const char *categories[] = {
+#define CK_PKCS11_FUNCTION_INFO(name) "pkcs11",
+#include "pkcs11f.h"
+#undef CK_PKCS11_FUNCTION_INFO
+#define TRACE_EVENT(name, cat) cat,
+	TRACE_EVENT_LIST
+#undef TRACE_EVENT
+};
+
+static int
+json_event_compare(const void *a, const void *b)
+{
+	const struct json_event *ea = a, *eb = b;
+
+	if (ea->ts != eb->ts)
+		return ea->ts < eb->ts ? -1 : 1;
+
+	/*
+	 * At the same timestamp, ends go before begins; the outer of two
+	 * nested events (the longer one) begins first and ends last.
+	 */
+
+	if (ea->phase != eb->phase)
+		return ea->phase == 'E' ? -1 : 1;
+
+	if (ea->duration != eb->duration) {
+		if (ea->phase == 'B')
+			return ea->duration > eb->duration ? -1 : 1;
+		else
+			return ea->duration < eb->duration ? -1 : 1;
+	}
+
+	return 0;
+}
+
+static void
+write_json(struct trace_header *hdr, struct trace_record *records)
+{
+	struct json_event *events;
+	uint64_t i, base = UINT64_MAX;
+	char *filename;
+	FILE *f;
+
+	if (! (filename = trace_filename(json_file)))
+		return;
+
+	if (! (events = calloc(hdr->record_count ? hdr->record_count * 2 : 1,
+			       sizeof(*events)))) {
+		free(filename);
+		return;
+	}
+
+	for (i = 0; i < hdr->record_count; i++) {
+		events[i * 2].ts = records[i].timestamp;
+		events[i * 2].duration = records[i].duration;
+		events[i * 2].index = i;
+		events[i * 2].phase = 'B';
+		events[i * 2 + 1].ts = records[i].timestamp +
+							records[i].duration;
+		events[i * 2 + 1].duration = records[i].duration;
+		events[i * 2 + 1].index = i;
+		events[i * 2 + 1].phase = 'E';
+		if (records[i].timestamp < base)
+			base = records[i].timestamp;
+	}
+
+	qsort(events, hdr->record_count * 2, sizeof(*events),
+	      json_event_compare);
+
+	if (! (f = fopen(filename, "w"))) {
+		os_log_debug(logsys, "Unable to open JSON trace file "
+			     "\"%{public}s\": %{darwin.errno}d", filename, errno);
+		free(events);
+		free(filename);
+		return;
+	}
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"otherData\":"
+		"{\"dropped\":%llu},\"traceEvents\":[\n",
+		(unsigned long long) hdr->dropped);
+
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%llu,"
+		"\"args\":{\"name\":\"%s (keychain-pkcs11)\"}}",
+		(unsigned long long) hdr->pid, getprogname());
+
+	for (i = 0; i < hdr->record_count * 2; i++) {
+		struct json_event *e = &events[i];
+		struct trace_record *rec = &records[e->index];
+		const char *cat = rec->id < TRACE_ID_MAX ?
+						categories[rec->id] : "unknown";
+
+		fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\","
+			"\"ts\":%.3f,\"pid\":%llu,\"tid\":%llu",
+			getTraceName(rec->id), cat, e->phase,
+			(e->ts - base) / 1000.0,
+			(unsigned long long) hdr->pid,
+			(unsigned long long) rec->thread);
+
+		if (e->phase == 'B')
+			fprintf(f, ",\"args\":{\"handle\":%llu}}",
+				(unsigned long long) rec->handle);
+		else if (TRACE_IS_FUNCTION(rec->id))
+			fprintf(f, ",\"args\":{\"rv\":\"%s\"}}",
+				getCKRName(rec->rv));
+		else
+			fprintf(f, ",\"args\":{\"status\":%d}}",
+				(int) rec->rv);
+	}
+
+	fprintf(f, "\n]}\n");
+	fclose(f);
+
+	os_log_debug(logsys, "Wrote %llu JSON trace events to \"%{public}s\"",
+		     hdr->record_count * 2, filename);
+
+	free(events);
+	free(filename);
+}
+
+/*
+ * Expand a "%d" in a trace filename into our process ID so multiple
+ * processes can share the same setting.  Returns a malloc'd string.
+ * The call recorder (see recorder.h) uses this too.
+ */
+
+char *
+trace_filename(const char *name)
+{
+	char *filename = NULL;
+	const char *p;
+
+	if ((p = strstr(name, "%d")) != NULL) {
+		if (asprintf(&filename, "%.*s%d%s", (int) (p - name),
+			     name, (int) getpid(), p + 2) < 0)
+			filename = NULL;
+	} else {
+		filename = strdup(name);
+	}
+
+	return filename;
+}
+
+/*
+ * Get the ring for this thread, allocating one if we don't have one yet.
+ */
+
+static struct trace_ring *
+ring_get(void)
+{
+	struct trace_ring *r;
+
+	if (ring)
+		return ring;
+
+	if (! (r = calloc(1, sizeof(*r))))
+		return NULL;
+
+	pthread_threadid_np(NULL, &r->thread);
+
+	/*
+	 * Push us onto the head of the global ring list
+	 */
+
+	r->next = atomic_load(&ring_list);
+
+	while (! atomic_compare_exchange_weak(&ring_list, &r->next, r))
+		;
+
+	ring = r;
+
+	return r;
+}
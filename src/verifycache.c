@@ -0,0 +1,282 @@
+/*
+ * Our verification cache (see verifycache.h for the overview).
+ *
+ * Entries live in a fixed-size array, and are linked (by array index)
+ * into a hash table and a doubly-linked LRU list.  Since our keys are
+ * already SHA-256 hashes, we just use the first few bytes to pick a hash
+ * bucket.  One mutex protects everything; what we do while holding it is
+ * tiny compared to hashing the message.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <CommonCrypto/CommonDigest.h>
+
+#include "mypkcs11.h"
+#include "keychain_vendor.h"
+#include "verifycache.h"
+
+#define VC_NONE		UINT32_MAX
+
+struct vc_entry {
+	unsigned char	key[VCACHE_KEYLEN];	/* Our cache key */
+	uint32_t	hnext;			/* Next in hash bucket */
+	uint32_t	prev;			/* Next most recently used */
+	uint32_t	next;			/* Next least recently used */
+};
+
+static pthread_mutex_t vc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct vc_entry *vc_entries = NULL;
+static uint32_t *vc_hash = NULL;
+static uint32_t vc_size = 0;			/* Number of entries */
+static uint32_t vc_hashsize = 0;		/* Always a power of 2 */
+static uint32_t vc_count = 0;			/* Entries in use */
+static uint32_t vc_head = VC_NONE;		/* Most recently used */
+static uint32_t vc_tail = VC_NONE;		/* Least recently used */
+static uint64_t vc_hits = 0;
+static uint64_t vc_misses = 0;
+static uint64_t vc_evictions = 0;
+static uint64_t vc_flushes = 0;
+
+static uint32_t vc_bucket(const unsigned char *);
+static void vc_lru_unlink(uint32_t);
+static void vc_lru_push(uint32_t);
+static void vc_reset(void);
+
+void
+vcache_init(unsigned int size)
+{
+	pthread_mutex_lock(&vc_mutex);
+
+	free(vc_entries);
+	free(vc_hash);
+	vc_entries = NULL;
+	vc_hash = NULL;
+	vc_size = vc_hashsize = 0;
+	vc_hits = vc_misses = vc_evictions = vc_flushes = 0;
+
+	if (size > 0) {
+		for (vc_hashsize = 1; vc_hashsize < size * 2; vc_hashsize <<= 1)
+			;
+		vc_entries = calloc(size, sizeof(*vc_entries));
+		vc_hash = malloc(vc_hashsize * sizeof(*vc_hash));
+		vc_size = size;
+
+		/*
+		 * If we can't get the memory, just run without a cache
+		 */
+
+		if (! vc_entries || ! vc_hash) {
+			free(vc_entries);
+			free(vc_hash);
+			vc_entries = NULL;
+			vc_hash = NULL;
+			vc_size = vc_hashsize = 0;
+		}
+	}
+
+	vc_reset();
+
+	pthread_mutex_unlock(&vc_mutex);
+}
+
+void
+vcache_free(void)
+{
+	vcache_init(0);
+}
+
+bool
+vcache_enabled(void)
+{
+	return vc_size > 0;
+}
+
+void
+vcache_key(CK_OBJECT_HANDLE obj, CK_MECHANISM_TYPE mech, const void *data,
+	   size_t datalen, const void *sig, size_t siglen, unsigned char *key)
+{
+	CC_SHA256_CTX ctx;
+	uint64_t v;
+
+	/*
+	 * Include the lengths so that moving bytes between the data and
+	 * the signature can't get us the same hash
+	 */
+
+	CC_SHA256_Init(&ctx);
+	v = obj;
+	CC_SHA256_Update(&ctx, &v, sizeof(v));
+	v = mech;
+	CC_SHA256_Update(&ctx, &v, sizeof(v));
+	v = datalen;
+	CC_SHA256_Update(&ctx, &v, sizeof(v));
+	CC_SHA256_Update(&ctx, data, (CC_LONG) datalen);
+	v = siglen;
+	CC_SHA256_Update(&ctx, &v, sizeof(v));
+	CC_SHA256_Update(&ctx, sig, (CC_LONG) siglen);
+	CC_SHA256_Final(key, &ctx);
+}
+
+bool
+vcache_lookup(const unsigned char *key)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&vc_mutex);
+
+	if (vc_size == 0) {
+		pthread_mutex_unlock(&vc_mutex);
+		return false;
+	}
+
+	for (i = vc_hash[vc_bucket(key)]; i != VC_NONE;
+	     i = vc_entries[i].hnext)
+		if (memcmp(vc_entries[i].key, key, VCACHE_KEYLEN) == 0)
+			break;
+
+	if (i != VC_NONE) {
+		vc_lru_unlink(i);
+		vc_lru_push(i);
+		vc_hits++;
+	} else {
+		vc_misses++;
+	}
+
+	pthread_mutex_unlock(&vc_mutex);
+
+	return i != VC_NONE;
+}
+
+void
+vcache_insert(const unsigned char *key)
+{
+	uint32_t i, b, *p;
+
+	pthread_mutex_lock(&vc_mutex);
+
+	if (vc_size == 0)
+		goto out;
+
+	b = vc_bucket(key);
+
+	for (i = vc_hash[b]; i != VC_NONE; i = vc_entries[i].hnext) {
+		if (memcmp(vc_entries[i].key, key, VCACHE_KEYLEN) == 0) {
+			vc_lru_unlink(i);
+			vc_lru_push(i);
+			goto out;
+		}
+	}
+
+	/*
+	 * Use a free entry if we have one, otherwise recycle the least
+	 * recently used one (which means taking it out of its bucket).
+	 */
+
+	if (vc_count < vc_size) {
+		i = vc_count++;
+	} else {
+		i = vc_tail;
+		vc_lru_unlink(i);
+		for (p = &vc_hash[vc_bucket(vc_entries[i].key)];
+		     *p != i; p = &vc_entries[*p].hnext)
+			;
+		*p = vc_entries[i].hnext;
+		vc_evictions++;
+	}
+
+	memcpy(vc_entries[i].key, key, VCACHE_KEYLEN);
+	vc_entries[i].hnext = vc_hash[b];
+	vc_hash[b] = i;
+	vc_lru_push(i);
+
+out:
+	pthread_mutex_unlock(&vc_mutex);
+}
+
+void
+vcache_flush(void)
+{
+	pthread_mutex_lock(&vc_mutex);
+
+	if (vc_size > 0) {
+		vc_reset();
+		vc_flushes++;
+	}
+
+	pthread_mutex_unlock(&vc_mutex);
+}
+
+void
+vcache_stats(struct keychain_verify_cache_stats *stats)
+{
+	pthread_mutex_lock(&vc_mutex);
+
+	stats->size = vc_size;
+	stats->entries = vc_count;
+	stats->hits = vc_hits;
+	stats->misses = vc_misses;
+	stats->evictions = vc_evictions;
+	stats->flushes = vc_flushes;
+
+	pthread_mutex_unlock(&vc_mutex);
+}
+
+/*
+ * Everything below here should be called with vc_mutex locked
+ */
+
+static uint32_t
+vc_bucket(const unsigned char *key)
+{
+	uint32_t b;
+
+	memcpy(&b, key, sizeof(b));
+
+	return b & (vc_hashsize - 1);
+}
+
+static void
+vc_lru_unlink(uint32_t i)
+{
+	struct vc_entry *e = &vc_entries[i];
+
+	if (e->prev != VC_NONE)
+		vc_entries[e->prev].next = e->next;
+	else
+		vc_head = e->next;
+
+	if (e->next != VC_NONE)
+		vc_entries[e->next].prev = e->prev;
+	else
+		vc_tail = e->prev;
+}
+
+static void
+vc_lru_push(uint32_t i)
+{
+	vc_entries[i].prev = VC_NONE;
+	vc_entries[i].next = vc_head;
+
+	if (vc_head != VC_NONE)
+		vc_entries[vc_head].prev = i;
+	else
+		vc_tail = i;
+
+	vc_head = i;
+}
+
+static void
+vc_reset(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < vc_hashsize; i++)
+		vc_hash[i] = VC_NONE;
+
+	vc_count = 0;
+	vc_head = vc_tail = VC_NONE;
+}
@@ -0,0 +1,155 @@
+/*
+ *  certscan_ref.c
+ *  KeychainToken
+ *
+ *  The way we picked certificates for our certificate slot before
+ *  certscan.c (see certscan_ref.h).
+ *
+ *  For every certificate we add, we search the whole set of certificates
+ *  we haven't looked at yet for the ones it issued, and check it against
+ *  every certificate we already have; for every certificate, we look at
+ *  every other one to find its issuer.  The set is an array we remove
+ *  from by moving the last one in, since removing from a CFSet didn't
+ *  cost much either.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "certscan_ref.h"
+
+struct ref {
+    const struct certscan_cert *cs;
+    unsigned int *set, *pos, set_count;
+    unsigned int *order, count;
+};
+
+static void *xmalloc(size_t len) {
+    void *p = malloc(len ? len : 1);
+
+    if (!p) {
+        fprintf(stderr, "Unable to allocate %zu bytes\n", len);
+        exit(1);
+    }
+    return p;
+}
+
+static int name_equal(const void *a, size_t alen, const void *b,
+                      size_t blen) {
+    return a && b && alen == blen && memcmp(a, b, alen) == 0;
+}
+
+static void ref_remove(struct ref *r, unsigned int c) {
+    unsigned int last;
+
+    if (r->pos[c] == 0)
+        return;
+
+    last = r->set[--r->set_count];
+    r->set[r->pos[c] - 1] = last;
+    r->pos[last] = r->pos[c];
+    r->pos[c] = 0;
+}
+
+/*
+ * add_certificate(), as it was
+ */
+
+static void ref_add(struct ref *r, unsigned int c) {
+    const struct certscan_cert *ce = &r->cs[c];
+    unsigned int *issued, n = 0, i;
+
+    ref_remove(r, c);
+
+    if (ce->skip || !ce->keyhash)
+        return;
+
+    for (i = 0; i < r->count; i++)
+        if (name_equal(ce->keyhash, ce->keyhash_len,
+                       r->cs[r->order[i]].keyhash,
+                       r->cs[r->order[i]].keyhash_len))
+            return;
+
+    r->order[r->count++] = c;
+
+    if (!ce->subject)
+        return;
+
+    issued = xmalloc(sizeof(*issued) * (r->set_count + 1));
+    for (i = 0; i < r->set_count; i++)
+        if (name_equal(ce->subject, ce->subject_len, r->cs[r->set[i]].issuer,
+                       r->cs[r->set[i]].issuer_len))
+            issued[n++] = r->set[i];
+
+    for (i = 0; i < n; i++)
+        ref_add(r, issued[i]);
+
+    free(issued);
+}
+
+unsigned int certscan_ref_select(const struct certscan_cert *cs,
+                                 unsigned int count, unsigned int *order) {
+    struct ref r = { cs, NULL, NULL, 0, order, 0 };
+    unsigned int *roots, n = 0, i;
+
+    r.set = xmalloc(sizeof(*r.set) * (count + 1));
+    r.pos = xmalloc(sizeof(*r.pos) * (count + 1));
+    roots = xmalloc(sizeof(*roots) * (count + 1));
+
+    for (i = 0; i < count; i++) {
+        r.set[i] = i;
+        r.pos[i] = i + 1;
+        if (cs[i].root)
+            roots[n++] = i;
+    }
+    r.set_count = count;
+
+    for (i = 0; i < n; i++)
+        ref_add(&r, roots[i]);
+
+    free(roots);
+    free(r.set);
+    free(r.pos);
+
+    return r.count;
+}
+
+/*
+ * cert_issuers_find(), as it was
+ */
+
+void certscan_ref_issuers(const struct certscan_cert *cs, unsigned int count,
+                          int *issuer) {
+    unsigned int i, j, found;
+
+    for (i = 0; i < count; i++) {
+        issuer[i] = -1;
+        if (!cs[i].issuer)
+            continue;
+        for (j = 0, found = 0; j < count; j++) {
+            if (cs[j].subject && cs[j].keyhash &&
+                name_equal(cs[j].subject, cs[j].subject_len, cs[i].issuer,
+                           cs[i].issuer_len)) {
+                found++;
+                issuer[i] = j;
+            }
+        }
+        if (found != 1)
+            issuer[i] = -1;
+    }
+}
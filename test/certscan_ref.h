@@ -0,0 +1,43 @@
+/*
+ *  certscan_ref.h
+ *  KeychainToken
+ *
+ *  The way we picked certificates for our certificate slot before
+ *  certscan.c, kept as a reference for certscan_test and certslot_bench.
+ *  These take the same arguments as certscan_select() and
+ *  certscan_issuers(), and should give the same answers, only slower.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __CERTSCAN_REF_H__
+#define __CERTSCAN_REF_H__
+
+#include "certscan.h"
+
+/*
+ * Like certscan_select(), but can't be cancelled (and exits if it runs
+ * out of memory).  We walk the certificates in no particular order, as
+ * we did with the CFSet we used to keep them in, so the order we pick
+ * them in, and which of two certificates with the same public key hash
+ * we keep, can differ from certscan_select(); the public key hashes we
+ * end up with shouldn't.
+ */
+
+unsigned int certscan_ref_select(const struct certscan_cert *, unsigned int,
+                                 unsigned int *);
+void certscan_ref_issuers(const struct certscan_cert *, unsigned int, int *);
+
+#endif /* __CERTSCAN_REF_H__ */
@@ -0,0 +1,403 @@
+/*
+ *  certscan_test.c
+ *  KeychainToken
+ *
+ *  Check that certscan_select() and certscan_issuers() give the same
+ *  answers as the way we used to pick certificates (certscan_ref.c), on
+ *  synthetic PKI forests (see pki_forest.h) of all shapes, with some
+ *  certificates damaged the ways the Keychain can give them to us:
+ *  on a hardware token, or missing a public key hash, subject or issuer.
+ *
+ *  Usage: certscan_test [-v] [-n forests] [-s seed]
+ *
+ *	-v	Say how each forest went
+ *	-n	Number of forests to try (default: 200)
+ *	-s	Random number seed for the forest shapes (default: 1)
+ *
+ *  Exits with 0 if everything matched, 1 if not.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "certscan.h"
+#include "certscan_ref.h"
+#include "pki_forest.h"
+
+#define LONG_CHAIN 20000
+
+static int verbose = 0, failures = 0;
+
+static void usage(const char *progname) {
+    fprintf(stderr, "Usage: %s [-v] [-n forests] [-s seed]\n", progname);
+    exit(1);
+}
+
+static void *xmalloc(size_t len) {
+    void *p = malloc(len ? len : 1);
+
+    if (!p) {
+        fprintf(stderr, "Unable to allocate %zu bytes\n", len);
+        exit(1);
+    }
+    return p;
+}
+
+static void fail(const char *test, const char *fmt, unsigned int a,
+                 unsigned int b) {
+    printf("FAILED: %s: ", test);
+    printf(fmt, a, b);
+    printf("\n");
+    failures++;
+}
+
+/*
+ * Sort picked certificates by public key hash, to compare two picks
+ */
+
+static const struct certscan_cert *sort_certs;
+
+static int compare_keyhash(const void *a, const void *b) {
+    const struct certscan_cert *x = &sort_certs[*(const unsigned int *) a];
+    const struct certscan_cert *y = &sort_certs[*(const unsigned int *) b];
+
+    if (x->keyhash_len != y->keyhash_len)
+        return x->keyhash_len < y->keyhash_len ? -1 : 1;
+    return memcmp(x->keyhash, y->keyhash, x->keyhash_len);
+}
+
+/*
+ * Our cancel function: cancel once we've been asked this many times
+ */
+
+static bool cancel_after(void *arg) {
+    unsigned int *left = arg;
+
+    return (*left)-- == 0;
+}
+
+/*
+ * Check certscan against the reference on one set of certificates
+ */
+
+static void check(const char *test, const struct certscan_cert *cs,
+                  unsigned int count) {
+    unsigned int *order = xmalloc(sizeof(*order) * (count + 1));
+    unsigned int *ref = xmalloc(sizeof(*ref) * (count + 1));
+    unsigned int *sorted = xmalloc(sizeof(*sorted) * (count + 1));
+    int *issuer = xmalloc(sizeof(*issuer) * (count + 1));
+    int *ref_issuer = xmalloc(sizeof(*ref_issuer) * (count + 1));
+    struct certscan_cert *picked;
+    unsigned int i, n, rn, left;
+    int rv;
+
+    if ((rv = certscan_select(cs, count, order, NULL, NULL)) < 0) {
+        fail(test, "certscan_select() failed (%u of %u)", 0, count);
+        goto out;
+    }
+
+    n = rv;
+    rn = certscan_ref_select(cs, count, ref);
+
+    if (n != rn) {
+        fail(test, "picked %u certificates, not %u", n, rn);
+        goto out;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (cs[order[i]].skip || !cs[order[i]].keyhash) {
+            fail(test, "picked certificate %u, which we can't use (%u)",
+                 order[i], i);
+            goto out;
+        }
+    }
+
+    /*
+     * The same public key hashes, once each
+     */
+
+    sort_certs = cs;
+    qsort(ref, n, sizeof(*ref), compare_keyhash);
+    memcpy(sorted, order, sizeof(*order) * n);
+    qsort(sorted, n, sizeof(*sorted), compare_keyhash);
+
+    for (i = 0; i < n; i++) {
+        if (compare_keyhash(&sorted[i], &ref[i]) != 0) {
+            fail(test, "picked certificate %u, not %u", sorted[i], ref[i]);
+            goto out;
+        }
+        if (i > 0 && compare_keyhash(&sorted[i - 1], &sorted[i]) == 0) {
+            fail(test, "picked certificates %u and %u with the same key",
+                 sorted[i - 1], sorted[i]);
+            goto out;
+        }
+    }
+
+    /*
+     * The same issuers, for what we picked and for everything
+     */
+
+    picked = xmalloc(sizeof(*picked) * (n + 1));
+    for (i = 0; i < n; i++)
+        picked[i] = cs[order[i]];
+
+    certscan_issuers(picked, n, issuer);
+    certscan_ref_issuers(picked, n, ref_issuer);
+    free(picked);
+
+    for (i = 0; i < n; i++)
+        if (issuer[i] != ref_issuer[i]) {
+            fail(test, "picked certificate %u has the wrong issuer (%u)",
+                 i, issuer[i]);
+            goto out;
+        }
+
+    certscan_issuers(cs, count, issuer);
+    certscan_ref_issuers(cs, count, ref_issuer);
+
+    for (i = 0; i < count; i++)
+        if (issuer[i] != ref_issuer[i]) {
+            fail(test, "certificate %u has the wrong issuer (%u)", i,
+                 issuer[i]);
+            goto out;
+        }
+
+    /*
+     * Cancelling gets us -1, wherever it happens
+     */
+
+    if (n > 0) {
+        left = n / 2;
+        if (certscan_select(cs, count, order, cancel_after, &left) != -1)
+            fail(test, "cancelling after %u of %u didn't stop us", n / 2, n);
+    }
+
+    if (verbose)
+        printf("ok: %s: %u certificates, picked %u\n", test, count, n);
+
+out:
+    free(order);
+    free(ref);
+    free(sorted);
+    free(issuer);
+    free(ref_issuer);
+}
+
+/*
+ * Describe a forest's certificates, as cert_describe() would
+ */
+
+static struct certscan_cert *describe(const struct pki_cert *certs,
+                                      unsigned int count,
+                                      struct pki_fields *fields,
+                                      const char *match) {
+    struct certscan_cert *cs = xmalloc(sizeof(*cs) * (count + 1));
+    unsigned int i;
+
+    memset(cs, 0, sizeof(*cs) * (count + 1));
+
+    for (i = 0; i < count; i++) {
+        if (pki_cert_fields(certs[i].der, certs[i].len, &fields[i]) != 0) {
+            cs[i].skip = true;
+            continue;
+        }
+        cs[i].subject = fields[i].subject;
+        cs[i].subject_len = fields[i].subject_len;
+        cs[i].issuer = fields[i].issuer;
+        cs[i].issuer_len = fields[i].issuer_len;
+        cs[i].keyhash = fields[i].spki;
+        cs[i].keyhash_len = fields[i].spki_len;
+        cs[i].root = strstr(fields[i].cn, match) != NULL;
+    }
+
+    return cs;
+}
+
+/*
+ * Damage a few certificates: on a hardware token, missing a key hash, a
+ * subject or an issuer, or made into another certificate issued by
+ * someone else (its subject and key, with a different issuer).  We
+ * don't give two certificates with different subjects the same key, or
+ * take the subject from one of two with the same key; which of them we'd
+ * keep (and so what we'd find under it) depends on the order we find
+ * them in, and the CFSet we used to walk didn't have one.
+ */
+
+static int unique_key(const struct certscan_cert *cs, unsigned int count,
+                      unsigned int i) {
+    unsigned int j;
+
+    for (j = 0; j < count; j++)
+        if (j != i && cs[j].keyhash && cs[i].keyhash &&
+            cs[j].keyhash_len == cs[i].keyhash_len &&
+            memcmp(cs[j].keyhash, cs[i].keyhash, cs[i].keyhash_len) == 0)
+            return 0;
+    return 1;
+}
+
+static void damage(struct certscan_cert *cs, unsigned int count,
+                   unsigned int percent) {
+    unsigned int i, j;
+
+    for (i = 0; i < count && percent; i++) {
+        switch (random() % (100 / percent * 5)) {
+        case 0:
+            cs[i].skip = true;
+            break;
+        case 1:
+            cs[i].keyhash = NULL;
+            break;
+        case 2:
+            if (unique_key(cs, count, i))
+                cs[i].subject = NULL;
+            break;
+        case 3:
+            cs[i].issuer = NULL;
+            break;
+        case 4:
+            j = random() % count;
+            cs[i].subject = cs[j].subject;
+            cs[i].subject_len = cs[j].subject_len;
+            cs[i].keyhash = cs[j].keyhash;
+            cs[i].keyhash_len = cs[j].keyhash_len;
+            break;
+        }
+    }
+}
+
+/*
+ * A chain longer than any stack would take, if we recursed
+ */
+
+static void long_chain(void) {
+    static unsigned char names[LONG_CHAIN + 1][4];
+    struct certscan_cert *cs = xmalloc(sizeof(*cs) * LONG_CHAIN);
+    unsigned int *order = xmalloc(sizeof(*order) * LONG_CHAIN);
+    unsigned int i, c;
+    int n;
+
+    for (i = 0; i <= LONG_CHAIN; i++)
+        memcpy(names[i], &i, sizeof(names[i]));
+
+    /*
+     * Certificate i is issued by level i, and is level i + 1; put them
+     * in backwards so the walk can't just follow along
+     */
+
+    for (i = 0; i < LONG_CHAIN; i++) {
+        c = LONG_CHAIN - 1 - i;
+        memset(&cs[c], 0, sizeof(cs[c]));
+        cs[c].issuer = names[i];
+        cs[c].issuer_len = sizeof(names[i]);
+        cs[c].subject = names[i + 1];
+        cs[c].subject_len = sizeof(names[i + 1]);
+        cs[c].keyhash = names[i + 1];
+        cs[c].keyhash_len = sizeof(names[i + 1]);
+    }
+
+    cs[LONG_CHAIN - 1].issuer = cs[LONG_CHAIN - 1].subject;
+    cs[LONG_CHAIN - 1].root = true;
+
+    if ((n = certscan_select(cs, LONG_CHAIN, order, NULL, NULL)) !=
+        LONG_CHAIN)
+        fail("long chain", "picked %u certificates, not %u",
+             (unsigned int) n, LONG_CHAIN);
+    else if (verbose)
+        printf("ok: long chain: %u certificates\n", LONG_CHAIN);
+
+    free(cs);
+    free(order);
+}
+
+int main(int argc, char *argv[]) {
+    struct pki_params params = PKI_PARAMS_DEFAULT;
+    static const char *keytypes[] = { "rsa2048", "p256", "rsa2048,p384" };
+    struct pki_fields *fields;
+    struct certscan_cert *cs;
+    struct pki_cert *certs;
+    unsigned int count, forests = 200, i, k, seed = 1;
+    char test[128];
+    int c;
+
+    while ((c = getopt(argc, argv, "vn:s:")) != -1) {
+        switch (c) {
+        case 'v':
+            verbose = 1;
+            break;
+        case 'n':
+            forests = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc)
+        usage(argv[0]);
+
+    srandom(seed);
+
+    check("no certificates", NULL, 0);
+
+    for (i = 0; i < forests; i++) {
+        params.roots = random() % 4;
+        params.others = random() % 3;
+        if (params.roots + params.others == 0)
+            params.roots = 1;
+        params.depth = 1 + random() % 4;
+        params.fanout = 1 + random() % 5;
+        params.keytypes = keytypes[random() % 3];
+        params.collide = (random() % 4) * 0.1;
+        params.cross = (random() % 4) * 0.1;
+        params.seed = random();
+
+        if (!(certs = pki_forest(&params, &count))) {
+            fprintf(stderr, "Unable to make forest %u\n", i);
+            return 1;
+        }
+
+        fields = xmalloc(sizeof(*fields) * (count + 1));
+        cs = describe(certs, count, fields, params.root_name);
+
+        for (k = 0; k < 2; k++) {
+            snprintf(test, sizeof(test), "forest %u (%u+%u roots, depth %u, "
+                     "fanout %u, collide %.1f, cross %.1f)%s", i,
+                     params.roots, params.others, params.depth,
+                     params.fanout, params.collide, params.cross,
+                     k ? ", damaged" : "");
+            if (k)
+                damage(cs, count, 5);
+            check(test, cs, count);
+        }
+
+        free(cs);
+        free(fields);
+        pki_forest_free(certs, count);
+    }
+
+    long_chain();
+
+    printf("%s: %u forests, %d failures\n", failures ? "FAILED" : "PASSED",
+           forests, failures);
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,874 @@
+/*
+ *  certslot_bench.c
+ *  KeychainToken
+ *
+ *  Measure how our certificate slot scales.  We build it from synthetic
+ *  PKI forests (see pki_forest.h) of increasing size, or from PEM
+ *  bundles, look things up in it the way Firefox does when it verifies a
+ *  server certificate, and report import time, memory and lookup latency
+ *  at each size.
+ *
+ *  Usage: certslot_bench [-Lzc] [-n chains] [-N sizes] [-m match]
+ *			  [-r roots] [-o others] [-d depth] [-f fanout]
+ *			  [-k keytypes] [-x collide] [-X cross] [-s seed]
+ *			  [pemfile ...]
+ *
+ *	-L	Also time the import we used to do (see certscan_ref.h)
+ *	-z	Pack certificates, as the compressCertificates preference does
+ *	-c	Print results as CSV, one line per size
+ *	-n	Number of certificate chains to look up at each size
+ *		(default: 1000)
+ *	-N	Comma-separated list of forest sizes (default:
+ *		1000,2000,5000,10000,20000,50000)
+ *	-m	certificateList entry (default: "Synthetic Root CA")
+ *
+ *  The forest options are the same as pki_gen's, except that by default
+ *  there are as many roots that don't match as do, and a few names
+ *  collide and CAs are cross-signed.  To reach each size we add more
+ *  trees, keeping the ratio of matching roots to others.  If PEM files
+ *  are given they are used instead of forests, one size each.
+ *
+ *  The Keychain is replaced by a stand-in: we parse each certificate for
+ *  what SecItemCopyMatching() would give us (subject, issuer, common name
+ *  and a public key hash), then pick and link certificates with the same
+ *  certscan_select() and certscan_issuers() the module uses.  The objects
+ *  we build and the way we search them follow cert_objects_add() and
+ *  search_object() in keychain_pkcs11.c, so they scale the same way.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif /* __APPLE__ */
+
+#include "mypkcs11.h"
+#include "certscan.h"
+#include "certscan_ref.h"
+#include "certstore.h"
+#include "pki_forest.h"
+
+#define HASH_LEN 20		/* Like a SHA-1 */
+#define MAX_CHAIN 8
+
+/*
+ * A certificate as our stand-in Keychain gives it to us
+ */
+
+struct item {
+    const unsigned char *der;
+    size_t len;
+    const unsigned char *subject, *issuer, *serial, *spki;
+    size_t subject_len, issuer_len, serial_len, spki_len;
+    char cn[PKI_CN_MAX];
+    unsigned char keyhash[HASH_LEN];
+    unsigned char hash[HASH_LEN];	/* Of the whole certificate */
+    int ca;
+};
+
+/*
+ * One of our slot objects, as in keychain_pkcs11.c
+ */
+
+struct obj {
+    CK_OBJECT_CLASS class;
+    CK_ATTRIBUTE *attrs;
+    unsigned int attr_count, attr_size;
+    struct certstore_entry *store;
+    unsigned int item;
+};
+
+struct slot {
+    struct obj *objs;
+    unsigned int count, size;
+    uint64_t bytes;			/* What we allocated */
+};
+
+/*
+ * Timings of one kind of lookup
+ */
+
+struct timings {
+    uint64_t *ns;
+    unsigned long count;
+};
+
+/*
+ * Everything we measure at one size
+ */
+
+struct result {
+    unsigned int certs, picked;
+    double source_ms, select_ms, issuers_ms, build_ms;
+    double legacy_select_ms, legacy_issuers_ms;
+    double slot_kb, rss_kb;
+    double subject_us, subject_p99, trust_us, trust_p99, value_us,
+           value_p99, fetch_us, chain_us, chain_p99;
+};
+
+static int legacy = 0, pack = 0;
+static const char *match = "Synthetic Root CA";
+
+static void usage(const char *progname) {
+    fprintf(stderr, "Usage: %s [-Lzc] [-n chains] [-N sizes] [-m match]\n"
+            "\t[-r roots] [-o others] [-d depth] [-f fanout] [-k keytypes]\n"
+            "\t[-x collide] [-X cross] [-s seed] [pemfile ...]\n", progname);
+    exit(1);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double ms_since(uint64_t start) {
+    return (now_ns() - start) / 1000000.0;
+}
+
+/*
+ * Our resident set size, in bytes
+ */
+
+static uint64_t rss(void) {
+#ifdef __APPLE__
+    struct mach_task_basic_info info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO,
+                  (task_info_t) &info, &count) != KERN_SUCCESS)
+        return 0;
+    return info.resident_size;
+#else /* __APPLE__ */
+    unsigned long size, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if (f) {
+        if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+            resident = 0;
+        fclose(f);
+    }
+    return (uint64_t) resident * sysconf(_SC_PAGESIZE);
+#endif /* __APPLE__ */
+}
+
+static void *xmalloc(size_t len) {
+    void *p = malloc(len ? len : 1);
+
+    if (!p) {
+        fprintf(stderr, "Unable to allocate %zu bytes\n", len);
+        exit(1);
+    }
+    return p;
+}
+
+static void *xrealloc(void *p, size_t len) {
+    if (!(p = realloc(p, len ? len : 1))) {
+        fprintf(stderr, "Unable to allocate %zu bytes\n", len);
+        exit(1);
+    }
+    return p;
+}
+
+/*
+ * A stand-in for a SHA-1 hash: FNV-1a, five ways
+ */
+
+static void hash(const void *data, size_t len, unsigned char *out) {
+    const unsigned char *p = data;
+    uint32_t h;
+    size_t i;
+    int k;
+
+    for (k = 0; k < HASH_LEN / 4; k++) {
+        h = 2166136261U + k;
+        for (i = 0; i < len; i++) {
+            h ^= p[i];
+            h *= 16777619U;
+        }
+        memcpy(out + k * 4, &h, 4);
+    }
+}
+
+/*
+ * Our stand-in for the Keychain: pick apart a certificate for the
+ * attributes we'd get with it.  Returns -1 if we can't.
+ */
+
+static int keychain_item(struct item *it, const unsigned char *der,
+                         size_t len, int ca) {
+    struct pki_fields fields;
+
+    memset(it, 0, sizeof(*it));
+    it->der = der;
+    it->len = len;
+    it->ca = ca;
+
+    if (pki_cert_fields(der, len, &fields) != 0)
+        return -1;
+
+    it->serial = fields.serial;
+    it->serial_len = fields.serial_len;
+    it->issuer = fields.issuer;
+    it->issuer_len = fields.issuer_len;
+    it->subject = fields.subject;
+    it->subject_len = fields.subject_len;
+    it->spki = fields.spki;
+    it->spki_len = fields.spki_len;
+    memcpy(it->cn, fields.cn, sizeof(it->cn));
+
+    hash(it->spki, it->spki_len, it->keyhash);
+    hash(der, len, it->hash);
+
+    return 0;
+}
+
+static int name_equal(const void *a, size_t alen, const void *b,
+                      size_t blen) {
+    return a && b && alen == blen && memcmp(a, b, alen) == 0;
+}
+
+/*
+ * Building our slot, as cert_objects_add() does
+ */
+
+static void add_attr(struct slot *s, CK_ATTRIBUTE_TYPE type, const void *v,
+                     size_t len) {
+    struct obj *o = &s->objs[s->count - 1];
+
+    if (o->attr_count == o->attr_size) {
+        o->attr_size += 5;
+        o->attrs = xrealloc(o->attrs, o->attr_size * sizeof(*o->attrs));
+        s->bytes += 5 * sizeof(*o->attrs);
+    }
+
+    o->attrs[o->attr_count].type = type;
+    o->attrs[o->attr_count].pValue = xmalloc(len);
+    memcpy(o->attrs[o->attr_count].pValue, v, len);
+    o->attrs[o->attr_count++].ulValueLen = len;
+    s->bytes += len;
+}
+
+#define ADD(s, type, v) add_attr(s, type, &(v), sizeof(v))
+
+static void new_obj(struct slot *s, CK_OBJECT_CLASS class, unsigned int i) {
+    if (s->count == s->size) {
+        s->size = s->size ? s->size * 2 : 64;
+        s->objs = xrealloc(s->objs, s->size * sizeof(*s->objs));
+    }
+    memset(&s->objs[s->count], 0, sizeof(s->objs[s->count]));
+    s->objs[s->count].class = class;
+    s->objs[s->count++].item = i;
+    s->bytes += sizeof(struct obj);
+}
+
+static CK_ATTRIBUTE *find_attr(struct obj *o, CK_ATTRIBUTE_TYPE type) {
+    unsigned int i;
+
+    for (i = 0; i < o->attr_count; i++)
+        if (o->attrs[i].type == type)
+            return &o->attrs[i];
+    return NULL;
+}
+
+static void build_slot(struct slot *s, struct item *items,
+                       const unsigned int *picked, unsigned int count,
+                       const int *issuer) {
+    static const CK_DATE date = { { '2', '0', '2', '5' }, { '0', '1' },
+                                  { '0', '1' } };
+    CK_OBJECT_CLASS cl;
+    CK_CERTIFICATE_TYPE ct = CKC_X_509;
+    CK_TRUST trust = CKT_NSS_TRUSTED_DELEGATOR;
+    CK_BBOOL b = CK_TRUE;
+    CK_ULONG id;
+    unsigned int i;
+    struct item *it;
+
+    for (i = 0; i < count; i++) {
+        it = &items[picked[i]];
+
+        cl = CKO_CERTIFICATE;
+        id = i + 0xff00;
+        new_obj(s, cl, picked[i]);
+        ADD(s, CKA_CLASS, cl);
+        ADD(s, CKA_ID, id);
+        ADD(s, CKA_CERTIFICATE_TYPE, ct);
+        ADD(s, CKA_TOKEN, b);
+        add_attr(s, CKA_LABEL, it->cn, strlen(it->cn));
+        add_attr(s, CKA_VALUE, it->der, it->len);
+        add_attr(s, CKA_SUBJECT, it->subject, it->subject_len);
+        add_attr(s, CKA_ISSUER, it->issuer, it->issuer_len);
+        add_attr(s, CKA_SERIAL_NUMBER, it->serial, it->serial_len);
+        add_attr(s, CKA_PUBLIC_KEY_INFO, it->spki, it->spki_len);
+        add_attr(s, CKA_HASH_OF_SUBJECT_PUBLIC_KEY, it->keyhash, HASH_LEN);
+        if (issuer[i] >= 0)
+            add_attr(s, CKA_HASH_OF_ISSUER_PUBLIC_KEY,
+                     items[picked[issuer[i]]].keyhash, HASH_LEN);
+        ADD(s, CKA_START_DATE, date);
+        ADD(s, CKA_END_DATE, date);
+        add_attr(s, CKA_CHECK_VALUE, it->hash, 3);
+
+        cl = CKO_NSS_TRUST;
+        new_obj(s, cl, picked[i]);
+        ADD(s, CKA_CLASS, cl);
+        ADD(s, CKA_TOKEN, b);
+        add_attr(s, CKA_ISSUER, it->issuer, it->issuer_len);
+        add_attr(s, CKA_SERIAL_NUMBER, it->serial, it->serial_len);
+        add_attr(s, CKA_CERT_SHA1_HASH, it->hash, HASH_LEN);
+        if (it->ca) {
+            ADD(s, CKA_TRUST_SERVER_AUTH, trust);
+            ADD(s, CKA_TRUST_CLIENT_AUTH, trust);
+            ADD(s, CKA_TRUST_EMAIL_PROTECTION, trust);
+            ADD(s, CKA_TRUST_CODE_SIGNING, trust);
+        }
+    }
+}
+
+/*
+ * Pack the slot, as cert_objects_pack() does
+ */
+
+static void pack_slot(struct slot *s) {
+    static const CK_ATTRIBUTE_TYPE types[CERTSTORE_NAMES_MAX] = {
+        CKA_SUBJECT, CKA_ISSUER, CKA_SERIAL_NUMBER,
+    };
+    struct certstore_sample *samples, names[CERTSTORE_NAMES_MAX];
+    struct certstore_dict *dict;
+    struct certstore_packer *pk;
+    struct certstore_entry *e;
+    struct obj *o, *t;
+    CK_ATTRIBUTE *a, *ta, *value;
+    unsigned int i, k, n = 0;
+
+    samples = xmalloc(sizeof(*samples) * (s->count + 1));
+
+    for (i = 0; i < s->count; i++) {
+        if (s->objs[i].class != CKO_CERTIFICATE)
+            continue;
+        for (k = 0; k < 2; k++) {
+            a = find_attr(&s->objs[i], types[k]);
+            samples[n].data = a->pValue;
+            samples[n++].len = a->ulValueLen;
+        }
+    }
+
+    dict = certstore_dict_new(samples, n);
+    pk = certstore_packer_new(dict);
+    free(samples);
+
+    for (i = 0; i < s->count; i++) {
+        o = &s->objs[i];
+        if (o->class != CKO_CERTIFICATE)
+            continue;
+
+        value = find_attr(o, CKA_VALUE);
+        for (k = 0; k < CERTSTORE_NAMES_MAX; k++) {
+            a = find_attr(o, types[k]);
+            names[k].data = a->pValue;
+            names[k].len = a->ulValueLen;
+        }
+
+        if (!(e = certstore_pack(pk, value->pValue, value->ulValueLen,
+                                 names, CERTSTORE_NAMES_MAX)))
+            continue;
+
+        o->store = e;
+        s->bytes -= value->ulValueLen;
+        free(value->pValue);
+        value->pValue = NULL;
+
+        t = i + 1 < s->count && s->objs[i + 1].class == CKO_NSS_TRUST ?
+            &s->objs[i + 1] : NULL;
+        if (t)
+            t->store = certstore_retain(e);
+
+        for (k = 0; k < CERTSTORE_NAMES_MAX; k++) {
+            a = find_attr(o, types[k]);
+            if (t && (ta = find_attr(t, types[k]))) {
+                s->bytes -= ta->ulValueLen;
+                free(ta->pValue);
+                ta->pValue = (void *) certstore_name(e, k);
+            }
+            s->bytes -= a->ulValueLen;
+            free(a->pValue);
+            a->pValue = (void *) certstore_name(e, k);
+        }
+    }
+
+    certstore_packer_free(pk);
+    certstore_dict_release(dict);
+}
+
+static void free_slot(struct slot *s) {
+    unsigned int i, j;
+    struct obj *o;
+
+    for (i = 0; i < s->count; i++) {
+        o = &s->objs[i];
+        for (j = 0; j < o->attr_count; j++)
+            if (!certstore_owns(o->store, o->attrs[j].pValue))
+                free(o->attrs[j].pValue);
+        free(o->attrs);
+        certstore_release(o->store);
+    }
+
+    free(s->objs);
+    memset(s, 0, sizeof(*s));
+}
+
+/*
+ * Searching, as search_object() does: every object, every attribute
+ */
+
+static int obj_match(struct obj *o, CK_ATTRIBUTE *tmpl, unsigned int n) {
+    CK_ATTRIBUTE *a;
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        if (!(a = find_attr(o, tmpl[i].type)) ||
+            a->ulValueLen != tmpl[i].ulValueLen)
+            return 0;
+        if (o->store && a->type == CKA_VALUE && !a->pValue) {
+            if (!certstore_equal(o->store, tmpl[i].pValue,
+                                 tmpl[i].ulValueLen))
+                return 0;
+        } else if (memcmp(a->pValue, tmpl[i].pValue, a->ulValueLen) != 0) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Find every object matching a template (as C_FindObjects() with a big
+ * enough count would), and return the first, or NULL
+ */
+
+static struct obj *find(struct slot *s, CK_ATTRIBUTE *tmpl, unsigned int n,
+                        struct timings *t) {
+    struct obj *first = NULL;
+    uint64_t start = now_ns();
+    unsigned int i;
+
+    for (i = 0; i < s->count; i++)
+        if (obj_match(&s->objs[i], tmpl, n) && !first)
+            first = &s->objs[i];
+
+    t->ns[t->count++] = now_ns() - start;
+
+    return first;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Average and 99th percentile, in microseconds
+ */
+
+static void summarize(struct timings *t, double *avg, double *p99) {
+    uint64_t total = 0;
+    unsigned long i;
+
+    *avg = 0;
+    if (p99)
+        *p99 = 0;
+
+    if (!t->count)
+        return;
+
+    for (i = 0; i < t->count; i++)
+        total += t->ns[i];
+
+    qsort(t->ns, t->count, sizeof(*t->ns), compare_u64);
+
+    *avg = (double) total / t->count / 1000.0;
+    if (p99)
+        *p99 = t->ns[t->count * 99 / 100] / 1000.0;
+}
+
+/*
+ * What Firefox does with our slot when it verifies a server certificate:
+ * see if the certificate is one of ours, then for it and each issuer up
+ * the chain look for trust, find the issuer by subject and read its
+ * value.
+ */
+
+static void lookups(struct slot *s, struct item *items, unsigned long chains,
+                    struct result *r) {
+    struct timings subject, trust, value, fetch, chain;
+    CK_OBJECT_CLASS cert_class = CKO_CERTIFICATE, trust_class = CKO_NSS_TRUST;
+    CK_ATTRIBUTE tmpl[3], *a;
+    unsigned char *buf = NULL;
+    size_t bufsize = 0;
+    unsigned long i, per = chains * (MAX_CHAIN + 1);
+    unsigned int leaves = 0, *leaf, j, depth;
+    struct obj *o;
+    struct item *it;
+    uint64_t start, fstart;
+
+    subject.ns = xmalloc(sizeof(uint64_t) * per);
+    trust.ns = xmalloc(sizeof(uint64_t) * per);
+    value.ns = xmalloc(sizeof(uint64_t) * per);
+    fetch.ns = xmalloc(sizeof(uint64_t) * per);
+    chain.ns = xmalloc(sizeof(uint64_t) * per);
+    subject.count = trust.count = value.count = fetch.count = 0;
+    chain.count = 0;
+
+    leaf = xmalloc(sizeof(*leaf) * (s->count + 1));
+    for (j = 0; j < s->count; j++)
+        if (s->objs[j].class == CKO_CERTIFICATE &&
+            !items[s->objs[j].item].ca)
+            leaf[leaves++] = s->objs[j].item;
+    if (!leaves)
+        for (j = 0; j < s->count; j++)
+            if (s->objs[j].class == CKO_CERTIFICATE)
+                leaf[leaves++] = s->objs[j].item;
+
+    srandom(1);
+
+    for (i = 0; leaves && i < chains; i++) {
+        start = now_ns();
+        it = &items[leaf[random() % leaves]];
+
+        tmpl[0].type = CKA_CLASS;
+        tmpl[0].pValue = &cert_class;
+        tmpl[0].ulValueLen = sizeof(cert_class);
+        tmpl[1].type = CKA_VALUE;
+        tmpl[1].pValue = (void *) it->der;
+        tmpl[1].ulValueLen = it->len;
+        find(s, tmpl, 2, &value);
+
+        for (depth = 0; it && depth < MAX_CHAIN; depth++) {
+            tmpl[0].pValue = &trust_class;
+            tmpl[1].type = CKA_ISSUER;
+            tmpl[1].pValue = (void *) it->issuer;
+            tmpl[1].ulValueLen = it->issuer_len;
+            tmpl[2].type = CKA_SERIAL_NUMBER;
+            tmpl[2].pValue = (void *) it->serial;
+            tmpl[2].ulValueLen = it->serial_len;
+            find(s, tmpl, 3, &trust);
+
+            if (name_equal(it->issuer, it->issuer_len, it->subject,
+                           it->subject_len))
+                break;
+
+            tmpl[0].pValue = &cert_class;
+            tmpl[1].type = CKA_SUBJECT;
+            if (!(o = find(s, tmpl, 2, &subject)))
+                break;
+
+            a = find_attr(o, CKA_VALUE);
+            if (a->ulValueLen > bufsize)
+                buf = xrealloc(buf, bufsize = a->ulValueLen);
+            fstart = now_ns();
+            if (o->store && !a->pValue)
+                certstore_copy(o->store, buf);
+            else
+                memcpy(buf, a->pValue, a->ulValueLen);
+            fetch.ns[fetch.count++] = now_ns() - fstart;
+
+            it = &items[o->item];
+        }
+
+        chain.ns[chain.count++] = now_ns() - start;
+    }
+
+    summarize(&subject, &r->subject_us, &r->subject_p99);
+    summarize(&trust, &r->trust_us, &r->trust_p99);
+    summarize(&value, &r->value_us, &r->value_p99);
+    summarize(&fetch, &r->fetch_us, NULL);
+    summarize(&chain, &r->chain_us, &r->chain_p99);
+
+    free(subject.ns);
+    free(trust.ns);
+    free(value.ns);
+    free(fetch.ns);
+    free(chain.ns);
+    free(leaf);
+    free(buf);
+}
+
+/*
+ * Import a set of certificates and measure everything at that size
+ */
+
+static void run(struct pki_cert *certs, unsigned int count,
+                unsigned long chains, struct result *r) {
+    struct certstore_stats stats;
+    struct certscan_cert *cs, *picked_cs;
+    struct item *items;
+    struct slot slot = { NULL, 0, 0, 0 };
+    unsigned int *order, *legacy_order, i;
+    int *issuer, *legacy_issuer, n;
+    uint64_t rss0, start;
+
+    memset(r, 0, sizeof(*r));
+    r->certs = count;
+    rss0 = rss();
+
+    start = now_ns();
+    items = xmalloc(sizeof(*items) * (count + 1));
+    cs = xmalloc(sizeof(*cs) * (count + 1));
+    for (i = 0; i < count; i++) {
+        memset(&cs[i], 0, sizeof(cs[i]));
+        if (keychain_item(&items[i], certs[i].der, certs[i].len,
+                          certs[i].ca) != 0) {
+            cs[i].skip = 1;
+            continue;
+        }
+    }
+    r->source_ms = ms_since(start);
+
+    start = now_ns();
+    for (i = 0; i < count; i++) {
+        if (cs[i].skip)
+            continue;
+        cs[i].subject = items[i].subject;
+        cs[i].subject_len = items[i].subject_len;
+        cs[i].issuer = items[i].issuer;
+        cs[i].issuer_len = items[i].issuer_len;
+        cs[i].keyhash = items[i].keyhash;
+        cs[i].keyhash_len = HASH_LEN;
+        cs[i].root = strstr(items[i].cn, match) != NULL;
+    }
+    order = xmalloc(sizeof(*order) * (count + 1));
+    if ((n = certscan_select(cs, count, order, NULL, NULL)) < 0) {
+        fprintf(stderr, "certscan_select() failed\n");
+        exit(1);
+    }
+    r->picked = n;
+    r->select_ms = ms_since(start);
+
+    if (legacy) {
+        start = now_ns();
+        legacy_order = xmalloc(sizeof(*legacy_order) * (count + 1));
+        i = certscan_ref_select(cs, count, legacy_order);
+        r->legacy_select_ms = ms_since(start);
+        free(legacy_order);
+        if (i != r->picked)
+            fprintf(stderr, "Warning: the old import picked %u "
+                    "certificates, not %u\n", i, r->picked);
+    }
+
+    picked_cs = xmalloc(sizeof(*picked_cs) * (r->picked + 1));
+    for (i = 0; i < r->picked; i++)
+        picked_cs[i] = cs[order[i]];
+
+    issuer = xmalloc(sizeof(*issuer) * (r->picked + 1));
+    start = now_ns();
+    certscan_issuers(picked_cs, r->picked, issuer);
+    r->issuers_ms = ms_since(start);
+
+    if (legacy) {
+        legacy_issuer = xmalloc(sizeof(*legacy_issuer) * (r->picked + 1));
+        start = now_ns();
+        certscan_ref_issuers(picked_cs, r->picked, legacy_issuer);
+        r->legacy_issuers_ms = ms_since(start);
+        if (memcmp(issuer, legacy_issuer, sizeof(*issuer) * r->picked))
+            fprintf(stderr, "Warning: the old import found different "
+                    "issuers\n");
+        free(legacy_issuer);
+    }
+
+    start = now_ns();
+    build_slot(&slot, items, order, r->picked, issuer);
+    if (pack)
+        pack_slot(&slot);
+    r->build_ms = ms_since(start);
+
+    certstore_stats(&stats);
+    r->slot_kb = (slot.bytes + stats.stored_bytes) / 1024.0;
+    r->rss_kb = ((double) rss() - rss0) / 1024.0;
+
+    lookups(&slot, items, chains, r);
+
+    free_slot(&slot);
+    certstore_flush();
+    free(issuer);
+    free(picked_cs);
+    free(order);
+    free(cs);
+    free(items);
+}
+
+static void print(const struct result *r, int csv) {
+    double import = r->source_ms + r->select_ms + r->issuers_ms + r->build_ms;
+
+    if (csv) {
+        printf("%u,%u,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.0f,%.0f,"
+               "%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.3f,%.2f,%.2f\n",
+               r->certs, r->picked, import, r->source_ms, r->select_ms,
+               r->issuers_ms, r->build_ms, r->legacy_select_ms,
+               r->legacy_issuers_ms, r->slot_kb, r->rss_kb, r->value_us,
+               r->value_p99, r->trust_us, r->trust_p99, r->subject_us,
+               r->subject_p99, r->fetch_us, r->chain_us, r->chain_p99);
+        return;
+    }
+
+    printf("\n%u certificates, %u in our slot (%u objects)\n", r->certs,
+           r->picked, r->picked * 2);
+    printf("  Import: %.2f ms (source %.2f, select %.2f, issuers %.2f, "
+           "objects %.2f)\n", import, r->source_ms, r->select_ms,
+           r->issuers_ms, r->build_ms);
+    if (legacy)
+        printf("  Old import: select %.2f ms, issuers %.2f ms\n",
+               r->legacy_select_ms, r->legacy_issuers_ms);
+    printf("  Memory: %.0f KB in objects, %.0f KB resident\n", r->slot_kb,
+           r->rss_kb);
+    printf("  %-24s %10s %10s\n", "Lookup (us)", "average", "99th");
+    printf("  %-24s %10.2f %10.2f\n", "Find by value", r->value_us,
+           r->value_p99);
+    printf("  %-24s %10.2f %10.2f\n", "Find trust", r->trust_us,
+           r->trust_p99);
+    printf("  %-24s %10.2f %10.2f\n", "Find issuer by subject",
+           r->subject_us, r->subject_p99);
+    printf("  %-24s %10.3f %10s\n", "Read value", r->fetch_us, "");
+    printf("  %-24s %10.2f %10.2f\n", "Whole chain", r->chain_us,
+           r->chain_p99);
+}
+
+int main(int argc, char *argv[]) {
+    struct pki_params params = PKI_PARAMS_DEFAULT, p;
+    const char *sizes = "1000,2000,5000,10000,20000,50000";
+    unsigned long chains = 1000, size, tree, trees;
+    struct pki_cert *certs;
+    struct result r;
+    unsigned int count;
+    int c, csv = 0;
+    char *s, *e;
+
+    params.others = 1;
+    params.collide = 0.02;
+    params.cross = 0.02;
+
+    while ((c = getopt(argc, argv, "Lzcn:N:m:r:o:d:f:k:x:X:s:")) != -1) {
+        switch (c) {
+        case 'L':
+            legacy = 1;
+            break;
+        case 'z':
+            pack = 1;
+            break;
+        case 'c':
+            csv = 1;
+            break;
+        case 'n':
+            chains = strtoul(optarg, NULL, 0);
+            break;
+        case 'N':
+            sizes = optarg;
+            break;
+        case 'm':
+            match = params.root_name = optarg;
+            break;
+        case 'r':
+            params.roots = strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            params.others = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            params.depth = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            params.fanout = strtoul(optarg, NULL, 0);
+            break;
+        case 'k':
+            params.keytypes = optarg;
+            break;
+        case 'x':
+            params.collide = strtod(optarg, NULL);
+            break;
+        case 'X':
+            params.cross = strtod(optarg, NULL);
+            break;
+        case 's':
+            params.seed = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (params.roots + params.others == 0)
+        usage(argv[0]);
+
+    if (csv)
+        printf("certs,picked,import_ms,source_ms,select_ms,issuers_ms,"
+               "objects_ms,old_select_ms,old_issuers_ms,slot_kb,rss_kb,"
+               "value_us,value_p99,trust_us,trust_p99,subject_us,"
+               "subject_p99,read_us,chain_us,chain_p99\n");
+
+    if (optind < argc) {
+        for (; optind < argc; optind++) {
+            if (!(certs = pki_read_pem(argv[optind], &count))) {
+                perror(argv[optind]);
+                return 1;
+            }
+            if (!csv)
+                printf("\n%s:", argv[optind]);
+            run(certs, count, chains, &r);
+            print(&r, csv);
+            pki_forest_free(certs, count);
+        }
+        return 0;
+    }
+
+    /*
+     * The size of one tree, then enough trees for each size, matching
+     * and not in the ratio we were given
+     */
+
+    p = params;
+    p.roots = 1;
+    p.others = 0;
+    tree = pki_forest_size(&p);
+
+    for (s = (char *) sizes; *s; s = *e ? e + 1 : e) {
+        size = strtoul(s, &e, 0);
+        if (e == s || (*e && *e != ',') || size == 0 || size > 10000000)
+            usage(argv[0]);
+
+        trees = (size + tree - 1) / tree;
+        p = params;
+        p.roots = (trees * params.roots + params.roots + params.others - 1) /
+                  (params.roots + params.others);
+        if (p.roots > trees)
+            p.roots = trees;
+        p.others = trees - p.roots;
+
+        if (!(certs = pki_forest(&p, &count)))
+            return 1;
+
+        run(certs, count, chains, &r);
+        print(&r, csv);
+
+        pki_forest_free(certs, count);
+    }
+
+    return 0;
+}
@@ -0,0 +1,559 @@
+/*
+ *  certstore_bench.c
+ *  KeychainToken
+ *
+ *  Benchmark our compressed certificate store (src/certstore.c) against
+ *  keeping every certificate as it is, the way the certificate slot does
+ *  without the compressCertificates preference.  Reads a PEM bundle (a
+ *  trust store, say) and reports memory used each way, and how long it
+ *  takes to fetch values and search for one by value.
+ *
+ *  Usage: certstore_bench [-n lookups] [-r copies] [pemfile]
+ *
+ *	-n	Number of lookups for each test (default: 100000)
+ *	-r	Store this many copies of the bundle (default: 1), to see
+ *		how things scale
+ *
+ *  This doesn't need the Security framework, so it runs anywhere zlib
+ *  does.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif /* __APPLE__ */
+
+#include "certstore.h"
+
+/*
+ * One certificate from the bundle, and the names we keep with it
+ */
+
+struct cert {
+    unsigned char *der;
+    size_t len;
+    struct certstore_sample names[CERTSTORE_NAMES_MAX];	/* subject, */
+							/* issuer, serial */
+};
+
+/*
+ * A certificate stored the old way: the value, and separate copies of
+ * the names for the certificate object and the trust object
+ */
+
+struct plain {
+    unsigned char *value;
+    size_t len;
+    unsigned char *copies[CERTSTORE_NAMES_MAX + 2];
+};
+
+static const char *default_files[] = {
+    "/etc/ssl/cert.pem",
+    "/etc/ssl/certs/ca-certificates.crt",
+    "/etc/pki/tls/certs/ca-bundle.crt",
+    NULL
+};
+
+static void usage(const char *progname) {
+    fprintf(stderr, "Usage: %s [-n lookups] [-r copies] [pemfile]\n",
+            progname);
+    exit(1);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Our resident set size, in bytes
+ */
+
+static uint64_t rss(void) {
+#ifdef __APPLE__
+    struct mach_task_basic_info info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO,
+                  (task_info_t) &info, &count) != KERN_SUCCESS)
+        return 0;
+    return info.resident_size;
+#else /* __APPLE__ */
+    unsigned long size, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if (f) {
+        if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+            resident = 0;
+        fclose(f);
+    }
+    return (uint64_t) resident * sysconf(_SC_PAGESIZE);
+#endif /* __APPLE__ */
+}
+
+static void *xmalloc(size_t len) {
+    void *p = malloc(len ? len : 1);
+
+    if (!p) {
+        fprintf(stderr, "Unable to allocate %zu bytes\n", len);
+        exit(1);
+    }
+    return p;
+}
+
+/*
+ * Decode base64, ignoring anything that isn't base64
+ */
+
+static size_t unbase64(const char *in, size_t inlen, unsigned char *out) {
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    unsigned int bits = 0, nbits = 0;
+    size_t i, n = 0;
+    const char *c;
+
+    for (i = 0; i < inlen && in[i] != '='; i++) {
+        if (!in[i] || !(c = strchr(alphabet, in[i])))
+            continue;
+        bits = (bits << 6) | (c - alphabet);
+        nbits += 6;
+        if (nbits >= 8) {
+            nbits -= 8;
+            out[n++] = (bits >> nbits) & 0xff;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * Read a DER tag and length; returns the start of the value, or NULL
+ */
+
+static const unsigned char *der_item(const unsigned char *p,
+                                     const unsigned char *end,
+                                     unsigned char *tag, size_t *len) {
+    size_t n, i;
+
+    if (end - p < 2)
+        return NULL;
+
+    *tag = *p++;
+
+    if (*p < 0x80) {
+        *len = *p++;
+    } else {
+        n = *p++ & 0x7f;
+        if (n == 0 || n > sizeof(size_t) || end - p < (ptrdiff_t) n)
+            return NULL;
+        for (i = 0, *len = 0; i < n; i++)
+            *len = (*len << 8) | *p++;
+    }
+
+    if ((size_t) (end - p) < *len)
+        return NULL;
+
+    return p;
+}
+
+/*
+ * Find the serial number, issuer and subject (as whole DER items, as
+ * they are in our attributes) in a certificate
+ */
+
+static int der_names(struct cert *c) {
+    const unsigned char *p = c->der, *end = c->der + c->len, *v, *start;
+    unsigned char tag;
+    size_t len;
+    int item;
+
+    if (!(v = der_item(p, end, &tag, &len)) || tag != 0x30)
+        return -1;
+    if (!(v = der_item(v, v + len, &tag, &len)) || tag != 0x30)
+        return -1;
+
+    end = v + len;
+    p = v;
+
+    /*
+     * version [0] (optional), serial, signature, issuer, validity,
+     * subject
+     */
+
+    for (item = 0; item < 6; item++) {
+        start = p;
+        if (!(v = der_item(p, end, &tag, &len)))
+            return -1;
+        p = v + len;
+
+        if (item == 0 && tag != 0xa0)
+            item++;
+
+        switch (item) {
+        case 1:
+            c->names[2].data = start;
+            c->names[2].len = p - start;
+            break;
+        case 3:
+            c->names[1].data = start;
+            c->names[1].len = p - start;
+            break;
+        case 5:
+            c->names[0].data = start;
+            c->names[0].len = p - start;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static struct cert *read_bundle(const char *file, unsigned int *count) {
+    static const char begin[] = "-----BEGIN CERTIFICATE-----";
+    static const char end[] = "-----END CERTIFICATE-----";
+    struct cert *certs = NULL;
+    unsigned int n = 0, size = 0;
+    char *text, *p, *e;
+    long len;
+    FILE *f;
+
+    if (!(f = fopen(file, "r"))) {
+        perror(file);
+        exit(1);
+    }
+
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    rewind(f);
+
+    text = xmalloc(len + 1);
+    len = fread(text, 1, len, f);
+    text[len] = '\0';
+    fclose(f);
+
+    for (p = text; (p = strstr(p, begin)) && (e = strstr(p, end));
+         p = e + sizeof(end) - 1) {
+        p += sizeof(begin) - 1;
+
+        if (n == size) {
+            size = size ? size * 2 : 256;
+            certs = realloc(certs, size * sizeof(*certs));
+            if (!certs) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+        }
+
+        memset(&certs[n], 0, sizeof(certs[n]));
+        certs[n].der = xmalloc(e - p);
+        certs[n].len = unbase64(p, e - p, certs[n].der);
+
+        if (der_names(&certs[n]) != 0) {
+            fprintf(stderr, "Skipping certificate %u, which we can't "
+                    "parse\n", n);
+            free(certs[n].der);
+            continue;
+        }
+
+        n++;
+    }
+
+    free(text);
+    *count = n;
+
+    return certs;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Print the average and 99th percentile of some timings
+ */
+
+static void report(const char *what, uint64_t *ns, unsigned long n) {
+    uint64_t total = 0;
+    unsigned long i;
+
+    for (i = 0; i < n; i++)
+        total += ns[i];
+
+    qsort(ns, n, sizeof(*ns), compare_u64);
+
+    printf("  %-34s %10.1f %10.1f\n", what, (double) total / n / 1000.0,
+           ns[n * 99 / 100] / 1000.0);
+}
+
+int main(int argc, char *argv[]) {
+    struct certstore_sample *samples;
+    struct certstore_dict *dict;
+    struct certstore_packer *pk;
+    struct certstore_entry **entries;
+    struct certstore_stats stats;
+    struct plain *plain;
+    struct cert *certs;
+    const char *file = NULL;
+    unsigned long lookups = 100000, copies = 1, i, j, k;
+    unsigned int ncerts, n;
+    uint64_t rss0, rss1, rss2, t, *ns, plain_bytes = 0, target;
+    unsigned char *buf;
+    size_t maxlen = 0;
+    int c, found;
+
+    while ((c = getopt(argc, argv, "n:r:")) != -1) {
+        switch (c) {
+        case 'n':
+            lookups = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            copies = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind < argc - 1 || !lookups || !copies)
+        usage(argv[0]);
+
+    if (optind == argc - 1) {
+        file = argv[optind];
+    } else {
+        for (i = 0; default_files[i] && !file; i++)
+            if (access(default_files[i], R_OK) == 0)
+                file = default_files[i];
+        if (!file) {
+            fprintf(stderr, "No trust store found; give me a PEM file\n");
+            return 1;
+        }
+    }
+
+    certs = read_bundle(file, &ncerts);
+
+    if (!ncerts) {
+        fprintf(stderr, "%s: no certificates found\n", file);
+        return 1;
+    }
+
+    n = ncerts * copies;
+
+    for (i = 0; i < ncerts; i++)
+        if (certs[i].len > maxlen)
+            maxlen = certs[i].len;
+
+    printf("%u certificates from %s, stored %lu time%s\n", ncerts, file,
+           copies, copies == 1 ? "" : "s");
+
+    /*
+     * Pack everything, training our dictionary on the issuers and
+     * subjects as the certificate slot does
+     */
+
+    rss0 = rss();
+    t = now_ns();
+
+    samples = xmalloc(sizeof(*samples) * n * 2);
+    for (i = 0; i < n; i++) {
+        samples[i * 2] = certs[i % ncerts].names[0];
+        samples[i * 2 + 1] = certs[i % ncerts].names[1];
+    }
+
+    dict = certstore_dict_new(samples, n * 2);
+    free(samples);
+
+    pk = certstore_packer_new(dict);
+    entries = xmalloc(sizeof(*entries) * n);
+
+    for (i = 0; i < n; i++) {
+        entries[i] = certstore_pack(pk, certs[i % ncerts].der,
+                                    certs[i % ncerts].len,
+                                    certs[i % ncerts].names,
+                                    CERTSTORE_NAMES_MAX);
+        if (!entries[i]) {
+            fprintf(stderr, "Unable to pack certificate %lu\n", i);
+            return 1;
+        }
+    }
+
+    certstore_packer_free(pk);
+
+    t = now_ns() - t;
+    rss1 = rss();
+
+    /*
+     * And the old way
+     */
+
+    plain = xmalloc(sizeof(*plain) * n);
+
+    for (i = 0; i < n; i++) {
+        struct cert *ce = &certs[i % ncerts];
+
+        plain[i].len = ce->len;
+        plain[i].value = xmalloc(ce->len);
+        memcpy(plain[i].value, ce->der, ce->len);
+        plain_bytes += ce->len;
+
+        for (j = 0; j < CERTSTORE_NAMES_MAX + 2; j++) {
+            k = j < CERTSTORE_NAMES_MAX ? j : j - 2;
+            plain[i].copies[j] = xmalloc(ce->names[k].len);
+            memcpy(plain[i].copies[j], ce->names[k].data, ce->names[k].len);
+            plain_bytes += ce->names[k].len;
+        }
+    }
+
+    rss2 = rss();
+
+    certstore_stats(&stats);
+
+    printf("\nMemory                              %10s %10s\n", "Plain",
+           "Packed");
+    printf("  %-34s %10.1f %10.1f\n", "Allocated (KB)", plain_bytes / 1024.0,
+           (stats.stored_bytes + certstore_dict_size(dict)) / 1024.0);
+    printf("  %-34s %10.1f %10.1f\n", "RSS growth (KB)",
+           (rss2 - rss1) / 1024.0, (rss1 - rss0) / 1024.0);
+    printf("  Certificates packed to %.1f%% of their size (dictionary "
+           "%zu bytes), in %.1f ms\n",
+           100.0 * stats.packed_bytes / stats.value_bytes,
+           certstore_dict_size(dict), t / 1000000.0);
+
+    /*
+     * Now time lookups: every certificate once, the same few over and
+     * over (as when building a chain), and searching for a certificate
+     * by value (as C_FindObjects() with a CKA_VALUE template does).
+     */
+
+    ns = xmalloc(sizeof(*ns) * (lookups > n ? lookups : n));
+    buf = xmalloc(maxlen);
+    srandom(1);
+
+    printf("\nLookup latency (us)                 %10s %10s\n", "Average",
+           "99th %");
+
+    for (i = 0; i < n; i++) {
+        t = now_ns();
+        memcpy(buf, plain[i].value, plain[i].len);
+        ns[i] = now_ns() - t;
+    }
+    report("Plain, every certificate", ns, n);
+
+    certstore_flush();
+    for (i = 0; i < n; i++) {
+        t = now_ns();
+        certstore_copy(entries[i], buf);
+        ns[i] = now_ns() - t;
+    }
+    report("Packed, every certificate", ns, n);
+
+    for (i = 0; i < lookups; i++) {
+        j = random() % (n < 8 ? n : 8);
+        t = now_ns();
+        certstore_copy(entries[j], buf);
+        ns[i] = now_ns() - t;
+    }
+    report("Packed, same 8 certificates", ns, lookups);
+
+    for (i = 0; i < lookups; i++) {
+        j = random() % n;
+        t = now_ns();
+        certstore_copy(entries[j], buf);
+        ns[i] = now_ns() - t;
+    }
+    report("Packed, random certificates", ns, lookups);
+
+    for (i = 0, found = 0; i < lookups / 100 + 1; i++) {
+        target = random() % n;
+        t = now_ns();
+        for (j = 0; j < n; j++)
+            if (plain[j].len == plain[target].len &&
+                memcmp(plain[j].value, plain[target].value,
+                       plain[j].len) == 0)
+                break;
+        ns[i] = now_ns() - t;
+        found += j < n;
+    }
+    report("Plain, search by value", ns, i);
+
+    for (i = 0; i < lookups / 100 + 1; i++) {
+        target = random() % n;
+        t = now_ns();
+        for (j = 0; j < n; j++)
+            if (certstore_equal(entries[j], certs[target % ncerts].der,
+                                certs[target % ncerts].len))
+                break;
+        ns[i] = now_ns() - t;
+        found += j < n;
+    }
+    report("Packed, search by value", ns, i);
+
+    certstore_stats(&stats);
+    printf("\nCache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64
+           " bytes\n", stats.hits, stats.misses, stats.cache_bytes);
+
+    /*
+     * Make sure everything comes back as it went in
+     */
+
+    for (i = 0; i < n; i++) {
+        if (!certstore_copy(entries[i], buf) ||
+            memcmp(buf, certs[i % ncerts].der, certs[i % ncerts].len) != 0) {
+            fprintf(stderr, "Certificate %lu did not unpack correctly\n", i);
+            return 1;
+        }
+        if (memcmp(certstore_name(entries[i], 0), certs[i % ncerts].names[0].data,
+                   certs[i % ncerts].names[0].len) != 0) {
+            fprintf(stderr, "Certificate %lu has the wrong subject\n", i);
+            return 1;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        certstore_release(entries[i]);
+        free(plain[i].value);
+        for (j = 0; j < CERTSTORE_NAMES_MAX + 2; j++)
+            free(plain[i].copies[j]);
+    }
+
+    certstore_dict_release(dict);
+    certstore_stats(&stats);
+
+    if (stats.entries || stats.stored_bytes) {
+        fprintf(stderr, "%" PRIu64 " entries were not freed\n",
+                stats.entries);
+        return 1;
+    }
+
+    for (i = 0; i < ncerts; i++)
+        free(certs[i].der);
+    free(certs);
+    free(entries);
+    free(plain);
+    free(ns);
+    free(buf);
+
+    return found ? 0 : 1;
+}
@@ -0,0 +1,173 @@
+/*
+ *  circuit_test.c
+ *  KeychainToken
+ *
+ *  Check that our circuit breaker (src/circuit.c) only opens for errors
+ *  that are the card's fault: a user who keeps hitting Cancel on the PIN
+ *  dialog, gets the PIN wrong, or hands us bad data shouldn't lock
+ *  everyone out of the card, but a card that keeps failing should.
+ *
+ *  Usage: circuit_test [-v] [-n operations]
+ *
+ *	-v	Say how each check went
+ *	-n	Number of operations to try per check (default: 100)
+ *
+ *  Exits with 0 if everything worked, 1 if not.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "mypkcs11.h"
+#include "keychain_vendor.h"
+#include "circuit.h"
+
+static int verbose = 0, failures = 0;
+static unsigned int operations = 100;
+
+static void usage(const char *progname) {
+    fprintf(stderr, "Usage: %s [-v] [-n operations]\n", progname);
+    exit(1);
+}
+
+/*
+ * Run "operations" operations through a fresh breaker, all returning rv,
+ * and check whether it opened (and whether it then let anything else
+ * through).
+ */
+
+static void check(const char *test, CK_RV rv, bool enabled, bool trip) {
+    struct keychain_circuit_stats stats;
+    struct circuit c;
+    unsigned int i, allowed = 0;
+    bool trial;
+
+    circuit_init(&c, enabled);
+
+    for (i = 0; i < operations; i++) {
+        if (!circuit_allow(&c, &trial))
+            continue;
+        allowed++;
+        circuit_record(&c, trial, rv, 1000000);
+    }
+
+    circuit_stats(&c, &stats);
+
+    if (circuit_tripped(&c) != trip ||
+        (stats.state == KEYCHAIN_CIRCUIT_OPEN) != trip ||
+        (trip ? allowed == operations : allowed != operations)) {
+        printf("FAILED: %s: %s after %u operations (%u let through, "
+               "%lu failures, %lu trips)\n", test,
+               circuit_tripped(&c) ? "open" : "closed", operations, allowed,
+               (unsigned long) stats.failures, (unsigned long) stats.trips);
+        failures++;
+    } else if (verbose) {
+        printf("%s: %s, %u of %u let through, %lu failures\n", test,
+               trip ? "opened" : "stayed closed", allowed, operations,
+               (unsigned long) stats.failures);
+    }
+}
+
+/*
+ * A few cancels mixed in with real device failures shouldn't keep the
+ * breaker from opening, or make it open any sooner.
+ */
+
+static void mixed(void) {
+    struct circuit c;
+    unsigned int i;
+    bool trial;
+
+    circuit_init(&c, true);
+
+    for (i = 0; i < 20; i++) {
+        circuit_allow(&c, &trial);
+        circuit_record(&c, trial, CKR_FUNCTION_CANCELED, 1000000);
+    }
+
+    for (i = 0; i < 4; i++) {
+        circuit_allow(&c, &trial);
+        circuit_record(&c, trial, CKR_GENERAL_ERROR, 1000000);
+    }
+
+    if (circuit_tripped(&c)) {
+        printf("FAILED: mixed: opened after 20 cancels and 4 failures\n");
+        failures++;
+        return;
+    }
+
+    for (i = 0; i < 16; i++) {
+        circuit_allow(&c, &trial);
+        circuit_record(&c, trial, CKR_GENERAL_ERROR, 1000000);
+    }
+
+    if (!circuit_tripped(&c)) {
+        printf("FAILED: mixed: still closed after 20 failures\n");
+        failures++;
+    } else if (verbose) {
+        printf("mixed: opened once failures were half of the window\n");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int ch;
+
+    while ((ch = getopt(argc, argv, "vn:")) != -1) {
+        switch (ch) {
+        case 'v':
+            verbose++;
+            break;
+        case 'n':
+            operations = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc || operations < 20)
+        usage(argv[0]);
+
+    /*
+     * What we get for a user canceling the PIN dialog, a wrong PIN, a
+     * dialog we weren't allowed to show, and bad input; see cferr_rv()
+     * in keychain_pkcs11.c.
+     */
+
+    check("user cancels", CKR_FUNCTION_CANCELED, true, false);
+    check("wrong PIN", CKR_PIN_INCORRECT, true, false);
+    check("not logged in", CKR_USER_NOT_LOGGED_IN, true, false);
+    check("bad ciphertext", CKR_ENCRYPTED_DATA_INVALID, true, false);
+    check("bad data", CKR_DATA_INVALID, true, false);
+    check("success", CKR_OK, true, false);
+
+    /*
+     * And what we get when the card is in trouble
+     */
+
+    check("general errors", CKR_GENERAL_ERROR, true, true);
+    check("device errors", CKR_DEVICE_ERROR, true, true);
+    check("card removed", CKR_DEVICE_REMOVED, true, true);
+    check("device errors, disabled", CKR_DEVICE_ERROR, false, false);
+
+    mixed();
+
+    printf("%s: %d failures\n", failures ? "FAILED" : "PASSED", failures);
+
+    return failures ? 1 : 0;
+}
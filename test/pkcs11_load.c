@@ -0,0 +1,591 @@
+/*
+ *  pkcs11_load.c
+ *  KeychainToken
+ *
+ *  Multi-threaded load generation for pkcs11_test.  Runs a mix of
+ *  operations from a number of threads and reports throughput and
+ *  latency percentiles for each operation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "pkcs11_test.h"
+#include "keychain_vendor.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * The operations we know how to run
+ */
+
+enum load_op {
+    OP_FIND,
+    OP_GETATTR,
+    OP_SIGN,
+    OP_VERIFY,
+    OP_OPEN,
+    OP_MAX
+};
+
+static const char *op_names[OP_MAX] = {
+    "find", "getattr", "sign", "verify", "open"
+};
+
+/*
+ * Latency samples for one operation on one thread
+ */
+
+struct samples {
+    uint64_t *ns;
+    size_t count;
+    size_t size;
+    unsigned long errors;
+    CK_RV lasterror;
+};
+
+struct load_thread {
+    pthread_t tid;
+    int index;
+    struct load_params *lp;
+    struct samples samples[OP_MAX];
+};
+
+/*
+ * State shared by all threads
+ */
+
+static CK_FUNCTION_LIST_PTR lp11p;
+static enum load_op *schedule;
+static size_t schedule_len;
+static CK_OBJECT_HANDLE sign_key = CK_INVALID_HANDLE;
+static CK_OBJECT_HANDLE verify_key = CK_INVALID_HANDLE;
+static unsigned char load_data[32];
+static CK_BYTE_PTR ref_sig;
+static CK_ULONG ref_siglen;
+
+/*
+ * Our start gate; all threads wait here until everyone is ready so
+ * thread creation doesn't count against the run.
+ */
+
+static pthread_mutex_t gate_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gate_cond = PTHREAD_COND_INITIALIZER;
+static bool gate_open = false;
+static struct timespec run_start;
+
+/*
+ * When running with a shared session, operations that keep state in
+ * the session (find, sign, verify) have to be serialized or they will
+ * step on each other.
+ */
+
+static pthread_mutex_t shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int parse_mix(const char *);
+static CK_RV load_setup(struct load_params *);
+static void *load_thread(void *);
+static CK_RV run_op(enum load_op, CK_SESSION_HANDLE, struct load_params *);
+static void add_sample(struct samples *, uint64_t);
+static int compare_ns(const void *, const void *);
+static uint64_t elapsed_ns(struct timespec *);
+
+int
+run_load(CK_FUNCTION_LIST_PTR p11p, struct load_params *lp)
+{
+    struct load_thread *threads;
+    struct samples total;
+    double seconds;
+    uint64_t runtime;
+    unsigned long allops = 0;
+    C_KeychainGetSignCoalesceStats_t coalesce_stats;
+    struct keychain_sign_coalesce_stats ss;
+    C_KeychainGetCircuitStats_t circuit_stats;
+    struct keychain_circuit_stats cs;
+    int i, j;
+
+    lp11p = p11p;
+
+    if (parse_mix(lp->mix))
+	return 1;
+
+    if (load_setup(lp) != CKR_OK)
+	return 1;
+
+    threads = calloc(lp->threads, sizeof(*threads));
+
+    for (i = 0; i < lp->threads; i++) {
+	threads[i].index = i;
+	threads[i].lp = lp;
+	if (pthread_create(&threads[i].tid, NULL, load_thread, &threads[i])) {
+	    fprintf(stderr, "Unable to create thread %d: %s\n", i,
+		    strerror(errno));
+	    exit(1);
+	}
+    }
+
+    printf("Running load: %d thread%s, ", lp->threads,
+	   lp->threads == 1 ? "" : "s");
+    if (lp->iterations)
+	printf("%lu operations per thread", lp->iterations);
+    else
+	printf("%u seconds", lp->duration);
+    printf(", %s session%s\n", lp->shared ? "shared" : "per-thread",
+	   lp->shared ? "" : "s");
+
+    pthread_mutex_lock(&gate_mutex);
+    clock_gettime(CLOCK_MONOTONIC, &run_start);
+    gate_open = true;
+    pthread_cond_broadcast(&gate_cond);
+    pthread_mutex_unlock(&gate_mutex);
+
+    for (i = 0; i < lp->threads; i++)
+	pthread_join(threads[i].tid, NULL);
+
+    runtime = elapsed_ns(&run_start);
+    seconds = runtime / 1E9;
+
+    printf("Elapsed time: %.3f seconds\n", seconds);
+    printf("%-10s %10s %8s %12s %10s %10s %10s %10s %10s\n", "Operation",
+	   "Count", "Errors", "Ops/sec", "p50 (us)", "p90 (us)", "p99 (us)",
+	   "p99.9 (us)", "max (us)");
+
+    /*
+     * Merge the samples for each operation across all threads and
+     * sort them so we can pick out the percentiles
+     */
+
+    for (j = 0; j < OP_MAX; j++) {
+	memset(&total, 0, sizeof(total));
+
+	for (i = 0; i < lp->threads; i++) {
+	    struct samples *s = &threads[i].samples[j];
+	    size_t k;
+
+	    for (k = 0; k < s->count; k++)
+		add_sample(&total, s->ns[k]);
+	    total.errors += s->errors;
+	    if (s->errors)
+		total.lasterror = s->lasterror;
+	    free(s->ns);
+	}
+
+	if (total.count == 0 && total.errors == 0)
+	    continue;
+
+	allops += total.count;
+
+	qsort(total.ns, total.count, sizeof(uint64_t), compare_ns);
+
+#define PCT(p) (total.count ? \
+		total.ns[(size_t) ((total.count - 1) * (p))] / 1000.0 : 0.0)
+
+	printf("%-10s %10lu %8lu %12.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+	       op_names[j], (unsigned long) total.count, total.errors,
+	       total.count / seconds, PCT(0.50), PCT(0.90), PCT(0.99),
+	       PCT(0.999), PCT(1.0));
+
+#undef PCT
+
+	if (total.errors)
+	    printf("%-10s last error was %s\n", "",
+		   getCKRName(total.lasterror));
+
+	free(total.ns);
+    }
+
+    printf("%-10s %10lu %8s %12.1f\n", "total", allops, "",
+	   allops / seconds);
+
+    /*
+     * Every thread signs the same data with the same key, so if the
+     * library is coalescing signatures say how much that saved us.
+     */
+
+    coalesce_stats = (C_KeychainGetSignCoalesceStats_t)
+			vendor_func("C_KeychainGetSignCoalesceStats");
+
+    if (coalesce_stats && coalesce_stats(&ss) == CKR_OK && ss.mechanisms)
+	printf("Coalesced signatures: %lu made, %lu copied from a "
+	       "concurrent signer\n", ss.leaders, ss.followers);
+
+    circuit_stats = (C_KeychainGetCircuitStats_t)
+			vendor_func("C_KeychainGetCircuitStats");
+
+    if (circuit_stats && circuit_stats(lp->slot, &cs) == CKR_OK && cs.enabled)
+	printf("Circuit breaker: %lu calls, %lu failed, %lu failed fast, "
+	       "opened %lu times\n", cs.calls, cs.failures, cs.rejected,
+	       cs.trips);
+
+    free(threads);
+    free(schedule);
+    free(ref_sig);
+
+    return 0;
+}
+
+/*
+ * Parse our operation mix; it's a comma-separated list of operation
+ * names, each of which can be followed by ":weight".  For example,
+ * "sign:4,find,getattr:2".  We turn that into a schedule that each
+ * thread walks through in order.
+ */
+
+static int
+parse_mix(const char *mix)
+{
+    char *str = strdup(mix), *tok, *p, *save;
+    unsigned long weight;
+    int i;
+
+    schedule = NULL;
+    schedule_len = 0;
+
+    for (tok = strtok_r(str, ",", &save); tok != NULL;
+	 tok = strtok_r(NULL, ",", &save)) {
+	weight = 1;
+	if ((p = strchr(tok, ':')) != NULL) {
+	    *p++ = '\0';
+	    weight = strtoul(p, NULL, 0);
+	    if (weight == 0 || weight > 1000) {
+		fprintf(stderr, "Invalid weight for \"%s\": %s\n", tok, p);
+		free(str);
+		return 1;
+	    }
+	}
+
+	for (i = 0; i < OP_MAX; i++)
+	    if (strcmp(tok, op_names[i]) == 0)
+		break;
+
+	if (i == OP_MAX) {
+	    fprintf(stderr, "Unknown load operation \"%s\"; valid operations "
+		    "are: find, getattr, sign, verify, open\n", tok);
+	    free(str);
+	    return 1;
+	}
+
+	schedule = realloc(schedule, sizeof(*schedule) *
+			   (schedule_len + weight));
+	while (weight-- > 0)
+	    schedule[schedule_len++] = i;
+    }
+
+    free(str);
+
+    if (schedule_len == 0) {
+	fprintf(stderr, "No load operations given\n");
+	return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Find the keys we need and generate a reference signature for
+ * verification.  We use the object given with -o as our signing key,
+ * or the first private key we find if we weren't given one.
+ */
+
+static CK_RV
+load_setup(struct load_params *lp)
+{
+    CK_OBJECT_CLASS cls = CKO_PRIVATE_KEY;
+    CK_ATTRIBUTE attrs[2];
+    CK_MECHANISM mech = { lp->mech, NULL, 0 };
+    CK_ULONG count = 0;
+    CK_RV rv;
+    size_t i;
+    bool needkeys = false;
+
+    for (i = 0; i < schedule_len; i++)
+	if (schedule[i] == OP_SIGN || schedule[i] == OP_VERIFY ||
+	    schedule[i] == OP_GETATTR)
+	    needkeys = true;
+
+    if (!needkeys)
+	return CKR_OK;
+
+    memset(load_data, 0xa5, sizeof(load_data));
+
+    if (lp->key != -1) {
+	sign_key = lp->key;
+    } else {
+	attrs[0].type = CKA_CLASS;
+	attrs[0].pValue = &cls;
+	attrs[0].ulValueLen = sizeof(cls);
+
+	rv = lp11p->C_FindObjectsInit(lp->session, attrs, 1);
+	if (rv == CKR_OK) {
+	    rv = lp11p->C_FindObjects(lp->session, &sign_key, 1, &count);
+	    lp11p->C_FindObjectsFinal(lp->session);
+	}
+
+	if (rv != CKR_OK || count == 0) {
+	    fprintf(stderr, "Unable to find a private key for load test "
+		    "(rv = %s)\n", getCKRName(rv));
+	    return rv != CKR_OK ? rv : CKR_KEY_HANDLE_INVALID;
+	}
+    }
+
+    /*
+     * Find the public key with the same CKA_ID as our signing key
+     */
+
+    attrs[0].type = CKA_ID;
+    attrs[0].pValue = NULL;
+    attrs[0].ulValueLen = 0;
+
+    rv = lp11p->C_GetAttributeValue(lp->session, sign_key, attrs, 1);
+    if (rv != CKR_OK) {
+	fprintf(stderr, "Unable to get CKA_ID of key %lu (rv = %s)\n",
+		sign_key, getCKRName(rv));
+	return rv;
+    }
+
+    attrs[0].pValue = malloc(attrs[0].ulValueLen);
+    rv = lp11p->C_GetAttributeValue(lp->session, sign_key, attrs, 1);
+    if (rv != CKR_OK) {
+	fprintf(stderr, "Unable to get CKA_ID of key %lu (rv = %s)\n",
+		sign_key, getCKRName(rv));
+	free(attrs[0].pValue);
+	return rv;
+    }
+
+    cls = CKO_PUBLIC_KEY;
+    attrs[1].type = CKA_CLASS;
+    attrs[1].pValue = &cls;
+    attrs[1].ulValueLen = sizeof(cls);
+
+    count = 0;
+    rv = lp11p->C_FindObjectsInit(lp->session, attrs, 2);
+    if (rv == CKR_OK) {
+	rv = lp11p->C_FindObjects(lp->session, &verify_key, 1, &count);
+	lp11p->C_FindObjectsFinal(lp->session);
+	if (count == 0)
+	    verify_key = CK_INVALID_HANDLE;
+    }
+
+    free(attrs[0].pValue);
+
+    printf("Load test using private key %lu, public key %lu\n", sign_key,
+	   verify_key);
+
+    /*
+     * Generate our reference signature; that is used by the verify
+     * operation and also tells us how big a signature buffer we need.
+     */
+
+    rv = lp11p->C_SignInit(lp->session, &mech, sign_key);
+    if (rv == CKR_OK)
+	rv = lp11p->C_Sign(lp->session, load_data, sizeof(load_data), NULL,
+			   &ref_siglen);
+    if (rv == CKR_OK) {
+	ref_sig = malloc(ref_siglen);
+	rv = lp11p->C_Sign(lp->session, load_data, sizeof(load_data),
+			   ref_sig, &ref_siglen);
+    }
+
+    if (rv != CKR_OK) {
+	fprintf(stderr, "Unable to generate reference signature "
+		"(rv = %s)\n", getCKRName(rv));
+	return rv;
+    }
+
+    for (i = 0; i < schedule_len; i++)
+	if (schedule[i] == OP_VERIFY && verify_key == CK_INVALID_HANDLE) {
+	    fprintf(stderr, "No public key found for verify operation\n");
+	    return CKR_KEY_HANDLE_INVALID;
+	}
+
+    return CKR_OK;
+}
+
+/*
+ * The body of each load thread
+ */
+
+static void *
+load_thread(void *arg)
+{
+    struct load_thread *lt = arg;
+    struct load_params *lp = lt->lp;
+    CK_SESSION_HANDLE session = lp->session;
+    struct timespec start;
+    unsigned long n;
+    uint64_t ns, deadline = (uint64_t) lp->duration * 1000000000ULL;
+    size_t next = lt->index % schedule_len;
+    enum load_op op;
+    CK_RV rv;
+
+    if (!lp->shared) {
+	rv = lp11p->C_OpenSession(lp->slot, CKF_SERIAL_SESSION, NULL, NULL,
+				  &session);
+	if (rv != CKR_OK) {
+	    fprintf(stderr, "Thread %d: C_OpenSession failed (rv = %s)\n",
+		    lt->index, getCKRName(rv));
+	    return NULL;
+	}
+    }
+
+    pthread_mutex_lock(&gate_mutex);
+    while (!gate_open)
+	pthread_cond_wait(&gate_cond, &gate_mutex);
+    pthread_mutex_unlock(&gate_mutex);
+
+    for (n = 0; lp->iterations == 0 || n < lp->iterations; n++) {
+	if (lp->iterations == 0 && elapsed_ns(&run_start) >= deadline)
+	    break;
+
+	op = schedule[next];
+	next = (next + 1) % schedule_len;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rv = run_op(op, session, lp);
+	ns = elapsed_ns(&start);
+
+	if (rv == CKR_OK) {
+	    add_sample(&lt->samples[op], ns);
+	} else {
+	    lt->samples[op].errors++;
+	    lt->samples[op].lasterror = rv;
+	}
+    }
+
+    if (!lp->shared)
+	lp11p->C_CloseSession(session);
+
+    return NULL;
+}
+
+/*
+ * Run a single operation
+ */
+
+static CK_RV
+run_op(enum load_op op, CK_SESSION_HANDLE session, struct load_params *lp)
+{
+    CK_MECHANISM mech = { lp->mech, NULL, 0 };
+    CK_OBJECT_HANDLE obj[16];
+    CK_ATTRIBUTE attrs[2];
+    CK_BYTE sig[1024];
+    CK_ULONG count, siglen;
+    CK_SESSION_HANDLE s;
+    CK_OBJECT_CLASS cls;
+    CK_KEY_TYPE keytype;
+    CK_RV rv;
+    bool locked = false;
+
+    if (lp->shared && (op == OP_FIND || op == OP_SIGN || op == OP_VERIFY)) {
+	pthread_mutex_lock(&shared_mutex);
+	locked = true;
+    }
+
+    switch (op) {
+    case OP_FIND:
+	attrs[0].type = CKA_CLASS;
+	attrs[0].pValue = &lp->cls;
+	attrs[0].ulValueLen = sizeof(lp->cls);
+	rv = lp11p->C_FindObjectsInit(session, attrs, lp->cls != -1 ? 1 : 0);
+	if (rv != CKR_OK)
+	    break;
+	do {
+	    rv = lp11p->C_FindObjects(session, obj, 16, &count);
+	} while (rv == CKR_OK && count > 0);
+	if (rv == CKR_OK)
+	    rv = lp11p->C_FindObjectsFinal(session);
+	else
+	    lp11p->C_FindObjectsFinal(session);
+	break;
+    case OP_GETATTR:
+	attrs[0].type = CKA_CLASS;
+	attrs[0].pValue = &cls;
+	attrs[0].ulValueLen = sizeof(cls);
+	attrs[1].type = CKA_KEY_TYPE;
+	attrs[1].pValue = &keytype;
+	attrs[1].ulValueLen = sizeof(keytype);
+	rv = lp11p->C_GetAttributeValue(session, sign_key, attrs, 2);
+	break;
+    case OP_SIGN:
+	siglen = sizeof(sig);
+	rv = lp11p->C_SignInit(session, &mech, sign_key);
+	if (rv == CKR_OK)
+	    rv = lp11p->C_Sign(session, load_data, sizeof(load_data), sig,
+			       &siglen);
+	break;
+    case OP_VERIFY:
+	rv = lp11p->C_VerifyInit(session, &mech, verify_key);
+	if (rv == CKR_OK)
+	    rv = lp11p->C_Verify(session, load_data, sizeof(load_data),
+				 ref_sig, ref_siglen);
+	break;
+    case OP_OPEN:
+	rv = lp11p->C_OpenSession(lp->slot, CKF_SERIAL_SESSION, NULL, NULL,
+				  &s);
+	if (rv == CKR_OK)
+	    rv = lp11p->C_CloseSession(s);
+	break;
+    default:
+	rv = CKR_FUNCTION_NOT_SUPPORTED;
+	break;
+    }
+
+    if (locked)
+	pthread_mutex_unlock(&shared_mutex);
+
+    return rv;
+}
+
+static void
+add_sample(struct samples *s, uint64_t ns)
+{
+    if (s->count >= s->size) {
+	s->size = s->size ? s->size * 2 : 1024;
+	s->ns = realloc(s->ns, s->size * sizeof(uint64_t));
+	if (!s->ns) {
+	    fprintf(stderr, "Unable to allocate %lu latency samples\n",
+		    (unsigned long) s->size);
+	    exit(1);
+	}
+    }
+
+    s->ns[s->count++] = ns;
+}
+
+static int
+compare_ns(const void *a, const void *b)
+{
+    uint64_t na = *(const uint64_t *) a, nb = *(const uint64_t *) b;
+
+    return na < nb ? -1 : (na > nb ? 1 : 0);
+}
+
+/*
+ * Return the number of nanoseconds since "start"
+ */
+
+static uint64_t
+elapsed_ns(struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) (now.tv_sec - start->tv_sec) * 1000000000ULL +
+	   now.tv_nsec - start->tv_nsec;
+}
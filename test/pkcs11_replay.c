@@ -0,0 +1,720 @@
+/*
+ *  pkcs11_replay.c
+ *  KeychainToken
+ *
+ *  Replay a call recording written by keychain-pkcs11 when the
+ *  KEYCHAIN_PKCS11_RECORD environment variable is set (see
+ *  include/recorder.h) against any PKCS#11 module, and report how long
+ *  each function took.
+ *
+ *  Usage: pkcs11_replay [-v] [-p pin] [-s speed] library recording
+ *
+ *	-v	Print every call as it is replayed
+ *	-p	PIN to use for C_Login (PINs are never recorded)
+ *	-s	Replay at this multiple of the recorded speed (1 is the
+ *		original timing); by default calls are made back to back
+ *
+ *  Calls are replayed from a single thread in the order they started.
+ *  Handles (slots, sessions and objects) are mapped to whatever the module
+ *  returns for the same call in the replay, and attribute values the
+ *  application searched for are matched up with the values the replay
+ *  read back.  We never have the data that was signed or decrypted, just
+ *  its length, so we use zeros; expect operations whose result depends on
+ *  the data (C_Verify, C_Decrypt) to fail in the replay.  Those show up
+ *  as return value mismatches.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+#include <dlfcn.h>
+
+#include "mypkcs11.h"
+#include "debug.h"
+#include "trace.h"
+#include "recorder.h"
+
+/*
+ * One recorded call, and our position in its arguments
+ */
+
+struct call {
+    struct rec_call rec;
+    struct rec_arg *args;
+    uint32_t next;
+};
+
+/*
+ * Recorded handle (or value hash) to what the replay got
+ */
+
+struct mapping {
+    uint64_t from;
+    uint64_t to;
+    CK_BYTE_PTR value;
+};
+
+struct map {
+    struct mapping *m;
+    size_t count;
+    size_t size;
+};
+
+struct summary {
+    uint64_t count;
+    uint64_t mismatches;
+    uint64_t total;
+    uint64_t max;
+    uint64_t recorded;
+};
+
+static CK_FUNCTION_LIST_PTR p11p;
+static struct map slots, sessions, objects, values;
+static CK_UTF8CHAR_PTR pin = NULL;
+static CK_ULONG pinlen = 0;
+static int verbose = 0;
+
+static struct rec_arg empty_arg = { REC_NULL, 0, 0, 0 };
+
+static void usage(const char *progname) {
+    fprintf(stderr, "Usage: %s [-v] [-p pin] [-s speed] library "
+            "recording\n", progname);
+    exit(1);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_calls(const void *a, const void *b) {
+    const struct call *ca = a, *cb = b;
+
+    if (ca->rec.timestamp < cb->rec.timestamp)
+        return -1;
+    if (ca->rec.timestamp > cb->rec.timestamp)
+        return 1;
+    return 0;
+}
+
+static struct rec_arg *next_arg(struct call *c) {
+    if (c->next >= c->rec.arg_count)
+        return &empty_arg;
+    return &c->args[c->next++];
+}
+
+static struct rec_arg *peek_arg(struct call *c) {
+    if (c->next >= c->rec.arg_count)
+        return &empty_arg;
+    return &c->args[c->next];
+}
+
+/*
+ * Our maps are searched from the end, so the latest mapping for a
+ * (reused) handle wins.
+ */
+
+static void map_add(struct map *map, uint64_t from, uint64_t to,
+                    CK_BYTE_PTR value) {
+    if (map->count == map->size) {
+        map->size = map->size ? map->size * 2 : 64;
+        map->m = realloc(map->m, map->size * sizeof(*map->m));
+        if (!map->m) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+
+    map->m[map->count].from = from;
+    map->m[map->count].to = to;
+    map->m[map->count].value = value;
+    map->count++;
+}
+
+static struct mapping *map_find(struct map *map, uint64_t from) {
+    size_t i;
+
+    for (i = map->count; i > 0; i--)
+        if (map->m[i - 1].from == from)
+            return &map->m[i - 1];
+
+    return NULL;
+}
+
+static CK_ULONG map_handle(struct map *map, uint64_t from) {
+    struct mapping *m = map_find(map, from);
+
+    return m ? m->to : from;
+}
+
+/*
+ * Map the handles a call returned (after its count) to the ones we got
+ */
+
+static void map_handles(struct call *c, struct map *map, CK_ULONG *list,
+                        CK_ULONG count) {
+    struct rec_arg *a;
+    CK_ULONG i;
+
+    for (i = 0; peek_arg(c)->kind == REC_OUT_ULONG; i++) {
+        a = next_arg(c);
+        if (list && i < count)
+            map_add(map, a->value, list[i], NULL);
+    }
+}
+
+static CK_BYTE_PTR zeros(uint64_t len) {
+    CK_BYTE_PTR p = calloc(1, len ? len : 1);
+
+    if (!p) {
+        fprintf(stderr, "Unable to allocate %" PRIu64 " bytes\n", len);
+        exit(1);
+    }
+
+    return p;
+}
+
+/*
+ * Read a template back in.  Values we searched for are recreated from
+ * the recording if they were short, or from the replay's answer to the
+ * C_GetAttributeValue() call that returned the same value if not.
+ */
+
+static CK_ATTRIBUTE_PTR get_template(struct call *c, CK_ULONG *count) {
+    CK_ATTRIBUTE_PTR tmpl;
+    struct rec_arg *a;
+    struct mapping *m;
+    uint32_t start = c->next;
+    CK_ULONG i, n = 0;
+
+    while (c->next < c->rec.arg_count &&
+           (c->args[c->next].kind == REC_ATTR ||
+            c->args[c->next].kind == REC_ATTR_NULL ||
+            c->args[c->next].kind == REC_BUFFER)) {
+        c->next++;
+        n++;
+    }
+
+    tmpl = calloc(n ? n : 1, sizeof(*tmpl));
+    if (!tmpl) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    for (i = 0; i < n; i++) {
+        a = &c->args[start + i];
+        tmpl[i].type = a->type;
+        tmpl[i].ulValueLen = a->value;
+
+        if (a->kind == REC_ATTR_NULL)
+            continue;
+
+        tmpl[i].pValue = zeros(a->value);
+
+        if (a->kind != REC_ATTR)
+            continue;
+
+        if (a->value <= REC_INLINE_MAX)
+            memcpy(tmpl[i].pValue, &a->hash, a->value);
+        else if ((m = map_find(&values, a->hash)) && m->to <= a->value) {
+            memcpy(tmpl[i].pValue, m->value, m->to);
+            tmpl[i].ulValueLen = m->to;
+        }
+    }
+
+    *count = n;
+    return tmpl;
+}
+
+static void free_template(CK_ATTRIBUTE_PTR tmpl, CK_ULONG count) {
+    CK_ULONG i;
+
+    for (i = 0; i < count; i++)
+        free(tmpl[i].pValue);
+    free(tmpl);
+}
+
+/*
+ * Remember the values C_GetAttributeValue() gave us, by the hash of the
+ * value recorded for the same attribute
+ */
+
+static void map_values(struct call *c, CK_ATTRIBUTE_PTR tmpl, CK_ULONG count,
+                       CK_RV rv) {
+    struct rec_arg *a;
+    CK_BYTE_PTR value;
+    CK_ULONG i;
+
+    for (i = 0; peek_arg(c)->kind == REC_OUT_ATTR; i++) {
+        a = next_arg(c);
+
+        if (i >= count || !a->hash || a->value <= REC_INLINE_MAX ||
+            a->value == CK_UNAVAILABLE_INFORMATION || !tmpl[i].pValue ||
+            tmpl[i].ulValueLen == CK_UNAVAILABLE_INFORMATION ||
+            (rv != CKR_OK && rv != CKR_ATTRIBUTE_SENSITIVE &&
+             rv != CKR_ATTRIBUTE_TYPE_INVALID) ||
+            map_find(&values, a->hash))
+            continue;
+
+        value = zeros(tmpl[i].ulValueLen);
+        memcpy(value, tmpl[i].pValue, tmpl[i].ulValueLen);
+        map_add(&values, a->hash, tmpl[i].ulValueLen, value);
+    }
+}
+
+/*
+ * A mechanism and its parameters.  The only parameters that point
+ * anywhere are the OAEP source data, which we can't recreate, so drop it.
+ */
+
+static void get_mech(struct call *c, CK_MECHANISM_PTR mech) {
+    struct rec_arg *a = next_arg(c);
+    CK_RSA_PKCS_OAEP_PARAMS *oaep;
+    CK_ULONG off = 0;
+
+    mech->mechanism = a->type;
+    mech->pParameter = NULL;
+    mech->ulParameterLen = a->value;
+
+    if (a->kind != REC_MECH)
+        return;
+
+    if (peek_arg(c)->kind == REC_PARAM)
+        mech->pParameter = zeros(mech->ulParameterLen);
+
+    while (peek_arg(c)->kind == REC_PARAM) {
+        a = next_arg(c);
+        if (off + a->value <= mech->ulParameterLen)
+            memcpy((CK_BYTE_PTR) mech->pParameter + off, &a->hash, a->value);
+        off += a->value;
+    }
+
+    if (mech->mechanism == CKM_RSA_PKCS_OAEP && mech->pParameter &&
+        mech->ulParameterLen == sizeof(*oaep)) {
+        oaep = mech->pParameter;
+        oaep->pSourceData = NULL;
+        oaep->ulSourceDataLen = 0;
+    }
+}
+
+/*
+ * An output buffer (or NULL) and the length that was passed with it
+ */
+
+static CK_BYTE_PTR get_buffer(struct call *c, CK_ULONG *len) {
+    struct rec_arg *a = next_arg(c);
+
+    *len = a->value;
+    return a->kind == REC_NULL ? NULL : zeros(a->value);
+}
+
+/*
+ * Make one call.  The arguments are in the order the wrappers in
+ * recorder.c write them.
+ */
+
+static CK_RV replay(struct call *c) {
+    CK_C_INITIALIZE_ARGS initargs;
+    CK_INFO info;
+    CK_SLOT_INFO slotinfo;
+    CK_TOKEN_INFO tokeninfo;
+    CK_MECHANISM_INFO mechinfo;
+    CK_SESSION_INFO sessinfo;
+    CK_MECHANISM mech;
+    CK_ATTRIBUTE_PTR tmpl;
+    CK_ULONG *list, count, len, outlen, a1, a2;
+    CK_BYTE_PTR in, out;
+    CK_SESSION_HANDLE session;
+    struct rec_arg *a;
+    CK_RV rv;
+
+    switch (c->rec.id) {
+    case TRACE_C_Initialize:
+        memset(&initargs, 0, sizeof(initargs));
+        initargs.flags = next_arg(c)->value;
+        return p11p->C_Initialize(initargs.flags ? &initargs : NULL);
+
+    case TRACE_C_Finalize:
+        return p11p->C_Finalize(NULL);
+
+    case TRACE_C_GetInfo:
+        return p11p->C_GetInfo(&info);
+
+    case TRACE_C_GetSlotList:
+    case TRACE_C_GetMechanismList:
+        a1 = next_arg(c)->value;
+        if (c->rec.id == TRACE_C_GetMechanismList)
+            a1 = map_handle(&slots, a1);
+        a = next_arg(c);
+        count = a->value;
+        list = a->kind == REC_NULL ? NULL :
+                                (CK_ULONG *) zeros(count * sizeof(*list));
+        if (c->rec.id == TRACE_C_GetSlotList)
+            rv = p11p->C_GetSlotList(a1, list, &count);
+        else
+            rv = p11p->C_GetMechanismList(a1, list, &count);
+        next_arg(c);
+        map_handles(c, &slots, list, c->rec.id == TRACE_C_GetSlotList &&
+                                            rv == CKR_OK ? count : 0);
+        free(list);
+        return rv;
+
+    case TRACE_C_GetSlotInfo:
+        return p11p->C_GetSlotInfo(map_handle(&slots, next_arg(c)->value),
+                                   &slotinfo);
+
+    case TRACE_C_GetTokenInfo:
+        return p11p->C_GetTokenInfo(map_handle(&slots, next_arg(c)->value),
+                                    &tokeninfo);
+
+    case TRACE_C_GetMechanismInfo:
+        a1 = map_handle(&slots, next_arg(c)->value);
+        a2 = next_arg(c)->value;
+        return p11p->C_GetMechanismInfo(a1, a2, &mechinfo);
+
+    case TRACE_C_OpenSession:
+        a1 = map_handle(&slots, next_arg(c)->value);
+        a2 = next_arg(c)->value;
+        session = CK_INVALID_HANDLE;
+        rv = p11p->C_OpenSession(a1, a2, NULL, NULL, &session);
+        a = next_arg(c);
+        if (rv == CKR_OK && a->kind == REC_OUT_ULONG)
+            map_add(&sessions, a->value, session, NULL);
+        return rv;
+
+    case TRACE_C_CloseSession:
+        return p11p->C_CloseSession(map_handle(&sessions,
+                                               next_arg(c)->value));
+
+    case TRACE_C_CloseAllSessions:
+        return p11p->C_CloseAllSessions(map_handle(&slots,
+                                                   next_arg(c)->value));
+
+    case TRACE_C_GetSessionInfo:
+        return p11p->C_GetSessionInfo(map_handle(&sessions,
+                                                 next_arg(c)->value),
+                                      &sessinfo);
+
+    case TRACE_C_Login:
+        a1 = map_handle(&sessions, next_arg(c)->value);
+        a2 = next_arg(c)->value;
+        a = next_arg(c);
+        return p11p->C_Login(a1, a2, a->kind == REC_NULL ? NULL : pin,
+                             a->kind == REC_NULL ? 0 : pinlen);
+
+    case TRACE_C_Logout:
+        return p11p->C_Logout(map_handle(&sessions, next_arg(c)->value));
+
+    case TRACE_C_GetAttributeValue:
+        a1 = map_handle(&sessions, next_arg(c)->value);
+        a2 = map_handle(&objects, next_arg(c)->value);
+        tmpl = get_template(c, &count);
+        rv = p11p->C_GetAttributeValue(a1, a2, tmpl, count);
+        map_values(c, tmpl, count, rv);
+        free_template(tmpl, count);
+        return rv;
+
+    case TRACE_C_FindObjectsInit:
+        a1 = map_handle(&sessions, next_arg(c)->value);
+        tmpl = get_template(c, &count);
+        rv = p11p->C_FindObjectsInit(a1, tmpl, count);
+        free_template(tmpl, count);
+        return rv;
+
+    case TRACE_C_FindObjects:
+        a1 = map_handle(&sessions, next_arg(c)->value);
+        a2 = next_arg(c)->value;
+        list = (CK_ULONG *) zeros(a2 * sizeof(*list));
+        count = 0;
+        rv = p11p->C_FindObjects(a1, list, a2, &count);
+        next_arg(c);
+        map_handles(c, &objects, list, rv == CKR_OK ? count : 0);
+        free(list);
+        return rv;
+
+    case TRACE_C_FindObjectsFinal:
+        return p11p->C_FindObjectsFinal(map_handle(&sessions,
+                                                   next_arg(c)->value));
+
+    case TRACE_C_EncryptInit:
+    case TRACE_C_DecryptInit:
+    case TRACE_C_SignInit:
+    case TRACE_C_VerifyInit:
+        a1 = map_handle(&sessions, next_arg(c)->value);
+        get_mech(c, &mech);
+        a2 = map_handle(&objects, next_arg(c)->value);
+        switch (c->rec.id) {
+        case TRACE_C_EncryptInit:
+            rv = p11p->C_EncryptInit(a1, &mech, a2);
+            break;
+        case TRACE_C_DecryptInit:
+            rv = p11p->C_DecryptInit(a1, &mech, a2);
+            break;
+        case TRACE_C_SignInit:
+            rv = p11p->C_SignInit(a1, &mech, a2);
+            break;
+        default:
+            rv = p11p->C_VerifyInit(a1, &mech, a2);
+            break;
+        }
+        free(mech.pParameter);
+        return rv;
+
+    case TRACE_C_Encrypt:
+    case TRACE_C_Decrypt:
+    case TRACE_C_Sign:
+        a1 = map_handle(&sessions, next_arg(c)->value);
+        in = get_buffer(c, &len);
+        out = get_buffer(c, &outlen);
+        switch (c->rec.id) {
+        case TRACE_C_Encrypt:
+            rv = p11p->C_Encrypt(a1, in, len, out, &outlen);
+            break;
+        case TRACE_C_Decrypt:
+            rv = p11p->C_Decrypt(a1, in, len, out, &outlen);
+            break;
+        default:
+            rv = p11p->C_Sign(a1, in, len, out, &outlen);
+            break;
+        }
+        free(in);
+        free(out);
+        return rv;
+
+    case TRACE_C_Verify:
+        a1 = map_handle(&sessions, next_arg(c)->value);
+        in = get_buffer(c, &len);
+        out = get_buffer(c, &outlen);
+        rv = p11p->C_Verify(a1, in, len, out, outlen);
+        free(in);
+        free(out);
+        return rv;
+
+    case TRACE_C_CancelFunction:
+        return p11p->C_CancelFunction(map_handle(&sessions,
+                                                 next_arg(c)->value));
+
+    default:
+        fprintf(stderr, "Don't know how to replay %s\n",
+                getTraceName(c->rec.id));
+        return CKR_FUNCTION_NOT_SUPPORTED;
+    }
+}
+
+static CK_FUNCTION_LIST_PTR load_module(const char *library) {
+    CK_RV (*getflist)(CK_FUNCTION_LIST_PTR_PTR);
+    CK_FUNCTION_LIST_PTR list;
+    void *handle;
+    CK_RV rv;
+
+    if (!(handle = dlopen(library, RTLD_NOW))) {
+        fprintf(stderr, "Error loading PKCS11 library: %s\n", dlerror());
+        return NULL;
+    }
+
+    getflist = (CK_RV (*)(CK_FUNCTION_LIST_PTR_PTR))
+                        dlsym(handle, "C_GetFunctionList");
+    if (!getflist) {
+        fprintf(stderr, "Error finding \"C_GetFunctionList\" symbol: %s\n",
+                dlerror());
+        return NULL;
+    }
+
+    if ((rv = (*getflist)(&list)) != CKR_OK) {
+        fprintf(stderr, "Error calling \"C_GetFunctionList\" (rv = %s)\n",
+                getCKRName(rv));
+        return NULL;
+    }
+
+    return list;
+}
+
+int main(int argc, char *argv[]) {
+    struct rec_header hdr;
+    struct call *calls = NULL;
+    struct summary sum[TRACE_ID_MAX];
+    struct timespec ts;
+    uint64_t i, n = 0, size = 0, mismatches = 0, start, t, target;
+    double speed = 0;
+    int c;
+    FILE *f;
+    CK_RV rv;
+
+    while ((c = getopt(argc, argv, "p:s:v")) != -1) {
+        switch (c) {
+        case 'p':
+            pin = (CK_UTF8CHAR_PTR) optarg;
+            pinlen = strlen(optarg);
+            break;
+        case 's':
+            speed = atof(optarg);
+            if (speed <= 0)
+                usage(argv[0]);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 2)
+        usage(argv[0]);
+
+    if (!(f = fopen(argv[optind + 1], "rb"))) {
+        perror(argv[optind + 1]);
+        return 1;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        strncmp(hdr.magic, REC_MAGIC, sizeof(hdr.magic)) != 0) {
+        fprintf(stderr, "%s: not a keychain-pkcs11 call recording\n",
+                argv[optind + 1]);
+        return 1;
+    }
+
+    if (hdr.version != REC_VERSION ||
+        hdr.arg_size != sizeof(struct rec_arg)) {
+        fprintf(stderr, "%s: unsupported recording version %u (argument "
+                "size %u)\n", argv[optind + 1], hdr.version, hdr.arg_size);
+        return 1;
+    }
+
+    /*
+     * A recording from a process that crashed can end partway through
+     * a call; just drop that one.
+     */
+
+    for (;;) {
+        if (n == size) {
+            size = size ? size * 2 : 1024;
+            if (!(calls = realloc(calls, size * sizeof(*calls)))) {
+                fprintf(stderr, "Unable to allocate %" PRIu64 " calls\n",
+                        size);
+                return 1;
+            }
+        }
+
+        if (fread(&calls[n].rec, sizeof(calls[n].rec), 1, f) != 1)
+            break;
+
+        calls[n].next = 0;
+        calls[n].args = calloc(calls[n].rec.arg_count ?
+                               calls[n].rec.arg_count : 1,
+                               sizeof(struct rec_arg));
+        if (!calls[n].args) {
+            fprintf(stderr, "Unable to allocate %u arguments\n",
+                    calls[n].rec.arg_count);
+            return 1;
+        }
+
+        if (fread(calls[n].args, sizeof(struct rec_arg),
+                  calls[n].rec.arg_count, f) != calls[n].rec.arg_count) {
+            fprintf(stderr, "Warning: recording truncated\n");
+            free(calls[n].args);
+            break;
+        }
+
+        n++;
+    }
+
+    fclose(f);
+
+    qsort(calls, n, sizeof(*calls), compare_calls);
+
+    printf("Recording of process %" PRIu64 ": %" PRIu64 " calls\n",
+           hdr.pid, n);
+
+    if (!(p11p = load_module(argv[optind])))
+        return 1;
+
+    memset(sum, 0, sizeof(sum));
+    start = now_ns();
+
+    for (i = 0; i < n; i++) {
+        /*
+         * If we're keeping to the recorded timing, wait until it's
+         * time for this call (if we're running behind, just go)
+         */
+
+        if (speed > 0) {
+            target = start + (uint64_t) ((calls[i].rec.timestamp -
+                                          calls[0].rec.timestamp) / speed);
+            if ((t = now_ns()) < target) {
+                ts.tv_sec = (target - t) / 1000000000ULL;
+                ts.tv_nsec = (target - t) % 1000000000ULL;
+                nanosleep(&ts, NULL);
+            }
+        }
+
+        t = now_ns();
+        rv = replay(&calls[i]);
+        t = now_ns() - t;
+
+        if (calls[i].rec.id >= TRACE_ID_MAX)
+            continue;
+
+        sum[calls[i].rec.id].count++;
+        sum[calls[i].rec.id].total += t;
+        sum[calls[i].rec.id].recorded += calls[i].rec.duration;
+        if (t > sum[calls[i].rec.id].max)
+            sum[calls[i].rec.id].max = t;
+        if ((uint32_t) rv != calls[i].rec.rv) {
+            sum[calls[i].rec.id].mismatches++;
+            mismatches++;
+        }
+
+        if (verbose) {
+            printf("%12.3f ms  tid %-8" PRIu64 " %-24s %-32s",
+                   (calls[i].rec.timestamp - calls[0].rec.timestamp) /
+                                                                1000000.0,
+                   calls[i].rec.thread, getTraceName(calls[i].rec.id),
+                   getCKRName(rv));
+            if ((uint32_t) rv != calls[i].rec.rv)
+                printf(" (recorded %s)", getCKRName(calls[i].rec.rv));
+            printf(" %10.1f us\n", t / 1000.0);
+        }
+    }
+
+    printf("%-24s %8s %8s %12s %12s %12s %14s\n", "Function", "Count",
+           "Mismatch", "Total (us)", "Avg (us)", "Max (us)",
+           "Recorded (us)");
+
+    for (i = 0; i < TRACE_ID_MAX; i++) {
+        if (sum[i].count == 0)
+            continue;
+        printf("%-24s %8" PRIu64 " %8" PRIu64 " %12.1f %12.1f %12.1f "
+               "%14.1f\n", getTraceName(i), sum[i].count, sum[i].mismatches,
+               sum[i].total / 1000.0, sum[i].total / 1000.0 / sum[i].count,
+               sum[i].max / 1000.0, sum[i].recorded / 1000.0);
+    }
+
+    printf("%" PRIu64 " of %" PRIu64 " calls returned something different "
+           "than they did when recorded\n", mismatches, n);
+
+    for (i = 0; i < n; i++)
+        free(calls[i].args);
+    free(calls);
+
+    return 0;
+}
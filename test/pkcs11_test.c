@@ -23,6 +23,7 @@
  */
 
 #include "pkcs11_test.h"
+#include "keychain_vendor.h"
 #include "config.h"
 
 #include <stdarg.h>
@@ -228,6 +229,17 @@ struct op_list {
 
 static void getdata(const char *, unsigned char **, size_t *);
 static CK_ULONG getnum(const char *, const char *);
+static void verify_bench(CK_FUNCTION_LIST_PTR, CK_SESSION_HANDLE,
+			 CK_MECHANISM_PTR, CK_OBJECT_HANDLE, unsigned char *,
+			 size_t, unsigned char *, size_t, CK_ULONG);
+static void print_profile(void);
+static void attr_bench(CK_FUNCTION_LIST_PTR, CK_SESSION_HANDLE);
+
+/*
+ * The library we loaded, so we can find our vendor functions
+ */
+
+static LpHandleType p11lib = NULL;
 
 static void
 usage(const char *progname)
@@ -237,8 +249,17 @@ usage(const char *progname)
     fprintf(stderr, "Valid flags are:\n");
     fprintf(stderr, "\t-a attr\t\tNumeric attribute to dump (may be repeated "
     		    "with -F)\n");
+    fprintf(stderr, "\t-A\t\tBenchmark fetching attributes from every "
+		    "object, one object\n");
+    fprintf(stderr, "\t\t\tat a time and with "
+		    "C_KeychainGetAttributeValues\n");
+    fprintf(stderr, "\t-b count\tBenchmark <count> verifications of the "
+		    "-v/-V signature,\n");
+    fprintf(stderr, "\t\t\tone at a time and with C_KeychainVerifyBatch\n");
     fprintf(stderr, "\t-c class\tNumeric class of objects to select; \n");
     fprintf(stderr, "\t\t\tdefault is to apply to all objects\n");
+    fprintf(stderr, "\t-d seconds\tRun load test for <seconds> (default: "
+		    "10)\n");
     fprintf(stderr, "\t-D filename\tData to decrypt, requires -o, ");
     fprintf(stderr, "may be repeated\n");
     fprintf(stderr, "\t-E encdata\tData to encrypt, requires -o, ");
@@ -249,19 +270,36 @@ usage(const char *progname)
     fprintf(stderr, "\t\t\t%%o\tObject number\n");
     fprintf(stderr, "\t\t\t%%a\tAttribute number\n");
     fprintf(stderr, "\t\t\t%%s\tSlot number\n");
+    fprintf(stderr, "\t-i count\tRun load test for <count> operations "
+		    "per thread\n");
     fprintf(stderr, "\t-L\t\tDo NOT log into card using C_Login\n");
+    fprintf(stderr, "\t-m mix\t\tRun a multi-threaded load test using the "
+		    "given operation\n");
+    fprintf(stderr, "\t\t\tmix; a comma-separated list of find, getattr, "
+		    "sign,\n");
+    fprintf(stderr, "\t\t\tverify and open, each optionally followed by "
+		    ":weight\n");
+    fprintf(stderr, "\t\t\t(e.g. sign:4,find).  Uses the key selected by "
+		    "-o, or\n");
+    fprintf(stderr, "\t\t\tthe first private key found\n");
     fprintf(stderr, "\t-N num\t\tSign <num> bytes of NULs (may be "
     		    "repeated)\n");
     fprintf(stderr, "\t-n progname\tSet program name to <progname>\n");
     fprintf(stderr, "\t-o object\tObject number to select for inspection or "
     		    "use for other\n");
     fprintf(stderr, "\t\t\toperations; affects next argument, may be repeated\n");
+    fprintf(stderr, "\t-p\t\tPrint the library's backend call profile "
+		    "before exiting\n");
+    fprintf(stderr, "\t-P\t\tShare one session between all load test "
+		    "threads\n");
     fprintf(stderr, "\t-s slot\t\tSelect this slot (default: first slot);\n");
 #if 0
     fprintf(stderr, "\t\t\tmay be repeated\n");
 #endif
     fprintf(stderr, "\t-S signdata\tData to sign; requires -o, "
 		    "may be repeated\n");
+    fprintf(stderr, "\t-t threads\tNumber of load test threads "
+		    "(default: 1)\n");
     fprintf(stderr, "\t-T\t\tAllow the use of slots WITHOUT tokens\n");
     fprintf(stderr, "\t-v filename\tFilename of data to verify signature;\n");
     fprintf(stderr, "\t\t\tuse -V for signature data and -o to select key\n");
@@ -305,6 +343,7 @@ int main(int argc, char *argv[]) {
     CK_MECHANISM mech = { sMech, NULL, 0 };
     const char *verify_data = NULL;
     const char *verify_sig = NULL;
+    CK_ULONG verify_count = 0;
     const char *attr_filename = NULL;
     const char *attr_filetemplate = NULL;
 
@@ -313,6 +352,8 @@ int main(int argc, char *argv[]) {
     struct op_list *dec_head = NULL, *dec_tail = NULL, *dec;
 
     bool sleepatexit = false;
+    bool dumpprofile = false;
+    bool attrbench = false;
     bool tokenlogin;
     bool forcelogin = false;
     bool forcenologin = false;
@@ -321,9 +362,16 @@ int main(int argc, char *argv[]) {
 
     struct attr_list *attr_head = NULL, *attr_tail = NULL, *attr;
 
+    struct load_params load;
+    CK_C_INITIALIZE_ARGS initargs;
+
     int i;
 
-    while ((i = getopt(argc, argv, "a:c:D:E:f:F:lLN:n:o:S:s:Tv:V:wW")) != -1) {
+    memset(&load, 0, sizeof(load));
+    load.threads = 1;
+    load.duration = 10;
+
+    while ((i = getopt(argc, argv, "a:Ab:c:d:D:E:f:F:i:lLm:N:n:o:pPS:s:t:Tv:V:wW")) != -1) {
 	switch (i) {
 	case 'a':
 	    if (!attr_filename && !attr_filetemplate) {
@@ -351,11 +399,18 @@ int main(int argc, char *argv[]) {
 		attr_tail = attr;
 	    }
 
+	    break;
+	case 'b':
+	    verify_count = getnum(optarg, "Invalid verification count");
 	    break;
 	case 'c':
 	    cls = getnum(optarg, "Invalid object class number");
 	    sObject = -1;
 	    break;
+	case 'd':
+	    load.duration = getnum(optarg, "Invalid load test duration");
+	    load.iterations = 0;
+	    break;
 	case 'D':
 	    if (sObject == -1) {
 		fprintf(stderr, "-o required before -D\n");
@@ -401,6 +456,10 @@ int main(int argc, char *argv[]) {
 	    attr_filetemplate = optarg;
 	    attr_filename = NULL;
 	    break;
+	case 'i':
+	    load.iterations = getnum(optarg, "Invalid load test iteration "
+				     "count");
+	    break;
 	case 'l':
 	    forcelogin = true;
 	    forcenologin = false;
@@ -409,6 +468,9 @@ int main(int argc, char *argv[]) {
 	    forcenologin = true;
 	    forcelogin = false;
 	    break;
+	case 'm':
+	    load.mix = optarg;
+	    break;
 	case 'N':
 	    if (sObject == -1) {
 		fprintf(stderr, "-o required before -S\n");
@@ -437,6 +499,15 @@ int main(int argc, char *argv[]) {
 	    setprogname(optarg);
 #endif /* HAVE_SETPROGNAME */
 	    break;
+	case 'A':
+	    attrbench = true;
+	    break;
+	case 'p':
+	    dumpprofile = true;
+	    break;
+	case 'P':
+	    load.shared = 1;
+	    break;
 	case 's':
 	    slot = getnum(optarg, "Invalid slot number");
 	    break;
@@ -458,6 +529,13 @@ int main(int argc, char *argv[]) {
 		sign_tail = sign;
 	    }
 
+	    break;
+	case 't':
+	    load.threads = getnum(optarg, "Invalid number of threads");
+	    if (load.threads < 1) {
+		fprintf(stderr, "At least one thread is required\n");
+		exit(1);
+	    }
 	    break;
 	case 'T':
 	    requiretoken = false;
@@ -489,6 +567,11 @@ int main(int argc, char *argv[]) {
 	exit(1);
     }
 
+    if (verify_count && !verify_data) {
+	fprintf(stderr, "-b requires -v and -V\n");
+	exit(1);
+    }
+
     argc -= optind - 1;
     argv += optind - 1;
 
@@ -502,7 +585,14 @@ int main(int argc, char *argv[]) {
         return(1);
     }
 
-    rv = p11p->C_Initialize(NULL);
+    /*
+     * If we are running a load test we need the library to do locking
+     */
+
+    memset(&initargs, 0, sizeof(initargs));
+    initargs.flags = CKF_OS_LOCKING_OK;
+
+    rv = p11p->C_Initialize(load.mix ? &initargs : NULL);
     if (rv != CKR_OK) {
         fprintf(stderr, "Error initalizing library (rv = %X)\n", (unsigned int) rv);
         return(2);
@@ -746,6 +836,35 @@ int main(int argc, char *argv[]) {
 	}
     }
 
+    /*
+     * If we were asked to run a load test, do that instead of anything
+     * else.
+     */
+
+    if (load.mix) {
+	load.slot = slot;
+	load.session = hSession;
+	load.key = sObject;
+	load.cls = cls;
+	load.mech = sMech;
+
+	if (run_load(p11p, &load))
+	    exit(1);
+
+	(void)p11p->C_CloseSession(hSession);
+	goto cleanup;
+    }
+
+    /*
+     * Same for the attribute fetching benchmark
+     */
+
+    if (attrbench) {
+	attr_bench(p11p, hSession);
+	(void)p11p->C_CloseSession(hSession);
+	goto cleanup;
+    }
+
     /*
      * If we are given a list of attributes to write out to a file, then
      * do that.
@@ -1291,8 +1410,6 @@ int main(int argc, char *argv[]) {
 	}
 
 	rv = p11p->C_Verify(hSession, d, dlen, sig, siglen);
-	free(d);
-	free(sig);
 
 	if (rv != CKR_OK) {
 	    fprintf(stderr, "C_Verify failed (rv = %s)\n", getCKRName(rv));
@@ -1300,6 +1417,13 @@ int main(int argc, char *argv[]) {
 	} else {
 	    printf("Good signature on %s/%s\n", verify_data, verify_sig);
 	}
+
+	if (verify_count)
+	    verify_bench(p11p, hSession, &mech, sObject, d, dlen, sig, siglen,
+			 verify_count);
+
+	free(d);
+	free(sig);
     }
 
 #if 0
@@ -1317,6 +1441,9 @@ int main(int argc, char *argv[]) {
     (void)p11p->C_CloseSession(hSession);
 #endif
 cleanup:
+    if (p11p && dumpprofile)
+	print_profile();
+
     if (p11p) p11p->C_Finalize(0);
 
     if (sleepatexit) {
@@ -1388,6 +1515,7 @@ CK_RV load_library(char *library, CK_FUNCTION_LIST_PTR *p11p) {
 #else
     p11lib_handle = dlopen(library, RTLD_NOW);
 #endif
+    p11lib = p11lib_handle;
     if (p11lib_handle == NULL) {
 #ifdef _WIN32
         printf("Error loading PKCS11 library: %s\n", (char *)GetLastError);
@@ -1419,6 +1547,20 @@ CK_RV load_library(char *library, CK_FUNCTION_LIST_PTR *p11p) {
     return(CKR_OK);
 }
 
+/*
+ * Find one of our vendor functions (see keychain_vendor.h); returns NULL
+ * if the library we loaded doesn't have it.
+ */
+
+void *
+vendor_func(const char *name)
+{
+    if (!p11lib)
+	return NULL;
+
+    return (void *) GetFuncFromMod(p11lib, name);
+}
+
 CK_RV getPassword(CK_UTF8CHAR *pass, CK_ULONG *length) {
 #ifndef _WIN32
     struct termios t, save;
@@ -2002,3 +2144,272 @@ getnum(const char *number, const char *errstring)
 
     return val;
 }
+
+/*
+ * Seconds since "start"
+ */
+
+static double
+elapsed(struct timespec *start)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (end.tv_sec - start->tv_sec) +
+				(end.tv_nsec - start->tv_nsec) / 1E9;
+}
+
+/*
+ * Verify the same signature "count" times, first with C_VerifyInit/C_Verify
+ * and then with one call to C_KeychainVerifyBatch, and report the rate
+ * for each.  The verification cache would make this meaningless, so
+ * complain if it's on.
+ */
+
+static void
+verify_bench(CK_FUNCTION_LIST_PTR p11p, CK_SESSION_HANDLE hSession,
+	     CK_MECHANISM_PTR mech, CK_OBJECT_HANDLE key, unsigned char *data,
+	     size_t datalen, unsigned char *sig, size_t siglen, CK_ULONG count)
+{
+    C_KeychainVerifyBatch_t verify_batch;
+    C_KeychainGetVerifyCacheStats_t cache_stats;
+    struct keychain_verify_cache_stats vs;
+    struct keychain_verify_item *items;
+    struct timespec start;
+    CK_RV rv, *results;
+    CK_ULONG i, bad = 0;
+    double secs;
+
+    verify_batch = (C_KeychainVerifyBatch_t)
+				vendor_func("C_KeychainVerifyBatch");
+
+    if (!verify_batch) {
+	fprintf(stderr, "Library has no C_KeychainVerifyBatch\n");
+	exit(1);
+    }
+
+    cache_stats = (C_KeychainGetVerifyCacheStats_t)
+				vendor_func("C_KeychainGetVerifyCacheStats");
+
+    if (cache_stats && cache_stats(&vs) == CKR_OK && vs.size > 0)
+	fprintf(stderr, "Warning: verifyCache is enabled, so these numbers "
+		"only measure the cache\n");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (i = 0; i < count; i++) {
+	rv = p11p->C_VerifyInit(hSession, mech, key);
+	if (rv == CKR_OK)
+	    rv = p11p->C_Verify(hSession, data, datalen, sig, siglen);
+	if (rv != CKR_OK) {
+	    fprintf(stderr, "Verify %lu failed (rv = %s)\n", i,
+		    getCKRName(rv));
+	    exit(1);
+	}
+    }
+
+    secs = elapsed(&start);
+    printf("Single: %lu verifications in %.3f seconds, %.1f/sec\n",
+	   count, secs, count / secs);
+
+    items = malloc(sizeof(*items) * count);
+    results = malloc(sizeof(*results) * count);
+
+    for (i = 0; i < count; i++) {
+	items[i].data = data;
+	items[i].data_len = datalen;
+	items[i].sig = sig;
+	items[i].sig_len = siglen;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    rv = verify_batch(hSession, mech, key, items, count, results);
+
+    secs = elapsed(&start);
+
+    if (rv != CKR_OK) {
+	fprintf(stderr, "C_KeychainVerifyBatch failed (rv = %s)\n",
+		getCKRName(rv));
+	exit(1);
+    }
+
+    for (i = 0; i < count; i++)
+	if (results[i] != CKR_OK)
+	    bad++;
+
+    printf("Batch: %lu verifications in %.3f seconds, %.1f/sec "
+	   "(%lu failed)\n", count, secs, count / secs, bad);
+
+    free(items);
+    free(results);
+}
+
+/*
+ * Print out the library's backend call profile as a table
+ */
+
+static void
+print_profile(void)
+{
+    static const char *phases[] = {
+	"other", "id scan", "cert scan", "objects", "crypto",
+    };
+    C_KeychainGetBackendProfile_t get_profile;
+    struct keychain_backend_probe *probes;
+    CK_ULONG count = 0, i;
+    CK_RV rv;
+
+    get_profile = (C_KeychainGetBackendProfile_t)
+				vendor_func("C_KeychainGetBackendProfile");
+
+    if (! get_profile) {
+	fprintf(stderr, "This library has no backend call profile\n");
+	return;
+    }
+
+    if ((rv = get_profile(NULL, &count)) != CKR_OK) {
+	fprintf(stderr, "C_KeychainGetBackendProfile failed (rv = %s)\n",
+		getCKRName(rv));
+	return;
+    }
+
+    probes = calloc(count ? count : 1, sizeof(*probes));
+
+    if ((rv = get_profile(probes, &count)) != CKR_OK) {
+	fprintf(stderr, "C_KeychainGetBackendProfile failed (rv = %s)\n",
+		getCKRName(rv));
+	free(probes);
+	return;
+    }
+
+    printf("Backend call profile:\n");
+    printf("%-34s %-9s %8s %6s %8s %10s %9s %9s\n", "Probe", "Phase",
+	   "Calls", "Errors", "Last err", "Total ms", "Avg us", "Max us");
+
+    for (i = 0; i < count; i++)
+	printf("%-34s %-9s %8lu %6lu %8ld %10.3f %9lu %9lu\n", probes[i].name,
+	       probes[i].phase < sizeof(phases) / sizeof(phases[0]) ?
+				phases[probes[i].phase] : "unknown",
+	       probes[i].count, probes[i].errors, probes[i].last_error,
+	       probes[i].total_us / 1000.0, probes[i].total_us /
+							probes[i].count,
+	       probes[i].max_us);
+
+    free(probes);
+}
+
+/*
+ * Fetch the class, ID, label and value of every object in the slot, first
+ * the usual way (two C_GetAttributeValue calls per object, to size and
+ * then fetch) and then with two calls to C_KeychainGetAttributeValues, and
+ * report the time each took.
+ */
+
+static void
+attr_bench(CK_FUNCTION_LIST_PTR p11p, CK_SESSION_HANDLE hSession)
+{
+    static CK_ATTRIBUTE_TYPE types[] = {
+	CKA_CLASS, CKA_ID, CKA_LABEL, CKA_VALUE,
+    };
+    const CK_ULONG ntypes = sizeof(types) / sizeof(types[0]);
+    C_KeychainGetAttributeValues_t get_values;
+    CK_OBJECT_HANDLE_PTR objects = NULL;
+    CK_ATTRIBUTE tmpl[sizeof(types) / sizeof(types[0])], *values;
+    CK_ULONG count = 0, n, i, j, calls = 0, buflen = 0, bad = 0;
+    CK_BYTE_PTR buffer;
+    CK_RV rv, *results;
+    struct timespec start;
+    double secs;
+
+    get_values = (C_KeychainGetAttributeValues_t)
+				vendor_func("C_KeychainGetAttributeValues");
+
+    if (!get_values) {
+	fprintf(stderr, "Library has no C_KeychainGetAttributeValues\n");
+	exit(1);
+    }
+
+    rv = p11p->C_FindObjectsInit(hSession, NULL, 0);
+    if (rv != CKR_OK) {
+	fprintf(stderr, "C_FindObjectsInit failed (rv = %s)\n",
+		getCKRName(rv));
+	exit(1);
+    }
+
+    do {
+	objects = realloc(objects, sizeof(*objects) * (count + 256));
+	rv = p11p->C_FindObjects(hSession, objects + count, 256, &n);
+	if (rv != CKR_OK) {
+	    fprintf(stderr, "C_FindObjects failed (rv = %s)\n",
+		    getCKRName(rv));
+	    exit(1);
+	}
+	count += n;
+    } while (n > 0);
+
+    p11p->C_FindObjectsFinal(hSession);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (i = 0; i < count; i++) {
+	for (j = 0; j < ntypes; j++) {
+	    tmpl[j].type = types[j];
+	    tmpl[j].pValue = NULL;
+	    tmpl[j].ulValueLen = 0;
+	}
+
+	p11p->C_GetAttributeValue(hSession, objects[i], tmpl, ntypes);
+	calls++;
+
+	for (j = 0; j < ntypes; j++) {
+	    if (tmpl[j].ulValueLen == CK_UNAVAILABLE_INFORMATION)
+		tmpl[j].ulValueLen = 0;
+	    tmpl[j].pValue = malloc(tmpl[j].ulValueLen + 1);
+	}
+
+	p11p->C_GetAttributeValue(hSession, objects[i], tmpl, ntypes);
+	calls++;
+
+	for (j = 0; j < ntypes; j++)
+	    free(tmpl[j].pValue);
+    }
+
+    secs = elapsed(&start);
+    printf("Single: %lu objects in %lu calls, %.3f seconds\n", count, calls,
+	   secs);
+
+    values = malloc(sizeof(*values) * (count * ntypes + 1));
+    results = malloc(sizeof(*results) * (count + 1));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    rv = get_values(hSession, objects, count, types, ntypes, values, NULL,
+		    &buflen, results);
+    if (rv == CKR_OK) {
+	buffer = malloc(buflen + 1);
+	rv = get_values(hSession, objects, count, types, ntypes, values,
+			buffer, &buflen, results);
+	free(buffer);
+    }
+
+    secs = elapsed(&start);
+
+    if (rv != CKR_OK) {
+	fprintf(stderr, "C_KeychainGetAttributeValues failed (rv = %s)\n",
+		getCKRName(rv));
+	exit(1);
+    }
+
+    for (i = 0; i < count; i++)
+	if (results[i] != CKR_OK)
+	    bad++;
+
+    printf("Multi: %lu objects in 2 calls (%lu bytes), %.3f seconds "
+	   "(%lu missing an attribute)\n", count, buflen, secs, bad);
+
+    free(values);
+    free(results);
+    free(objects);
+}
@@ -48,8 +48,28 @@ void hexdump(unsigned char *, int);
 CK_RV get_slot(CK_FUNCTION_LIST_PTR, CK_SLOT_ID_PTR);
 CK_RV login(CK_FUNCTION_LIST_PTR, CK_TOKEN_INFO_PTR, CK_SESSION_HANDLE, int, CK_UTF8CHAR *, CK_ULONG);
 CK_RV load_library(char *, CK_FUNCTION_LIST_PTR *);
+void *vendor_func(const char *);
 char *unhex(char *input, CK_ULONG *length);
 CK_RV getPassword(CK_UTF8CHAR *pass, CK_ULONG *length);
 
+/*
+ * Parameters for our multi-threaded load mode (see pkcs11_load.c)
+ */
+
+struct load_params {
+    CK_SLOT_ID slot;			/* Slot to open sessions on */
+    CK_SESSION_HANDLE session;		/* Our main (shared) session */
+    CK_OBJECT_HANDLE key;		/* Signing key, or -1 */
+    CK_OBJECT_CLASS cls;		/* Class for find operation, or -1 */
+    CK_MECHANISM_TYPE mech;		/* Sign/verify mechanism */
+    const char *mix;			/* Operation mix */
+    int threads;			/* Number of threads */
+    unsigned int duration;		/* Run time in seconds */
+    unsigned long iterations;		/* Operations per thread, or 0 */
+    int shared;				/* If set, use one session for all */
+};
+
+int run_load(CK_FUNCTION_LIST_PTR, struct load_params *);
+
 
 #endif
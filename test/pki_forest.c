@@ -0,0 +1,822 @@
+/*
+ *  pki_forest.c
+ *  KeychainToken
+ *
+ *  Our synthetic PKI generator (see pki_forest.h).
+ *
+ *  Everything comes from one seeded random number generator, so the
+ *  same parameters always make the same forest.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "pki_forest.h"
+
+#define SKI_LEN 20
+
+/*
+ * The key types we know about.  "size" is the RSA modulus or EC field
+ * element size, in bytes.
+ */
+
+struct keytype {
+    const char *name;
+    int ec;
+    size_t size;
+    const unsigned char *curve;		/* Curve OID (EC) */
+    const unsigned char *sigalg;	/* OID of signatures we make */
+};
+
+static const unsigned char oid_rsa[] = {
+    0x06, 0x09, 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x01, 0x01 };
+static const unsigned char oid_sha256_rsa[] = {
+    0x06, 0x09, 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x01, 0x0b };
+static const unsigned char oid_ec[] = {
+    0x06, 0x07, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x02, 0x01 };
+static const unsigned char oid_p256[] = {
+    0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07 };
+static const unsigned char oid_p384[] = {
+    0x06, 0x05, 0x2b, 0x81, 0x04, 0x00, 0x22 };
+static const unsigned char oid_ecdsa_sha256[] = {
+    0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x04, 0x03, 0x02 };
+static const unsigned char oid_ecdsa_sha384[] = {
+    0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x04, 0x03, 0x03 };
+
+static const struct keytype keytypes[] = {
+    { "rsa2048", 0, 256, NULL, oid_sha256_rsa },
+    { "rsa3072", 0, 384, NULL, oid_sha256_rsa },
+    { "rsa4096", 0, 512, NULL, oid_sha256_rsa },
+    { "p256", 1, 32, oid_p256, oid_ecdsa_sha256 },
+    { "p384", 1, 48, oid_p384, oid_ecdsa_sha384 },
+};
+
+#define NKEYTYPES (sizeof(keytypes) / sizeof(keytypes[0]))
+
+static const unsigned char oid_c[] = { 0x06, 0x03, 0x55, 0x04, 0x06 };
+static const unsigned char oid_o[] = { 0x06, 0x03, 0x55, 0x04, 0x0a };
+static const unsigned char oid_ou[] = { 0x06, 0x03, 0x55, 0x04, 0x0b };
+static const unsigned char oid_cn[] = { 0x06, 0x03, 0x55, 0x04, 0x03 };
+static const unsigned char oid_bc[] = { 0x06, 0x03, 0x55, 0x1d, 0x13 };
+static const unsigned char oid_ku[] = { 0x06, 0x03, 0x55, 0x1d, 0x0f };
+static const unsigned char oid_ski[] = { 0x06, 0x03, 0x55, 0x1d, 0x0e };
+static const unsigned char oid_aki[] = { 0x06, 0x03, 0x55, 0x1d, 0x23 };
+static const unsigned char oid_san[] = { 0x06, 0x03, 0x55, 0x1d, 0x11 };
+static const unsigned char oid_eku[] = { 0x06, 0x03, 0x55, 0x1d, 0x25 };
+static const unsigned char oid_server_auth[] = {
+    0x06, 0x08, 0x2b, 0x06, 0x01, 0x05, 0x05, 0x07, 0x03, 0x01 };
+
+/*
+ * A CA we've made, which things can be issued by
+ */
+
+struct ca {
+    unsigned char *name;		/* DER subject */
+    size_t name_len;
+    unsigned char *spki;		/* DER subjectPublicKeyInfo */
+    size_t spki_len;
+    unsigned char ski[SKI_LEN];
+    const struct keytype *kt;
+    unsigned int tree;
+};
+
+/*
+ * A DER buffer we're building
+ */
+
+struct der {
+    unsigned char *p;
+    size_t len, size;
+};
+
+struct forest {
+    const struct pki_params *params;
+    const struct keytype **kts;
+    unsigned int nkts, next_kt;
+    uint64_t rng;
+    struct pki_cert *certs;
+    unsigned int count, size;
+    unsigned long names;		/* For unique names */
+};
+
+static void *xmalloc(size_t len) {
+    void *p = malloc(len ? len : 1);
+
+    if (!p) {
+        fprintf(stderr, "Unable to allocate %zu bytes\n", len);
+        exit(1);
+    }
+    return p;
+}
+
+static void *xrealloc(void *p, size_t len) {
+    if (!(p = realloc(p, len ? len : 1))) {
+        fprintf(stderr, "Unable to allocate %zu bytes\n", len);
+        exit(1);
+    }
+    return p;
+}
+
+/*
+ * xorshift64*
+ */
+
+static uint64_t rnd(struct forest *f) {
+    f->rng ^= f->rng >> 12;
+    f->rng ^= f->rng << 25;
+    f->rng ^= f->rng >> 27;
+    return f->rng * 0x2545f4914f6cdd1dULL;
+}
+
+static double rnd_frac(struct forest *f) {
+    return (rnd(f) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void rnd_bytes(struct forest *f, unsigned char *p, size_t len) {
+    uint64_t r = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (i % 8 == 0)
+            r = rnd(f);
+        p[i] = r & 0xff;
+        r >>= 8;
+    }
+}
+
+static void put(struct der *d, const void *data, size_t len) {
+    if (!len)
+        return;
+    if (d->len + len > d->size) {
+        d->size = (d->len + len) * 2;
+        if (!(d->p = realloc(d->p, d->size))) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(d->p + d->len, data, len);
+    d->len += len;
+}
+
+/*
+ * Add a tag, length and value
+ */
+
+static void tlv(struct der *d, unsigned char tag, const void *value,
+                size_t len) {
+    unsigned char hdr[6];
+    size_t n = 0;
+
+    hdr[n++] = tag;
+    if (len < 0x80) {
+        hdr[n++] = len;
+    } else if (len < 0x100) {
+        hdr[n++] = 0x81;
+        hdr[n++] = len;
+    } else if (len < 0x10000) {
+        hdr[n++] = 0x82;
+        hdr[n++] = len >> 8;
+        hdr[n++] = len;
+    } else {
+        hdr[n++] = 0x83;
+        hdr[n++] = len >> 16;
+        hdr[n++] = len >> 8;
+        hdr[n++] = len;
+    }
+
+    put(d, hdr, n);
+    put(d, value, len);
+}
+
+/*
+ * Wrap everything in "inner" in a tag, add it to "d", and empty "inner"
+ */
+
+static void wrap(struct der *d, unsigned char tag, struct der *inner) {
+    tlv(d, tag, inner->p, inner->len);
+    inner->len = 0;
+}
+
+static void der_free(struct der *d) {
+    free(d->p);
+    d->p = NULL;
+    d->len = d->size = 0;
+}
+
+/*
+ * A positive INTEGER of random bytes
+ */
+
+static void random_int(struct forest *f, struct der *d, size_t len) {
+    unsigned char *v = xmalloc(len + 1);
+
+    rnd_bytes(f, v + 1, len);
+    v[0] = 0;
+    v[1] |= 0x80;
+    tlv(d, 0x02, v, len + 1);
+    free(v);
+}
+
+static void name_attr(struct der *d, const unsigned char *oid, size_t oidlen,
+                      unsigned char type, const char *value) {
+    struct der seq = { 0 }, set = { 0 };
+
+    put(&seq, oid, oidlen);
+    tlv(&seq, type, value, strlen(value));
+    wrap(&set, 0x30, &seq);
+    wrap(d, 0x31, &set);
+    der_free(&seq);
+    der_free(&set);
+}
+
+static void make_name(struct der *out, unsigned int tree, const char *ou,
+                      const char *cn) {
+    struct der d = { 0 };
+    char org[64];
+
+    snprintf(org, sizeof(org), "Synthetic PKI %u", tree + 1);
+    name_attr(&d, oid_c, sizeof(oid_c), 0x13, "US");
+    name_attr(&d, oid_o, sizeof(oid_o), 0x0c, org);
+    if (ou)
+        name_attr(&d, oid_ou, sizeof(oid_ou), 0x0c, ou);
+    name_attr(&d, oid_cn, sizeof(oid_cn), 0x0c, cn);
+    wrap(out, 0x30, &d);
+    der_free(&d);
+}
+
+/*
+ * Make up a key, and its subject key identifier
+ */
+
+static void make_key(struct forest *f, const struct keytype *kt,
+                     struct der *spki, unsigned char *ski) {
+    struct der alg = { 0 }, key = { 0 }, bits = { 0 };
+    unsigned char *point;
+    static const unsigned char exponent[] = { 0x02, 0x03, 0x01, 0x00, 0x01 };
+    static const unsigned char null[] = { 0x05, 0x00 };
+    unsigned char zero = 0;
+
+    if (kt->ec) {
+        put(&alg, oid_ec, sizeof(oid_ec));
+        put(&alg, kt->curve, kt->curve[1] + 2);
+        point = xmalloc(kt->size * 2 + 2);
+        point[0] = 0;
+        point[1] = 0x04;
+        rnd_bytes(f, point + 2, kt->size * 2);
+        put(&bits, point, kt->size * 2 + 2);
+        free(point);
+    } else {
+        put(&alg, oid_rsa, sizeof(oid_rsa));
+        put(&alg, null, sizeof(null));
+        random_int(f, &key, kt->size);
+        put(&key, exponent, sizeof(exponent));
+        put(&bits, &zero, 1);
+        wrap(&bits, 0x30, &key);
+    }
+
+    wrap(&key, 0x30, &alg);
+    wrap(&key, 0x03, &bits);
+    wrap(spki, 0x30, &key);
+
+    rnd_bytes(f, ski, SKI_LEN);
+
+    der_free(&alg);
+    der_free(&key);
+    der_free(&bits);
+}
+
+static void extension(struct der *exts, const unsigned char *oid,
+                      size_t oidlen, int critical, struct der *value) {
+    static const unsigned char crit[] = { 0x01, 0x01, 0xff };
+    struct der ext = { 0 };
+
+    put(&ext, oid, oidlen);
+    if (critical)
+        put(&ext, crit, sizeof(crit));
+    wrap(&ext, 0x04, value);
+    wrap(exts, 0x30, &ext);
+    der_free(&ext);
+}
+
+/*
+ * Issue a certificate.  "issuer" is NULL for a root, which is issued by
+ * itself.  "dns" is the host name of an end-entity certificate.
+ */
+
+static void issue(struct forest *f, const struct ca *issuer,
+                  const struct ca *subject, int ca, const char *dns) {
+    static const unsigned char version[] = { 0xa0, 0x03, 0x02, 0x01, 0x02 };
+    static const char validity[] = "\x17\x0d" "250101000000Z"
+                                   "\x17\x0d" "350101000000Z";
+    static const unsigned char ca_usage[] = { 0x03, 0x02, 0x01, 0x06 };
+    static const unsigned char ee_usage[] = { 0x03, 0x02, 0x05, 0xa0 };
+    static const unsigned char ca_true[] = { 0x01, 0x01, 0xff };
+    static const unsigned char null[] = { 0x05, 0x00 };
+    struct der tbs = { 0 }, alg = { 0 }, exts = { 0 }, v = { 0 },
+               cert = { 0 }, sig = { 0 }, tmp = { 0 };
+    const struct ca *by = issuer ? issuer : subject;
+    struct pki_cert *out;
+    unsigned char zero = 0, *bytes;
+
+    put(&alg, by->kt->sigalg, by->kt->sigalg[1] + 2);
+    if (!by->kt->ec)
+        put(&alg, null, sizeof(null));
+
+    put(&tbs, version, sizeof(version));
+    random_int(f, &tbs, 15);
+    tlv(&tbs, 0x30, alg.p, alg.len);
+    put(&tbs, by->name, by->name_len);
+    tlv(&tbs, 0x30, validity, sizeof(validity) - 1);
+    put(&tbs, subject->name, subject->name_len);
+    put(&tbs, subject->spki, subject->spki_len);
+
+    if (ca)
+        put(&v, ca_true, sizeof(ca_true));
+    wrap(&tmp, 0x30, &v);
+    extension(&exts, oid_bc, sizeof(oid_bc), 1, &tmp);
+
+    put(&tmp, ca ? ca_usage : ee_usage, sizeof(ca_usage));
+    extension(&exts, oid_ku, sizeof(oid_ku), 1, &tmp);
+
+    tlv(&tmp, 0x04, subject->ski, SKI_LEN);
+    extension(&exts, oid_ski, sizeof(oid_ski), 0, &tmp);
+
+    if (issuer) {
+        tlv(&v, 0x80, issuer->ski, SKI_LEN);
+        wrap(&tmp, 0x30, &v);
+        extension(&exts, oid_aki, sizeof(oid_aki), 0, &tmp);
+    }
+
+    if (dns) {
+        tlv(&v, 0x82, dns, strlen(dns));
+        wrap(&tmp, 0x30, &v);
+        extension(&exts, oid_san, sizeof(oid_san), 0, &tmp);
+
+        put(&v, oid_server_auth, sizeof(oid_server_auth));
+        wrap(&tmp, 0x30, &v);
+        extension(&exts, oid_eku, sizeof(oid_eku), 0, &tmp);
+    }
+
+    wrap(&v, 0x30, &exts);
+    wrap(&tbs, 0xa3, &v);
+
+    wrap(&cert, 0x30, &tbs);
+    tlv(&cert, 0x30, alg.p, alg.len);
+
+    /*
+     * And a signature of the right size
+     */
+
+    put(&sig, &zero, 1);
+    if (by->kt->ec) {
+        random_int(f, &v, by->kt->size - 1);
+        random_int(f, &v, by->kt->size - 1);
+        wrap(&sig, 0x30, &v);
+    } else {
+        bytes = xmalloc(by->kt->size);
+        rnd_bytes(f, bytes, by->kt->size);
+        put(&sig, bytes, by->kt->size);
+        free(bytes);
+    }
+    wrap(&cert, 0x03, &sig);
+
+    if (f->count == f->size) {
+        f->size = f->size ? f->size * 2 : 256;
+        if (!(f->certs = realloc(f->certs, f->size * sizeof(*f->certs)))) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+
+    out = &f->certs[f->count++];
+    wrap(&tmp, 0x30, &cert);
+    out->der = tmp.p;
+    out->len = tmp.len;
+    tmp.p = NULL;
+    out->ca = ca;
+    out->root = issuer == NULL;
+
+    der_free(&tbs);
+    der_free(&alg);
+    der_free(&exts);
+    der_free(&v);
+    der_free(&cert);
+    der_free(&sig);
+    der_free(&tmp);
+}
+
+/*
+ * Make a new CA (with a unique name, unless it borrows one)
+ */
+
+static void new_ca(struct forest *f, struct ca *ca, unsigned int tree,
+                   const char *cn, const struct ca *borrow) {
+    struct der d = { 0 };
+    char ou[32];
+
+    memset(ca, 0, sizeof(*ca));
+    ca->tree = tree;
+    ca->kt = f->kts[f->next_kt++ % f->nkts];
+
+    if (borrow) {
+        ca->name = xmalloc(borrow->name_len);
+        memcpy(ca->name, borrow->name, borrow->name_len);
+        ca->name_len = borrow->name_len;
+    } else {
+        snprintf(ou, sizeof(ou), "Unit %lu", f->names++);
+        make_name(&d, tree, ou, cn);
+        ca->name = d.p;
+        ca->name_len = d.len;
+        memset(&d, 0, sizeof(d));
+    }
+
+    make_key(f, ca->kt, &d, ca->ski);
+    ca->spki = d.p;
+    ca->spki_len = d.len;
+}
+
+static void free_ca(struct ca *ca) {
+    free(ca->name);
+    free(ca->spki);
+}
+
+unsigned long pki_forest_size(const struct pki_params *p) {
+    unsigned long per_tree = 0, level = 1;
+    unsigned int d;
+
+    for (d = 0; d <= p->depth; d++) {
+        per_tree += level;
+        level *= p->fanout;
+    }
+
+    return per_tree * (p->roots + p->others);
+}
+
+struct pki_cert *pki_forest(const struct pki_params *p, unsigned int *count) {
+    struct forest f;
+    struct ca *roots, *level, *next, leaf;
+    unsigned int trees = p->roots + p->others, t, d, i, j, n, nn;
+    char cn[64], *types, *tok;
+    size_t k;
+
+    memset(&f, 0, sizeof(f));
+    f.params = p;
+    f.rng = p->seed * 0x9e3779b97f4a7c15ULL + 1;
+    f.kts = xmalloc(sizeof(*f.kts) * (strlen(p->keytypes) + 1));
+
+    types = strdup(p->keytypes);
+    for (tok = strtok(types, ","); tok; tok = strtok(NULL, ",")) {
+        for (k = 0; k < NKEYTYPES; k++)
+            if (strcmp(tok, keytypes[k].name) == 0)
+                break;
+        if (k == NKEYTYPES) {
+            fprintf(stderr, "Unknown key type \"%s\"\n", tok);
+            free(types);
+            free(f.kts);
+            return NULL;
+        }
+        f.kts[f.nkts++] = &keytypes[k];
+    }
+    free(types);
+
+    if (!f.nkts) {
+        free(f.kts);
+        return NULL;
+    }
+
+    /*
+     * Roots first, so we can cross-sign with them
+     */
+
+    roots = xmalloc(sizeof(*roots) * (trees ? trees : 1));
+
+    for (t = 0; t < trees; t++) {
+        if (t < p->roots)
+            snprintf(cn, sizeof(cn), "%s %u", p->root_name, t + 1);
+        else
+            snprintf(cn, sizeof(cn), "Other Root CA %u", t - p->roots + 1);
+        new_ca(&f, &roots[t], t, cn, NULL);
+        issue(&f, NULL, &roots[t], 1, NULL);
+    }
+
+    /*
+     * Then each tree, a level at a time; the last level is end-entity
+     * certificates, which nothing needs to remember
+     */
+
+    for (t = 0; t < trees; t++) {
+        level = &roots[t];
+        n = 1;
+
+        for (d = 1; d <= p->depth; d++) {
+            if (d == p->depth) {
+                for (i = 0; i < n; i++) {
+                    for (j = 0; j < p->fanout; j++) {
+                        snprintf(cn, sizeof(cn), "host%lu.example.test",
+                                 f.names);
+                        new_ca(&f, &leaf, t, cn, NULL);
+                        issue(&f, &level[i], &leaf, 0, cn);
+                        free_ca(&leaf);
+                    }
+                }
+                break;
+            }
+
+            next = xmalloc(sizeof(*next) * n * p->fanout);
+            nn = 0;
+
+            for (i = 0; i < n; i++) {
+                for (j = 0; j < p->fanout; j++, nn++) {
+                    snprintf(cn, sizeof(cn), "Intermediate CA %u-%u", t + 1,
+                             d);
+                    new_ca(&f, &next[nn], t, cn,
+                           nn > 0 && rnd_frac(&f) < p->collide ?
+                           &next[rnd(&f) % nn] : NULL);
+                    issue(&f, &level[i], &next[nn], 1, NULL);
+
+                    if (trees > 1 && rnd_frac(&f) < p->cross)
+                        issue(&f, &roots[(t + 1 + rnd(&f) % (trees - 1)) %
+                                         trees], &next[nn], 1, NULL);
+                }
+            }
+
+            if (level != &roots[t]) {
+                for (i = 0; i < n; i++)
+                    free_ca(&level[i]);
+                free(level);
+            }
+
+            level = next;
+            n = nn;
+        }
+
+        if (level != &roots[t]) {
+            for (i = 0; i < n; i++)
+                free_ca(&level[i]);
+            free(level);
+        }
+    }
+
+    for (t = 0; t < trees; t++)
+        free_ca(&roots[t]);
+    free(roots);
+    free(f.kts);
+
+    /*
+     * Shuffle, since the Keychain doesn't give us things in order
+     */
+
+    for (i = f.count; i > 1; i--) {
+        struct pki_cert c;
+
+        j = rnd(&f) % i;
+        c = f.certs[i - 1];
+        f.certs[i - 1] = f.certs[j];
+        f.certs[j] = c;
+    }
+
+    *count = f.count;
+    return f.certs;
+}
+
+void pki_forest_free(struct pki_cert *certs, unsigned int count) {
+    unsigned int i;
+
+    for (i = 0; i < count; i++)
+        free(certs[i].der);
+    free(certs);
+}
+
+int pki_write_pem(FILE *out, const struct pki_cert *certs,
+                  unsigned int count) {
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    unsigned int i, col;
+    size_t j;
+    uint32_t v;
+
+    for (i = 0; i < count; i++) {
+        fputs("-----BEGIN CERTIFICATE-----\n", out);
+        for (j = 0, col = 0; j < certs[i].len; j += 3) {
+            v = certs[i].der[j] << 16;
+            if (j + 1 < certs[i].len)
+                v |= certs[i].der[j + 1] << 8;
+            if (j + 2 < certs[i].len)
+                v |= certs[i].der[j + 2];
+            putc(alphabet[(v >> 18) & 0x3f], out);
+            putc(alphabet[(v >> 12) & 0x3f], out);
+            putc(j + 1 < certs[i].len ? alphabet[(v >> 6) & 0x3f] : '=',
+                 out);
+            putc(j + 2 < certs[i].len ? alphabet[v & 0x3f] : '=', out);
+            if ((col += 4) == 64) {
+                putc('\n', out);
+                col = 0;
+            }
+        }
+        if (col)
+            putc('\n', out);
+        fputs("-----END CERTIFICATE-----\n", out);
+    }
+
+    return ferror(out) ? -1 : 0;
+}
+
+/*
+ * Read a DER tag and length; returns the start of the value, or NULL
+ */
+
+static const unsigned char *der_item(const unsigned char *p,
+                                     const unsigned char *end,
+                                     unsigned char *tag, size_t *len) {
+    size_t n, i;
+
+    if (end - p < 2)
+        return NULL;
+
+    *tag = *p++;
+
+    if (*p < 0x80) {
+        *len = *p++;
+    } else {
+        n = *p++ & 0x7f;
+        if (n == 0 || n > sizeof(size_t) || end - p < (ptrdiff_t) n)
+            return NULL;
+        for (i = 0, *len = 0; i < n; i++)
+            *len = (*len << 8) | *p++;
+    }
+
+    if ((size_t) (end - p) < *len)
+        return NULL;
+
+    return p;
+}
+
+/*
+ * Find the common name in a DER name (the last one, if there are more)
+ */
+
+static void der_cn(const unsigned char *name, size_t len, char *cn,
+                   size_t cnlen) {
+    const unsigned char *p, *end, *set, *seq, *v;
+    unsigned char tag;
+    size_t n, vlen;
+
+    cn[0] = '\0';
+
+    if (!(p = der_item(name, name + len, &tag, &n)) || tag != 0x30)
+        return;
+
+    for (end = p + n; p < end; p = set + n) {
+        if (!(set = der_item(p, end, &tag, &n)))
+            return;
+        if (!(seq = der_item(set, set + n, &tag, &vlen)) ||
+            vlen < sizeof(oid_cn) || memcmp(seq, oid_cn, sizeof(oid_cn)))
+            continue;
+        if (!(v = der_item(seq + sizeof(oid_cn), seq + vlen, &tag, &vlen)))
+            continue;
+        if (vlen >= cnlen)
+            vlen = cnlen - 1;
+        memcpy(cn, v, vlen);
+        cn[vlen] = '\0';
+    }
+}
+
+int pki_cert_fields(const unsigned char *der, size_t len,
+                    struct pki_fields *fields) {
+    const unsigned char *p, *end, *v, *start;
+    unsigned char tag;
+    size_t n;
+    int item;
+
+    memset(fields, 0, sizeof(*fields));
+
+    if (!(v = der_item(der, der + len, &tag, &n)) || tag != 0x30)
+        return -1;
+    if (!(v = der_item(v, v + n, &tag, &n)) || tag != 0x30)
+        return -1;
+
+    end = v + n;
+    p = v;
+
+    /*
+     * version [0] (optional), serial, signature, issuer, validity,
+     * subject, subjectPublicKeyInfo
+     */
+
+    for (item = 0; item < 7; item++) {
+        start = p;
+        if (!(v = der_item(p, end, &tag, &n)))
+            return -1;
+        p = v + n;
+
+        if (item == 0 && tag != 0xa0)
+            item++;
+
+        switch (item) {
+        case 1:
+            fields->serial = start;
+            fields->serial_len = p - start;
+            break;
+        case 3:
+            fields->issuer = start;
+            fields->issuer_len = p - start;
+            break;
+        case 5:
+            fields->subject = start;
+            fields->subject_len = p - start;
+            break;
+        case 6:
+            fields->spki = start;
+            fields->spki_len = p - start;
+            break;
+        }
+    }
+
+    der_cn(fields->subject, fields->subject_len, fields->cn,
+           sizeof(fields->cn));
+
+    return 0;
+}
+
+/*
+ * Decode base64, ignoring anything that isn't base64
+ */
+
+static size_t unbase64(const char *in, size_t inlen, unsigned char *out) {
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    unsigned int bits = 0, nbits = 0;
+    size_t i, n = 0;
+    const char *c;
+
+    for (i = 0; i < inlen && in[i] != '='; i++) {
+        if (!in[i] || !(c = strchr(alphabet, in[i])))
+            continue;
+        bits = (bits << 6) | (c - alphabet);
+        nbits += 6;
+        if (nbits >= 8) {
+            nbits -= 8;
+            out[n++] = (bits >> nbits) & 0xff;
+        }
+    }
+
+    return n;
+}
+
+struct pki_cert *pki_read_pem(const char *file, unsigned int *count) {
+    static const char begin[] = "-----BEGIN CERTIFICATE-----";
+    static const char end[] = "-----END CERTIFICATE-----";
+    struct pki_cert *certs = NULL;
+    unsigned int n = 0, size = 0;
+    char *text, *p, *e;
+    long len;
+    FILE *f;
+
+    if (!(f = fopen(file, "r")))
+        return NULL;
+
+    if (fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 0) {
+        fclose(f);
+        return NULL;
+    }
+    rewind(f);
+
+    text = xmalloc(len + 1);
+    len = fread(text, 1, len, f);
+    text[len] = '\0';
+    fclose(f);
+
+    for (p = text; (p = strstr(p, begin)) && (e = strstr(p, end));
+         p = e + sizeof(end) - 1) {
+        p += sizeof(begin) - 1;
+        if (n == size) {
+            size = size ? size * 2 : 256;
+            certs = xrealloc(certs, size * sizeof(*certs));
+        }
+        memset(&certs[n], 0, sizeof(certs[n]));
+        certs[n].der = xmalloc(e - p);
+        certs[n].len = unbase64(p, e - p, certs[n].der);
+        n++;
+    }
+
+    free(text);
+    *count = n;
+
+    return certs ? certs : xmalloc(sizeof(*certs));
+}
@@ -0,0 +1,104 @@
+/*
+ *  pki_forest.h
+ *  KeychainToken
+ *
+ *  Interfaces to our synthetic PKI generator, used by pki_gen and
+ *  certslot_bench.
+ *
+ *  A forest is a number of root CAs, each with a tree of certificates
+ *  under it "fanout" wide and "depth" deep: intermediate CAs, with
+ *  end-entity certificates at the bottom.  Certificates are real DER
+ *  with the names, keys and extensions a CA would use, but the keys and
+ *  signatures are random bytes of the right size; nothing that imports
+ *  them checks signatures, and generating real keys would take far longer
+ *  than the thing we want to measure.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __PKI_FOREST_H__
+#define __PKI_FOREST_H__
+
+#include <stdio.h>
+#include <stddef.h>
+
+struct pki_params {
+    unsigned int roots;		/* Root CAs whose name matches */
+    unsigned int others;	/* Root CAs whose name doesn't */
+    unsigned int depth;		/* Levels under each root; the last */
+				/* is end-entity certificates */
+    unsigned int fanout;	/* Certificates each CA issues */
+    const char *keytypes;	/* Key types, used in turn: any of */
+				/* rsa2048, rsa3072, rsa4096, p256, p384 */
+    double collide;		/* Fraction of CAs that get the name of */
+				/* another CA in the same tree */
+    double cross;		/* Fraction of intermediate CAs that are */
+				/* also issued by a root in another tree */
+    const char *root_name;	/* Common name prefix of matching roots */
+    unsigned long seed;		/* For our random numbers */
+};
+
+/*
+ * Default parameters: one matching root, three levels, four wide
+ */
+
+#define PKI_PARAMS_DEFAULT { 1, 0, 3, 4, "rsa2048,p256", 0.0, 0.0, \
+			     "Synthetic Root CA", 1 }
+
+struct pki_cert {
+    unsigned char *der;
+    size_t len;
+    int ca;			/* Is a CA */
+    int root;			/* Is a root (matching or not) */
+};
+
+/*
+ * How many certificates a forest with these parameters has (not counting
+ * cross-signed copies), and make one.  The certificates come out in no
+ * particular order (as they would from the Keychain).  Returns NULL if
+ * the key types are bad.
+ */
+
+unsigned long pki_forest_size(const struct pki_params *);
+struct pki_cert *pki_forest(const struct pki_params *, unsigned int *);
+void pki_forest_free(struct pki_cert *, unsigned int);
+
+/*
+ * Write certificates out as a PEM bundle, and read them back in (or any
+ * other bundle; we don't know which are CAs).  pki_read_pem() returns
+ * NULL if it can't read the file.
+ */
+
+int pki_write_pem(FILE *, const struct pki_cert *, unsigned int);
+struct pki_cert *pki_read_pem(const char *, unsigned int *);
+
+/*
+ * Where the parts of a certificate are, as far as we need to know to
+ * stand in for the Keychain: the DER serial number, issuer and subject
+ * names and subjectPublicKeyInfo (each with its tag and length), and the
+ * common name.  Returns -1 if it doesn't look like a certificate.
+ */
+
+#define PKI_CN_MAX 128
+
+struct pki_fields {
+    const unsigned char *serial, *issuer, *subject, *spki;
+    size_t serial_len, issuer_len, subject_len, spki_len;
+    char cn[PKI_CN_MAX];
+};
+
+int pki_cert_fields(const unsigned char *, size_t, struct pki_fields *);
+
+#endif /* __PKI_FOREST_H__ */
@@ -0,0 +1,126 @@
+/*
+ *  pki_gen.c
+ *  KeychainToken
+ *
+ *  Write a synthetic PKI forest (see pki_forest.h) as a PEM bundle, for
+ *  certslot_bench or certstore_bench, or to import into a test Keychain.
+ *
+ *  Usage: pki_gen [-r roots] [-o others] [-d depth] [-f fanout]
+ *		   [-k keytypes] [-x collide] [-X cross] [-m name] [-s seed]
+ *		   [file]
+ *
+ *	-r	Number of root CAs whose common name matches (default: 1)
+ *	-o	Number of root CAs whose name doesn't (default: 0)
+ *	-d	Levels of certificates under each root; the last level is
+ *		end-entity certificates (default: 3)
+ *	-f	Number of certificates each CA issues (default: 4)
+ *	-k	Key types to use in turn (default: rsa2048,p256); any of
+ *		rsa2048, rsa3072, rsa4096, p256 and p384
+ *	-x	Fraction of intermediate CAs that get the same name as
+ *		another CA in their tree (default: 0)
+ *	-X	Fraction of intermediate CAs that are cross-signed by the
+ *		root of another tree (default: 0)
+ *	-m	Common name of matching roots, before their number (default:
+ *		"Synthetic Root CA"); use it in your certificateList
+ *	-s	Random number seed (default: 1)
+ *
+ *  The keys and signatures are random, so these certificates won't
+ *  verify; they're for measuring how we handle lots of certificates.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pki_forest.h"
+
+static void usage(const char *progname) {
+    fprintf(stderr, "Usage: %s [-r roots] [-o others] [-d depth] "
+            "[-f fanout]\n\t[-k keytypes] [-x collide] [-X cross] "
+            "[-m name] [-s seed] [file]\n", progname);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    struct pki_params params = PKI_PARAMS_DEFAULT;
+    struct pki_cert *certs;
+    unsigned int count;
+    FILE *out = stdout;
+    int c;
+
+    while ((c = getopt(argc, argv, "r:o:d:f:k:x:X:m:s:")) != -1) {
+        switch (c) {
+        case 'r':
+            params.roots = strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            params.others = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            params.depth = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            params.fanout = strtoul(optarg, NULL, 0);
+            break;
+        case 'k':
+            params.keytypes = optarg;
+            break;
+        case 'x':
+            params.collide = strtod(optarg, NULL);
+            break;
+        case 'X':
+            params.cross = strtod(optarg, NULL);
+            break;
+        case 'm':
+            params.root_name = optarg;
+            break;
+        case 's':
+            params.seed = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind < argc - 1)
+        usage(argv[0]);
+
+    if (pki_forest_size(&params) > 10000000) {
+        fprintf(stderr, "That would be %lu certificates; try something "
+                "smaller\n", pki_forest_size(&params));
+        return 1;
+    }
+
+    if (!(certs = pki_forest(&params, &count)))
+        return 1;
+
+    if (optind == argc - 1 && !(out = fopen(argv[optind], "w"))) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    if (pki_write_pem(out, certs, count) != 0 || fclose(out) != 0) {
+        perror("Unable to write certificates");
+        return 1;
+    }
+
+    fprintf(stderr, "Wrote %u certificates\n", count);
+
+    pki_forest_free(certs, count);
+
+    return 0;
+}
@@ -0,0 +1,164 @@
+/*
+ *  trace_decode.c
+ *  KeychainToken
+ *
+ *  Decode a binary trace file written by keychain-pkcs11 when the
+ *  KEYCHAIN_PKCS11_TRACE environment variable is set.
+ *
+ *  Usage: trace_decode [-s] tracefile
+ *
+ *	-s	Print a per-function summary instead of every record
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "mypkcs11.h"
+#include "debug.h"
+#include "trace.h"
+
+struct summary {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t total;
+    uint64_t max;
+};
+
+static int compare_records(const void *a, const void *b) {
+    const struct trace_record *ra = a, *rb = b;
+
+    if (ra->timestamp < rb->timestamp)
+        return -1;
+    if (ra->timestamp > rb->timestamp)
+        return 1;
+    return 0;
+}
+
+static void usage(const char *progname) {
+    fprintf(stderr, "Usage: %s [-s] tracefile\n", progname);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    struct trace_header hdr;
+    struct trace_record *recs;
+    struct summary sum[TRACE_ID_MAX];
+    uint64_t i, n;
+    int c, summarize = 0;
+    FILE *f;
+
+    while ((c = getopt(argc, argv, "s")) != -1) {
+        switch (c) {
+        case 's':
+            summarize = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1)
+        usage(argv[0]);
+
+    if (!(f = fopen(argv[optind], "rb"))) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        strncmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0) {
+        fprintf(stderr, "%s: not a keychain-pkcs11 trace file\n",
+                argv[optind]);
+        return 1;
+    }
+
+    if (hdr.version != TRACE_VERSION ||
+        hdr.record_size != sizeof(struct trace_record)) {
+        fprintf(stderr, "%s: unsupported trace version %u (record size %u)\n",
+                argv[optind], hdr.version, hdr.record_size);
+        return 1;
+    }
+
+    recs = calloc(hdr.record_count ? hdr.record_count : 1, sizeof(*recs));
+    if (!recs) {
+        fprintf(stderr, "Unable to allocate %" PRIu64 " records\n",
+                hdr.record_count);
+        return 1;
+    }
+
+    n = fread(recs, sizeof(*recs), hdr.record_count, f);
+    fclose(f);
+
+    if (n != hdr.record_count)
+        fprintf(stderr, "Warning: trace truncated, read %" PRIu64 " of %"
+                PRIu64 " records\n", n, hdr.record_count);
+
+    qsort(recs, n, sizeof(*recs), compare_records);
+
+    printf("Trace of process %" PRIu64 ": %" PRIu64 " records, %" PRIu64
+           " dropped\n", hdr.pid, n, hdr.dropped);
+
+    if (summarize) {
+        memset(sum, 0, sizeof(sum));
+
+        for (i = 0; i < n; i++) {
+            if (recs[i].id >= TRACE_ID_MAX)
+                continue;
+            sum[recs[i].id].count++;
+            sum[recs[i].id].total += recs[i].duration;
+            if (recs[i].rv != CKR_OK)
+                sum[recs[i].id].errors++;
+            if (recs[i].duration > sum[recs[i].id].max)
+                sum[recs[i].id].max = recs[i].duration;
+        }
+
+        printf("%-24s %8s %8s %12s %12s %12s\n", "Function", "Count",
+               "Errors", "Total (us)", "Avg (us)", "Max (us)");
+
+        for (i = 0; i < TRACE_ID_MAX; i++) {
+            if (sum[i].count == 0)
+                continue;
+            printf("%-24s %8" PRIu64 " %8" PRIu64 " %12.1f %12.1f %12.1f\n",
+                   getTraceName(i), sum[i].count, sum[i].errors,
+                   sum[i].total / 1000.0,
+                   sum[i].total / 1000.0 / sum[i].count,
+                   sum[i].max / 1000.0);
+        }
+    } else {
+        for (i = 0; i < n; i++) {
+            /*
+             * Internal events don't return a CK_RV, so just print
+             * the raw value for those.
+             */
+            printf("%12.3f ms  tid %-8" PRIu64 " %-24s handle %-6" PRIu64,
+                   (recs[i].timestamp - recs[0].timestamp) / 1000000.0,
+                   recs[i].thread, getTraceName(recs[i].id), recs[i].handle);
+            if (TRACE_IS_FUNCTION(recs[i].id))
+                printf(" %-32s", getCKRName(recs[i].rv));
+            else
+                printf(" %-32u", recs[i].rv);
+            printf(" %10.1f us\n", recs[i].duration / 1000.0);
+        }
+    }
+
+    free(recs);
+
+    return 0;
+}